@@ -12,6 +12,13 @@ INCLUDEDIR := $(PREFIX)/include
 
 ARFLAGS := rcs
 
+# Set to 1 to store gzip variants of compressible files in site bundles
+WITH_ZLIB ?= 0
+ifeq ($(WITH_ZLIB),1)
+ZLIB_CFLAGS := -DIRIS_HAVE_ZLIB
+ZLIB_LIBS := -lz
+endif
+
 ROOT_DIR := $(realpath $(dir $(lastword $(MAKEFILE_LIST))))
 IRIS_DIR := $(ROOT_DIR)/iris
 MARKER_DIR := $(ROOT_DIR)/marker
@@ -0,0 +1,651 @@
+// Loopback HTTP load generator for Iris.
+//
+// Closed loop: every connection sends its next request as soon as the previous
+// response is in. Open loop (-r): requests are scheduled at a constant rate no
+// matter how fast the server answers, and latency is measured from the time a
+// request was scheduled rather than sent. A server that stalls therefore pays
+// for every request it delayed, instead of hiding them (coordinated omission).
+// Closed loop runs get the same correction after the fact: a response slower
+// than the expected interval also records the requests that would have been
+// sent in the meantime.
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_CONNECTIONS 4096
+#define BENCH_MAX_PATHS 64
+#define BENCH_MAX_PATH_SIZE 512
+#define BENCH_HEADER_SIZE 4096
+#define BENCH_READ_SIZE 65536
+#define BENCH_DRAIN_NS 5000000000ull
+#define BENCH_MAX_RATE 1e9  // Open loop schedules are in whole nanoseconds
+
+// Log-linear histogram: 64 sub-buckets per power of two, about 1.5% precision
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_COUNT * 40)
+
+typedef enum {
+  CONN_IDLE,
+  CONN_CONNECTING,
+  CONN_SENDING,
+  CONN_RECEIVING
+} bench_conn_state;
+
+typedef struct {
+  int              fd;
+  bench_conn_state state;
+  size_t           path_index;
+  size_t           sent;
+  uint64_t         start_ns;  // Scheduled time (open loop) or send time (closed loop)
+  int              reused;    // Request sent on a kept-alive connection
+  char             header[BENCH_HEADER_SIZE];
+  size_t           header_length;
+  int              header_done;
+  int              status;
+  int              keep_alive;
+  long long        content_length;
+  long long        body_read;
+} bench_conn;
+
+typedef struct {
+  char   path[BENCH_MAX_PATH_SIZE];
+  char   request[BENCH_MAX_PATH_SIZE + 128];
+  size_t request_length;
+  int    weight;
+} bench_path;
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} bench_histogram;
+
+typedef struct {
+  const char* address;
+  int         port;
+  int         connections;
+  double      duration;
+  double      warmup;
+  double      rate;
+  int         keep_alive;
+  uint64_t    seed;
+} bench_options;
+
+static bench_options   options = {"127.0.0.1", 8000, 16, 10.0, 1.0, 0.0, 0, 0x9e3779b97f4a7c15ull};
+static bench_path      paths[BENCH_MAX_PATHS];
+static size_t          path_count   = 0;
+static int             total_weight = 0;
+static bench_conn*     conns        = NULL;
+static int*            idle_stack   = NULL;
+static int             idle_count   = 0;
+static int             epoll_fd     = -1;
+static bench_histogram histogram;
+
+// Run state
+static uint64_t run_start_ns      = 0;
+static uint64_t measure_start_ns  = 0;
+static uint64_t run_end_ns        = 0;
+static uint64_t expected_interval = 0;  // Closed loop correction, learned in warmup
+static uint64_t warmup_latency    = 0;
+static uint64_t warmup_count      = 0;
+static uint64_t completed         = 0;
+static uint64_t errors            = 0;
+static uint64_t non_success       = 0;
+static uint64_t reconnects        = 0;
+static uint64_t bytes_received    = 0;
+static uint64_t scheduled         = 0;  // Open loop: requests issued so far
+static uint64_t in_flight         = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t next_random(void) {
+  // xorshift64*, seeded so that runs pick the same file sequence
+  options.seed ^= options.seed >> 12;
+  options.seed ^= options.seed << 25;
+  options.seed ^= options.seed >> 27;
+  return options.seed * 0x2545f4914f6cdd1dull;
+}
+
+static size_t hist_index(uint64_t value) {
+  if (value < HIST_SUB_COUNT)
+    return (size_t) value;
+
+  int    msb   = 63 - __builtin_clzll(value);
+  int    shift = msb - HIST_SUB_BITS;
+  size_t index = HIST_SUB_COUNT + (size_t) shift * HIST_SUB_COUNT +
+                 (size_t) ((value >> shift) & (HIST_SUB_COUNT - 1));
+  return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+static uint64_t hist_value(size_t index) {
+  if (index < HIST_SUB_COUNT)
+    return index;
+
+  size_t shift = (index - HIST_SUB_COUNT) / HIST_SUB_COUNT;
+  size_t sub   = (index - HIST_SUB_COUNT) % HIST_SUB_COUNT;
+  // Report the middle of the bucket
+  uint64_t low = (uint64_t) (HIST_SUB_COUNT + sub) << shift;
+  return low + (((uint64_t) 1 << shift) >> 1);
+}
+
+static void hist_record(bench_histogram* hist, uint64_t value) {
+  hist->counts[hist_index(value)]++;
+  hist->total++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+static uint64_t hist_percentile(const bench_histogram* hist, double percentile) {
+  if (hist->total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) (percentile / 100.0 * (double) hist->total + 0.5);
+  if (rank == 0)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen >= rank)
+      return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+  }
+  return hist->max;
+}
+
+static void record_latency(uint64_t start, uint64_t latency) {
+  if (start < measure_start_ns) {
+    warmup_latency += latency;
+    warmup_count++;
+    return;
+  }
+
+  hist_record(&histogram, latency);
+
+  // Backfill the requests a closed loop could not send while this one stalled
+  if (expected_interval > 0) {
+    for (uint64_t missed = latency; missed > expected_interval;) {
+      missed -= expected_interval;
+      hist_record(&histogram, missed);
+    }
+  }
+}
+
+static size_t pick_path(void) {
+  if (path_count == 1)
+    return 0;
+
+  int target = (int) (next_random() % (uint64_t) total_weight);
+  for (size_t i = 0; i < path_count; ++i) {
+    target -= paths[i].weight;
+    if (target < 0)
+      return i;
+  }
+  return path_count - 1;
+}
+
+static void conn_close(bench_conn* conn) {
+  if (conn->fd >= 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+  }
+  conn->fd = -1;
+}
+
+static int conn_watch(bench_conn* conn, uint32_t events, int op) {
+  struct epoll_event event = {0};
+  event.events             = events;
+  event.data.ptr           = conn;
+  return epoll_ctl(epoll_fd, op, conn->fd, &event);
+}
+
+static int conn_open(bench_conn* conn) {
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (conn->fd < 0)
+    return -1;
+
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family         = AF_INET;
+  addr.sin_port           = htons(options.port);
+  inet_pton(AF_INET, options.address, &addr.sin_addr);
+
+  if (connect(conn->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+    conn_close(conn);
+    return -1;
+  }
+
+  conn->state = CONN_CONNECTING;
+  return conn_watch(conn, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+static void conn_fail(bench_conn* conn);
+
+static void conn_start(bench_conn* conn, uint64_t start) {
+  conn->path_index     = pick_path();
+  conn->sent           = 0;
+  conn->start_ns       = start;
+  conn->header_length  = 0;
+  conn->header_done    = 0;
+  conn->status         = 0;
+  conn->keep_alive     = 0;
+  conn->content_length = -1;
+  conn->body_read      = 0;
+  in_flight++;
+
+  if (conn->fd < 0) {
+    conn->reused = 0;
+    if (conn_open(conn) != 0)
+      conn_fail(conn);
+    return;
+  }
+
+  conn->reused = 1;
+  conn->state  = CONN_SENDING;
+  if (conn_watch(conn, EPOLLOUT, EPOLL_CTL_MOD) != 0)
+    conn_fail(conn);
+}
+
+static void conn_finish(bench_conn* conn, int failed) {
+  uint64_t now = now_ns();
+  in_flight--;
+
+  if (failed) {
+    errors++;
+    conn_close(conn);
+  } else {
+    completed += conn->start_ns >= measure_start_ns;
+    if (conn->status < 200 || conn->status >= 400)
+      non_success += conn->start_ns >= measure_start_ns;
+    record_latency(conn->start_ns, now - conn->start_ns);
+    if (!options.keep_alive || !conn->keep_alive)
+      conn_close(conn);
+  }
+
+  conn->state = CONN_IDLE;
+  if (conn->fd >= 0)
+    conn_watch(conn, 0, EPOLL_CTL_MOD);
+  idle_stack[idle_count++] = (int) (conn - conns);
+}
+
+static void conn_fail(bench_conn* conn) { conn_finish(conn, 1); }
+
+// Parse the status line and the headers that decide how the body ends
+static void conn_parse_header(bench_conn* conn) {
+  conn->header[conn->header_length] = '\0';
+
+  int minor = 0;
+  if (sscanf(conn->header, "HTTP/1.%d %d", &minor, &conn->status) != 2)
+    conn->status = 0;
+  conn->keep_alive = minor >= 1;
+
+  for (char* line = strstr(conn->header, "\r\n"); line; line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      conn->content_length = atoll(line + 15);
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      const char* value = line + 11;
+      while (*value == ' ')
+        value++;
+      if (strncasecmp(value, "close", 5) == 0)
+        conn->keep_alive = 0;
+      else if (strncasecmp(value, "keep-alive", 10) == 0)
+        conn->keep_alive = 1;
+    }
+  }
+
+  // Without a length the body runs until the server closes the connection
+  if (conn->content_length < 0)
+    conn->keep_alive = 0;
+}
+
+static void conn_readable(bench_conn* conn) {
+  static char buffer[BENCH_READ_SIZE];
+
+  for (;;) {
+    ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      conn_fail(conn);
+      return;
+    }
+
+    if (n == 0) {
+      if (conn->header_done && conn->content_length < 0) {
+        conn_finish(conn, 0);
+      } else if (conn->reused && conn->header_length == 0) {
+        // The server dropped an idle kept-alive connection, send again on a new one
+        reconnects++;
+        conn_close(conn);
+        in_flight--;
+        conn_start(conn, conn->start_ns);
+      } else {
+        conn_fail(conn);
+      }
+      return;
+    }
+
+    bytes_received += (uint64_t) n;
+    size_t offset = 0;
+    if (!conn->header_done) {
+      size_t room = sizeof(conn->header) - 1 - conn->header_length;
+      size_t take = (size_t) n < room ? (size_t) n : room;
+      memcpy(conn->header + conn->header_length, buffer, take);
+      conn->header_length += take;
+      conn->header[conn->header_length] = '\0';
+
+      char* end = strstr(conn->header, "\r\n\r\n");
+      if (!end) {
+        if (conn->header_length == sizeof(conn->header) - 1) {
+          conn_fail(conn);
+          return;
+        }
+        continue;
+      }
+
+      size_t header_size  = (size_t) (end + 4 - conn->header);
+      offset              = take - (conn->header_length - header_size);
+      conn->header_length = header_size;
+      conn->header_done   = 1;
+      conn_parse_header(conn);
+    }
+
+    conn->body_read += (long long) ((size_t) n - offset);
+    if (conn->content_length >= 0 && conn->body_read >= conn->content_length) {
+      conn_finish(conn, 0);
+      return;
+    }
+  }
+}
+
+static void conn_writable(bench_conn* conn) {
+  if (conn->state == CONN_CONNECTING) {
+    int       error  = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      conn_fail(conn);
+      return;
+    }
+    conn->state = CONN_SENDING;
+  }
+
+  const bench_path* path = &paths[conn->path_index];
+  while (conn->sent < path->request_length) {
+    ssize_t n = send(conn->fd, path->request + conn->sent, path->request_length - conn->sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        conn_fail(conn);
+      return;
+    }
+    conn->sent += (size_t) n;
+  }
+
+  conn->state = CONN_RECEIVING;
+  if (conn_watch(conn, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD) != 0)
+    conn_fail(conn);
+}
+
+// Hand out work to idle connections: everything that is due in open loop,
+// a new request per idle connection in closed loop.
+static void dispatch(uint64_t now) {
+  if (options.rate > 0) {
+    uint64_t interval = (uint64_t) (1e9 / options.rate);
+    uint64_t due      = now >= run_end_ns ? (run_end_ns - run_start_ns) / interval
+                                          : (now - run_start_ns) / interval + 1;
+    while (scheduled < due && idle_count > 0) {
+      bench_conn* conn = &conns[idle_stack[--idle_count]];
+      conn_start(conn, run_start_ns + scheduled * interval);
+      scheduled++;
+    }
+    return;
+  }
+
+  if (now >= run_end_ns)
+    return;
+  // One pass only: a connection that fails right away goes back on the stack
+  for (int idle = idle_count; idle > 0; --idle) {
+    bench_conn* conn = &conns[idle_stack[--idle_count]];
+    conn_start(conn, now);
+  }
+}
+
+static int pending_work(uint64_t now) {
+  if (in_flight > 0)
+    return 1;
+  if (options.rate > 0 && now < run_end_ns + BENCH_DRAIN_NS) {
+    uint64_t interval = (uint64_t) (1e9 / options.rate);
+    return scheduled < (run_end_ns - run_start_ns) / interval;
+  }
+  return now < run_end_ns;
+}
+
+static void run(void) {
+  struct epoll_event events[256];
+
+  run_start_ns     = now_ns();
+  measure_start_ns = run_start_ns + (uint64_t) (options.warmup * 1e9);
+  run_end_ns       = measure_start_ns + (uint64_t) (options.duration * 1e9);
+
+  int learned = options.rate > 0;
+  for (;;) {
+    uint64_t now = now_ns();
+
+    if (!learned && now >= measure_start_ns) {
+      // The mean warmup latency is the pace a closed loop connection expects
+      expected_interval = warmup_count ? warmup_latency / warmup_count : 0;
+      learned           = 1;
+    }
+
+    dispatch(now);
+    if (!pending_work(now))
+      break;
+    if (now >= run_end_ns + BENCH_DRAIN_NS) {
+      // Whatever is still out counts as failed, it will never be measured
+      errors += in_flight;
+      break;
+    }
+
+    int timeout = 100;
+    if (options.rate > 0 && now < run_end_ns) {
+      uint64_t interval = (uint64_t) (1e9 / options.rate);
+      uint64_t next     = run_start_ns + scheduled * interval;
+      timeout           = next > now ? (int) ((next - now) / 1000000) : 0;
+    }
+
+    int count = epoll_wait(epoll_fd, events, 256, timeout);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for (int i = 0; i < count; ++i) {
+      bench_conn* conn = events[i].data.ptr;
+      if (conn->state == CONN_IDLE) {
+        // A kept-alive connection the server closed while it was idle
+        if (events[i].events & (EPOLLHUP | EPOLLERR))
+          conn_close(conn);
+      } else if (conn->state == CONN_CONNECTING || conn->state == CONN_SENDING) {
+        conn_writable(conn);
+      } else if (conn->state == CONN_RECEIVING) {
+        conn_readable(conn);
+      }
+    }
+  }
+}
+
+static void print_latency(const char* label, uint64_t ns) {
+  if (ns >= 1000000)
+    printf("  %s %8.2f ms", label, (double) ns / 1e6);
+  else
+    printf("  %s %8.2f us", label, (double) ns / 1e3);
+}
+
+static void report(void) {
+  double elapsed = options.duration;
+
+  printf("mode        %s, %d connections, keep-alive %s\n",
+         options.rate > 0 ? "open loop" : "closed loop", options.connections,
+         options.keep_alive ? "on" : "off");
+  if (options.rate > 0)
+    printf("rate        %.0f req/s scheduled\n", options.rate);
+  else if (expected_interval > 0)
+    printf("correction  expected interval %.2f us\n", (double) expected_interval / 1e3);
+  printf("requests    %llu in %.2f s, %llu errors, %llu non-2xx/3xx, %llu reconnects\n",
+         (unsigned long long) completed, elapsed, (unsigned long long) errors,
+         (unsigned long long) non_success, (unsigned long long) reconnects);
+  printf("throughput  %.1f req/s, %.2f MB/s\n", (double) completed / elapsed,
+         (double) bytes_received / elapsed / (1024.0 * 1024.0));
+  printf("latency   ");
+  print_latency("p50", hist_percentile(&histogram, 50.0));
+  print_latency("p99", hist_percentile(&histogram, 99.0));
+  print_latency("p999", hist_percentile(&histogram, 99.9));
+  print_latency("max", histogram.max);
+  printf("\n");
+}
+
+static int add_path(const char* spec) {
+  if (path_count >= BENCH_MAX_PATHS) {
+    fprintf(stderr, "Too many paths (max %d)\n", BENCH_MAX_PATHS);
+    return -1;
+  }
+
+  bench_path* path   = &paths[path_count];
+  const char* colon  = strrchr(spec, ':');
+  size_t      length = colon ? (size_t) (colon - spec) : strlen(spec);
+  if (length == 0 || length >= sizeof(path->path) || spec[0] != '/') {
+    fprintf(stderr, "Invalid path: %s\n", spec);
+    return -1;
+  }
+
+  memcpy(path->path, spec, length);
+  path->path[length] = '\0';
+  path->weight       = colon ? atoi(colon + 1) : 1;
+  if (path->weight <= 0) {
+    fprintf(stderr, "Invalid weight: %s\n", spec);
+    return -1;
+  }
+
+  total_weight += path->weight;
+  path_count++;
+  return 0;
+}
+
+static void build_requests(void) {
+  for (size_t i = 0; i < path_count; ++i) {
+    int length = snprintf(paths[i].request, sizeof(paths[i].request),
+                          "GET %s HTTP/1.1\r\n"
+                          "Host: %s:%d\r\n"
+                          "Connection: %s\r\n\r\n",
+                          paths[i].path, options.address, options.port,
+                          options.keep_alive ? "keep-alive" : "close");
+    paths[i].request_length = (size_t) length;
+  }
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-a ADDRESS] [-p PORT] [-c CONNECTIONS] [-d SECONDS] [-w SECONDS]\n"
+          "          [-r RATE] [-k] [-s SEED] PATH[:WEIGHT]...\n",
+          prog);
+  fprintf(stderr, "  -a ADDRESS      Server address (default: 127.0.0.1)\n");
+  fprintf(stderr, "  -p PORT         Server port (default: 8000)\n");
+  fprintf(stderr, "  -c CONNECTIONS  Concurrent connections (default: 16)\n");
+  fprintf(stderr, "  -d SECONDS      Measured duration (default: 10)\n");
+  fprintf(stderr, "  -w SECONDS      Warmup, not measured (default: 1)\n");
+  fprintf(stderr, "  -r RATE         Open loop at RATE <= 1e9 requests/s (default: closed loop)\n");
+  fprintf(stderr, "  -k              Ask for keep-alive connections\n");
+  fprintf(stderr, "  -s SEED         Seed for the path mix\n");
+  fprintf(stderr, "  PATH[:WEIGHT]   Request PATH with relative WEIGHT (default: 1)\n");
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      options.address = argv[++i];
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      options.port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      options.connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      options.duration = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      options.warmup = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      options.rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-k") == 0) {
+      options.keep_alive = 1;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      options.seed = strtoull(argv[++i], NULL, 0) | 1;
+    } else if (add_path(argv[i]) != 0) {
+      return 1;
+    }
+  }
+
+  if (path_count == 0)
+    add_path("/");
+  if (options.connections <= 0 || options.connections > BENCH_MAX_CONNECTIONS ||
+      options.duration <= 0 || options.warmup < 0 || options.rate < 0 ||
+      options.rate > BENCH_MAX_RATE) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  struct in_addr check;
+  if (inet_pton(AF_INET, options.address, &check) != 1) {
+    fprintf(stderr, "Invalid address: %s\n", options.address);
+    return 1;
+  }
+
+  build_requests();
+
+  epoll_fd   = epoll_create1(0);
+  conns      = calloc((size_t) options.connections, sizeof(bench_conn));
+  idle_stack = calloc((size_t) options.connections, sizeof(int));
+  if (epoll_fd < 0 || !conns || !idle_stack) {
+    perror("setup");
+    return 1;
+  }
+
+  for (int i = 0; i < options.connections; ++i) {
+    conns[i].fd              = -1;
+    conns[i].state           = CONN_IDLE;
+    idle_stack[idle_count++] = options.connections - 1 - i;
+  }
+
+  run();
+  report();
+
+  for (int i = 0; i < options.connections; ++i)
+    conn_close(&conns[i]);
+  close(epoll_fd);
+  free(conns);
+  free(idle_stack);
+  return errors > 0;
+}
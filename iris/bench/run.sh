@@ -0,0 +1,40 @@
+#!/bin/sh
+# Serve a generated file mix with Iris over loopback and measure it with
+# iris_bench, once closed loop and once open loop.
+# Usage: run.sh IRIS IRIS_BENCH PORT [IRIS_BENCH ARGS...]
+set -eu
+
+IRIS=$1
+BENCH=$2
+PORT=$3
+shift 3
+
+RATE=${BENCH_RATE:-2000}
+ROOT=$(mktemp -d "${TMPDIR:-/tmp}/iris-bench.XXXXXX")
+IRIS_PID=
+
+cleanup() {
+  if [ -n "$IRIS_PID" ]; then
+    kill "$IRIS_PID" 2>/dev/null || true
+    wait "$IRIS_PID" 2>/dev/null || true
+  fi
+  rm -rf "$ROOT"
+}
+trap cleanup EXIT INT TERM
+
+# Mostly small pages, some assets, the odd large download
+head -c 1024 /dev/zero | tr '\0' 'a' > "$ROOT/index.html"
+head -c 16384 /dev/urandom > "$ROOT/medium.bin"
+head -c 262144 /dev/urandom > "$ROOT/large.bin"
+head -c 1048576 /dev/urandom > "$ROOT/huge.bin"
+MIX="/index.html:80 /medium.bin:15 /large.bin:4 /huge.bin:1"
+
+"$IRIS" -d "$ROOT" "$PORT" > /dev/null &
+IRIS_PID=$!
+sleep 0.5
+
+echo "== closed loop"
+"$BENCH" -p "$PORT" "$@" $MIX
+echo
+echo "== open loop"
+"$BENCH" -p "$PORT" -r "$RATE" "$@" $MIX
@@ -0,0 +1,510 @@
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+#include "bundle.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef IRIS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+uint32_t iris_bundle_hash(const char* path, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char) path[i];
+    hash *= 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+static int iris_bundle_in_range(const iris_bundle* bundle, uint64_t offset, uint64_t length) {
+  return offset <= bundle->size && length <= bundle->size - offset;
+}
+
+int iris_bundle_open(const char* path, iris_bundle* bundle) {
+  memset(bundle, 0, sizeof(*bundle));
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(iris_bundle_header)) {
+    close(fd);
+    return -1;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+
+  bundle->data   = data;
+  bundle->size   = st.st_size;
+  bundle->device = st.st_dev;
+  bundle->inode  = st.st_ino;
+
+  const iris_bundle_header* header = data;
+  if (memcmp(header->magic, IRIS_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != IRIS_BUNDLE_VERSION || header->size != bundle->size ||
+      header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 ||
+      header->entries_offset % sizeof(uint64_t) != 0 ||
+      header->slots_offset % sizeof(uint32_t) != 0 ||
+      !iris_bundle_in_range(bundle, header->entries_offset,
+                            (uint64_t) header->entry_count * sizeof(iris_bundle_entry)) ||
+      !iris_bundle_in_range(bundle, header->slots_offset,
+                            (uint64_t) header->slot_count * sizeof(uint32_t))) {
+    iris_bundle_close(bundle);
+    return -1;
+  }
+
+  bundle->entries     = (const iris_bundle_entry*) (bundle->data + header->entries_offset);
+  bundle->slots       = (const uint32_t*) (bundle->data + header->slots_offset);
+  bundle->entry_count = header->entry_count;
+  bundle->slot_count  = header->slot_count;
+
+  for (uint32_t i = 0; i < bundle->slot_count; ++i) {
+    if (bundle->slots[i] > bundle->entry_count) {
+      iris_bundle_close(bundle);
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < bundle->entry_count; ++i) {
+    const iris_bundle_entry* entry = &bundle->entries[i];
+    if (!iris_bundle_in_range(bundle, entry->path_offset, entry->path_length) ||
+        !iris_bundle_in_range(bundle, entry->header_offset, entry->header_length) ||
+        !iris_bundle_in_range(bundle, entry->body_offset, entry->body_length) ||
+        !iris_bundle_in_range(bundle, entry->gzip_header_offset, entry->gzip_header_length) ||
+        !iris_bundle_in_range(bundle, entry->gzip_body_offset, entry->gzip_body_length) ||
+        !iris_bundle_in_range(bundle, entry->etag_offset, entry->etag_length)) {
+      iris_bundle_close(bundle);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void iris_bundle_close(iris_bundle* bundle) {
+  if (bundle->data)
+    munmap((void*) bundle->data, bundle->size);
+  memset(bundle, 0, sizeof(*bundle));
+}
+
+const iris_bundle_entry* iris_bundle_find(const iris_bundle* bundle, const char* path,
+                                          size_t length) {
+  if (!bundle->data)
+    return NULL;
+
+  uint32_t mask = bundle->slot_count - 1;
+  uint32_t slot = iris_bundle_hash(path, length) & mask;
+  for (uint32_t probes = 0; probes < bundle->slot_count; ++probes) {
+    uint32_t index = bundle->slots[slot];
+    if (index == 0)
+      return NULL;
+
+    const iris_bundle_entry* entry = &bundle->entries[index - 1];
+    if (entry->path_length == length &&
+        memcmp(bundle->data + entry->path_offset, path, length) == 0) {
+      return entry;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
+
+// A file of the tree being bundled
+typedef struct {
+  char*  fs_path;
+  time_t mtime;
+  off_t  size;
+} iris_bundle_file;
+
+// A URL path and the file it serves
+typedef struct {
+  char*  url_path;
+  size_t file;
+} iris_bundle_key;
+
+typedef struct {
+  iris_bundle_file* files;
+  size_t            file_count;
+  size_t            file_capacity;
+  iris_bundle_key*  keys;
+  size_t            key_count;
+  size_t            key_capacity;
+  dev_t             bundle_device;  // The previous bundle, when it is inside the tree
+  ino_t             bundle_inode;
+} iris_bundle_tree;
+
+static int iris_bundle_add_key(iris_bundle_tree* tree, const char* url_path, size_t length,
+                               size_t file) {
+  if (tree->key_count == tree->key_capacity) {
+    size_t           capacity = tree->key_capacity ? tree->key_capacity * 2 : 64;
+    iris_bundle_key* keys     = realloc(tree->keys, capacity * sizeof(iris_bundle_key));
+    if (!keys)
+      return -1;
+    tree->keys         = keys;
+    tree->key_capacity = capacity;
+  }
+
+  char* copy = malloc(length + 1);
+  if (!copy)
+    return -1;
+  memcpy(copy, url_path, length);
+  copy[length] = '\0';
+
+  tree->keys[tree->key_count].url_path = copy;
+  tree->keys[tree->key_count].file     = file;
+  tree->key_count++;
+  return 0;
+}
+
+static int iris_bundle_add_file(iris_bundle_tree* tree, const char* fs_path, const char* url_path,
+                                const struct stat* st) {
+  if (tree->file_count == tree->file_capacity) {
+    size_t            capacity = tree->file_capacity ? tree->file_capacity * 2 : 64;
+    iris_bundle_file* files    = realloc(tree->files, capacity * sizeof(iris_bundle_file));
+    if (!files)
+      return -1;
+    tree->files         = files;
+    tree->file_capacity = capacity;
+  }
+
+  size_t file                = tree->file_count;
+  tree->files[file].fs_path  = strdup(fs_path);
+  tree->files[file].mtime    = st->st_mtime;
+  tree->files[file].size     = st->st_size;
+  if (!tree->files[file].fs_path)
+    return -1;
+  tree->file_count++;
+
+  size_t length = strlen(url_path);
+  if (iris_bundle_add_key(tree, url_path, length, file) != 0)
+    return -1;
+
+  // An index page also answers for its directory, with and without the slash
+  static const char index_name[] = "/index.html";
+  size_t            index_length = sizeof(index_name) - 1;
+  if (length >= index_length && strcmp(url_path + length - index_length, index_name) == 0) {
+    size_t directory_length = length - index_length;
+    if (directory_length > 0 && iris_bundle_add_key(tree, url_path, directory_length, file) != 0)
+      return -1;
+    if (iris_bundle_add_key(tree, url_path, directory_length + 1, file) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int iris_bundle_scan(iris_bundle_tree* tree, const char* fs_dir, const char* url_dir) {
+  DIR* dir = opendir(fs_dir);
+  if (!dir)
+    return -1;
+
+  int            result = 0;
+  struct dirent* entry;
+  while (result == 0 && (entry = readdir(dir))) {
+    // Skip hidden files and the temporaries of files being written
+    const char* name   = entry->d_name;
+    size_t      length = strlen(name);
+    if (name[0] == '.' || (length > 4 && strcmp(name + length - 4, ".tmp") == 0))
+      continue;
+
+    char fs_path[IRIS_MAX_PATH_SIZE];
+    char url_path[IRIS_MAX_PATH_SIZE];
+    int  fs_length  = snprintf(fs_path, sizeof(fs_path), "%s/%s", fs_dir, name);
+    int  url_length = snprintf(url_path, sizeof(url_path), "%s/%s", url_dir, name);
+    if (fs_length < 0 || fs_length >= (int) sizeof(fs_path) || url_length < 0 ||
+        url_length >= (int) sizeof(url_path)) {
+      continue;
+    }
+
+    struct stat st;
+    if (stat(fs_path, &st) != 0 ||
+        (st.st_dev == tree->bundle_device && st.st_ino == tree->bundle_inode)) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode))
+      result = iris_bundle_scan(tree, fs_path, url_path);
+    else if (S_ISREG(st.st_mode))
+      result = iris_bundle_add_file(tree, fs_path, url_path, &st);
+  }
+  closedir(dir);
+  return result;
+}
+
+static void iris_bundle_free_tree(iris_bundle_tree* tree) {
+  for (size_t i = 0; i < tree->file_count; ++i)
+    free(tree->files[i].fs_path);
+  for (size_t i = 0; i < tree->key_count; ++i)
+    free(tree->keys[i].url_path);
+  free(tree->files);
+  free(tree->keys);
+}
+
+static int iris_bundle_compare_keys(const void* a, const void* b) {
+  return strcmp(((const iris_bundle_key*) a)->url_path, ((const iris_bundle_key*) b)->url_path);
+}
+
+static uint64_t iris_bundle_etag_hash(const unsigned char* data, size_t length) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static int iris_bundle_read_file(const char* path, size_t size, unsigned char** data) {
+  *data = malloc(size ? size : 1);
+  if (!*data)
+    return -1;
+
+  FILE* file = fopen(path, "rb");
+  if (!file || fread(*data, 1, size, file) != size) {
+    if (file)
+      fclose(file);
+    free(*data);
+    *data = NULL;
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
+
+#ifdef IRIS_HAVE_ZLIB
+// Types worth compressing, everything else is usually compressed already
+static int iris_bundle_compressible(const char* mime_type) {
+  return strncmp(mime_type, "text/", 5) == 0 || strstr(mime_type, "javascript") ||
+         strstr(mime_type, "json") || strstr(mime_type, "xml");
+}
+
+// Compress with a gzip wrapper. Returns the compressed size, or 0 when the
+// result would not be worth serving.
+static size_t iris_bundle_gzip(const unsigned char* data, size_t length, unsigned char** out) {
+  *out = NULL;
+  if (length < 256)
+    return 0;
+
+  z_stream stream = {0};
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    return 0;
+  }
+
+  size_t         bound  = deflateBound(&stream, length);
+  unsigned char* buffer = malloc(bound);
+  if (!buffer) {
+    deflateEnd(&stream);
+    return 0;
+  }
+  stream.next_in   = (unsigned char*) data;
+  stream.avail_in  = length;
+  stream.next_out  = buffer;
+  stream.avail_out = bound;
+  int    result    = deflate(&stream, Z_FINISH);
+  size_t size      = stream.total_out;
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END || size >= length - length / 8) {
+    free(buffer);
+    return 0;
+  }
+  *out = buffer;
+  return size;
+}
+#endif
+
+// Append to the bundle being written, tracking the offset
+static int iris_bundle_append(FILE* out, uint64_t* offset, const void* data, size_t length) {
+  if (length && fwrite(data, 1, length, out) != length)
+    return -1;
+  *offset += length;
+  return 0;
+}
+
+static int iris_bundle_write(iris_bundle_tree* tree, FILE* out) {
+  uint32_t slot_count = 1;
+  while (slot_count < tree->key_count * 2)
+    slot_count <<= 1;
+
+  iris_bundle_header header = {0};
+  memcpy(header.magic, IRIS_BUNDLE_MAGIC, sizeof(header.magic));
+  header.version        = IRIS_BUNDLE_VERSION;
+  header.entry_count    = (uint32_t) tree->key_count;
+  header.slot_count     = slot_count;
+  header.entries_offset = sizeof(iris_bundle_header);
+  header.slots_offset   = header.entries_offset + tree->key_count * sizeof(iris_bundle_entry);
+
+  iris_bundle_entry* entries = calloc(tree->key_count ? tree->key_count : 1, sizeof(*entries));
+  uint32_t*          slots   = calloc(slot_count, sizeof(uint32_t));
+  iris_bundle_entry* shared  = calloc(tree->file_count ? tree->file_count : 1, sizeof(*shared));
+  if (!entries || !slots || !shared) {
+    free(entries);
+    free(slots);
+    free(shared);
+    return -1;
+  }
+
+  // Linear probing over at most half full slots
+  for (uint32_t i = 0; i < header.entry_count; ++i) {
+    const char* path = tree->keys[i].url_path;
+    uint32_t    slot = iris_bundle_hash(path, strlen(path)) & (slot_count - 1);
+    while (slots[slot])
+      slot = (slot + 1) & (slot_count - 1);
+    slots[slot] = i + 1;
+  }
+
+  // Entries are rewritten once the offsets of the data are known
+  uint64_t offset = 0;
+  int      result = 0;
+  if (iris_bundle_append(out, &offset, &header, sizeof(header)) != 0 ||
+      iris_bundle_append(out, &offset, entries, tree->key_count * sizeof(*entries)) != 0 ||
+      iris_bundle_append(out, &offset, slots, slot_count * sizeof(uint32_t)) != 0) {
+    result = -1;
+  }
+
+  for (size_t i = 0; result == 0 && i < tree->key_count; ++i) {
+    entries[i].path_offset = offset;
+    entries[i].path_length = (uint32_t) strlen(tree->keys[i].url_path);
+    result = iris_bundle_append(out, &offset, tree->keys[i].url_path, entries[i].path_length);
+  }
+
+  for (size_t i = 0; result == 0 && i < tree->file_count; ++i) {
+    const iris_bundle_file* file   = &tree->files[i];
+    iris_bundle_entry*      target = &shared[i];
+    unsigned char*          data   = NULL;
+    if (iris_bundle_read_file(file->fs_path, (size_t) file->size, &data) != 0) {
+      result = -1;
+      break;
+    }
+
+    const char*        mime_type = iris_get_mime_type(file->fs_path);
+    unsigned long long etag_hash = iris_bundle_etag_hash(data, file->size);
+    char               etag[32];
+    int                etag_length = snprintf(etag, sizeof(etag), "\"%016llx\"", etag_hash);
+
+    char      last_modified[64];
+    struct tm tm_mtime;
+    gmtime_r(&file->mtime, &tm_mtime);
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm_mtime);
+
+    unsigned char* gzip_data   = NULL;
+    size_t         gzip_length = 0;
+#ifdef IRIS_HAVE_ZLIB
+    if (iris_bundle_compressible(mime_type))
+      gzip_length = iris_bundle_gzip(data, file->size, &gzip_data);
+#endif
+
+    char header_text[IRIS_MAX_HEADER_SIZE];
+    int  header_length = snprintf(header_text, sizeof(header_text),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: %s\r\n"
+                                  "Content-Length: %llu\r\n"
+                                  "Last-Modified: %s\r\n"
+                                  "ETag: %s\r\n"
+                                  "%s"
+                                  "Server: Iris/1.0\r\n",
+                                  mime_type, (unsigned long long) file->size, last_modified, etag,
+                                  gzip_length ? "Vary: Accept-Encoding\r\n" : "");
+
+    target->header_offset = offset;
+    target->header_length = (uint32_t) header_length;
+    target->etag_offset   = offset + (strstr(header_text, "ETag: ") - header_text) + 6;
+    target->etag_length   = (uint32_t) etag_length;
+    result                = iris_bundle_append(out, &offset, header_text, header_length);
+
+    if (result == 0) {
+      target->body_offset = offset;
+      target->body_length = file->size;
+      result              = iris_bundle_append(out, &offset, data, file->size);
+    }
+
+    if (result == 0 && gzip_length) {
+      header_length = snprintf(header_text, sizeof(header_text),
+                               "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Length: %llu\r\n"
+                               "Content-Encoding: gzip\r\n"
+                               "Last-Modified: %s\r\n"
+                               "ETag: %s\r\n"
+                               "Vary: Accept-Encoding\r\n"
+                               "Server: Iris/1.0\r\n",
+                               mime_type, (unsigned long long) gzip_length, last_modified, etag);
+      target->gzip_header_offset = offset;
+      target->gzip_header_length = (uint32_t) header_length;
+      result                     = iris_bundle_append(out, &offset, header_text, header_length);
+      if (result == 0) {
+        target->gzip_body_offset = offset;
+        target->gzip_body_length = gzip_length;
+        result                   = iris_bundle_append(out, &offset, gzip_data, gzip_length);
+      }
+    }
+
+    free(gzip_data);
+    free(data);
+  }
+
+  if (result == 0) {
+    for (size_t i = 0; i < tree->key_count; ++i) {
+      const iris_bundle_entry* target = &shared[tree->keys[i].file];
+      uint64_t                 path   = entries[i].path_offset;
+      uint32_t                 length = entries[i].path_length;
+      entries[i]                      = *target;
+      entries[i].path_offset          = path;
+      entries[i].path_length          = length;
+    }
+
+    header.size = offset;
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+        (tree->key_count &&
+         fwrite(entries, sizeof(iris_bundle_entry), tree->key_count, out) != tree->key_count)) {
+      result = -1;
+    }
+  }
+
+  free(entries);
+  free(slots);
+  free(shared);
+  return result;
+}
+
+int iris_bundle_build(const char* directory, const char* bundle_path) {
+  iris_bundle_tree tree = {0};
+  struct stat      st;
+  if (stat(bundle_path, &st) == 0) {
+    tree.bundle_device = st.st_dev;
+    tree.bundle_inode  = st.st_ino;
+  }
+  if (iris_bundle_scan(&tree, directory, "") != 0) {
+    iris_bundle_free_tree(&tree);
+    return -1;
+  }
+  qsort(tree.keys, tree.key_count, sizeof(iris_bundle_key), iris_bundle_compare_keys);
+
+  // Readers map whole files, so the new bundle only replaces the old one
+  // once it is complete
+  char tmp_path[IRIS_MAX_PATH_SIZE + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", bundle_path);
+  FILE* out = fopen(tmp_path, "wb");
+  if (!out) {
+    iris_bundle_free_tree(&tree);
+    return -1;
+  }
+
+  int result = iris_bundle_write(&tree, out);
+  if (fclose(out) != 0)
+    result = -1;
+  if (result == 0 && rename(tmp_path, bundle_path) != 0)
+    result = -1;
+  if (result != 0)
+    unlink(tmp_path);
+
+  iris_bundle_free_tree(&tree);
+  return result;
+}
@@ -0,0 +1,106 @@
+#ifndef IRIS_BUNDLE_H
+#define IRIS_BUNDLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "iris.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IRIS_BUNDLE_MAGIC   "IRISBDL1"
+#define IRIS_BUNDLE_VERSION 1
+
+/*
+ * A site bundle is one file holding every file of a served tree, laid out so
+ * that Iris can answer from an mmap of it:
+ *
+ *   header | entries, sorted by path | hash slots | paths | headers and bodies
+ *
+ * Integers are in host byte order, a bundle is served on the machine type that
+ * built it. Every offset is from the start of the file.
+ */
+typedef struct {
+  char     magic[8];        // IRIS_BUNDLE_MAGIC, without the terminating NUL
+  uint32_t version;         // IRIS_BUNDLE_VERSION
+  uint32_t entry_count;     // Number of entries
+  uint32_t slot_count;      // Number of hash slots, power of two
+  uint32_t reserved;
+  uint64_t entries_offset;  // Array of entry_count iris_bundle_entry
+  uint64_t slots_offset;    // Array of slot_count uint32_t, entry index + 1 or 0 when empty
+  uint64_t size;            // Size of the whole bundle
+} iris_bundle_header;
+
+// One request path. Aliases such as "/docs/" for "/docs/index.html" are entries
+// of their own that share the response of the file.
+typedef struct {
+  uint64_t path_offset;         // URL path, starting with '/'
+  uint64_t header_offset;       // Response header without Date and the blank line
+  uint64_t body_offset;         // File contents
+  uint64_t body_length;         // Size of the file
+  uint64_t gzip_header_offset;  // Response header of the gzip variant
+  uint64_t gzip_body_offset;    // Gzip variant of the file
+  uint64_t gzip_body_length;    // Size of the gzip variant, 0 when there is none
+  uint64_t etag_offset;         // Quoted entity tag, as sent in the header
+  uint32_t path_length;
+  uint32_t header_length;
+  uint32_t gzip_header_length;
+  uint32_t etag_length;
+} iris_bundle_entry;
+
+// A bundle mapped into memory
+typedef struct {
+  const unsigned char*     data;
+  size_t                   size;
+  const iris_bundle_entry* entries;
+  const uint32_t*          slots;
+  uint32_t                 entry_count;
+  uint32_t                 slot_count;
+  dev_t                    device;  // Identity of the file, to notice a swap
+  ino_t                    inode;
+} iris_bundle;
+
+/*
+ * Hash a URL path for the slot table.
+ *
+ * @param path The path.
+ * @param length The length of the path.
+ * @return The 32-bit hash.
+ */
+uint32_t iris_bundle_hash(const char* path, size_t length);
+
+/*
+ * Map a bundle and check that all of its offsets are within the file, so
+ * entries can be served without further checks.
+ *
+ * @param path The path to the bundle.
+ * @param bundle The bundle to fill.
+ * @return 0 on success, -1 if the file cannot be mapped or is not a valid bundle.
+ */
+int iris_bundle_open(const char* path, iris_bundle* bundle);
+
+/*
+ * Unmap a bundle opened with iris_bundle_open.
+ *
+ * @param bundle The bundle to close.
+ */
+void iris_bundle_close(iris_bundle* bundle);
+
+/*
+ * Find the entry of a URL path.
+ *
+ * @param bundle The bundle to search.
+ * @param path The URL path, starting with '/'.
+ * @param length The length of the path.
+ * @return The entry, or NULL if the bundle has no such path.
+ */
+const iris_bundle_entry* iris_bundle_find(const iris_bundle* bundle, const char* path,
+                                          size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IRIS_BUNDLE_H */
@@ -1,11 +1,16 @@
 #define _POSIX_C_SOURCE 200112L
 #define _DEFAULT_SOURCE
 #include "iris.h"
+#include "bundle.h"
+#include "mime.h"
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <limits.h>
 #include <netinet/in.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,49 +18,301 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-static iris_mime_entry mime_types[] = {
-    {".html", "text/html"               },
-    {".htm",  "text/html"               },
-    {".css",  "text/css"                },
-    {".js",   "application/javascript"  },
-    {".json", "application/json"        },
-    {".png",  "image/png"               },
-    {".jpg",  "image/jpeg"              },
-    {".jpeg", "image/jpeg"              },
-    {".gif",  "image/gif"               },
-    {".txt",  "text/plain"              },
-    {NULL,    "application/octet-stream"}
-};
+// Built-in table, generated from mime.types at build time
+#include "mime_table.h"
+
+// Table used for lookups, replaced by iris_load_mime_types
+static const iris_mime_table* mime_table = &builtin_mime_table;
+
+// Storage behind a table loaded at runtime
+static iris_mime_table loaded_mime_table;
+static char*           loaded_mime_data    = NULL;
+static char*           loaded_mime_charset = NULL;
+
+// Answer for clients over their budget. Built once so that rejecting a client
+// costs a single send and no formatting.
+static const char too_many_requests_response[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Content-Type: text/html\r\n"
+    "Content-Length: 105\r\n"
+    "Retry-After: 1\r\n"
+    "Server: Iris/1.0\r\n\r\n"
+    "<html><head><title>429 Too Many Requests</title></head>"
+    "<body><h1>429 Too Many Requests</h1></body></html>";
+
+// Token buckets of a single client. A zero last_seen marks an unused slot.
+typedef struct {
+  uint32_t addr;
+  uint64_t last_seen;
+  double   request_tokens;
+  double   byte_tokens;
+} iris_client_bucket;
+
+// Iris handles one connection at a time from the accept loop, so the client
+// table is never shared and needs no synchronization.
+static iris_rate_limit    rate_limit;
+static int                rate_limit_enabled = 0;
+static iris_client_bucket rate_limit_table[IRIS_RATELIMIT_SETS][IRIS_RATELIMIT_WAYS];
+
+// Bytes sent for the response in flight, charged to the client once it is done
+static size_t response_bytes = 0;
+
+// How often to look for a rebuilt bundle
+#define IRIS_BUNDLE_CHECK_NS 1000000000ull
+
+// Bundle served instead of the directory, see iris_set_bundle
+static iris_bundle bundle;
+static char        bundle_path[IRIS_MAX_PATH_SIZE];
+static int         bundle_enabled = 0;
+static uint64_t    bundle_checked = 0;
+
+static void iris_send(int client_fd, const void* data, size_t length) {
+  ssize_t sent = send(client_fd, data, length, 0);
+  if (sent > 0)
+    response_bytes += (size_t) sent;
+}
+
+// Send a response gathered from several buffers, continuing after partial writes
+static void iris_send_vector(int client_fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t sent = writev(client_fd, iov, count);
+    if (sent <= 0)
+      return;
+    response_bytes += (size_t) sent;
+
+    while (count > 0 && (size_t) sent >= iov->iov_len) {
+      sent -= (ssize_t) iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*) iov->iov_base + sent;
+      iov->iov_len -= (size_t) sent;
+    }
+  }
+}
+
+static uint64_t iris_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static double iris_refill(double tokens, double rate, double burst, double elapsed) {
+  tokens += rate * elapsed;
+  return tokens > burst ? burst : tokens;
+}
+
+// Find the bucket of a client, or evict the least recently seen client of its
+// set to make room. Either way this touches IRIS_RATELIMIT_WAYS slots at most.
+static iris_client_bucket* iris_rate_limit_lookup(uint32_t client_addr, uint64_t now) {
+  uint32_t            set_index = ((client_addr * 2654435761u) >> 16) & (IRIS_RATELIMIT_SETS - 1);
+  iris_client_bucket* set       = rate_limit_table[set_index];
+  iris_client_bucket* oldest    = &set[0];
+
+  for (int i = 0; i < IRIS_RATELIMIT_WAYS; ++i) {
+    iris_client_bucket* bucket = &set[i];
+    if (bucket->last_seen != 0 && bucket->addr == client_addr) {
+      double elapsed         = (double) (now - bucket->last_seen) / 1e9;
+      bucket->request_tokens = iris_refill(bucket->request_tokens, rate_limit.requests_per_second,
+                                           rate_limit.request_burst, elapsed);
+      bucket->byte_tokens    = iris_refill(bucket->byte_tokens, rate_limit.bytes_per_second,
+                                           rate_limit.byte_burst, elapsed);
+      bucket->last_seen      = now;
+      return bucket;
+    }
+    if (bucket->last_seen < oldest->last_seen)
+      oldest = bucket;
+  }
+
+  oldest->addr           = client_addr;
+  oldest->last_seen      = now;
+  oldest->request_tokens = rate_limit.request_burst;
+  oldest->byte_tokens    = rate_limit.byte_burst;
+  return oldest;
+}
+
+void iris_set_rate_limit(const iris_rate_limit* limit) {
+  memset(rate_limit_table, 0, sizeof(rate_limit_table));
+  rate_limit_enabled = 0;
+  if (!limit)
+    return;
+
+  rate_limit = *limit;
+  if (rate_limit.requests_per_second < 0)
+    rate_limit.requests_per_second = 0;
+  if (rate_limit.bytes_per_second < 0)
+    rate_limit.bytes_per_second = 0;
+  if (rate_limit.request_burst <= 0)
+    rate_limit.request_burst = rate_limit.requests_per_second;
+  if (rate_limit.request_burst < 1)
+    rate_limit.request_burst = 1;
+  if (rate_limit.byte_burst <= 0)
+    rate_limit.byte_burst = rate_limit.bytes_per_second;
+
+  rate_limit_enabled = rate_limit.requests_per_second > 0 || rate_limit.bytes_per_second > 0;
+}
+
+int iris_rate_limit_admit(uint32_t client_addr) {
+  if (!rate_limit_enabled)
+    return 1;
+
+  iris_client_bucket* bucket = iris_rate_limit_lookup(client_addr, iris_monotonic_ns());
+  if (rate_limit.bytes_per_second > 0 && bucket->byte_tokens <= 0)
+    return 0;
+  if (rate_limit.requests_per_second > 0) {
+    if (bucket->request_tokens < 1)
+      return 0;
+    bucket->request_tokens -= 1;
+  }
+  return 1;
+}
+
+void iris_rate_limit_charge(uint32_t client_addr, size_t bytes) {
+  if (!rate_limit_enabled || rate_limit.bytes_per_second <= 0)
+    return;
+
+  iris_client_bucket* bucket = iris_rate_limit_lookup(client_addr, iris_monotonic_ns());
+  bucket->byte_tokens -= (double) bytes;
+}
 
 const char* iris_get_mime_type(const char* path) {
   const char* ext = strrchr(path, '.');
   if (ext) {
-    for (iris_mime_entry* entry = mime_types; entry->extension; ++entry) {
-      if (strcasecmp(ext, entry->extension) == 0) {
-        return entry->mime_type;
-      }
+    char   key[IRIS_MIME_MAX_EXTENSION];
+    size_t length = 0;
+    for (++ext; ext[length] && length < sizeof(key); ++length) {
+      key[length] = (char) tolower((unsigned char) ext[length]);
+    }
+
+    if (!ext[length]) {
+      const char* mime_type = iris_mime_table_lookup(mime_table, key, length);
+      if (mime_type)
+        return mime_type;
     }
   }
 
   return "application/octet-stream";
 }
 
-void iris_get_http_date(char* buffer, size_t buffer_size) {
-  time_t    now = time(NULL);
-  struct tm tm_now;
+int iris_load_mime_types(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return -1;
+
+  fseek(file, 0, SEEK_END);
+  long file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (file_size < 0) {
+    fclose(file);
+    return -1;
+  }
+
+  char* data = malloc(file_size + 1);
+  if (!data) {
+    fclose(file);
+    return -1;
+  }
+  size_t bytes_read = fread(data, 1, file_size, file);
+  data[bytes_read]  = '\0';
+  fclose(file);
+
+  size_t charset_size = 0;
+  size_t file_count   = iris_mime_parse(data, NULL, NULL, &charset_size);
+
+  size_t builtin_count = 0;
+  for (uint32_t i = 0; i < builtin_mime_table.size; ++i) {
+    if (builtin_mime_table.slots[i].extension)
+      builtin_count++;
+  }
+
+  iris_mime_entry* entries = malloc((builtin_count + file_count + 1) * sizeof(iris_mime_entry));
+  char*            charset = malloc(charset_size + 1);
+  if (!entries || !charset) {
+    free(entries);
+    free(charset);
+    free(data);
+    return -1;
+  }
+
+  // Built-in entries come first so they win over the file on conflicts
+  size_t count = 0;
+  for (uint32_t i = 0; i < builtin_mime_table.size; ++i) {
+    if (builtin_mime_table.slots[i].extension)
+      entries[count++] = builtin_mime_table.slots[i];
+  }
+  count += iris_mime_parse(data, entries + count, charset, NULL);
+
+  iris_mime_table table;
+  int             result = iris_mime_table_build(entries, count, &table);
+  free(entries);
+  if (result != 0) {
+    free(charset);
+    free(data);
+    return -1;
+  }
+
+  if (mime_table == &loaded_mime_table) {
+    iris_mime_table_free(&loaded_mime_table);
+    free(loaded_mime_data);
+    free(loaded_mime_charset);
+  }
+  loaded_mime_table   = table;
+  loaded_mime_data    = data;
+  loaded_mime_charset = charset;
+  mime_table          = &loaded_mime_table;
+  return 0;
+}
+
+static void iris_format_http_date(time_t when, char* buffer, size_t buffer_size) {
+  struct tm tm_when;
 #if defined(_POSIX_VERSION)
-  gmtime_r(&now, &tm_now);
+  gmtime_r(&when, &tm_when);
 #else
-  struct tm* tmptr = gmtime(&now);
+  struct tm* tmptr = gmtime(&when);
   if (tmptr)
-    tm_now = *tmptr;
+    tm_when = *tmptr;
   else
-    memset(&tm_now, 0, sizeof(tm_now));
+    memset(&tm_when, 0, sizeof(tm_when));
 #endif
-  strftime(buffer, buffer_size, "%a, %d %b %Y %H:%M:%S GMT", &tm_now);
+  strftime(buffer, buffer_size, "%a, %d %b %Y %H:%M:%S GMT", &tm_when);
+}
+
+void iris_get_http_date(char* buffer, size_t buffer_size) {
+  iris_format_http_date(time(NULL), buffer, buffer_size);
+}
+
+// Copy the value of a request header, without surrounding whitespace. Returns 0
+// when the header is missing or does not fit.
+static int iris_get_header(const char* request, const char* name, char* value, size_t value_size) {
+  size_t      name_length = strlen(name);
+  const char* line        = strstr(request, "\r\n");
+  while (line && line[2] != '\r' && line[2] != '\0') {
+    line += 2;
+    const char* line_end = strstr(line, "\r\n");
+    if (!line_end)
+      line_end = line + strlen(line);
+
+    if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+      const char* start = line + name_length + 1;
+      while (start < line_end && (*start == ' ' || *start == '\t'))
+        start++;
+      const char* end = line_end;
+      while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+      if ((size_t) (end - start) >= value_size)
+        return 0;
+      memcpy(value, start, end - start);
+      value[end - start] = '\0';
+      return 1;
+    }
+    line = *line_end ? line_end : NULL;
+  }
+  return 0;
 }
 
 void iris_send_error_response(int client_fd, int status_code, const char* message) {
@@ -76,8 +333,8 @@ void iris_send_error_response(int client_fd, int status_code, const char* messag
            "Date: %s\r\n"
            "Server: Iris/1.0\r\n\r\n",
            status_code, message, body_length, date);
-  send(client_fd, header, strlen(header), 0);
-  send(client_fd, body, body_length, 0);
+  iris_send(client_fd, header, strlen(header));
+  iris_send(client_fd, body, body_length);
 }
 
 void iris_send_file(const char* path, int client_fd) {
@@ -97,25 +354,146 @@ void iris_send_file(const char* path, int client_fd) {
     return;
   }
 
+  char last_modified[128];
+  iris_format_http_date(st.st_mtime, last_modified, sizeof(last_modified));
+
   const char* mime_type = iris_get_mime_type(path);
   char        header[IRIS_MAX_HEADER_SIZE];
   snprintf(header, sizeof(header),
            "HTTP/1.0 200 OK\r\n"
            "Content-Type: %s\r\n"
            "Content-Length: %ld\r\n"
+           "Last-Modified: %s\r\n"
            "Date: %s\r\n"
            "Server: Iris/1.0\r\n\r\n",
-           mime_type, st.st_size, date);
-  send(client_fd, header, strlen(header), 0);
+           mime_type, st.st_size, last_modified, date);
+  iris_send(client_fd, header, strlen(header));
 
   char   buffer[IRIS_BUFFER_SIZE];
   size_t bytes_read;
   while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-    send(client_fd, buffer, bytes_read, 0);
+    iris_send(client_fd, buffer, bytes_read);
   }
   fclose(file);
 }
 
+// Answer a conditional GET. Like the Last-Modified header it is compared with,
+// If-Modified-Since must be an exact date match; anything else gets the file.
+static void iris_send_file_if_modified(const char* path, const struct stat* st,
+                                       const char* if_modified_since, int client_fd) {
+  char last_modified[128];
+  iris_format_http_date(st->st_mtime, last_modified, sizeof(last_modified));
+  if (!if_modified_since[0] || strcmp(if_modified_since, last_modified) != 0) {
+    iris_send_file(path, client_fd);
+    return;
+  }
+
+  char date[128];
+  iris_get_http_date(date, sizeof(date));
+  char header[IRIS_MAX_HEADER_SIZE];
+  snprintf(header, sizeof(header),
+           "HTTP/1.0 304 Not Modified\r\n"
+           "Last-Modified: %s\r\n"
+           "Date: %s\r\n"
+           "Server: Iris/1.0\r\n\r\n",
+           last_modified, date);
+  iris_send(client_fd, header, strlen(header));
+}
+
+int iris_set_bundle(const char* path) {
+  if (strlen(path) >= sizeof(bundle_path))
+    return -1;
+
+  iris_bundle opened;
+  if (iris_bundle_open(path, &opened) != 0)
+    return -1;
+
+  iris_bundle_close(&bundle);
+  bundle = opened;
+  strcpy(bundle_path, path);
+  bundle_enabled = 1;
+  bundle_checked = iris_monotonic_ns();
+  return 0;
+}
+
+// Map the bundle again once it has been replaced. Rebuilds rename a new file
+// over the old one, so a different inode means a new bundle. One that fails to
+// open is ignored and the current one kept.
+static void iris_refresh_bundle(void) {
+  uint64_t now = iris_monotonic_ns();
+  if (now - bundle_checked < IRIS_BUNDLE_CHECK_NS)
+    return;
+  bundle_checked = now;
+
+  struct stat st;
+  if (stat(bundle_path, &st) != 0 || (st.st_dev == bundle.device && st.st_ino == bundle.inode))
+    return;
+
+  iris_bundle replacement;
+  if (iris_bundle_open(bundle_path, &replacement) == 0) {
+    iris_bundle_close(&bundle);
+    bundle = replacement;
+  }
+}
+
+// Answer from the bundle: the prebuilt header and the body come straight from
+// the mapping, only the Date line is formatted per request.
+static void iris_send_from_bundle(const char* request, const char* path, int client_fd) {
+  iris_refresh_bundle();
+
+  const iris_bundle_entry* entry = iris_bundle_find(&bundle, path, strcspn(path, "?"));
+  if (!entry) {
+    iris_send_error_response(client_fd, 404, "Not Found");
+    return;
+  }
+
+  const char* data = (const char*) bundle.data;
+  const char* etag = data + entry->etag_offset;
+  char        date[128];
+  iris_get_http_date(date, sizeof(date));
+
+  char if_none_match[64];
+  if (iris_get_header(request, "If-None-Match", if_none_match, sizeof(if_none_match)) &&
+      strlen(if_none_match) == entry->etag_length &&
+      memcmp(if_none_match, etag, entry->etag_length) == 0) {
+    char header[IRIS_MAX_HEADER_SIZE];
+    int  header_length = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 304 Not Modified\r\n"
+                                  "ETag: %.*s\r\n"
+                                  "Date: %s\r\n"
+                                  "Server: Iris/1.0\r\n\r\n",
+                                  (int) entry->etag_length, etag, date);
+    iris_send(client_fd, header, header_length);
+    return;
+  }
+
+  char accept_encoding[256];
+  int  gzip = 0;
+  if (entry->gzip_body_length &&
+      iris_get_header(request, "Accept-Encoding", accept_encoding, sizeof(accept_encoding))) {
+    gzip = strstr(accept_encoding, "gzip") != NULL;
+  }
+
+  char date_line[160];
+  int  date_length = snprintf(date_line, sizeof(date_line), "Date: %s\r\n\r\n", date);
+
+  struct iovec iov[3];
+  if (gzip) {
+    iov[0].iov_base = (void*) (data + entry->gzip_header_offset);
+    iov[0].iov_len  = entry->gzip_header_length;
+    iov[2].iov_base = (void*) (data + entry->gzip_body_offset);
+    iov[2].iov_len  = entry->gzip_body_length;
+  } else {
+    iov[0].iov_base = (void*) (data + entry->header_offset);
+    iov[0].iov_len  = entry->header_length;
+    iov[2].iov_base = (void*) (data + entry->body_offset);
+    iov[2].iov_len  = entry->body_length;
+  }
+  iov[1].iov_base = date_line;
+  iov[1].iov_len  = (size_t) date_length;
+  iris_send_vector(client_fd, iov, 3);
+}
+
 void iris_send_directory_listing(const char* fs_path, const char* url_path, int client_fd) {
   char date[128];
   iris_get_http_date(date, sizeof(date));
@@ -126,14 +504,14 @@ void iris_send_directory_listing(const char* fs_path, const char* url_path, int
            "Date: %s\r\n"
            "Server: Iris/1.0\r\n\r\n",
            date);
-  send(client_fd, header, strlen(header), 0);
+  iris_send(client_fd, header, strlen(header));
 
   char buffer[IRIS_BUFFER_SIZE];
   snprintf(buffer, sizeof(buffer),
            "<html><head><title>Directory listing for %s</title></head>"
            "<body><h1>Directory listing for %s</h1><ul>",
            url_path, url_path);
-  send(client_fd, buffer, strlen(buffer), 0);
+  iris_send(client_fd, buffer, strlen(buffer));
 
   DIR* dir = opendir(fs_path);
   if (!dir) {
@@ -154,12 +532,12 @@ void iris_send_directory_listing(const char* fs_path, const char* url_path, int
       snprintf(buffer, sizeof(buffer), "<li><a href=\"%s/%s\">%s</a></li>", url_path, entry->d_name,
                entry->d_name);
     }
-    send(client_fd, buffer, strlen(buffer), 0);
+    iris_send(client_fd, buffer, strlen(buffer));
   }
 
   closedir(dir);
   snprintf(buffer, sizeof(buffer), "</ul></body></html>");
-  send(client_fd, buffer, strlen(buffer), 0);
+  iris_send(client_fd, buffer, strlen(buffer));
 }
 
 int iris_sanitize_path(const char* base_dir, const char* requested_path, char* full_path) {
@@ -170,6 +548,7 @@ int iris_sanitize_path(const char* base_dir, const char* requested_path, char* f
 
   // Reject if the requested path is not rooted
   if (requested_path[0] != '/') {
+    errno = EACCES;
     return 0;
   }
 
@@ -179,11 +558,12 @@ int iris_sanitize_path(const char* base_dir, const char* requested_path, char* f
   // Use a larger buffer for realpath since it can write up to PATH_MAX bytes
   char realpath_buffer[PATH_MAX];
   if (!realpath(resolved_path, realpath_buffer)) {
-    return 0;
+    return 0;  // errno tells a missing file apart from other failures
   }
 
   // Check if the resolved path fits in our output buffer
   if (strlen(realpath_buffer) >= IRIS_MAX_PATH_SIZE) {
+    errno = ENAMETOOLONG;
     return 0;  // path is too long for our buffer
   }
 
@@ -196,12 +576,74 @@ int iris_sanitize_path(const char* base_dir, const char* requested_path, char* f
     base_len--;
   }
   if (strncmp(full_path, base_dir, base_len) != 0) {
+    errno = EACCES;
     return 0;
   }
 
   return 1;
 }
 
+// Answer one request. Every way out leaves the bytes sent in response_bytes, for
+// the caller to charge to the client.
+static void iris_handle_request(const char* base_dir, const char* request, int client_fd) {
+  char method[IRIS_MAX_METHOD_SIZE]   = {0};
+  char path[IRIS_MAX_PATH_SIZE]       = {0};
+  char version[IRIS_MAX_VERSION_SIZE] = {0};
+
+  int tokens = sscanf(request, "%15s %511s %15s", method, path, version);
+  if (tokens != 3) {
+    iris_send_error_response(client_fd, 400, "Bad Request");
+    return;
+  }
+
+  // Only allow GET method and require the path to start with '/'
+  if (strcasecmp(method, "GET") != 0 || path[0] != '/') {
+    iris_send_error_response(client_fd, 405, "Method Not Allowed");
+    return;
+  }
+
+  if (bundle_enabled) {
+    iris_send_from_bundle(request, path, client_fd);
+    return;
+  }
+
+  char if_modified_since[64];
+  if (!iris_get_header(request, "If-Modified-Since", if_modified_since,
+                       sizeof(if_modified_since))) {
+    if_modified_since[0] = '\0';
+  }
+
+  char full_path[IRIS_MAX_PATH_SIZE];
+  if (!iris_sanitize_path(base_dir, path, full_path)) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      iris_send_error_response(client_fd, 404, "Not Found");
+    else
+      iris_send_error_response(client_fd, 403, "Forbidden");
+    return;
+  }
+
+  struct stat st;
+  if (stat(full_path, &st) == 0) {
+    if (S_ISDIR(st.st_mode)) {
+      char index_path[IRIS_MAX_PATH_SIZE + 12];  // 12 for "/index.html"
+      snprintf(index_path, sizeof(index_path), "%s/index.html", full_path);
+      char url_index_path[IRIS_MAX_PATH_SIZE + 12];
+      snprintf(url_index_path, sizeof(url_index_path), "%s/index.html", path);
+      if (stat(index_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        iris_send_file_if_modified(index_path, &st, if_modified_since, client_fd);
+      } else {
+        iris_send_directory_listing(full_path, path, client_fd);
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      iris_send_file_if_modified(full_path, &st, if_modified_since, client_fd);
+    } else {
+      iris_send_error_response(client_fd, 403, "Forbidden");
+    }
+  } else {
+    iris_send_error_response(client_fd, 404, "Not Found");
+  }
+}
+
 int iris_start(const char* address, const char* directory, int port) {
   // Resolve base directory to absolute path once
   char resolved_base_dir[IRIS_MAX_PATH_SIZE];
@@ -263,7 +705,10 @@ int iris_start(const char* address, const char* directory, int port) {
   printf("Serving HTTP on %s port %d (http://%s:%d/) ...\n", address, port, address, port);
 
   while (1) {
-    int client_fd = accept(server_fd, NULL, NULL);
+    struct sockaddr_in client_addr     = {0};
+    socklen_t          client_addr_len = sizeof(client_addr);
+
+    int client_fd = accept(server_fd, (struct sockaddr*) &client_addr, &client_addr_len);
     if (client_fd == -1) {
       perror("accept");
       continue;
@@ -278,52 +723,14 @@ int iris_start(const char* address, const char* directory, int port) {
     buffer[bytes_read] = '\0';
     printf("Request:\n%s\n", buffer);
 
-    char method[IRIS_MAX_METHOD_SIZE]   = {0};
-    char path[IRIS_MAX_PATH_SIZE]       = {0};
-    char version[IRIS_MAX_VERSION_SIZE] = {0};
-
-    int tokens = sscanf(buffer, "%15s %511s %15s", method, path, version);
-    if (tokens != 3) {
-      iris_send_error_response(client_fd, 400, "Bad Request");
-      close(client_fd);
-      continue;
-    }
-
-    // Only allow GET method and require the path to start with '/'
-    if (strcasecmp(method, "GET") != 0 || path[0] != '/') {
-      iris_send_error_response(client_fd, 405, "Method Not Allowed");
+    if (!iris_rate_limit_admit(client_addr.sin_addr.s_addr)) {
+      send(client_fd, too_many_requests_response, sizeof(too_many_requests_response) - 1, 0);
       close(client_fd);
       continue;
     }
-
-    char full_path[IRIS_MAX_PATH_SIZE];
-    if (!iris_sanitize_path(resolved_base_dir, path, full_path)) {
-      iris_send_error_response(client_fd, 403, "Forbidden");
-      close(client_fd);
-      continue;
-    }
-
-    struct stat st;
-    if (stat(full_path, &st) == 0) {
-      if (S_ISDIR(st.st_mode)) {
-        char index_path[IRIS_MAX_PATH_SIZE + 12];  // 12 for "/index.html"
-        snprintf(index_path, sizeof(index_path), "%s/index.html", full_path);
-        char url_index_path[IRIS_MAX_PATH_SIZE + 12];
-        snprintf(url_index_path, sizeof(url_index_path), "%s/index.html", path);
-        if (stat(index_path, &st) == 0 && S_ISREG(st.st_mode)) {
-          iris_send_file(index_path, client_fd);
-        } else {
-          iris_send_directory_listing(full_path, path, client_fd);
-        }
-      } else if (S_ISREG(st.st_mode)) {
-        iris_send_file(full_path, client_fd);
-      } else {
-        iris_send_error_response(client_fd, 403, "Forbidden");
-      }
-    } else {
-      iris_send_error_response(client_fd, 404, "Not Found");
-    }
-
+    response_bytes = 0;
+    iris_handle_request(resolved_base_dir, buffer, client_fd);
+    iris_rate_limit_charge(client_addr.sin_addr.s_addr, response_bytes);
     close(client_fd);
   }
 
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define IRIS_BUFFER_SIZE 4096
 #define IRIS_MAX_PATH_SIZE 512
@@ -13,11 +14,23 @@ extern "C" {
 #define IRIS_MAX_METHOD_SIZE 16
 #define IRIS_MAX_VERSION_SIZE 16
 
+// Client table for rate limiting. Sets must be a power of two, the table holds
+// IRIS_RATELIMIT_SETS * IRIS_RATELIMIT_WAYS clients at most.
+#define IRIS_RATELIMIT_SETS 1024
+#define IRIS_RATELIMIT_WAYS 4
+
 typedef struct {
   const char* extension;
   const char* mime_type;
 } iris_mime_entry;
 
+typedef struct {
+  double requests_per_second;  // Sustained requests per client, 0 disables
+  double request_burst;        // Bucket capacity in requests, 0 means one second worth
+  double bytes_per_second;     // Sustained response bytes per client, 0 disables
+  double byte_burst;           // Bucket capacity in bytes, 0 means one second worth
+} iris_rate_limit;
+
 /*
  * Get the MIME type based on the file extension in the given path.
  *
@@ -26,6 +39,15 @@ typedef struct {
  */
 const char* iris_get_mime_type(const char* path);
 
+/*
+ * Extend the MIME table with a mime.types(5) file such as /etc/mime.types.
+ * Built-in types take precedence over the file for the same extension.
+ *
+ * @param path The path to the file.
+ * @return 0 on success, -1 if the file could not be read or indexed.
+ */
+int iris_load_mime_types(const char* path);
+
 /*
  * Fill the provided buffer with the current HTTP date string.
  *
@@ -65,10 +87,59 @@ void iris_send_directory_listing(const char* fs_path, const char* url_path, int
  * @param base_dir The base directory from which files are served.
  * @param requested_path The HTTP requested path.
  * @param full_path Buffer where the full, sanitized path is stored.
- * @return 1 if the path is valid and within the base directory, 0 otherwise.
+ * @return 1 if the path is valid and within the base directory, 0 otherwise,
+ *         with errno set to ENOENT when the path does not exist.
  */
 int iris_sanitize_path(const char* base_dir, const char* requested_path, char* full_path);
 
+/*
+ * Configure per-client rate limiting. Clients are keyed by source address and
+ * tracked in a fixed-size table, the least recently seen client of a set is
+ * evicted when the set is full. Passing NULL disables rate limiting.
+ *
+ * @param limit The limits to apply, copied by the server.
+ */
+void iris_set_rate_limit(const iris_rate_limit* limit);
+
+/*
+ * Charge one request against the bucket of the given client.
+ *
+ * @param client_addr The IPv4 source address of the client (network order).
+ * @return 1 if the request is admitted, 0 if the client is over budget.
+ */
+int iris_rate_limit_admit(uint32_t client_addr);
+
+/*
+ * Charge the bytes of a response against the bucket of the given client. The
+ * bucket may go into debt, which delays the next admitted request.
+ *
+ * @param client_addr The IPv4 source address of the client (network order).
+ * @param bytes Number of response bytes sent to the client.
+ */
+void iris_rate_limit_charge(uint32_t client_addr, size_t bytes);
+
+/*
+ * Write every file under a directory into a site bundle (see bundle.h). The
+ * bundle is written next to its destination and renamed over it, so a server
+ * reading the old bundle never sees a partial one. An index.html also answers
+ * for its directory.
+ *
+ * @param directory The directory to bundle.
+ * @param bundle_path The path of the bundle to write.
+ * @return 0 on success, -1 if a file could not be read or the bundle written.
+ */
+int iris_bundle_build(const char* directory, const char* bundle_path);
+
+/*
+ * Serve requests from a site bundle instead of the directory given to
+ * iris_start. The bundle is checked about once a second and mapped again when
+ * it has been replaced.
+ *
+ * @param path The path to the bundle.
+ * @return 0 on success, -1 if the bundle cannot be opened.
+ */
+int iris_set_bundle(const char* path);
+
 /*
  * Start the Iris HTTP server.
  *
@@ -11,18 +11,38 @@ int main(int argc, char* argv[]) {
   char directory[IRIS_MAX_PATH_SIZE] = ".";
   int  port                          = 8000;
 
+  iris_rate_limit limit = {0};
+
   for (int i = 1; i < argc; ++i) {
     if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
-      fprintf(stderr, "Usage: %s [-b ADDRESS] [-d DIRECTORY] [port]\n", argv[0]);
+      fprintf(stderr,
+              "Usage: %s [-b ADDRESS] [-d DIRECTORY] [-B BUNDLE] [-m MIME_TYPES] [-r REQS/S] "
+              "[-R BYTES/S] [port]\n",
+              argv[0]);
       return 0;
     } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
       strncpy(address, argv[++i], sizeof(address) - 1);
     } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
       strncpy(directory, argv[++i], sizeof(directory) - 1);
+    } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+      if (iris_set_bundle(argv[++i]) != 0) {
+        fprintf(stderr, "Failed to open bundle %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      if (iris_load_mime_types(argv[++i]) != 0) {
+        fprintf(stderr, "Failed to load MIME types from %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      limit.requests_per_second = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      limit.bytes_per_second = atof(argv[++i]);
     } else {
       port = atoi(argv[i]);
     }
   }
 
+  iris_set_rate_limit(&limit);
   return iris_start(address, directory, port);
 }
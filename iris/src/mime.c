@@ -0,0 +1,259 @@
+#include "mime.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IRIS_MIME_CHARSET "; charset=utf-8"
+#define IRIS_MIME_MAX_DISPLACEMENT 65535
+
+uint32_t iris_mime_hash(const char* key, size_t length, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char) key[i];
+    hash *= 16777619u;
+  }
+
+  // Finalize so that nearby seeds give unrelated slots
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+const char* iris_mime_table_lookup(const iris_mime_table* table, const char* key, size_t length) {
+  if (!table->size)
+    return NULL;
+
+  uint32_t bucket = iris_mime_hash(key, length, 0) & (table->bucket_count - 1);
+  uint32_t slot   = iris_mime_hash(key, length, table->displacements[bucket]) & (table->size - 1);
+
+  const iris_mime_entry* entry = &table->slots[slot];
+  if (entry->extension && strncmp(entry->extension, key, length) == 0 &&
+      entry->extension[length] == '\0') {
+    return entry->mime_type;
+  }
+  return NULL;
+}
+
+typedef struct {
+  size_t   index;   // Position in the input, to keep the first of duplicates
+  uint32_t bucket;  // Bucket chosen with seed 0
+} iris_mime_key;
+
+static const iris_mime_entry* mime_sort_entries;
+
+static int iris_mime_compare_keys(const void* a, const void* b) {
+  const iris_mime_key* ka = a;
+  const iris_mime_key* kb = b;
+
+  int order =
+      strcmp(mime_sort_entries[ka->index].extension, mime_sort_entries[kb->index].extension);
+  if (order != 0)
+    return order;
+  return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+static int iris_mime_compare_buckets(const void* a, const void* b) {
+  const iris_mime_key* ka = a;
+  const iris_mime_key* kb = b;
+  return ka->bucket < kb->bucket ? -1 : ka->bucket > kb->bucket;
+}
+
+static uint32_t iris_mime_round_pow2(size_t n) {
+  uint32_t size = 1;
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+int iris_mime_table_build(const iris_mime_entry* entries, size_t count, iris_mime_table* table) {
+  memset(table, 0, sizeof(*table));
+
+  iris_mime_key* keys = malloc((count ? count : 1) * sizeof(iris_mime_key));
+  if (!keys)
+    return -1;
+
+  // Drop duplicate extensions, keeping the first one
+  for (size_t i = 0; i < count; ++i)
+    keys[i].index = i;
+  mime_sort_entries = entries;
+  qsort(keys, count, sizeof(iris_mime_key), iris_mime_compare_keys);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (unique > 0 && strcmp(entries[keys[unique - 1].index].extension,
+                             entries[keys[i].index].extension) == 0) {
+      continue;
+    }
+    keys[unique++] = keys[i];
+  }
+
+  // Keep the load factor at or below 0.8, with about two keys per bucket
+  uint32_t size         = iris_mime_round_pow2(unique + unique / 4 + 1);
+  uint32_t bucket_count = iris_mime_round_pow2(unique / 2 + 1);
+
+  uint16_t*        displacements = calloc(bucket_count, sizeof(uint16_t));
+  iris_mime_entry* slots         = calloc(size, sizeof(iris_mime_entry));
+  uint32_t*        placed        = malloc((unique ? unique : 1) * sizeof(uint32_t));
+  if (!displacements || !slots || !placed) {
+    free(displacements);
+    free(slots);
+    free(placed);
+    free(keys);
+    return -1;
+  }
+
+  for (size_t i = 0; i < unique; ++i) {
+    const char* extension = entries[keys[i].index].extension;
+    keys[i].bucket = iris_mime_hash(extension, strlen(extension), 0) & (bucket_count - 1);
+  }
+  qsort(keys, unique, sizeof(iris_mime_key), iris_mime_compare_buckets);
+
+  // Place the largest buckets first, while the table is still empty
+  uint32_t* order = calloc(bucket_count + 1, sizeof(uint32_t));
+  if (!order) {
+    free(displacements);
+    free(slots);
+    free(placed);
+    free(keys);
+    return -1;
+  }
+  for (size_t i = 0; i < unique; ++i)
+    order[keys[i].bucket + 1]++;
+  for (uint32_t b = 0; b < bucket_count; ++b)
+    order[b + 1] += order[b];
+
+  for (size_t largest = unique; largest > 0; --largest) {
+    for (uint32_t b = 0; b < bucket_count; ++b) {
+      size_t first = order[b];
+      size_t last  = order[b + 1];
+      if (last - first != largest)
+        continue;
+
+      uint32_t seed = 1;
+      for (; seed <= IRIS_MIME_MAX_DISPLACEMENT; ++seed) {
+        size_t k = first;
+        for (; k < last; ++k) {
+          const char* extension = entries[keys[k].index].extension;
+          uint32_t    slot = iris_mime_hash(extension, strlen(extension), seed) & (size - 1);
+
+          int taken = slots[slot].extension != NULL;
+          for (size_t j = first; j < k && !taken; ++j)
+            taken = placed[j] == slot;
+          if (taken)
+            break;
+          placed[k] = slot;
+        }
+        if (k == last)
+          break;
+      }
+
+      if (seed > IRIS_MIME_MAX_DISPLACEMENT) {
+        free(order);
+        free(displacements);
+        free(slots);
+        free(placed);
+        free(keys);
+        return -1;
+      }
+
+      displacements[b] = (uint16_t) seed;
+      for (size_t k = first; k < last; ++k)
+        slots[placed[k]] = entries[keys[k].index];
+    }
+  }
+
+  free(order);
+  free(placed);
+  free(keys);
+
+  table->size          = size;
+  table->bucket_count  = bucket_count;
+  table->displacements = displacements;
+  table->slots         = slots;
+  return 0;
+}
+
+void iris_mime_table_free(iris_mime_table* table) {
+  free((void*) table->displacements);
+  free((void*) table->slots);
+  memset(table, 0, sizeof(*table));
+}
+
+static int iris_mime_is_space(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+size_t iris_mime_parse(char* data, iris_mime_entry* entries, char* charset_arena,
+                       size_t* charset_size) {
+  size_t count      = 0;
+  size_t arena_used = 0;
+  char*  p          = data;
+
+  while (*p) {
+    // Everything after '#' is a comment
+    char* line_end = p;
+    while (*line_end && *line_end != '\n' && *line_end != '#')
+      line_end++;
+    char* next = line_end;
+    while (*next && *next != '\n')
+      next++;
+    if (*next)
+      next++;
+
+    const char* type        = NULL;
+    const char* mime_type   = NULL;
+    size_t      type_length = 0;
+    char*       token       = p;
+    while (token < line_end) {
+      while (token < line_end && iris_mime_is_space(*token))
+        token++;
+      if (token == line_end)
+        break;
+
+      char* token_end = token;
+      while (token_end < line_end && !iris_mime_is_space(*token_end))
+        token_end++;
+      size_t length = token_end - token;
+      char*  after  = token_end < line_end ? token_end + 1 : line_end;
+
+      if (!type) {
+        type        = token;
+        type_length = length;
+        if (entries)
+          *token_end = '\0';
+      } else if (length <= IRIS_MIME_MAX_EXTENSION) {
+        // Text types share one charset variant per line, made for the first extension
+        if (!mime_type) {
+          mime_type = type;
+          if (type_length > 5 && strncmp(type, "text/", 5) == 0) {
+            if (entries) {
+              char* with_charset = charset_arena + arena_used;
+              memcpy(with_charset, type, type_length);
+              memcpy(with_charset + type_length, IRIS_MIME_CHARSET, sizeof(IRIS_MIME_CHARSET));
+              mime_type = with_charset;
+            }
+            arena_used += type_length + sizeof(IRIS_MIME_CHARSET);
+          }
+        }
+
+        if (entries) {
+          *token_end = '\0';
+          for (size_t i = 0; i < length; ++i)
+            token[i] = (char) tolower((unsigned char) token[i]);
+          entries[count].extension = token;
+          entries[count].mime_type = mime_type;
+        }
+        count++;
+      }
+      token = after;
+    }
+    p = next;
+  }
+
+  if (charset_size)
+    *charset_size = arena_used;
+  return count;
+}
@@ -0,0 +1,86 @@
+#ifndef IRIS_MIME_H
+#define IRIS_MIME_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "iris.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest extension the table can hold, longer ones are never looked up
+#define IRIS_MIME_MAX_EXTENSION 16
+
+/*
+ * Perfect hash over file extensions (hash and displace). An extension picks a
+ * bucket with seed 0, the bucket's displacement is the seed that places it in
+ * its slot. A lookup is two hashes and a single slot comparison.
+ */
+typedef struct {
+  uint32_t               size;           // Number of slots, power of two
+  uint32_t               bucket_count;   // Number of displacements, power of two
+  const uint16_t*        displacements;  // Seed per bucket
+  const iris_mime_entry* slots;          // Lowercase extension without the dot
+} iris_mime_table;
+
+/*
+ * Hash an extension with the given seed.
+ *
+ * @param key The lowercase extension.
+ * @param length The length of the extension.
+ * @param seed Seed, 0 selects the bucket.
+ * @return The 32-bit hash.
+ */
+uint32_t iris_mime_hash(const char* key, size_t length, uint32_t seed);
+
+/*
+ * Look up an extension in a table.
+ *
+ * @param table The table to search.
+ * @param key The lowercase extension, without the dot.
+ * @param length The length of the extension.
+ * @return The MIME type, or NULL if the extension is unknown.
+ */
+const char* iris_mime_table_lookup(const iris_mime_table* table, const char* key, size_t length);
+
+/*
+ * Build a perfect hash table. Extensions must be lowercase. When an extension
+ * appears more than once, the first entry wins. The slot and displacement
+ * arrays are allocated and owned by the caller, to be released with
+ * iris_mime_table_free.
+ *
+ * @param entries The extension to MIME type mapping.
+ * @param count Number of entries.
+ * @param table The table to fill.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int iris_mime_table_build(const iris_mime_entry* entries, size_t count, iris_mime_table* table);
+
+/*
+ * Release the arrays of a table built by iris_mime_table_build.
+ *
+ * @param table The table to release.
+ */
+void iris_mime_table_free(iris_mime_table* table);
+
+/*
+ * Parse the contents of a mime.types(5) file. Call once with entries set to
+ * NULL to count the entries and the charset storage, then again to fill them.
+ * The second pass splits data in place and lowercases extensions. Text types
+ * get a UTF-8 charset parameter, written to charset_arena.
+ *
+ * @param data The file contents, NUL-terminated.
+ * @param entries Output array, or NULL to only count.
+ * @param charset_arena Storage for text types with their charset parameter.
+ * @param charset_size Set to the bytes of charset_arena needed (counting pass).
+ * @return The number of entries found.
+ */
+size_t iris_mime_parse(char* data, iris_mime_entry* entries, char* charset_arena,
+                       size_t* charset_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IRIS_MIME_H */
@@ -0,0 +1,277 @@
+// Generated by tools/mimegen from src/mime.types, do not edit.
+
+static const uint16_t builtin_mime_displacements[128] = {
+    0, 0, 2, 4, 5, 0, 1, 0, 2, 1, 2, 1,
+    0, 2, 1, 2, 1, 3, 1, 0, 0, 0, 2, 1,
+    2, 2, 1, 4, 1, 2, 0, 0, 1, 5, 1, 0,
+    3, 4, 0, 0, 1, 2, 1, 2, 0, 0, 0, 1,
+    1, 0, 1, 3, 1, 1, 4, 1, 5, 0, 1, 1,
+    2, 0, 3, 1, 1, 2, 3, 3, 0, 3, 1, 3,
+    2, 2, 3, 1, 3, 1, 1, 0, 6, 2, 4, 2,
+    0, 6, 0, 1, 0, 0, 0, 5, 1, 3, 1, 2,
+    1, 0, 0, 0, 2, 1, 1, 2, 0, 2, 6, 1,
+    0, 0, 0, 1, 7, 3, 0, 0, 2, 2, 1, 1,
+    3, 1, 2, 0, 1, 2, 5, 1,
+};
+
+static const iris_mime_entry builtin_mime_slots[256] = {
+    {NULL, NULL},
+    {"java", "text/x-java-source; charset=utf-8"},
+    {NULL, NULL},
+    {"htm", "text/html; charset=utf-8"},
+    {NULL, NULL},
+    {"heic", "image/heic"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"log", "text/plain; charset=utf-8"},
+    {"opus", "audio/ogg"},
+    {NULL, NULL},
+    {"mp4", "video/mp4"},
+    {"bmp", "image/bmp"},
+    {"ppm", "image/x-portable-pixmap"},
+    {"m4v", "video/mp4"},
+    {"spx", "audio/ogg"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"p7c", "application/pkcs7-mime"},
+    {"crt", "application/x-x509-ca-cert"},
+    {"map", "application/json"},
+    {"webp", "image/webp"},
+    {"cur", "image/x-icon"},
+    {"jar", "application/java-archive"},
+    {NULL, NULL},
+    {"odt", "application/vnd.oasis.opendocument.text"},
+    {"hpp", "text/x-c++; charset=utf-8"},
+    {"mpg", "video/mpeg"},
+    {"ai", "application/postscript"},
+    {"apng", "image/png"},
+    {"p7m", "application/pkcs7-mime"},
+    {"obj", "model/obj"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"glb", "model/gltf-binary"},
+    {"torrent", "application/x-bittorrent"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"gltf", "model/gltf+json"},
+    {"xht", "application/xhtml+xml"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"so", "application/octet-stream"},
+    {"py", "text/x-python; charset=utf-8"},
+    {"tif", "image/tiff"},
+    {"bz2", "application/x-bzip2"},
+    {"ts", "video/mp2t"},
+    {"img", "application/octet-stream"},
+    {NULL, NULL},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"tar", "application/x-tar"},
+    {"cpp", "text/x-c++; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"doc", "application/msword"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"conf", "text/plain; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"eot", "application/vnd.ms-fontobject"},
+    {NULL, NULL},
+    {"m4a", "audio/mp4"},
+    {"eps", "application/postscript"},
+    {"rar", "application/vnd.rar"},
+    {"geojson", "application/geo+json"},
+    {"exe", "application/x-msdownload"},
+    {"json", "application/json"},
+    {"mkv", "video/x-matroska"},
+    {"run", "application/x-sh"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"otf", "font/otf"},
+    {"stl", "model/stl"},
+    {NULL, NULL},
+    {"markdown", "text/markdown; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"woff", "font/woff"},
+    {"cxx", "text/x-c++; charset=utf-8"},
+    {"rpm", "application/x-rpm"},
+    {"xsl", "text/xml; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"ps", "application/postscript"},
+    {"vcard", "text/vcard; charset=utf-8"},
+    {"rss", "application/rss+xml"},
+    {NULL, NULL},
+    {"patch", "text/plain; charset=utf-8"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"jpg", "image/jpeg"},
+    {NULL, NULL},
+    {"png", "image/png"},
+    {"avi", "video/x-msvideo"},
+    {NULL, NULL},
+    {"xhtml", "text/html; charset=utf-8"},
+    {"o", "application/octet-stream"},
+    {"svg", "image/svg+xml"},
+    {"gif", "image/gif"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"c", "text/x-c; charset=utf-8"},
+    {"toml", "text/x-toml; charset=utf-8"},
+    {"xz", "application/x-xz"},
+    {NULL, NULL},
+    {"oga", "audio/ogg"},
+    {"pgm", "image/x-portable-graymap"},
+    {"dll", "application/x-msdownload"},
+    {"tiff", "image/tiff"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"sig", "application/pgp-signature"},
+    {"mpga", "audio/mpeg"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"gz", "application/gzip"},
+    {"woff2", "font/woff2"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"sh", "text/x-shellscript; charset=utf-8"},
+    {"flac", "audio/flac"},
+    {"ico", "image/x-icon"},
+    {"bin", "application/octet-stream"},
+    {"shtml", "text/html; charset=utf-8"},
+    {"html", "text/html; charset=utf-8"},
+    {"mka", "audio/x-matroska"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"diff", "text/plain; charset=utf-8"},
+    {"xls", "application/vnd.ms-excel"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"mp3", "audio/mpeg"},
+    {"h", "text/x-c; charset=utf-8"},
+    {"hh", "text/x-c++; charset=utf-8"},
+    {NULL, NULL},
+    {"vcf", "text/vcard; charset=utf-8"},
+    {"7z", "application/x-7z-compressed"},
+    {"mpeg", "video/mpeg"},
+    {"jsonld", "application/ld+json"},
+    {"ics", "text/calendar; charset=utf-8"},
+    {"nix", "text/x-nix; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"cfg", "text/plain; charset=utf-8"},
+    {"vtt", "text/vtt; charset=utf-8"},
+    {NULL, NULL},
+    {"rs", "text/x-rust; charset=utf-8"},
+    {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mov", "video/quicktime"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"odp", "application/vnd.oasis.opendocument.presentation"},
+    {"midi", "audio/midi"},
+    {NULL, NULL},
+    {"text", "text/plain; charset=utf-8"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pbm", "image/x-portable-bitmap"},
+    {NULL, NULL},
+    {"flv", "video/x-flv"},
+    {NULL, NULL},
+    {"epub", "application/epub+zip"},
+    {"zst", "application/zstd"},
+    {NULL, NULL},
+    {"cc", "text/x-c++; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"svgz", "image/svg+xml"},
+    {"der", "application/x-x509-ca-cert"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"css", "text/css; charset=utf-8"},
+    {NULL, NULL},
+    {"msi", "application/x-msdownload"},
+    {"ifb", "text/calendar; charset=utf-8"},
+    {"xsd", "text/xml; charset=utf-8"},
+    {NULL, NULL},
+    {"avif", "image/avif"},
+    {NULL, NULL},
+    {"a", "application/octet-stream"},
+    {"webmanifest", "application/manifest+json"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"ogg", "audio/ogg"},
+    {"md", "text/markdown; charset=utf-8"},
+    {NULL, NULL},
+    {"jfif", "image/jpeg"},
+    {"webm", "video/webm"},
+    {"asc", "text/plain; charset=utf-8"},
+    {NULL, NULL},
+    {"xml", "text/xml; charset=utf-8"},
+    {"pdf", "application/pdf"},
+    {NULL, NULL},
+    {"yaml", "text/yaml; charset=utf-8"},
+    {"deb", "application/vnd.debian.binary-package"},
+    {"wav", "audio/wav"},
+    {"iso", "application/x-iso9660-image"},
+    {NULL, NULL},
+    {"jpeg", "image/jpeg"},
+    {"mid", "audio/midi"},
+    {"3gp", "video/3gpp"},
+    {"go", "text/x-go; charset=utf-8"},
+    {NULL, NULL},
+    {"pgp", "application/pgp-keys"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"tgz", "application/gzip"},
+    {"ogv", "video/ogg"},
+    {"tsv", "text/tab-separated-values; charset=utf-8"},
+    {"jpe", "image/jpeg"},
+    {"atom", "application/atom+xml"},
+    {"ttf", "font/ttf"},
+    {NULL, NULL},
+    {"gpg", "application/pgp-keys"},
+    {"rdf", "application/rdf+xml"},
+    {"wasm", "application/wasm"},
+    {"jxl", "image/jxl"},
+    {NULL, NULL},
+    {"zip", "application/zip"},
+    {"mp4v", "video/mp4"},
+    {NULL, NULL},
+    {"csv", "text/csv; charset=utf-8"},
+    {"dmg", "application/x-apple-diskimage"},
+    {"cjs", "text/javascript; charset=utf-8"},
+    {NULL, NULL},
+    {"aac", "audio/aac"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"apk", "application/vnd.android.package-archive"},
+    {"ttc", "font/collection"},
+    {NULL, NULL},
+    {"rtf", "application/rtf"},
+    {"weba", "audio/webm"},
+    {"icon", "image/vnd.microsoft.icon"},
+    {"ini", "text/plain; charset=utf-8"},
+    {"yml", "text/yaml; charset=utf-8"},
+    {"qt", "video/quicktime"},
+    {NULL, NULL},
+    {NULL, NULL},
+};
+
+static const iris_mime_table builtin_mime_table = {256, 128, builtin_mime_displacements,
+                                                   builtin_mime_slots};
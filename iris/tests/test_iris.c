@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "../src/iris.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Tests of the parts of Iris that can be checked without tracing it. Servers
+// run in a child process on a free loopback port.
+
+static int failures = 0;
+
+// Sixteen characters, IRIS_MIME_MAX_EXTENSION, and one more
+#define TEST_LONGEST_EXTENSION "abcdefghijklmnop"
+#define TEST_TOO_LONG_EXTENSION "abcdefghijklmnopq"
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+static void sleep_ms(long ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+// Ask the kernel for a free port. Nothing else should grab it before Iris binds.
+static int pick_port(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family         = AF_INET;
+  addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+  socklen_t length        = sizeof(addr);
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      getsockname(fd, (struct sockaddr*) &addr, &length) == -1) {
+    perror("bind");
+    exit(1);
+  }
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+// Start Iris on a port with the given limits, quietly
+static pid_t start_server(const char* root, int port, const iris_rate_limit* limit) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) {
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+    iris_set_rate_limit(limit);
+    _exit(iris_start("127.0.0.1", root, port));
+  }
+  return pid;
+}
+
+static void stop_server(pid_t pid) {
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+// Send a request and return the status of the response, 0 when there is none.
+// The server may still be starting, so connecting is retried for a while.
+static int request_status(int port, const char* request) {
+  struct sockaddr_in addr = {0};
+  addr.sin_family         = AF_INET;
+  addr.sin_port           = htons(port);
+  addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+
+  int fd = -1;
+  for (int attempt = 0; attempt < 200 && fd == -1; ++attempt) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+      close(fd);
+      fd = -1;
+      sleep_ms(10);
+    }
+  }
+  if (fd == -1)
+    return 0;
+
+  char    response[4096];
+  size_t  length = 0;
+  ssize_t got;
+  send(fd, request, strlen(request), 0);
+  while (length < sizeof(response) - 1 &&
+         (got = recv(fd, response + length, sizeof(response) - 1 - length, 0)) > 0)
+    length += (size_t) got;
+  response[length] = '\0';
+  close(fd);
+
+  int status = 0;
+  sscanf(response, "HTTP/%*s %d", &status);
+  return status;
+}
+
+static void check_mime(const char* path, const char* expected) {
+  const char* mime_type = iris_get_mime_type(path);
+  if (strcmp(mime_type, expected) != 0) {
+    fprintf(stderr, "FAIL: %s is %s, expected %s\n", path, mime_type, expected);
+    failures++;
+  }
+}
+
+static void test_mime_types(const char* root) {
+  printf("Testing MIME types...\n");
+
+  check_mime("index.html", "text/html; charset=utf-8");
+  check_mime("/docs/README.Md", "text/markdown; charset=utf-8");
+  check_mime("photo.PNG", "image/png");
+  check_mime("app.wasm", "application/wasm");
+  check_mime("archive.unknown", "application/octet-stream");
+  check_mime("Makefile", "application/octet-stream");
+  check_mime("file." TEST_LONGEST_EXTENSION, "application/octet-stream");
+
+  // The file adds types, including the longest extension the table holds, and
+  // cannot override the built-in ones
+  char path[256];
+  snprintf(path, sizeof(path), "%s/mime.types", root);
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    failures++;
+    return;
+  }
+  fprintf(file, "# Test types\n"
+                "application/x-iris-test  iristest\n"
+                "text/x-iris              iristext  # a comment\n"
+                "application/x-override   html png\n"
+                "application/x-longest    " TEST_LONGEST_EXTENSION "\n"
+                "application/x-too-long   " TEST_TOO_LONG_EXTENSION "\n");
+  fclose(file);
+  check(iris_load_mime_types(path) == 0, "mime.types file loads");
+  remove(path);
+
+  check_mime("data.iristest", "application/x-iris-test");
+  check_mime("notes.IrisText", "text/x-iris; charset=utf-8");
+  check_mime("index.html", "text/html; charset=utf-8");
+  check_mime("photo.png", "image/png");
+  check_mime("file." TEST_LONGEST_EXTENSION, "application/x-longest");
+  check_mime("file." TEST_TOO_LONG_EXTENSION, "application/octet-stream");
+  check_mime("archive.unknown", "application/octet-stream");
+  check(iris_load_mime_types("/nonexistent/mime.types") == -1, "Missing file fails to load");
+}
+
+// Set of the client table an address falls in, as iris_rate_limit_lookup picks it
+static uint32_t rate_limit_set(uint32_t addr) {
+  return ((addr * 2654435761u) >> 16) & (IRIS_RATELIMIT_SETS - 1);
+}
+
+static void test_rate_limit_burst(void) {
+  printf("Testing rate limit bursts...\n");
+
+  iris_rate_limit limit = {1, 3, 0, 0};
+  iris_set_rate_limit(&limit);
+  uint32_t client = htonl(0x0a000001);
+  for (int i = 0; i < 3; ++i)
+    check(iris_rate_limit_admit(client), "Request within the burst is admitted");
+  check(!iris_rate_limit_admit(client), "Request over the burst is refused");
+  check(iris_rate_limit_admit(htonl(0x0a000002)), "Another client has its own bucket");
+
+  iris_set_rate_limit(NULL);
+  check(iris_rate_limit_admit(client), "Requests are admitted without a limit");
+}
+
+static void test_rate_limit_refill(void) {
+  printf("Testing rate limit refill...\n");
+
+  // Two requests of burst, refilled at one every 50 ms
+  iris_rate_limit limit = {20, 2, 0, 0};
+  iris_set_rate_limit(&limit);
+  uint32_t client = htonl(0x0a000003);
+  check(iris_rate_limit_admit(client) && iris_rate_limit_admit(client), "Burst is admitted");
+  check(!iris_rate_limit_admit(client), "Empty bucket refuses");
+  sleep_ms(120);
+  check(iris_rate_limit_admit(client), "Request is admitted after a refill");
+
+  // Bytes sent put the bucket in debt until it refills
+  iris_rate_limit bytes = {0, 0, 1000, 100};
+  iris_set_rate_limit(&bytes);
+  check(iris_rate_limit_admit(client), "First request is admitted");
+  iris_rate_limit_charge(client, 150);
+  check(!iris_rate_limit_admit(client), "Client in byte debt is refused");
+  sleep_ms(120);
+  check(iris_rate_limit_admit(client), "Client is admitted once the debt is paid");
+  iris_set_rate_limit(NULL);
+}
+
+static void test_rate_limit_eviction(void) {
+  printf("Testing rate limit eviction...\n");
+
+  // One more client than a set holds, all in the set of the first
+  uint32_t clients[IRIS_RATELIMIT_WAYS + 1];
+  uint32_t set   = rate_limit_set(1);
+  int      count = 0;
+  for (uint32_t addr = 1; count < IRIS_RATELIMIT_WAYS + 1; ++addr) {
+    if (rate_limit_set(addr) == set)
+      clients[count++] = addr;
+  }
+
+  iris_rate_limit limit = {1, 1, 0, 0};
+  iris_set_rate_limit(&limit);
+  for (int i = 0; i < IRIS_RATELIMIT_WAYS; ++i) {
+    check(iris_rate_limit_admit(clients[i]), "Client filling the set is admitted");
+    sleep_ms(1);
+  }
+  check(iris_rate_limit_admit(clients[IRIS_RATELIMIT_WAYS]), "Client over the set is admitted");
+
+  // The newcomer took the slot of the oldest client, the others kept theirs
+  check(!iris_rate_limit_admit(clients[1]), "Client still in the set is refused");
+  check(iris_rate_limit_admit(clients[0]), "Evicted client starts with a full bucket");
+  iris_set_rate_limit(NULL);
+}
+
+static void test_rate_limit_server(const char* root) {
+  printf("Testing rate limited server...\n");
+
+  // The third request in a second is over the burst
+  iris_rate_limit requests = {1, 2, 0, 0};
+  int             port     = pick_port();
+  pid_t           pid      = start_server(root, port, &requests);
+  check(request_status(port, "GET /missing HTTP/1.0\r\n\r\n") == 404, "First request answered");
+  check(request_status(port, "GET /missing HTTP/1.0\r\n\r\n") == 404, "Second request answered");
+  check(request_status(port, "GET /missing HTTP/1.0\r\n\r\n") == 429, "Third request gets 429");
+  stop_server(pid);
+
+  // Error responses are charged like any other, so a client sending nothing
+  // but bad requests runs out of bytes as well
+  iris_rate_limit bytes = {0, 0, 1, 1};
+  port                  = pick_port();
+  pid                   = start_server(root, port, &bytes);
+  check(request_status(port, "BAD\r\n\r\n") == 400, "Bad request answered");
+  check(request_status(port, "BAD\r\n\r\n") == 429, "Bad request over the byte budget gets 429");
+  stop_server(pid);
+}
+
+int main(void) {
+  printf("===Running Iris tests===\n\n");
+
+  char root[] = "/tmp/iris-tests.XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  test_mime_types(root);
+  test_rate_limit_burst();
+  test_rate_limit_refill();
+  test_rate_limit_eviction();
+  test_rate_limit_server(root);
+
+  remove(root);
+
+  if (failures) {
+    printf("\n===%d failure(s)===\n", failures);
+    return 1;
+  }
+  printf("\n===All tests passed===\n");
+  return 0;
+}
@@ -0,0 +1,453 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "../src/iris.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Iris runs in a child traced by the test. Every syscall it makes from one
+// accept returning to entering the next accept is charged to the request that
+// accept returned, and each kind of request has a budget it must stay within.
+
+#define TEST_RESPONSE_SIZE 65536
+#define TEST_MAX_SYSCALL   1024
+#define TEST_SKIP          77
+
+// A request and the most syscalls it may take. When a change makes Iris
+// cheaper, lower the budget so the gain is kept.
+typedef struct {
+  const char* name;
+  const char* path;
+  const char* condition;  // Conditional header, filled in from the warm-up response
+  int         cold;       // Dropped from the page cache before the request
+  int         expected_status;
+  int         budget;
+} syscall_case;
+
+// A cold file is read from disk rather than the page cache. Only its syscalls
+// are counted, the time the disk takes is not checked.
+static const syscall_case directory_cases[] = {
+    {"hot file", "/hot.txt", NULL, 0, 200, 15},
+    {"cold file", "/cold.txt", NULL, 1, 200, 15},
+    {"directory", "/dir", NULL, 0, 200, 18},
+    {"404", "/missing.txt", NULL, 0, 404, 8},
+    {"304", "/hot.txt", "If-Modified-Since", 0, 304, 8},
+};
+
+// Serving from a bundle also stats it once a second to find a rebuilt one,
+// which may land on any request and is counted in every budget.
+static const syscall_case bundle_cases[] = {
+    {"bundle file", "/hot.txt", NULL, 0, 200, 5},
+    {"bundle 404", "/missing.txt", NULL, 0, 404, 6},
+    {"bundle 304", "/hot.txt", "If-None-Match", 0, 304, 5},
+};
+
+typedef struct {
+  int  total;
+  int  by_number[TEST_MAX_SYSCALL];
+  char response[TEST_RESPONSE_SIZE];
+  int  response_length;
+} request_trace;
+
+static const struct {
+  long        number;
+  const char* name;
+} syscall_names[] = {
+    {SYS_read, "read"},
+    {SYS_write, "write"},
+    {SYS_close, "close"},
+    {SYS_openat, "openat"},
+    {SYS_lseek, "lseek"},
+    {SYS_sendto, "sendto"},
+    {SYS_getdents64, "getdents64"},
+    {SYS_mmap, "mmap"},
+    {SYS_munmap, "munmap"},
+    {SYS_writev, "writev"},
+    {SYS_sendfile, "sendfile"},
+#ifdef SYS_fstat
+    {SYS_fstat, "fstat"},
+#endif
+#ifdef SYS_newfstatat
+    {SYS_newfstatat, "newfstatat"},
+#endif
+#ifdef SYS_statx
+    {SYS_statx, "statx"},
+#endif
+#ifdef SYS_readlink
+    {SYS_readlink, "readlink"},
+#endif
+#ifdef SYS_readlinkat
+    {SYS_readlinkat, "readlinkat"},
+#endif
+#ifdef SYS_brk
+    {SYS_brk, "brk"},
+#endif
+};
+
+static pid_t server_pid = -1;
+
+static void print_syscall(long number, int count) {
+  for (size_t i = 0; i < sizeof(syscall_names) / sizeof(syscall_names[0]); ++i) {
+    if (syscall_names[i].number == number) {
+      printf("    %-12s %d\n", syscall_names[i].name, count);
+      return;
+    }
+  }
+  printf("    #%-11ld %d\n", number, count);
+}
+
+static void write_file(const char* path, size_t size) {
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    exit(1);
+  }
+  for (size_t i = 0; i < size; ++i)
+    fputc('a' + (int) (i % 26), file);
+  fclose(file);
+}
+
+// Write a file back and drop it from the page cache, so the next read of it
+// goes to the disk
+static void evict_file(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return;
+  }
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Ask the kernel for a free port. Nothing else should grab it before Iris binds.
+static int pick_port(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family         = AF_INET;
+  addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+  socklen_t length        = sizeof(addr);
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      getsockname(fd, (struct sockaddr*) &addr, &length) == -1) {
+    perror("bind");
+    exit(1);
+  }
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+// Resume the server until its next syscall stop. Returns 0 once it is gone.
+static int next_syscall(struct __ptrace_syscall_info* info) {
+  for (;;) {
+    int status;
+    if (waitpid(server_pid, &status, 0) == -1 || WIFEXITED(status) || WIFSIGNALED(status))
+      return 0;
+
+    int signal = 0;
+    if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, server_pid, (void*) sizeof(*info), info) > 0)
+        return 1;
+    } else if (WIFSTOPPED(status) && WSTOPSIG(status) != SIGTRAP) {
+      signal = WSTOPSIG(status);
+    }
+    ptrace(PTRACE_SYSCALL, server_pid, NULL, (void*) (long) signal);
+  }
+}
+
+// Run the server until it blocks in accept.
+static int run_to_accept(void) {
+  struct __ptrace_syscall_info info;
+  for (;;) {
+    ptrace(PTRACE_SYSCALL, server_pid, NULL, NULL);
+    if (!next_syscall(&info))
+      return 0;
+    if (info.op == PTRACE_SYSCALL_INFO_ENTRY &&
+        (info.entry.nr == SYS_accept || info.entry.nr == SYS_accept4)) {
+      return 1;
+    }
+  }
+}
+
+static void read_response(int fd, request_trace* trace) {
+  for (;;) {
+    ssize_t length = recv(fd, trace->response + trace->response_length,
+                          sizeof(trace->response) - 1 - trace->response_length, MSG_DONTWAIT);
+    if (length <= 0)
+      break;
+    trace->response_length += (int) length;
+  }
+  trace->response[trace->response_length] = '\0';
+}
+
+// Send one request and count the syscalls the server makes to answer it
+static int trace_request(int port, const char* request, request_trace* trace) {
+  memset(trace, 0, sizeof(*trace));
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return 0;
+  }
+  struct sockaddr_in addr = {0};
+  addr.sin_family         = AF_INET;
+  addr.sin_port           = htons(port);
+  addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      send(fd, request, strlen(request), 0) != (ssize_t) strlen(request)) {
+    perror("connect");
+    close(fd);
+    return 0;
+  }
+
+  // Leave accept, then count until the server is back in it. The response is
+  // drained along the way so that a large one cannot block the server.
+  struct __ptrace_syscall_info info;
+  ptrace(PTRACE_SYSCALL, server_pid, NULL, NULL);
+  if (!next_syscall(&info)) {
+    close(fd);
+    return 0;
+  }
+
+  for (;;) {
+    ptrace(PTRACE_SYSCALL, server_pid, NULL, NULL);
+    if (!next_syscall(&info)) {
+      close(fd);
+      return 0;
+    }
+    read_response(fd, trace);
+    if (info.op != PTRACE_SYSCALL_INFO_ENTRY)
+      continue;
+    if (info.entry.nr == SYS_accept || info.entry.nr == SYS_accept4)
+      break;
+
+    trace->total++;
+    if (info.entry.nr < TEST_MAX_SYSCALL)
+      trace->by_number[info.entry.nr]++;
+  }
+
+  read_response(fd, trace);
+  close(fd);
+  return 1;
+}
+
+static int start_server(const char* root, const char* bundle_path, int port) {
+  server_pid = fork();
+  if (server_pid == -1) {
+    perror("fork");
+    return 0;
+  }
+
+  if (server_pid == 0) {
+    if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+      _exit(TEST_SKIP);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1)
+      dup2(null_fd, STDOUT_FILENO);
+    raise(SIGSTOP);
+    if (bundle_path && iris_set_bundle(bundle_path) != 0)
+      _exit(1);
+    _exit(iris_start("127.0.0.1", root, port));
+  }
+
+  int status;
+  if (waitpid(server_pid, &status, 0) == -1 || !WIFSTOPPED(status))
+    return 0;
+  ptrace(PTRACE_SETOPTIONS, server_pid, NULL,
+         (void*) (long) (PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+  // Make sure the kernel can describe syscalls before relying on it
+  struct __ptrace_syscall_info info;
+  ptrace(PTRACE_SYSCALL, server_pid, NULL, NULL);
+  if (!next_syscall(&info))
+    return 0;
+  return run_to_accept();
+}
+
+static int server_exited_with(int code) {
+  int status;
+  return server_pid > 0 && waitpid(server_pid, &status, 0) == server_pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == code;
+}
+
+static void stop_server(void) {
+  if (server_pid > 0) {
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+    server_pid = -1;
+  }
+}
+
+static void remove_tree(const char* root) {
+  static const char* const entries[] = {"hot.txt",   "cold.txt", "dir/a.txt",
+                                        "dir/b.txt", "dir",      "site.bundle"};
+  char                     path[256];
+  for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); ++i) {
+    snprintf(path, sizeof(path), "%s/%s", root, entries[i]);
+    remove(path);
+  }
+  remove(root);
+}
+
+// Value of a response header, empty when missing
+static void response_header(const char* response, const char* name, char* value, size_t size) {
+  value[0]          = '\0';
+  const char* found = strstr(response, name);
+  if (!found || found[strlen(name)] != ':')
+    return;
+  found += strlen(name) + 1;
+  while (*found == ' ')
+    found++;
+  size_t length = strcspn(found, "\r\n");
+  if (length < size) {
+    memcpy(value, found, length);
+    value[length] = '\0';
+  }
+}
+
+// Run a set of cases against a fresh server. Returns the number of failures,
+// or -1 when ptrace is not available.
+static int run_cases(const char* root, const char* bundle_path, const syscall_case* cases,
+                     size_t count, request_trace* trace) {
+  int port = pick_port();
+  if (!start_server(root, bundle_path, port)) {
+    if (server_exited_with(TEST_SKIP))
+      return -1;
+    fprintf(stderr, "FAIL: Could not trace the server\n");
+    stop_server();
+    return 1;
+  }
+
+  // The warm-up brings the file into the page cache and pays one-time costs
+  if (!trace_request(port, "GET /hot.txt HTTP/1.0\r\n\r\n", trace)) {
+    fprintf(stderr, "FAIL: Warm-up request\n");
+    stop_server();
+    return 1;
+  }
+  char last_modified[64];
+  char etag[64];
+  response_header(trace->response, "Last-Modified", last_modified, sizeof(last_modified));
+  response_header(trace->response, "ETag", etag, sizeof(etag));
+
+  int failures = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const syscall_case* test = &cases[i];
+    printf("Testing %s...\n", test->name);
+
+    char request[512];
+    if (test->condition) {
+      const char* value = strcmp(test->condition, "If-None-Match") == 0 ? etag : last_modified;
+      snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n%s: %s\r\n\r\n", test->path,
+               test->condition, value);
+    } else {
+      snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n", test->path);
+    }
+
+    if (test->cold) {
+      char path[256];
+      snprintf(path, sizeof(path), "%s%s", root, test->path);
+      evict_file(path);
+    }
+
+    if (!trace_request(port, request, trace)) {
+      fprintf(stderr, "FAIL: Server stopped during %s\n", test->name);
+      failures++;
+      break;
+    }
+
+    int status = 0;
+    sscanf(trace->response, "HTTP/%*s %d", &status);
+    if (status != test->expected_status) {
+      fprintf(stderr, "FAIL: Expected status %d for %s, got %d\n", test->expected_status,
+              test->path, status);
+      failures++;
+    }
+
+    printf("  %d syscalls, budget %d\n", trace->total, test->budget);
+    if (trace->total > test->budget) {
+      fprintf(stderr, "FAIL: %s is over its syscall budget\n", test->name);
+      failures++;
+      for (long number = 0; number < TEST_MAX_SYSCALL; ++number) {
+        if (trace->by_number[number])
+          print_syscall(number, trace->by_number[number]);
+      }
+    }
+  }
+
+  stop_server();
+  return failures;
+}
+
+int main(void) {
+  // Unbuffered, so that Iris logging each request is one write, not an
+  // occasional flush landing on whichever request fills the buffer
+  setvbuf(stdout, NULL, _IONBF, 0);
+  printf("===Running Iris syscall budget tests===\n\n");
+
+  char root[] = "/tmp/iris-syscalls.XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s/hot.txt", root);
+  write_file(path, 4096);
+  snprintf(path, sizeof(path), "%s/cold.txt", root);
+  write_file(path, 4096);
+  snprintf(path, sizeof(path), "%s/dir", root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/dir/a.txt", root);
+  write_file(path, 16);
+  snprintf(path, sizeof(path), "%s/dir/b.txt", root);
+  write_file(path, 16);
+
+  int            failures = 0;
+  request_trace* trace    = malloc(sizeof(request_trace));
+  if (!trace) {
+    fprintf(stderr, "FAIL: Out of memory\n");
+    failures++;
+  } else {
+    int result = run_cases(root, NULL, directory_cases,
+                           sizeof(directory_cases) / sizeof(directory_cases[0]), trace);
+    if (result >= 0) {
+      failures += result;
+
+      char bundle_path[256];
+      snprintf(bundle_path, sizeof(bundle_path), "%s/site.bundle", root);
+      if (iris_bundle_build(root, bundle_path) != 0) {
+        fprintf(stderr, "FAIL: Could not build %s\n", bundle_path);
+        failures++;
+      } else {
+        failures += run_cases(root, bundle_path, bundle_cases,
+                              sizeof(bundle_cases) / sizeof(bundle_cases[0]), trace);
+      }
+    } else {
+      printf("ptrace is not available, skipping\n");
+    }
+  }
+  free(trace);
+  remove_tree(root);
+
+  if (failures) {
+    printf("\n===%d failure(s)===\n", failures);
+    return 1;
+  }
+  printf("\n===All tests passed===\n");
+  return 0;
+}
@@ -0,0 +1,90 @@
+// Compile a mime.types(5) file into the perfect hash table built into Iris.
+// Usage: mimegen FILE > mime_table.h
+#include "../src/mime.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void print_string(const char* str) {
+  if (!str) {
+    printf("NULL");
+    return;
+  }
+  putchar('"');
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\')
+      putchar('\\');
+    putchar(*str);
+  }
+  putchar('"');
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  if (!file) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (file_size < 0) {
+    perror(argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  char* data = malloc(file_size + 1);
+  if (!data) {
+    fclose(file);
+    return 1;
+  }
+  size_t bytes_read = fread(data, 1, file_size, file);
+  data[bytes_read]  = '\0';
+  fclose(file);
+
+  size_t           charset_size = 0;
+  size_t           count        = iris_mime_parse(data, NULL, NULL, &charset_size);
+  iris_mime_entry* entries      = malloc((count ? count : 1) * sizeof(iris_mime_entry));
+  char*            arena        = malloc(charset_size ? charset_size : 1);
+  if (!entries || !arena)
+    return 1;
+  iris_mime_parse(data, entries, arena, NULL);
+
+  iris_mime_table table;
+  if (iris_mime_table_build(entries, count, &table) != 0) {
+    fprintf(stderr, "%s: failed to build the perfect hash\n", argv[1]);
+    return 1;
+  }
+
+  printf("// Generated by tools/mimegen from %s, do not edit.\n\n", argv[1]);
+  printf("static const uint16_t builtin_mime_displacements[%u] = {", table.bucket_count);
+  for (uint32_t i = 0; i < table.bucket_count; ++i)
+    printf("%s%u,", i % 12 == 0 ? "\n    " : " ", table.displacements[i]);
+  printf("\n};\n\n");
+
+  printf("static const iris_mime_entry builtin_mime_slots[%u] = {\n", table.size);
+  for (uint32_t i = 0; i < table.size; ++i) {
+    printf("    {");
+    print_string(table.slots[i].extension);
+    printf(", ");
+    print_string(table.slots[i].mime_type);
+    printf("},\n");
+  }
+  printf("};\n\n");
+
+  printf("static const iris_mime_table builtin_mime_table = {%u, %u, builtin_mime_displacements,\n"
+         "                                                   builtin_mime_slots};\n",
+         table.size, table.bucket_count);
+
+  iris_mime_table_free(&table);
+  free(entries);
+  free(arena);
+  free(data);
+  return 0;
+}
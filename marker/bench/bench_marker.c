@@ -0,0 +1,998 @@
+// Throughput benchmark for Marker.
+//
+// Every benchmark generates its input once, then runs it for the given number
+// of seconds and reports input bytes processed per second. Inputs are
+// deterministic so numbers are comparable between builds. Pathological inputs
+// also run at a sixteenth of the size, linear code reports about the same rate
+// for both while quadratic code drops by 16x.
+//
+// Results can be written to a baseline file and later runs compared against
+// it. A benchmark that is slower by more than the tolerance, 10% unless given,
+// or that needs more heap blocks per document, counts as a regression. So does
+// a stress document slower than the ceiling, whatever the baseline.
+//
+// Where the CPU counts them for us, the branch instructions per input byte are
+// reported as well.
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+#include "../src/marker.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#ifdef __linux__
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+#define BENCH_INPUT_SIZE (1u << 20)
+#define BENCH_TOLERANCE 10.0
+#define BENCH_STRESS_CEILING 500.0
+#define BENCH_MAX_BASELINE 256
+
+typedef struct {
+  const char* name;
+  const char* description;
+  char* (*generate)(size_t size, size_t* length);
+  int (*run)(const char* input, size_t length, char* scratch, size_t scratch_size,
+             marker_stats_t* stats);
+  bool scaling;  // Also run at a sixteenth of the size
+} bench_case;
+
+// One result of a baseline file
+typedef struct {
+  char   name[64];
+  size_t size;
+  double mib_per_second;
+  size_t allocations;
+} bench_result;
+
+// The corpus, realistic documents of each kind
+static const char* const corpus_names[] = {"prose", "links", "tables", "code", "nested"};
+
+#define CORPUS_COUNT (sizeof(corpus_names) / sizeof(corpus_names[0]))
+
+static uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Counter of the branch instructions retired in user space, by this thread and
+// the ones it starts. -1 where there is none, as in most virtual machines.
+static int bench_open_branches(void) {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+  attr.disabled       = 1;
+  attr.inherit        = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void bench_start_branches(int counter) {
+#ifdef __linux__
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#else
+  (void) counter;
+#endif
+}
+
+static uint64_t bench_stop_branches(int counter) {
+  uint64_t count = 0;
+#ifdef __linux__
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &count, sizeof(count)) != (ssize_t) sizeof(count))
+      count = 0;
+  }
+#else
+  (void) counter;
+#endif
+  return count;
+}
+
+static uint32_t bench_random(uint32_t* state) {
+  // xorshift32, good enough to vary the input
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+// Repeat the given words until the buffer is full, with roughly one word in
+// every `special_every` replaced by one of the specials.
+static char* bench_fill(size_t length, const char* const* words, size_t word_count,
+                        const char* const* specials, size_t special_count,
+                        uint32_t special_every, const char* prefix, const char* suffix) {
+  size_t prefix_length = prefix ? strlen(prefix) : 0;
+  size_t suffix_length = suffix ? strlen(suffix) : 0;
+  char*  input         = malloc(length + 1);
+  if (!input)
+    return NULL;
+
+  uint32_t state = 0x9e3779b9u;
+  size_t   at    = 0;
+  if (prefix_length)
+    memcpy(input, prefix, prefix_length);
+  at += prefix_length;
+
+  while (at < length - suffix_length) {
+    const char* word = words[bench_random(&state) % word_count];
+    if (special_every && bench_random(&state) % special_every == 0)
+      word = specials[bench_random(&state) % special_count];
+
+    size_t word_length = strlen(word);
+    if (at + word_length > length - suffix_length)
+      break;
+    memcpy(input + at, word, word_length);
+    at += word_length;
+  }
+
+  if (suffix_length)
+    memcpy(input + at, suffix, suffix_length);
+  at += suffix_length;
+  input[at] = '\0';
+  return input;
+}
+
+static const char* const prose_words[] = {
+    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog. ",
+    "Marker ", "renders ", "plain ", "paragraphs ", "of ", "text, ", "mostly\n",
+};
+
+static const char* const prose_specials[] = {"AT&T ", "\"quoted\" ", "it's ", "a < b "};
+
+static const char* const markdown_words[] = {
+    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog. ",
+    "Marker ", "renders ", "plain ", "paragraphs ", "of ", "text, ", "mostly\n", "here.\n\n",
+};
+
+static const char* const markdown_specials[] = {
+    "*emphasis* ", "**strong** ", "`code` ", "[a link](https://example.com) ", "AT&T ",
+};
+
+static const char* const code_words[] = {
+    "if ", "(a ", "&& ", "b) ", "{ ", "x ", "= ", "y->z; ", "} ", "s ", "<< ",
+    "\"str\"; ", "'c' ", "a<b> ", "p ", ">= ", "q;\n", "    ",
+};
+
+static char* generate_prose(size_t size, size_t* length) {
+  char* input = bench_fill(size, prose_words,
+                           sizeof(prose_words) / sizeof(prose_words[0]), prose_specials,
+                           sizeof(prose_specials) / sizeof(prose_specials[0]), 64, NULL, NULL);
+  *length = input ? strlen(input) : 0;
+  return input;
+}
+
+static char* generate_markdown(size_t size, size_t* length) {
+  char* input = bench_fill(size, markdown_words,
+                           sizeof(markdown_words) / sizeof(markdown_words[0]), markdown_specials,
+                           sizeof(markdown_specials) / sizeof(markdown_specials[0]), 32, NULL,
+                           NULL);
+  *length = input ? strlen(input) : 0;
+  return input;
+}
+
+static char* generate_code(size_t size, size_t* length) {
+  char* input = bench_fill(size, code_words, sizeof(code_words) / sizeof(code_words[0]),
+                           NULL, 0, 0, NULL, NULL);
+  *length = input ? strlen(input) : 0;
+  return input;
+}
+
+static char* generate_code_block(size_t size, size_t* length) {
+  char* input = bench_fill(size, code_words, sizeof(code_words) / sizeof(code_words[0]),
+                           NULL, 0, 0, "```c\n", "\n```\n");
+  *length = input ? strlen(input) : 0;
+  return input;
+}
+
+// Pathological inputs, one long line each
+static char* bench_repeat(size_t size, const char* head, const char* unit, size_t* length) {
+  size_t head_length = strlen(head);
+  size_t unit_length = strlen(unit);
+  char*  input       = malloc(size + 1);
+  if (!input)
+    return NULL;
+
+  memcpy(input, head, head_length);
+  size_t at = head_length;
+  while (at + unit_length <= size) {
+    memcpy(input + at, unit, unit_length);
+    at += unit_length;
+  }
+  input[at] = '\0';
+  *length   = at;
+  return input;
+}
+
+static char* generate_emphasis_openers(size_t size, size_t* length) {
+  return bench_repeat(size, "", "_a ", length);
+}
+
+static char* generate_emphasis_closers(size_t size, size_t* length) {
+  return bench_repeat(size, "", "a_ ", length);
+}
+
+static char* generate_emphasis_mismatched(size_t size, size_t* length) {
+  return bench_repeat(size, "", "*a_ ", length);
+}
+
+static char* generate_emphasis_mod3(size_t size, size_t* length) {
+  return bench_repeat(size, "a**b", "c* ", length);
+}
+
+static char* generate_strikethrough_openers(size_t size, size_t* length) {
+  return bench_repeat(size, "", "~~a ", length);
+}
+
+static char* generate_link_openers(size_t size, size_t* length) {
+  return bench_repeat(size, "", "[a ", length);
+}
+
+static char* generate_image_openers(size_t size, size_t* length) {
+  return bench_repeat(size, "", "![a ", length);
+}
+
+static char* generate_link_destinations(size_t size, size_t* length) {
+  return bench_repeat(size, "", "[a](", length);
+}
+
+static char* generate_link_labels(size_t size, size_t* length) {
+  return bench_repeat(size, "", "[a][b] ", length);
+}
+
+// Brackets nested as deep as the input allows, then closed
+static char* generate_link_nested(size_t size, size_t* length) {
+  char* input = malloc(size + 1);
+  if (!input)
+    return NULL;
+
+  memset(input, '[', size / 2);
+  memset(input + size / 2, ']', size / 2);
+  *length        = size / 2 * 2;
+  input[*length] = '\0';
+  return input;
+}
+
+// Hundreds of reference definitions, then prose that uses them
+#define BENCH_REFERENCE_COUNT 500
+
+static char* generate_references(size_t size, size_t* length) {
+  char* input = malloc(size + 1);
+  if (!input)
+    return NULL;
+
+  size_t at = 0;
+  for (int i = 0; i < BENCH_REFERENCE_COUNT && at + 64 < size; i++)
+    at += (size_t) sprintf(input + at, "[Ref %d]: https://example.com/%d \"Title %d\"\n", i, i, i);
+  input[at++] = '\n';
+
+  uint32_t state      = 0x9e3779b9u;
+  size_t   word_count = sizeof(prose_words) / sizeof(prose_words[0]);
+  while (at + 64 < size) {
+    const char* word = prose_words[bench_random(&state) % word_count];
+    if (bench_random(&state) % 8 == 0)
+      at += (size_t) sprintf(input + at, "[ref %u] ", bench_random(&state) % BENCH_REFERENCE_COUNT);
+    else
+      at += (size_t) sprintf(input + at, "%s", word);
+  }
+  input[at] = '\0';
+  *length   = at;
+  return input;
+}
+
+// Append text if it fits in size bytes
+static bool bench_append(char* input, size_t* at, size_t size, const char* text) {
+  size_t length = strlen(text);
+  if (*at + length > size)
+    return false;
+  memcpy(input + *at, text, length);
+  *at += length;
+  return true;
+}
+
+static const char* const link_specials[] = {
+    "[a link](https://example.com/path) ", "[titled](/docs/page \"A title\") ",
+    "![an image](/img/logo.png \"Logo\") ", "<https://example.com/auto> ",
+    "[full][ref] ",  "[Ref] ", "https://www.example.com/bare ", "[code `span`](/code) ",
+};
+
+// Prose where about every third word is a link of some kind
+static char* generate_links(size_t size, size_t* length) {
+  char* input = bench_fill(size, markdown_words, sizeof(markdown_words) / sizeof(markdown_words[0]),
+                           link_specials, sizeof(link_specials) / sizeof(link_specials[0]), 3,
+                           "[ref]: https://example.com/ref \"Reference\"\n\n", NULL);
+  *length = input ? strlen(input) : 0;
+  return input;
+}
+
+// Tables of twenty rows with some inline markup in the cells
+static char* generate_tables(size_t size, size_t* length) {
+  char* input = malloc(size + 1);
+  if (!input)
+    return NULL;
+
+  uint32_t state = 0x9e3779b9u;
+  size_t   at    = 0;
+  char     row[160];
+  for (bool full = false; !full;) {
+    full = !bench_append(input, &at, size,
+                         "| Name | Type | Count | Notes |\n|:-----|------|------:|:-----:|\n");
+    for (int i = 0; i < 20 && !full; i++) {
+      uint32_t value = bench_random(&state);
+      snprintf(row, sizeof(row), "| item %u | `type_%u` | %u | *note* and [link](/n/%u) |\n",
+               value % 1000, value % 7, value % 100000, value % 50);
+      full = !bench_append(input, &at, size, row);
+    }
+    full = full || !bench_append(input, &at, size, "\n");
+  }
+  input[at] = '\0';
+  *length   = at;
+  return input;
+}
+
+static const char* const code_lines[] = {
+    "static int parse(const char* text, size_t length) {\n",
+    "  for (size_t i = 0; i < length; i++) {\n",
+    "    if (text[i] == '<' && flags & ESCAPE_HTML)\n",
+    "      out << \"&lt;\";\n",
+    "  }\n",
+    "  return map[\"key\"] > 0 ? *ptr : -1;\n",
+    "}\n",
+};
+
+// Fenced code blocks of a dozen lines between short paragraphs with code spans
+static char* generate_code_heavy(size_t size, size_t* length) {
+  char* input = malloc(size + 1);
+  if (!input)
+    return NULL;
+
+  uint32_t state = 0x9e3779b9u;
+  size_t   at    = 0;
+  size_t   count = sizeof(code_lines) / sizeof(code_lines[0]);
+  for (bool full = false; !full;) {
+    full = !bench_append(input, &at, size,
+                         "Call `parse()` with the `text` and its `length`, then check that the "
+                         "result is `0`:\n\n```c\n");
+    for (int i = 0; i < 12 && !full; i++)
+      full = !bench_append(input, &at, size, code_lines[bench_random(&state) % count]);
+    full = full || !bench_append(input, &at, size, "```\n\n");
+  }
+  input[at] = '\0';
+  *length   = at;
+  return input;
+}
+
+// Block quotes and lists nested up to eight levels deep
+static char* generate_nested(size_t size, size_t* length) {
+  char* input = malloc(size + 1);
+  if (!input)
+    return NULL;
+
+  size_t at = 0;
+  for (bool full = false; !full;) {
+    for (int depth = 1; depth <= 8 && !full; depth++) {
+      for (int i = 0; i < depth && !full; i++)
+        full = !bench_append(input, &at, size, "> ");
+      full = full || !bench_append(input, &at, size, "Quoted *text* with `code`.\n");
+    }
+    full = full || !bench_append(input, &at, size, "\n");
+    for (int depth = 0; depth < 8 && !full; depth++) {
+      for (int i = 0; i < depth && !full; i++)
+        full = !bench_append(input, &at, size, "  ");
+      full = full || !bench_append(input, &at, size, "- item with **strong** text\n");
+    }
+    full = full || !bench_append(input, &at, size, "\n");
+  }
+  input[at] = '\0';
+  *length   = at;
+  return input;
+}
+
+static int run_escape(const char* input, size_t length, char* scratch, size_t scratch_size,
+                      marker_stats_t* stats) {
+  (void) length;
+  (void) stats;
+  return marker_escape_html(input, scratch, scratch_size) == MARKER_OK ? 0 : -1;
+}
+
+static int run_parse_with(const marker_config_t* config, const char* input, size_t length,
+                          marker_stats_t* stats) {
+  marker_parser_t* parser = marker_parser_new(config);
+  marker_buffer_t* output = marker_buffer_new(length * 2);
+  int              status = -1;
+
+  if (parser && output && marker_parse(parser, input, output) == MARKER_OK) {
+    marker_parser_stats(parser, stats);
+    status = 0;
+  }
+
+  marker_buffer_free(output);
+  marker_parser_free(parser);
+  return status;
+}
+
+static int run_parse(const char* input, size_t length, char* scratch, size_t scratch_size,
+                     marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+
+  marker_config_t config;
+  marker_config_init(&config);
+  return run_parse_with(&config, input, length, stats);
+}
+
+static int run_parse_commonmark(const char* input, size_t length, char* scratch,
+                                size_t scratch_size, marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+
+  marker_config_t config;
+  marker_config_init_commonmark(&config);
+  return run_parse_with(&config, input, length, stats);
+}
+
+// Without autolinks no inline engine built for a configuration fits, and the
+// generic one runs. The generated text has no `<`, so the HTML is the same.
+static int run_parse_generic(const char* input, size_t length, char* scratch,
+                             size_t scratch_size, marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+
+  marker_config_t config;
+  marker_config_init(&config);
+  config.enable_autolinks = false;
+  return run_parse_with(&config, input, length, stats);
+}
+
+static int run_parse_inline(const char* input, size_t length, char* scratch,
+                            size_t scratch_size, marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  marker_buffer_t* output = marker_buffer_new(length * 2);
+  int              status = -1;
+
+  if (parser && output && marker_parse_inline(parser, input, output) == MARKER_OK) {
+    marker_parser_stats(parser, stats);
+    status = 0;
+  }
+
+  marker_buffer_free(output);
+  marker_parser_free(parser);
+  return status;
+}
+
+static int run_document(const char* input, size_t length, char* scratch, size_t scratch_size,
+                        marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+
+  marker_parser_t*   parser   = marker_parser_new(NULL);
+  marker_document_t* document = marker_document_new();
+  marker_buffer_t*   output   = marker_buffer_new(length * 2);
+  int                status   = -1;
+
+  if (parser && document && output &&
+      marker_parse_document(parser, input, length, document) == MARKER_OK &&
+      marker_render_html(document, output) == MARKER_OK) {
+    marker_parser_stats(parser, stats);
+    status = 0;
+  }
+
+  marker_buffer_free(output);
+  marker_document_free(document);
+  marker_parser_free(parser);
+  return status;
+}
+
+// marker_parse_parallel on up to the given number of threads
+static int run_parallel(const char* input, size_t length, size_t thread_count,
+                        marker_stats_t* stats) {
+  marker_parser_t* parser = marker_parser_new(NULL);
+  marker_buffer_t* output = marker_buffer_new(length * 2);
+  int              status = -1;
+
+  if (parser && output &&
+      marker_parse_parallel(parser, input, length, output, thread_count) == MARKER_OK) {
+    marker_parser_stats(parser, stats);
+    status = 0;
+  }
+
+  marker_buffer_free(output);
+  marker_parser_free(parser);
+  return status;
+}
+
+static int run_parallel_2(const char* input, size_t length, char* scratch, size_t scratch_size,
+                          marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+  return run_parallel(input, length, 2, stats);
+}
+
+static int run_parallel_4(const char* input, size_t length, char* scratch, size_t scratch_size,
+                          marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+  return run_parallel(input, length, 4, stats);
+}
+
+static int run_parallel_8(const char* input, size_t length, char* scratch, size_t scratch_size,
+                          marker_stats_t* stats) {
+  (void) scratch;
+  (void) scratch_size;
+  return run_parallel(input, length, 8, stats);
+}
+
+static const bench_case bench_cases[] = {
+    {"escape", "marker_escape_html on prose with occasional specials", generate_prose, run_escape,
+     false},
+    {"escape-dense", "marker_escape_html on code with many specials", generate_code, run_escape,
+     false},
+    {"code-block", "marker_parse of one large fenced code block", generate_code_block, run_parse,
+     false},
+    {"prose", "marker_parse of paragraphs with some inline markup", generate_markdown, run_parse,
+     false},
+    {"commonmark", "marker_parse of the same text with the CommonMark configuration",
+     generate_markdown, run_parse_commonmark, false},
+    {"generic", "marker_parse of the same text with the generic inline engine",
+     generate_markdown, run_parse_generic, false},
+    {"links", "marker_parse of prose with inline, reference and autolinks",
+     generate_links, run_parse, false},
+    {"tables", "marker_parse of tables with inline markup in the cells", generate_tables,
+     run_parse, false},
+    {"code", "marker_parse of fenced code blocks between short paragraphs",
+     generate_code_heavy, run_parse, false},
+    {"nested", "marker_parse of block quotes and lists nested eight deep", generate_nested,
+     run_parse, false},
+    {"inline", "marker_parse_inline of the same text", generate_markdown, run_parse_inline, false},
+    {"document", "marker_parse_document and marker_render_html of the same text",
+     generate_markdown, run_document, false},
+    {"parallel-2", "marker_parse_parallel of the same text on 2 threads", generate_markdown,
+     run_parallel_2, false},
+    {"parallel-4", "marker_parse_parallel of the same text on 4 threads", generate_markdown,
+     run_parallel_4, false},
+    {"parallel-8", "marker_parse_parallel of the same text on 8 threads", generate_markdown,
+     run_parallel_8, false},
+    {"references", "marker_parse of prose with links to 500 reference definitions",
+     generate_references, run_parse, false},
+    {"emph-openers", "\"_a \" repeated, openers without closers", generate_emphasis_openers,
+     run_parse_inline, true},
+    {"emph-closers", "\"a_ \" repeated, closers without openers", generate_emphasis_closers,
+     run_parse_inline, true},
+    {"emph-mismatched", "\"*a_ \" repeated, openers and closers of another kind",
+     generate_emphasis_mismatched, run_parse_inline, true},
+    {"emph-mod3", "\"a**b\" then \"c* \" repeated, closers barred by the rule of three",
+     generate_emphasis_mod3, run_parse_inline, true},
+    {"strike-openers", "\"~~a \" repeated, strikethrough openers without closers",
+     generate_strikethrough_openers, run_parse_inline, true},
+    {"link-openers", "\"[a \" repeated, brackets never closed", generate_link_openers,
+     run_parse_inline, true},
+    {"image-openers", "\"![a \" repeated, image brackets never closed", generate_image_openers,
+     run_parse_inline, true},
+    {"link-dests", "\"[a](\" repeated, destinations never closed",
+     generate_link_destinations, run_parse_inline, true},
+    {"link-labels", "\"[a][b] \" repeated, references that are not defined",
+     generate_link_labels, run_parse_inline, true},
+    {"link-nested", "brackets nested half the input deep", generate_link_nested,
+     run_parse_inline, true},
+};
+
+#define BENCH_CASE_COUNT (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+// Read a whole file, NUL-terminated
+static char* bench_read_file(const char* path, size_t* length) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  char*  input    = NULL;
+  size_t capacity = 0;
+  size_t at       = 0;
+  for (;;) {
+    if (capacity - at < 4096) {
+      capacity    = capacity ? capacity * 2 : 65536;
+      char* grown = realloc(input, capacity + 1);
+      if (!grown)
+        break;
+      input = grown;
+    }
+    size_t got = fread(input + at, 1, capacity - at, file);
+    at += got;
+    if (got == 0)
+      break;
+  }
+
+  bool failed = ferror(file) || capacity - at < 4096;
+  fclose(file);
+  if (failed || !input) {
+    free(input);
+    return NULL;
+  }
+  input[at] = '\0';
+  *length   = at;
+  return input;
+}
+
+// Sizes such as 4096, 512K or 100M
+static size_t bench_parse_size(const char* text) {
+  char*  end  = NULL;
+  size_t size = (size_t) strtoull(text, &end, 10);
+  if (*end == 'K' || *end == 'k')
+    size *= 1024;
+  else if (*end == 'M' || *end == 'm')
+    size *= 1024 * 1024;
+  else if (*end != '\0')
+    return 0;
+  return size;
+}
+
+static size_t bench_load_baseline(const char* path, bench_result* results, size_t capacity) {
+  FILE* file = fopen(path, "r");
+  if (!file)
+    return 0;
+
+  char   line[256];
+  size_t count = 0;
+  while (count < capacity && fgets(line, sizeof(line), file)) {
+    bench_result* result = &results[count];
+    if (line[0] != '#' && sscanf(line, "%63s %zu %lf %zu", result->name, &result->size,
+                                 &result->mib_per_second, &result->allocations) == 4)
+      count++;
+  }
+  fclose(file);
+  return count;
+}
+
+static const bench_result* bench_find_baseline(const bench_result* results, size_t count,
+                                               const char* name, size_t size) {
+  for (size_t i = 0; i < count; i++)
+    if (results[i].size == size && strcmp(results[i].name, name) == 0)
+      return &results[i];
+  return NULL;
+}
+
+// Where results are compared to and written
+typedef struct {
+  const bench_result* baseline;
+  size_t              baseline_count;
+  double              tolerance;  // Percent slower that is still no regression
+  double              ceiling;    // ns/B of the slowest stress document that still passes
+  FILE*               record;     // NULL when results are not written
+  size_t              regressions;
+  int                 branches;  // Counter of branch instructions, -1 when there is none
+} bench_report;
+
+// Print a result, compare it with the baseline and record it
+static void bench_print(const char* name, const char* description, size_t size,
+                        double ns_per_byte, double branches_per_byte, const marker_stats_t* stats,
+                        uint64_t runs, bench_report* report) {
+  double mib_per_second = 1e9 / ns_per_byte / (1024.0 * 1024.0);
+
+  // Slower beyond the tolerance, or more heap blocks, is a regression
+  char                comparison[32] = "";
+  const bench_result* base =
+      bench_find_baseline(report->baseline, report->baseline_count, name, size);
+  if (base) {
+    double change     = (mib_per_second / base->mib_per_second - 1.0) * 100.0;
+    bool   slower     = change < -report->tolerance;
+    bool   allocating = stats->heap_allocations > base->allocations;
+    snprintf(comparison, sizeof(comparison), "%+6.1f%%%s", change,
+             slower || allocating ? " REGRESSED" : "");
+    if (slower || allocating)
+      report->regressions++;
+  }
+
+  printf("%-16s %7zu KiB %8.1f MiB/s %7.2f ns/B ", name, size / 1024, mib_per_second,
+         ns_per_byte);
+  if (report->branches >= 0 && branches_per_byte >= 0.0)
+    printf("%6.2f br/B ", branches_per_byte);
+  else if (report->branches >= 0)
+    printf("%6s br/B ", "-");
+  printf("%6zu allocs %7zu KiB heap %8llu runs %-17s %s\n", stats->heap_allocations,
+         stats->peak_heap_bytes / 1024, (unsigned long long) runs, comparison, description);
+  if (report->record)
+    fprintf(report->record, "%s %zu %.1f %zu\n", name, size, mib_per_second,
+            stats->heap_allocations);
+}
+
+// Time one benchmark on its input. Allocations and the peak heap are those of
+// the parser for one document, output buffers aside.
+static int bench_measure(const char* name, const char* description,
+                         int (*run)(const char*, size_t, char*, size_t, marker_stats_t*),
+                         const char* input, size_t length, size_t size, double seconds,
+                         bench_report* report) {
+  // Every entity is at most six bytes
+  size_t scratch_size = length * 6 + 1;
+  char*  scratch      = malloc(scratch_size);
+  if (!scratch)
+    return -1;
+
+  // One untimed run to fault in the buffers
+  marker_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  if (run(input, length, scratch, scratch_size, &stats) != 0) {
+    fprintf(stderr, "%s: run failed\n", name);
+    free(scratch);
+    return -1;
+  }
+
+  uint64_t budget     = (uint64_t) (seconds * 1e9);
+  uint64_t elapsed    = 0;
+  uint64_t iterations = 0;
+  bench_start_branches(report->branches);
+  uint64_t start = bench_now_ns();
+  do {
+    run(input, length, scratch, scratch_size, &stats);
+    iterations++;
+    elapsed = bench_now_ns() - start;
+  } while (elapsed < budget);
+  uint64_t branches = bench_stop_branches(report->branches);
+  free(scratch);
+
+  double bytes = (double) length * (double) iterations;
+  bench_print(name, description, size, (double) elapsed / bytes, (double) branches / bytes,
+              &stats, iterations, report);
+  return 0;
+}
+
+static int bench_run(const bench_case* bench, size_t size, double seconds, bench_report* report) {
+  size_t length = 0;
+  char*  input  = bench->generate(size, &length);
+  if (!input) {
+    fprintf(stderr, "%s: failed to generate input\n", bench->name);
+    return -1;
+  }
+
+  int status = bench_measure(bench->name, bench->description, bench->run, input, length, size,
+                             seconds, report);
+  free(input);
+  return status;
+}
+
+// marker_parse of a file, such as the CommonMark spec
+static int bench_run_file(const char* path, double seconds, bench_report* report) {
+  size_t length = 0;
+  char*  input  = bench_read_file(path, &length);
+  if (!input) {
+    fprintf(stderr, "%s: failed to read\n", path);
+    return -1;
+  }
+
+  const char* name   = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  int         status = bench_measure(name, "marker_parse of the file", run_parse, input, length,
+                                     length, seconds, report);
+  free(input);
+  return status;
+}
+
+// Pieces of random documents for the stress benchmark, mostly markup
+static const char* const stress_pieces[] = {
+    "*",  "_",  "**", "~~",  "[",  "]",  "(",  ")",    "![",  "`",    "``",  "<",   ">",
+    "\\", "\n", "\n\n", "a",  "word ", " ", "|",  "# ",  "> ",  "- ",  "1. ", "```\n",
+    "&",  "\"", "<https://x.y/", "@", "[x]: /u\n", "](", "][", "---\n", "    ",
+};
+
+// Parse random documents, each timed on its own, and report the slowest rate
+// of them. Every parse has a work budget of STRESS_WORK_FACTOR bytes per input
+// byte, so whatever the input the time per byte stays bounded.
+#define STRESS_WORK_FACTOR 64
+
+static int bench_stress(size_t size, double seconds, bench_report* report) {
+  char* input = malloc(size + 1);
+  if (!input)
+    return -1;
+
+  marker_config_t config;
+  marker_config_init(&config);
+  config.max_work = size * STRESS_WORK_FACTOR;
+
+  marker_parser_t* parser = marker_parser_new(&config);
+  marker_buffer_t* output = marker_buffer_new(size * 8);
+  if (!parser || !output) {
+    marker_buffer_free(output);
+    marker_parser_free(parser);
+    free(input);
+    return -1;
+  }
+
+  size_t         piece_count = sizeof(stress_pieces) / sizeof(stress_pieces[0]);
+  double         worst       = 0.0;
+  uint32_t       worst_seed  = 0;
+  uint64_t       documents   = 0;
+  uint64_t       stopped     = 0;
+  uint64_t       budget      = (uint64_t) (seconds * 1e9);
+  uint64_t       start       = bench_now_ns();
+  marker_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  do {
+    uint32_t seed  = (uint32_t) documents + 1;
+    uint32_t state = seed * 0x9e3779b9u;
+    size_t   at    = 0;
+    while (bench_append(input, &at, size, stress_pieces[bench_random(&state) % piece_count]))
+      ;
+    input[at] = '\0';
+
+    // A document that looks like the slowest yet is timed twice more, so a
+    // thread switch during one parse does not count
+    marker_result_t result = MARKER_OK;
+    double          time   = 0.0;
+    for (int run = 0; run < 3 && (run == 0 || time / (double) at > worst); run++) {
+      marker_parser_reset(parser);
+      marker_buffer_clear(output);
+      uint64_t parse_start = bench_now_ns();
+      result               = marker_parse_n(parser, input, at, output);
+      uint64_t parse_time  = bench_now_ns() - parse_start;
+      if (run == 0 || (double) parse_time < time)
+        time = (double) parse_time;
+    }
+    if (result == MARKER_ERROR_LIMIT_EXCEEDED)
+      stopped++;
+    else if (result != MARKER_OK)
+      fprintf(stderr, "stress: seed %u failed with %d\n", seed, (int) result);
+    if (time / (double) at > worst) {
+      worst      = time / (double) at;
+      worst_seed = seed;
+      marker_parser_stats(parser, &stats);
+    }
+    documents++;
+  } while (bench_now_ns() - start < budget);
+
+  char description[128];
+  snprintf(description, sizeof(description),
+           "slowest of random markup documents, seed %u, %llu stopped by limits", worst_seed,
+           (unsigned long long) stopped);
+  bench_print("stress", description, size, worst, -1.0, &stats, documents, report);
+  if (worst > report->ceiling) {
+    printf("stress: seed %u took %.2f ns/B, over the ceiling of %.2f\n", worst_seed, worst,
+           report->ceiling);
+    report->regressions++;
+  }
+
+  marker_buffer_free(output);
+  marker_parser_free(parser);
+  free(input);
+  return 0;
+}
+
+static bool bench_selected(const char* name, const char* const* names, size_t name_count) {
+  for (size_t i = 0; i < name_count; ++i) {
+    if (strcmp(names[i], name) == 0)
+      return true;
+    if (strcmp(names[i], "corpus") == 0)
+      for (size_t j = 0; j < CORPUS_COUNT; ++j)
+        if (strcmp(corpus_names[j], name) == 0)
+          return true;
+  }
+  return false;
+}
+
+int main(int argc, char* argv[]) {
+  double      seconds    = 2.0;
+  double      tolerance  = BENCH_TOLERANCE;
+  double      ceiling    = BENCH_STRESS_CEILING;
+  size_t      size       = BENCH_INPUT_SIZE;
+  const char* names[BENCH_CASE_COUNT + 2];
+  size_t      name_count = 0;
+  const char* files[16];
+  size_t      file_count    = 0;
+  const char* baseline_path = NULL;
+  const char* record_path   = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
+      fprintf(stderr,
+              "Usage: %s [-t SECONDS] [-s SIZE] [-f FILE]... [-b BASELINE [-r PERCENT]] "
+              "[-c NS] [-o BASELINE] [benchmark...]\n\n"
+              "  -t SECONDS   Time per benchmark\n"
+              "  -s SIZE      Input size, such as 512K or 100M\n"
+              "  -f FILE      Also parse a file, such as the CommonMark spec\n"
+              "  -b BASELINE  Compare with a baseline, fail on regressions\n"
+              "  -r PERCENT   Slowdown that is not yet a regression, 10 by default\n"
+              "  -c NS        Slowest stress document per byte that passes, 500 by default\n"
+              "  -o BASELINE  Write the results as a baseline\n\n"
+              "Benchmarks (\"corpus\" selects prose, links, tables, code and nested):\n",
+              argv[0]);
+      for (size_t j = 0; j < BENCH_CASE_COUNT; ++j)
+        fprintf(stderr, "  %-16s %s\n", bench_cases[j].name, bench_cases[j].description);
+      fprintf(stderr, "  %-16s %s\n", "stress", "slowest of random markup documents");
+      return 0;
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      size = bench_parse_size(argv[++i]);
+      if (size < 16) {
+        fprintf(stderr, "Invalid size %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc &&
+               file_count < sizeof(files) / sizeof(files[0])) {
+      files[file_count++] = argv[++i];
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      tolerance = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      ceiling = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (name_count < BENCH_CASE_COUNT + 2) {
+      names[name_count++] = argv[i];
+    } else {
+      fprintf(stderr, "Too many benchmarks given\n");
+      return 1;
+    }
+  }
+
+  static bench_result baseline[BENCH_MAX_BASELINE];
+  bench_report        report = {baseline, 0, tolerance, ceiling, NULL, 0, bench_open_branches()};
+  if (baseline_path) {
+    report.baseline_count = bench_load_baseline(baseline_path, baseline, BENCH_MAX_BASELINE);
+    if (report.baseline_count == 0)
+      fprintf(stderr, "No results in baseline %s\n", baseline_path);
+  }
+  if (record_path) {
+    report.record = fopen(record_path, "w");
+    if (!report.record) {
+      fprintf(stderr, "Cannot write %s\n", record_path);
+      return 1;
+    }
+    fprintf(report.record, "# name size MiB/s allocations\n");
+  }
+
+  // Without names every benchmark runs, unless only files are given
+  int status = 0;
+  for (size_t i = 0; i < BENCH_CASE_COUNT; ++i) {
+    bool selected = name_count == 0 ? file_count == 0
+                                    : bench_selected(bench_cases[i].name, names, name_count);
+    if (!selected)
+      continue;
+    if (bench_cases[i].scaling && bench_run(&bench_cases[i], size / 16, seconds, &report) != 0)
+      status = 1;
+    if (bench_run(&bench_cases[i], size, seconds, &report) != 0)
+      status = 1;
+  }
+  for (size_t i = 0; i < file_count; ++i)
+    if (bench_run_file(files[i], seconds, &report) != 0)
+      status = 1;
+  if ((name_count == 0 && file_count == 0) || bench_selected("stress", names, name_count))
+    if (bench_stress(size / 16, seconds, &report) != 0)
+      status = 1;
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    printf("Peak RSS %ld MiB\n", usage.ru_maxrss / 1024);
+  if (report.record)
+    fclose(report.record);
+#ifdef __linux__
+  if (report.branches >= 0)
+    close(report.branches);
+#endif
+  if (report.regressions) {
+    printf("%zu regressions against %s\n", report.regressions,
+           baseline_path ? baseline_path : "the stress ceiling");
+    status = 1;
+  }
+  return status;
+}
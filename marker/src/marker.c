@@ -1,60 +1,251 @@
+#define _POSIX_C_SOURCE 200112L
 #include "marker.h"
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Vector scans for x86, picked at runtime. Define MARKER_NO_SIMD to build the
+// scalar versions only.
+#if !defined(MARKER_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define MARKER_HAVE_X86_SIMD 1
+#  include <immintrin.h>
+#endif
+
+// The inline engine is built once for each common configuration, see
+// INLINE_VARIANT. Define MARKER_NO_VARIANTS to build the generic one only.
+#if defined(__GNUC__)
+#  define MARKER_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#  define MARKER_ALWAYS_INLINE inline
+#endif
 
 // Internal constants
 #define DEFAULT_BUFFER_SIZE 4096
 #define MAX_NESTING_DEPTH 32
-#define MAX_LINE_LENGTH 4096
+#define MAX_INLINE_DEPTH 256
 #define MAX_LINK_LENGTH 2048
+#define FILE_CHUNK_SIZE 16384
+#define SINK_CHUNK_SIZE 16384
+#define FD_SINK_SIZE (64 * 1024)
+#define SCATTER_MIN_RUN 64
+#define SCATTER_WRITE_BATCH 256
+#define PARALLEL_MIN_CHUNK (64 * 1024)
+#define PARALLEL_MAX_THREADS 64
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_MAX_CHUNK_SIZE (1024 * 1024)
+#define REF_MIN_SLOTS 16
+
+// Bump allocator. Memory comes from a list of chunks and is only given back all
+// at once, so strings that live as long as the parser cost no free of their own.
+// Scratch memory is rewound to a mark once a construct is done with it, and the
+// chunks stay with the arena for the next parse.
+typedef struct arena_chunk {
+  struct arena_chunk* next;
+  size_t              size;  // Usable bytes after the header
+  size_t              used;
+} arena_chunk_t;
+
+typedef struct {
+  arena_chunk_t*            first;      // In allocation order
+  arena_chunk_t*            current;    // Chunk allocations come from, the ones after it are spare
+  const marker_allocator_t* allocator;  // Where chunks come from, NULL for the C library
+} arena_t;
+
+typedef struct {
+  arena_chunk_t* chunk;
+  size_t         used;
+} arena_mark_t;
+
+// A reference definition with its lookup key, the CommonMark normalised label
+typedef struct {
+  marker_ref_link_t link;
+  const char*       key;
+  uint32_t          hash;
+} ref_entry_t;
+
+// Configuration as the inline engine sees it
+#define FEATURE_STRIKETHROUGH 1u
+#define FEATURE_AUTOLINKS 2u
+#define FEATURE_INLINE_HTML 4u
+#define FEATURE_ESCAPE_HTML 8u
+
+// The defaults, and the defaults without the GFM extensions
+#define FEATURES_GFM \
+  (FEATURE_STRIKETHROUGH | FEATURE_AUTOLINKS | FEATURE_INLINE_HTML | FEATURE_ESCAPE_HTML)
+#define FEATURES_COMMONMARK (FEATURE_AUTOLINKS | FEATURE_INLINE_HTML | FEATURE_ESCAPE_HTML)
+
+// Build of the inline engine a parser uses, picked when it is created
+typedef enum {
+  INLINE_GENERIC,  // Reads the features of the parser as it goes
+  INLINE_GFM,
+  INLINE_COMMONMARK
+} inline_variant_t;
+
+// Tokens of an inline span, see scan_inline_tokens
+typedef struct {
+  size_t    pos;         // First character of the run not yet matched
+  size_t    count;       // Characters of the run not yet matched
+  size_t    orig_count;  // Length of the run as written
+  char      ch;
+  bool      can_open;
+  bool      can_close;
+  ptrdiff_t prev;     // Neighbours still on the stack, -1 for none
+  ptrdiff_t next;
+  ptrdiff_t matches;  // Last match opened by the run, -1 for none
+} inline_delim_t;
+
+typedef struct {
+  size_t    open;   // Position of the `[`
+  size_t    close;  // Position of the matching `]`, SIZE_MAX when there is none
+  ptrdiff_t outer;  // Enclosing bracket while it is open, -1 for none
+  ptrdiff_t label;  // Bracket right after the `]`, -1 for none
+  bool      image;  // Preceded by an unescaped `!`
+} inline_bracket_t;
+
+typedef struct {
+  inline_delim_t*   delims;
+  size_t            delim_count;
+  size_t            delim_capacity;
+  inline_bracket_t* brackets;  // In order of the `[`
+  size_t            bracket_count;
+  size_t            bracket_capacity;
+  size_t*           parens;  // Positions of `)`
+  size_t            paren_count;
+  size_t            paren_capacity;
+} inline_tokens_t;
+
+// Links and emphasis of an inline span, see resolve_inline
+typedef struct {
+  size_t    opener;  // Position of the opening characters
+  size_t    closer;  // Position of the closing characters
+  size_t    count;   // Characters on each side, 2 for strong and strikethrough
+  ptrdiff_t next;    // Match opened earlier by the same run, further right
+} emphasis_match_t;
+
+typedef struct {
+  size_t                   start;       // `[` of a link, `!` of an image
+  size_t                   end;         // Just past the link
+  size_t                   text_start;  // Link text, or alt text of an image
+  size_t                   text_end;
+  size_t                   url_start;  // Destination and title, when ref is NULL
+  size_t                   url_end;
+  const marker_ref_link_t* ref;
+  bool                     image;
+} inline_link_t;
+
+typedef struct {
+  emphasis_match_t* matches;  // Sorted by opener
+  size_t            match_count;
+  inline_link_t*    links;  // Sorted by start
+  size_t            link_count;
+  size_t            end;  // Nothing of the span is read at or past it
+} inline_span_t;
+
+// Emphasis or link text being written, see render_inline. The span and end are
+// those of the enclosing content, which goes on once the node is closed.
+typedef struct {
+  const inline_span_t* span;
+  size_t               end;
+  size_t               resume;  // Just past the closer
+  arena_mark_t         mark;    // Scratch memory when the node was opened
+  marker_node_type_t   type;
+} inline_frame_t;
+
+// Blocks left open from one line to the next
+typedef struct {
+  bool in_code_block;
+  bool in_list;
+  bool list_is_ordered;
+  bool in_table;
+} block_state_t;
+
+// A worker of marker_parse_parallel, kept for the next call
+typedef struct {
+  marker_parser_t* parser;
+  marker_buffer_t* output;
+} parallel_worker_t;
+
+// A reference definition line, found before the input is split
+typedef struct {
+  const char* line;
+  size_t      length;
+} parallel_ref_t;
+
+// Heap memory of a parser, with the counts of marker_parser_stats
+typedef struct {
+  marker_allocator_t heap;         // The configured allocator, or the C library
+  size_t             allocations;  // Blocks allocated or grown since the parser was created
+  size_t             bytes;        // Bytes held now
+  size_t             peak;         // Most bytes held at once since the parse began
+  size_t             parse_start;  // allocations when the parse began
+  size_t             parse_bytes;  // Bytes allocated or grown into since the parse began
+} memory_t;
 
 // Parser state structure
 struct marker_parser {
   marker_config_t    config;
-  marker_ref_link_t* ref_links;
+  memory_t           memory;
+  marker_allocator_t allocator;  // Counts into memory, every block of the parser comes from it
+  marker_ref_link_t* ref_links;  // Most recent definition first
+  ref_entry_t**      ref_slots;  // Open addressing, power of two, NULL when empty
+  size_t             ref_slot_count;
+  size_t             ref_count;
+  arena_t            ref_arena;  // Entries and their strings
+  arena_t            scratch;    // Temporaries of a parse, reset when one starts
+  inline_tokens_t    tokens;     // Kept between spans, only used while one is resolved
+  inline_frame_t*    frames;     // Open emphasis and link text, innermost last
+  size_t             frame_count;
+  size_t             frame_capacity;
+  block_state_t      stream_blocks;
+  marker_buffer_t*   stream_output;   // NULL when no stream is open
+  char*              stream_pending;  // Input the stream has not parsed yet
+  size_t             stream_pending_size;
+  size_t             stream_pending_capacity;
+  marker_buffer_t*   sink_output;  // Output on its way to a sink, created when first needed
+  marker_scatter_t*  scatter;      // Set while a scatter-gather render runs
+  marker_document_t* document;     // Set while a document is built
+  parallel_worker_t* workers;      // Created when marker_parse_parallel first needs them
+  size_t             worker_count;
+  parallel_ref_t*    parallel_refs;
+  size_t             parallel_ref_capacity;
   size_t             nesting_depth;
+  size_t             inline_depth;  // Emphasis and link text open around the current span
+  size_t             work;          // Bytes scanned since the parse began, for max_work
+  size_t             output_size;   // Bytes written since the parse began, for max_output_size
+  unsigned           features;      // FEATURE_ bits of the configuration
+  inline_variant_t   variant;
   bool               in_code_block;
   bool               in_html_block;
-  char*              line_buffer;
-  size_t             line_buffer_size;
+  unsigned char      inline_triggers[256];  // Bytes that may start inline markup
+  unsigned char      inline_nibbles[16];    // inline_triggers by low nibble, bit per high nibble
 };
 
 // Forward declarations
-static marker_result_t parse_inline_content(marker_parser_t* parser, const char* text, size_t* pos,
-                                            marker_buffer_t* output, size_t end_pos);
-
-// Provide strcasecmp on platforms that don't have it (e.g., Windows uses _stricmp)
-// This is needed for case-insensitive comparison of Markdown reference link labels
-#if !defined(HAVE_STRCASECMP) && !defined(strcasecmp)
-static int marker_strcasecmp(const char* s1, const char* s2) {
-  while (*s1 && *s2) {
-    int c1 = tolower((unsigned char) *s1);
-    int c2 = tolower((unsigned char) *s2);
-    if (c1 != c2)
-      return c1 - c2;
-    s1++;
-    s2++;
-  }
-  return tolower((unsigned char) *s1) - tolower((unsigned char) *s2);
-}
-#  define strcasecmp marker_strcasecmp
-#endif
+static void            build_inline_triggers(marker_parser_t* parser);
+static void            select_inline_variant(marker_parser_t* parser);
+static bool            is_whitespace(char ch);
+static marker_result_t scan_inline_tokens(marker_parser_t* parser, const char* text, size_t start,
+                                          size_t end, inline_tokens_t* tokens);
+
+// HTML entities for escaping, indexed by byte and padded to eight bytes so one
+// can be copied with a fixed-size store. A zero length means the byte is copied
+// as is.
+static const char html_entities[256][8] = {
+    ['&'] = "&amp;", ['<'] = "&lt;", ['>'] = "&gt;", ['"'] = "&quot;", ['\''] = "&#39;",
+};
 
-// HTML entities for escaping
-static const struct {
-  char        ch;
-  const char* entity;
-} html_entities[] = {
-    {'&',  "&amp;" },
-    {'<',  "&lt;"  },
-    {'>',  "&gt;"  },
-    {'"',  "&quot;"},
-    {'\'', "&#39;" },
-    {0,    NULL    }
+static const unsigned char html_entity_lengths[256] = {
+    ['&'] = 5, ['<'] = 4, ['>'] = 4, ['"'] = 6, ['\''] = 5,
 };
 
 // Version and error handling
@@ -78,6 +269,8 @@ const char* marker_error_string(marker_result_t result) {
       return "Invalid input";
     case MARKER_ERROR_PARSE_FAILED:
       return "Parse failed";
+    case MARKER_ERROR_LIMIT_EXCEEDED:
+      return "Parse limit exceeded";
     default:
       return "Unknown error";
   }
@@ -98,26 +291,92 @@ void marker_config_init(marker_config_t* config) {
   config->hard_line_breaks     = false;
   config->max_nesting_depth    = MAX_NESTING_DEPTH;
   config->initial_buffer_size  = DEFAULT_BUFFER_SIZE;
+  config->allocator            = NULL;
+  config->max_output_size      = 0;
+  config->max_inline_depth     = MAX_INLINE_DEPTH;
+  config->max_work             = 0;
+}
+
+void marker_config_init_commonmark(marker_config_t* config) {
+  if (!config)
+    return;
+
+  marker_config_init(config);
+  config->enable_tables        = false;
+  config->enable_strikethrough = false;
+  config->enable_task_lists    = false;
+}
+
+// Heap memory
+// Blocks come from an allocator, or from the C library when there is none
+static void* libc_allocate(size_t size, void* user_data) {
+  (void) user_data;
+  return malloc(size);
+}
+
+static void* libc_reallocate(void* memory, size_t old_size, size_t size, void* user_data) {
+  (void) old_size;
+  (void) user_data;
+  return realloc(memory, size);
+}
+
+static void libc_deallocate(void* memory, size_t size, void* user_data) {
+  (void) size;
+  (void) user_data;
+  free(memory);
+}
+
+static const marker_allocator_t libc_allocator = {libc_allocate, libc_reallocate, libc_deallocate,
+                                                  NULL};
+
+static void* heap_alloc(const marker_allocator_t* allocator, size_t size) {
+  if (!allocator)
+    allocator = &libc_allocator;
+  return allocator->allocate(size, allocator->user_data);
+}
+
+// Resize a block, which may be NULL for a new one
+static void* heap_realloc(const marker_allocator_t* allocator, void* memory, size_t old_size,
+                          size_t size) {
+  if (!memory)
+    return heap_alloc(allocator, size);
+  if (!allocator)
+    allocator = &libc_allocator;
+  return allocator->reallocate(memory, old_size, size, allocator->user_data);
+}
+
+static void heap_free(const marker_allocator_t* allocator, void* memory, size_t size) {
+  if (!memory)
+    return;
+  if (!allocator)
+    allocator = &libc_allocator;
+  allocator->deallocate(memory, size, allocator->user_data);
 }
 
 // Buffer management
 marker_buffer_t* marker_buffer_new(size_t initial_capacity) {
+  return marker_buffer_new_with_allocator(initial_capacity, NULL);
+}
+
+marker_buffer_t* marker_buffer_new_with_allocator(size_t initial_capacity,
+                                                  const marker_allocator_t* allocator) {
   if (initial_capacity == 0)
     initial_capacity = DEFAULT_BUFFER_SIZE;
 
-  marker_buffer_t* buffer = malloc(sizeof(marker_buffer_t));
+  marker_buffer_t* buffer = heap_alloc(allocator, sizeof(marker_buffer_t));
   if (!buffer)
     return NULL;
 
-  buffer->data = malloc(initial_capacity);
+  buffer->data = heap_alloc(allocator, initial_capacity);
   if (!buffer->data) {
-    free(buffer);
+    heap_free(allocator, buffer, sizeof(marker_buffer_t));
     return NULL;
   }
 
-  buffer->size     = 0;
-  buffer->capacity = initial_capacity;
-  buffer->data[0]  = '\0';
+  buffer->size      = 0;
+  buffer->capacity  = initial_capacity;
+  buffer->allocator = allocator;
+  buffer->data[0]   = '\0';
 
   return buffer;
 }
@@ -125,8 +384,8 @@ marker_buffer_t* marker_buffer_new(size_t initial_capacity) {
 void marker_buffer_free(marker_buffer_t* buffer) {
   if (!buffer)
     return;
-  free(buffer->data);
-  free(buffer);
+  heap_free(buffer->allocator, buffer->data, buffer->capacity);
+  heap_free(buffer->allocator, buffer, sizeof(marker_buffer_t));
 }
 
 const char* marker_buffer_data(const marker_buffer_t* buffer) {
@@ -135,6 +394,13 @@ const char* marker_buffer_data(const marker_buffer_t* buffer) {
 
 size_t marker_buffer_size(const marker_buffer_t* buffer) { return buffer ? buffer->size : 0; }
 
+void marker_buffer_clear(marker_buffer_t* buffer) {
+  if (!buffer)
+    return;
+  buffer->size    = 0;
+  buffer->data[0] = '\0';
+}
+
 static marker_result_t buffer_ensure_capacity(marker_buffer_t* buffer, size_t needed) {
   if (!buffer)
     return MARKER_ERROR_NULL_POINTER;
@@ -147,7 +413,7 @@ static marker_result_t buffer_ensure_capacity(marker_buffer_t* buffer, size_t ne
     new_capacity *= 2;
   }
 
-  char* new_data = realloc(buffer->data, new_capacity);
+  char* new_data = heap_realloc(buffer->allocator, buffer->data, buffer->capacity, new_capacity);
   if (!new_data)
     return MARKER_ERROR_MEMORY_ALLOCATION;
 
@@ -181,711 +447,1499 @@ static marker_result_t buffer_append_char(marker_buffer_t* buffer, char ch) {
   return buffer_append(buffer, &ch, 1);
 }
 
-// Parser management
-marker_parser_t* marker_parser_new(const marker_config_t* config) {
-  marker_parser_t* parser = malloc(sizeof(marker_parser_t));
-  if (!parser)
-    return NULL;
+// Output sinks
+typedef struct {
+  marker_sink_t    base;
+  marker_buffer_t* buffer;
+} buffer_sink_t;
+
+typedef struct {
+  marker_sink_t base;
+  char*         data;
+  size_t        size;
+  size_t        capacity;
+} fixed_sink_t;
+
+typedef struct {
+  marker_sink_t base;
+  int           fd;
+  size_t        size;
+  char          staging[FD_SINK_SIZE];
+} fd_sink_t;
+
+typedef struct {
+  marker_sink_t   base;
+  marker_write_fn write;
+  void*           user_data;
+} callback_sink_t;
+
+marker_result_t marker_sink_write(marker_sink_t* sink, const char* data, size_t length) {
+  if (!sink || !data)
+    return MARKER_ERROR_NULL_POINTER;
+  if (length == 0)
+    return MARKER_OK;
+  return sink->write(sink, data, length);
+}
 
-  if (config) {
-    parser->config = *config;
-  } else {
-    marker_config_init(&parser->config);
-  }
+marker_result_t marker_sink_flush(marker_sink_t* sink) {
+  if (!sink)
+    return MARKER_ERROR_NULL_POINTER;
+  return sink->flush ? sink->flush(sink) : MARKER_OK;
+}
 
-  parser->ref_links        = NULL;
-  parser->nesting_depth    = 0;
-  parser->in_code_block    = false;
-  parser->in_html_block    = false;
-  parser->line_buffer_size = MAX_LINE_LENGTH;
-  parser->line_buffer      = malloc(parser->line_buffer_size);
+static marker_result_t buffer_sink_write(marker_sink_t* sink, const char* data, size_t length) {
+  return buffer_append(((buffer_sink_t*) sink)->buffer, data, length);
+}
 
-  if (!parser->line_buffer) {
-    free(parser);
+marker_sink_t* marker_sink_buffer_new(marker_buffer_t* buffer) {
+  if (!buffer)
     return NULL;
-  }
 
-  return parser;
+  buffer_sink_t* sink = malloc(sizeof(buffer_sink_t));
+  if (!sink)
+    return NULL;
+
+  sink->base.write = buffer_sink_write;
+  sink->base.flush = NULL;
+  sink->buffer     = buffer;
+  return &sink->base;
 }
 
-void marker_parser_free(marker_parser_t* parser) {
-  if (!parser)
-    return;
+static marker_result_t fixed_sink_write(marker_sink_t* sink, const char* data, size_t length) {
+  fixed_sink_t* fixed = (fixed_sink_t*) sink;
+  if (length >= fixed->capacity - fixed->size)
+    return MARKER_ERROR_BUFFER_TOO_SMALL;
 
-  marker_clear_reference_links(parser);
-  free(parser->line_buffer);
-  free(parser);
+  memcpy(fixed->data + fixed->size, data, length);
+  fixed->size += length;
+  fixed->data[fixed->size] = '\0';
+  return MARKER_OK;
 }
 
-// Reference link management
-marker_result_t marker_add_reference_link(marker_parser_t* parser, const char* label,
-                                          const char* url, const char* title) {
-  if (!parser || !label || !url)
-    return MARKER_ERROR_NULL_POINTER;
+marker_sink_t* marker_sink_fixed_new(char* data, size_t size) {
+  if (!data || size == 0)
+    return NULL;
 
-  marker_ref_link_t* ref = malloc(sizeof(marker_ref_link_t));
-  if (!ref)
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+  fixed_sink_t* sink = malloc(sizeof(fixed_sink_t));
+  if (!sink)
+    return NULL;
 
-  ref->label = malloc(strlen(label) + 1);
-  ref->url   = malloc(strlen(url) + 1);
-  ref->title = title ? malloc(strlen(title) + 1) : NULL;
+  sink->base.write = fixed_sink_write;
+  sink->base.flush = NULL;
+  sink->data       = data;
+  sink->size       = 0;
+  sink->capacity   = size;
+  data[0]          = '\0';
+  return &sink->base;
+}
 
-  if (!ref->label || !ref->url || (title && !ref->title)) {
-    free(ref->label);
-    free(ref->url);
-    free(ref->title);
-    free(ref);
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+static marker_result_t write_all(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return MARKER_ERROR_IO_FAILED;
+    }
+    data += written;
+    length -= (size_t) written;
   }
+  return MARKER_OK;
+}
+
+static marker_result_t fd_sink_flush(marker_sink_t* sink) {
+  fd_sink_t*      fd_sink = (fd_sink_t*) sink;
+  marker_result_t result  = write_all(fd_sink->fd, fd_sink->staging, fd_sink->size);
+  fd_sink->size           = 0;
+  return result;
+}
 
-  strcpy(ref->label, label);
-  strcpy(ref->url, url);
-  if (title)
-    strcpy(ref->title, title);
+static marker_result_t fd_sink_write(marker_sink_t* sink, const char* data, size_t length) {
+  fd_sink_t* fd_sink = (fd_sink_t*) sink;
+  if (length > FD_SINK_SIZE - fd_sink->size) {
+    marker_result_t result = fd_sink_flush(sink);
+    if (result != MARKER_OK)
+      return result;
 
-  ref->next         = parser->ref_links;
-  parser->ref_links = ref;
+    // Pieces as large as the staging buffer go out as they are
+    if (length >= FD_SINK_SIZE)
+      return write_all(fd_sink->fd, data, length);
+  }
 
+  memcpy(fd_sink->staging + fd_sink->size, data, length);
+  fd_sink->size += length;
   return MARKER_OK;
 }
 
-void marker_clear_reference_links(marker_parser_t* parser) {
-  if (!parser)
-    return;
+marker_sink_t* marker_sink_fd_new(int fd) {
+  if (fd < 0)
+    return NULL;
 
-  marker_ref_link_t* current = parser->ref_links;
-  while (current) {
-    marker_ref_link_t* next = current->next;
-    free(current->label);
-    free(current->url);
-    free(current->title);
-    free(current);
-    current = next;
-  }
-  parser->ref_links = NULL;
+  fd_sink_t* sink = malloc(sizeof(fd_sink_t));
+  if (!sink)
+    return NULL;
+
+  sink->base.write = fd_sink_write;
+  sink->base.flush = fd_sink_flush;
+  sink->fd         = fd;
+  sink->size       = 0;
+  return &sink->base;
+}
+
+static marker_result_t callback_sink_write(marker_sink_t* sink, const char* data, size_t length) {
+  callback_sink_t* callback = (callback_sink_t*) sink;
+  return callback->write(callback->user_data, data, length);
 }
 
-static marker_ref_link_t* find_reference_link(marker_parser_t* parser, const char* label) {
-  if (!parser || !label)
+marker_sink_t* marker_sink_callback_new(marker_write_fn write, void* user_data) {
+  if (!write)
     return NULL;
 
-  marker_ref_link_t* current = parser->ref_links;
-  while (current) {
-    if (strcasecmp(current->label, label) == 0) {
-      return current;
-    }
-    current = current->next;
-  }
-  return NULL;
+  callback_sink_t* sink = malloc(sizeof(callback_sink_t));
+  if (!sink)
+    return NULL;
+
+  sink->base.write = callback_sink_write;
+  sink->base.flush = NULL;
+  sink->write      = write;
+  sink->user_data  = user_data;
+  return &sink->base;
 }
 
-// HTML escaping
-marker_result_t marker_escape_html(const char* text, char* output, size_t output_size) {
-  if (!text || !output || output_size == 0)
-    return MARKER_ERROR_NULL_POINTER;
+void marker_sink_free(marker_sink_t* sink) { free(sink); }
 
-  size_t out_pos = 0;
-  size_t in_pos  = 0;
+// Arena allocation
+// Allocations are aligned for any type
+#define ARENA_ALIGN (sizeof(void*) * 2)
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_DATA(chunk) ((char*) (chunk) + ARENA_ROUND(sizeof(arena_chunk_t)))
 
-  while (text[in_pos] && out_pos < output_size - 1) {
-    bool found = false;
+static arena_chunk_t* arena_new_chunk(arena_t* arena, size_t size) {
+  arena_chunk_t* chunk = heap_alloc(arena->allocator, ARENA_ROUND(sizeof(arena_chunk_t)) + size);
+  if (!chunk)
+    return NULL;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
 
-    for (int i = 0; html_entities[i].ch; i++) {
-      if (text[in_pos] == html_entities[i].ch) {
-        size_t entity_len = strlen(html_entities[i].entity);
-        if (out_pos + entity_len >= output_size - 1) {
-          return MARKER_ERROR_BUFFER_TOO_SMALL;
-        }
-        strcpy(output + out_pos, html_entities[i].entity);
-        out_pos += entity_len;
-        found = true;
-        break;
-      }
+static void* arena_alloc(arena_t* arena, size_t size) {
+  size                 = ARENA_ROUND(size);
+  arena_chunk_t* chunk = arena->current;
+  while (!chunk || chunk->size - chunk->used < size) {
+    // Spare chunks from an earlier rewind come first
+    if (chunk && chunk->next) {
+      chunk       = chunk->next;
+      chunk->used = 0;
+      continue;
     }
 
-    if (!found) {
-      output[out_pos++] = text[in_pos];
-    }
-    in_pos++;
+    // Chunks double up to a limit, so a large arena is still a handful of them,
+    // and a larger request gets a chunk of its own size
+    size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK_SIZE;
+    if (chunk_size > ARENA_MAX_CHUNK_SIZE)
+      chunk_size = ARENA_MAX_CHUNK_SIZE;
+    if (chunk_size < size)
+      chunk_size = size;
+
+    arena_chunk_t* next = arena_new_chunk(arena, chunk_size);
+    if (!next)
+      return NULL;
+    if (chunk)
+      chunk->next = next;
+    else
+      arena->first = next;
+    chunk = next;
   }
 
-  output[out_pos] = '\0';
-  return text[in_pos] ? MARKER_ERROR_BUFFER_TOO_SMALL : MARKER_OK;
+  arena->current = chunk;
+  void* memory   = ARENA_DATA(chunk) + chunk->used;
+  chunk->used += size;
+  return memory;
 }
 
-static marker_result_t append_escaped_html(marker_buffer_t* buffer, const char* text, size_t len) {
-  if (!buffer || !text)
-    return MARKER_ERROR_NULL_POINTER;
-
-  for (size_t i = 0; i < len; i++) {
-    bool found = false;
-    for (int j = 0; html_entities[j].ch; j++) {
-      if (text[i] == html_entities[j].ch) {
-        marker_result_t result = buffer_append_str(buffer, html_entities[j].entity);
-        if (result != MARKER_OK)
-          return result;
-        found = true;
-        break;
-      }
-    }
-    if (!found) {
-      marker_result_t result = buffer_append_char(buffer, text[i]);
-      if (result != MARKER_OK)
-        return result;
-    }
+static char* arena_strndup(arena_t* arena, const char* str, size_t length) {
+  char* copy = arena_alloc(arena, length + 1);
+  if (copy) {
+    memcpy(copy, str, length);
+    copy[length] = '\0';
   }
-  return MARKER_OK;
+  return copy;
 }
 
-// Utility functions
-static bool is_whitespace(char ch) { return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'; }
+// Make room for one more item, doubling the array. The newest allocation grows
+// in place when its chunk has room, otherwise the items move.
+static void* arena_grow(arena_t* arena, void* items, size_t* capacity, size_t item_size) {
+  size_t old_size = ARENA_ROUND(*capacity * item_size);
+  size_t new_size = *capacity ? *capacity * 2 * item_size : 16 * item_size;
+
+  arena_chunk_t* chunk = arena->current;
+  if (items && chunk && (char*) items + old_size == ARENA_DATA(chunk) + chunk->used &&
+      chunk->used - old_size + ARENA_ROUND(new_size) <= chunk->size) {
+    chunk->used += ARENA_ROUND(new_size) - old_size;
+    *capacity = new_size / item_size;
+    return items;
+  }
 
-static bool is_punctuation(char ch) { return ispunct((unsigned char) ch); }
+  void* new_items = arena_alloc(arena, new_size);
+  if (!new_items)
+    return NULL;
+  if (items)
+    memcpy(new_items, items, *capacity * item_size);
+  *capacity = new_size / item_size;
+  return new_items;
+}
 
-static void trim_whitespace(char* str) {
-  if (!str)
-    return;
+static arena_mark_t arena_mark(const arena_t* arena) {
+  arena_mark_t mark = {arena->current, arena->current ? arena->current->used : 0};
+  return mark;
+}
 
-  // Trim leading whitespace
-  char* start = str;
-  while (is_whitespace(*start))
-    start++;
+// Give back everything allocated since the mark
+static void arena_rewind(arena_t* arena, arena_mark_t mark) {
+  if (mark.chunk) {
+    arena->current       = mark.chunk;
+    arena->current->used = mark.used;
+  } else if (arena->first) {
+    arena->current       = arena->first;
+    arena->current->used = 0;
+  }
+}
 
-  if (start != str) {
-    memmove(str, start, strlen(start) + 1);
+static void arena_release(arena_t* arena) {
+  arena_chunk_t* chunk = arena->first;
+  while (chunk) {
+    arena_chunk_t* next = chunk->next;
+    heap_free(arena->allocator, chunk, ARENA_ROUND(sizeof(arena_chunk_t)) + chunk->size);
+    chunk = next;
   }
+  arena->first   = NULL;
+  arena->current = NULL;
+}
 
-  // Trim trailing whitespace
-  size_t len = strlen(str);
-  while (len > 0 && is_whitespace(str[len - 1])) {
-    str[--len] = '\0';
+// Empty the arena for the next parse. A parse that needed several chunks leaves
+// one chunk as large as all of them, so the same document fits without growing.
+static void arena_reset(arena_t* arena) {
+  if (arena->first && arena->first->next) {
+    size_t total = 0;
+    for (arena_chunk_t* chunk = arena->first; chunk; chunk = chunk->next)
+      total += chunk->size;
+    arena_release(arena);
+    arena->first = arena_new_chunk(arena, total);
   }
+  arena->current = arena->first;
+  if (arena->current)
+    arena->current->used = 0;
 }
 
-static bool starts_with(const char* str, const char* prefix) {
-  if (!str || !prefix)
-    return false;
-  return strncmp(str, prefix, strlen(prefix)) == 0;
+// The allocator of a parser, which counts each block it hands out
+static void memory_add(memory_t* memory, size_t old_size, size_t size) {
+  memory->allocations++;
+  memory->bytes += size - old_size;
+  if (size > old_size)
+    memory->parse_bytes += size - old_size;
+  if (memory->bytes > memory->peak)
+    memory->peak = memory->bytes;
 }
 
-// Inline parsing functions
-static size_t find_emphasis_end(const char* text, size_t start, char marker, int count) {
-  size_t pos = start + count;
+static void* memory_allocate(size_t size, void* user_data) {
+  memory_t* memory = user_data;
+  void*     block  = memory->heap.allocate(size, memory->heap.user_data);
+  if (block)
+    memory_add(memory, 0, size);
+  return block;
+}
 
-  while (text[pos]) {
-    if (text[pos] == marker) {
-      int    found_count = 0;
-      size_t check_pos   = pos;
+static void* memory_reallocate(void* block, size_t old_size, size_t size, void* user_data) {
+  memory_t* memory    = user_data;
+  void*     new_block = memory->heap.reallocate(block, old_size, size, memory->heap.user_data);
+  if (new_block)
+    memory_add(memory, old_size, size);
+  return new_block;
+}
 
-      while (text[check_pos] == marker && found_count < count) {
-        found_count++;
-        check_pos++;
-      }
+static void memory_deallocate(void* block, size_t size, void* user_data) {
+  memory_t* memory = user_data;
+  memory->heap.deallocate(block, size, memory->heap.user_data);
+  memory->bytes -= size;
+}
 
-      if (found_count == count) {
-        // Check that it's not just whitespace before
-        if (pos > start + count) {
-          char prev = text[pos - 1];
-          if (!is_whitespace(prev)) {
-            return pos;
-          }
-        }
-      }
-    }
-    pos++;
+// Start the counts of a parse, on the workers too, and empty the scratch arena
+// for it
+static void begin_parse(marker_parser_t* parser) {
+  memory_t* memory    = &parser->memory;
+  memory->peak        = memory->bytes;
+  memory->parse_start = memory->allocations;
+  memory->parse_bytes = 0;
+  for (size_t i = 0; i < parser->worker_count; i++) {
+    memory_t* worker    = &parser->workers[i].parser->memory;
+    worker->peak        = worker->bytes;
+    worker->parse_start = worker->allocations;
+    worker->parse_bytes = 0;
   }
+  parser->inline_depth = 0;
+  parser->work         = 0;
+  parser->output_size  = 0;
+  arena_reset(&parser->scratch);
+}
 
-  return SIZE_MAX;  // Not found
+// Double a token array of the parser. Token arrays keep their size between
+// spans, and growing with realloc neither copies nor wastes the old block the way
+// moving it within the scratch arena would.
+static void* parser_grow(marker_parser_t* parser, void* items, size_t* capacity,
+                         size_t item_size) {
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  void*  new_items =
+      heap_realloc(&parser->allocator, items, *capacity * item_size, new_capacity * item_size);
+  if (!new_items)
+    return NULL;
+  *capacity = new_capacity;
+  return new_items;
 }
 
-static marker_result_t parse_link(marker_parser_t* parser, const char* text, size_t* pos,
-                                  marker_buffer_t* output) {
-  size_t start = *pos;
+// Parser management
+marker_parser_t* marker_parser_new(const marker_config_t* config) {
+  const marker_allocator_t* heap =
+      config && config->allocator ? config->allocator : &libc_allocator;
+  if (!heap->allocate || !heap->reallocate || !heap->deallocate)
+    return NULL;
 
-  if (text[start] != '[')
-    return MARKER_ERROR_INVALID_INPUT;
+  marker_parser_t* parser = heap->allocate(sizeof(marker_parser_t), heap->user_data);
+  if (!parser)
+    return NULL;
 
-  // Find the closing bracket for link text
-  size_t text_start    = start + 1;
-  size_t text_end      = text_start;
-  int    bracket_count = 0;
+  // The parser itself is counted as its first block
+  memory_t memory = {*heap, 1, sizeof(marker_parser_t), sizeof(marker_parser_t), 0, 0};
+  marker_allocator_t allocator = {memory_allocate, memory_reallocate, memory_deallocate,
+                                  &parser->memory};
+  parser->memory    = memory;
+  parser->allocator = allocator;
 
-  while (text[text_end]) {
-    if (text[text_end] == '[') {
-      bracket_count++;
-    } else if (text[text_end] == ']') {
-      if (bracket_count == 0)
-        break;
-      bracket_count--;
-    }
-    text_end++;
+  if (config) {
+    parser->config = *config;
+  } else {
+    marker_config_init(&parser->config);
   }
 
-  if (text[text_end] != ']')
-    return MARKER_ERROR_INVALID_INPUT;
+  parser->ref_links      = NULL;
+  parser->ref_slots      = NULL;
+  parser->ref_slot_count = 0;
+  parser->ref_count      = 0;
+  parser->nesting_depth  = 0;
+  parser->inline_depth   = 0;
+  parser->work           = 0;
+  parser->output_size    = 0;
+  parser->in_code_block  = false;
+  parser->in_html_block  = false;
+
+  arena_t empty     = {NULL, NULL, &parser->allocator};
+  parser->ref_arena = empty;
+  parser->scratch   = empty;
+  memset(&parser->tokens, 0, sizeof(parser->tokens));
+  parser->frames         = NULL;
+  parser->frame_count    = 0;
+  parser->frame_capacity = 0;
+  memset(&parser->stream_blocks, 0, sizeof(parser->stream_blocks));
+  parser->stream_output           = NULL;
+  parser->stream_pending          = NULL;
+  parser->stream_pending_size     = 0;
+  parser->stream_pending_capacity = 0;
+  parser->sink_output             = NULL;
+  parser->scatter                 = NULL;
+  parser->document                = NULL;
+  parser->workers                 = NULL;
+  parser->worker_count            = 0;
+  parser->parallel_refs           = NULL;
+  parser->parallel_ref_capacity   = 0;
+
+  build_inline_triggers(parser);
+  select_inline_variant(parser);
+  return parser;
+}
 
-  // Check for immediate URL in parentheses
-  if (text[text_end + 1] == '(') {
-    size_t url_start = text_end + 2;
-    size_t url_end   = url_start;
+void marker_parser_free(marker_parser_t* parser) {
+  if (!parser)
+    return;
 
-    // Find closing parenthesis
-    while (text[url_end] && text[url_end] != ')') {
-      url_end++;
-    }
+  marker_clear_reference_links(parser);
+  arena_release(&parser->scratch);
+
+  const marker_allocator_t* allocator = &parser->allocator;
+  inline_tokens_t*          tokens    = &parser->tokens;
+  heap_free(allocator, tokens->delims, tokens->delim_capacity * sizeof(inline_delim_t));
+  heap_free(allocator, tokens->brackets, tokens->bracket_capacity * sizeof(inline_bracket_t));
+  heap_free(allocator, tokens->parens, tokens->paren_capacity * sizeof(size_t));
+  heap_free(allocator, parser->frames, parser->frame_capacity * sizeof(inline_frame_t));
+  heap_free(allocator, parser->stream_pending, parser->stream_pending_capacity);
+  marker_buffer_free(parser->sink_output);
+  for (size_t i = 0; i < parser->worker_count; i++) {
+    // A worker's buffer comes from the worker's allocator
+    marker_buffer_free(parser->workers[i].output);
+    marker_parser_free(parser->workers[i].parser);
+  }
+  heap_free(allocator, parser->workers, parser->worker_count * sizeof(parallel_worker_t));
+  heap_free(allocator, parser->parallel_refs,
+            parser->parallel_ref_capacity * sizeof(parallel_ref_t));
 
-    if (text[url_end] != ')')
-      return MARKER_ERROR_INVALID_INPUT;
+  marker_allocator_t heap = parser->memory.heap;
+  heap.deallocate(parser, sizeof(marker_parser_t), heap.user_data);
+}
 
-    // Extract URL and optional title
-    char url[MAX_LINK_LENGTH];
-    char title[MAX_LINK_LENGTH] = {0};
+void marker_parser_stats(const marker_parser_t* parser, marker_stats_t* stats) {
+  if (!parser || !stats)
+    return;
 
-    size_t url_len = url_end - url_start;
-    if (url_len >= MAX_LINK_LENGTH)
-      return MARKER_ERROR_INVALID_INPUT;
+  const memory_t* memory  = &parser->memory;
+  stats->heap_allocations = memory->allocations;
+  stats->scratch_size     = 0;
+  for (arena_chunk_t* chunk = parser->scratch.first; chunk; chunk = chunk->next)
+    stats->scratch_size += chunk->size;
+  stats->reference_count   = parser->ref_count;
+  stats->heap_bytes        = memory->bytes;
+  stats->parse_allocations = memory->allocations - memory->parse_start;
+  stats->parse_bytes       = memory->parse_bytes;
+  stats->peak_heap_bytes   = memory->peak;
+
+  // Worker parsers and their buffers count as the parser's own. Their peaks are
+  // added, as the workers run at the same time.
+  for (size_t i = 0; i < parser->worker_count; i++) {
+    marker_stats_t worker;
+    marker_parser_stats(parser->workers[i].parser, &worker);
+    stats->heap_allocations += worker.heap_allocations;
+    stats->scratch_size += worker.scratch_size;
+    stats->heap_bytes += worker.heap_bytes;
+    stats->parse_allocations += worker.parse_allocations;
+    stats->parse_bytes += worker.parse_bytes;
+    stats->peak_heap_bytes += worker.peak_heap_bytes;
+  }
+}
 
-    memcpy(url, text + url_start, url_len);
-    url[url_len] = '\0';
-    trim_whitespace(url);
+// Reference link management
 
-    // Check for title in quotes
-    char* title_start = strchr(url, '"');
-    if (title_start) {
-      *title_start = '\0';
-      title_start++;
-      char* title_end = strrchr(title_start, '"');
-      if (title_end) {
-        *title_end = '\0';
-        strcpy(title, title_start);
-      }
-      trim_whitespace(url);
+// Normalise a label as CommonMark matches them: surrounding whitespace dropped,
+// inner runs of whitespace collapsed to one space, and case folded. Writes the
+// key to out, which has room for length + 1 bytes, and returns its FNV-1a hash.
+static uint32_t normalize_label(const char* label, size_t length, char* out, size_t* out_length) {
+  uint32_t hash  = 2166136261u;
+  size_t   at    = 0;
+  bool     space = false;
+
+  for (size_t i = 0; i < length; i++) {
+    char ch = label[i];
+    if (is_whitespace(ch)) {
+      space = at > 0;
+      continue;
     }
-
-    // Generate HTML
-    marker_result_t result = buffer_append_str(output, "<a href=\"");
-    if (result != MARKER_OK)
-      return result;
-
-    if (parser->config.escape_html) {
-      result = append_escaped_html(output, url, strlen(url));
-    } else {
-      result = buffer_append_str(output, url);
+    if (space) {
+      out[at++] = ' ';
+      hash      = (hash ^ ' ') * 16777619u;
+      space     = false;
     }
-    if (result != MARKER_OK)
-      return result;
+    ch        = (char) tolower((unsigned char) ch);
+    out[at++] = ch;
+    hash      = (hash ^ (unsigned char) ch) * 16777619u;
+  }
 
-    result = buffer_append_str(output, "\"");
-    if (result != MARKER_OK)
-      return result;
+  out[at]     = '\0';
+  *out_length = at;
+  return hash;
+}
 
-    if (title[0]) {
-      result = buffer_append_str(output, " title=\"");
-      if (result != MARKER_OK)
-        return result;
+// Slot of the key, or of the empty slot where it would go
+static size_t find_ref_slot(const marker_parser_t* parser, const char* key, uint32_t hash) {
+  size_t mask = parser->ref_slot_count - 1;
+  size_t slot = hash & mask;
+  while (parser->ref_slots[slot]) {
+    const ref_entry_t* entry = parser->ref_slots[slot];
+    if (entry->hash == hash && strcmp(entry->key, key) == 0)
+      break;
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
 
-      if (parser->config.escape_html) {
-        result = append_escaped_html(output, title, strlen(title));
-      } else {
-        result = buffer_append_str(output, title);
-      }
-      if (result != MARKER_OK)
-        return result;
+// Double the table once it is three quarters full
+static marker_result_t grow_ref_slots(marker_parser_t* parser) {
+  if ((parser->ref_count + 1) * 4 <= parser->ref_slot_count * 3)
+    return MARKER_OK;
 
-      result = buffer_append_str(output, "\"");
-      if (result != MARKER_OK)
-        return result;
-    }
+  size_t        slot_count = parser->ref_slot_count ? parser->ref_slot_count * 2 : REF_MIN_SLOTS;
+  ref_entry_t** old_slots  = parser->ref_slots;
+  size_t        old_count  = parser->ref_slot_count;
+  ref_entry_t** slots      = heap_alloc(&parser->allocator, slot_count * sizeof(ref_entry_t*));
+  if (!slots)
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+  memset(slots, 0, slot_count * sizeof(ref_entry_t*));
 
-    result = buffer_append_str(output, ">");
-    if (result != MARKER_OK)
-      return result;
+  parser->ref_slots      = slots;
+  parser->ref_slot_count = slot_count;
+  for (size_t i = 0; i < old_count; i++) {
+    if (old_slots[i])
+      slots[find_ref_slot(parser, old_slots[i]->key, old_slots[i]->hash)] = old_slots[i];
+  }
+  heap_free(&parser->allocator, old_slots, old_count * sizeof(ref_entry_t*));
+  return MARKER_OK;
+}
 
-    // Parse inline content of link text
-    size_t link_text_len = text_end - text_start;
-    char*  link_text     = malloc(link_text_len + 1);
-    if (!link_text)
-      return MARKER_ERROR_MEMORY_ALLOCATION;
+// Whether str is exactly text[0, length)
+static bool equals_text(const char* str, const char* text, size_t length) {
+  return strlen(str) == length && memcmp(str, text, length) == 0;
+}
 
-    memcpy(link_text, text + text_start, link_text_len);
-    link_text[link_text_len] = '\0';
+// Add a definition given as counted strings, which need not be NUL-terminated.
+// The title is NULL when there is none.
+static marker_result_t add_reference_link(marker_parser_t* parser, const char* label,
+                                          size_t label_len, const char* url, size_t url_len,
+                                          const char* title, size_t title_len) {
+  marker_result_t result = grow_ref_slots(parser);
+  if (result != MARKER_OK)
+    return result;
 
-    size_t link_pos = 0;
-    result          = parse_inline_content(parser, link_text, &link_pos, output, link_text_len);
-    free(link_text);
-    if (result != MARKER_OK)
-      return result;
+  // The key is worked out in scratch memory, a repeated definition keeps nothing
+  arena_mark_t mark = arena_mark(&parser->scratch);
+  char*        key  = arena_alloc(&parser->scratch, label_len + 1);
+  if (!key)
+    return MARKER_ERROR_MEMORY_ALLOCATION;
 
-    result = buffer_append_str(output, "</a>");
-    if (result != MARKER_OK)
-      return result;
+  size_t   key_len;
+  uint32_t hash = normalize_label(label, label_len, key, &key_len);
+  size_t   slot = find_ref_slot(parser, key, hash);
 
-    *pos = url_end + 1;
+  // Parsing the same document again finds every definition already there
+  const ref_entry_t* existing = parser->ref_slots[slot];
+  if (existing && equals_text(existing->link.url, url, url_len) &&
+      (existing->link.title && title ? equals_text(existing->link.title, title, title_len)
+                                     : existing->link.title == title)) {
+    arena_rewind(&parser->scratch, mark);
     return MARKER_OK;
   }
 
-  // Check for reference link
-  size_t ref_start = text_end + 1;
-  if (text[ref_start] == '[') {
-    size_t ref_end = ref_start + 1;
-    while (text[ref_end] && text[ref_end] != ']') {
-      ref_end++;
-    }
-
-    if (text[ref_end] == ']') {
-      char   ref_label[MAX_LINK_LENGTH];
-      size_t ref_len = ref_end - ref_start - 1;
-
-      if (ref_len == 0) {
-        // Empty reference - use link text as reference
-        ref_len = text_end - text_start;
-        if (ref_len >= MAX_LINK_LENGTH)
-          return MARKER_ERROR_INVALID_INPUT;
-        memcpy(ref_label, text + text_start, ref_len);
-      } else {
-        if (ref_len >= MAX_LINK_LENGTH)
-          return MARKER_ERROR_INVALID_INPUT;
-        memcpy(ref_label, text + ref_start + 1, ref_len);
-      }
+  ref_entry_t* entry = arena_alloc(&parser->ref_arena, sizeof(ref_entry_t));
+  if (!entry) {
+    arena_rewind(&parser->scratch, mark);
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+  }
+  entry->hash       = hash;
+  entry->key        = arena_strndup(&parser->ref_arena, key, key_len);
+  entry->link.label = arena_strndup(&parser->ref_arena, label, label_len);
+  entry->link.url   = arena_strndup(&parser->ref_arena, url, url_len);
+  entry->link.title = title ? arena_strndup(&parser->ref_arena, title, title_len) : NULL;
+  arena_rewind(&parser->scratch, mark);
+  if (!entry->key || !entry->link.label || !entry->link.url || (title && !entry->link.title))
+    return MARKER_ERROR_MEMORY_ALLOCATION;
 
-      ref_label[ref_len] = '\0';
-      trim_whitespace(ref_label);
+  // A later definition of the same label replaces the earlier one
+  if (!existing)
+    parser->ref_count++;
+  parser->ref_slots[slot] = entry;
 
-      marker_ref_link_t* ref = find_reference_link(parser, ref_label);
-      if (ref) {
-        // Generate HTML for reference link
-        marker_result_t result = buffer_append_str(output, "<a href=\"");
-        if (result != MARKER_OK)
-          return result;
+  entry->link.next  = parser->ref_links;
+  parser->ref_links = &entry->link;
 
-        if (parser->config.escape_html) {
-          result = append_escaped_html(output, ref->url, strlen(ref->url));
-        } else {
-          result = buffer_append_str(output, ref->url);
-        }
-        if (result != MARKER_OK)
-          return result;
+  return MARKER_OK;
+}
 
-        result = buffer_append_str(output, "\"");
-        if (result != MARKER_OK)
-          return result;
+marker_result_t marker_add_reference_link(marker_parser_t* parser, const char* label,
+                                          const char* url, const char* title) {
+  if (!parser || !label || !url)
+    return MARKER_ERROR_NULL_POINTER;
 
-        if (ref->title) {
-          result = buffer_append_str(output, " title=\"");
-          if (result != MARKER_OK)
-            return result;
+  return add_reference_link(parser, label, strlen(label), url, strlen(url), title,
+                            title ? strlen(title) : 0);
+}
 
-          if (parser->config.escape_html) {
-            result = append_escaped_html(output, ref->title, strlen(ref->title));
-          } else {
-            result = buffer_append_str(output, ref->title);
-          }
-          if (result != MARKER_OK)
-            return result;
+void marker_clear_reference_links(marker_parser_t* parser) {
+  if (!parser)
+    return;
 
-          result = buffer_append_str(output, "\"");
-          if (result != MARKER_OK)
-            return result;
-        }
+  arena_release(&parser->ref_arena);
+  heap_free(&parser->allocator, parser->ref_slots, parser->ref_slot_count * sizeof(ref_entry_t*));
+  parser->ref_links      = NULL;
+  parser->ref_slots      = NULL;
+  parser->ref_slot_count = 0;
+  parser->ref_count      = 0;
+}
 
-        result = buffer_append_str(output, ">");
-        if (result != MARKER_OK)
-          return result;
+// Forget every definition but keep the memory for the next ones
+static void reset_reference_links(marker_parser_t* parser) {
+  arena_reset(&parser->ref_arena);
+  if (parser->ref_slots)
+    memset(parser->ref_slots, 0, parser->ref_slot_count * sizeof(ref_entry_t*));
+  parser->ref_links = NULL;
+  parser->ref_count = 0;
+}
 
-        // Parse link text
-        size_t link_text_len = text_end - text_start;
-        char*  link_text     = malloc(link_text_len + 1);
-        if (!link_text)
-          return MARKER_ERROR_MEMORY_ALLOCATION;
+void marker_parser_reset(marker_parser_t* parser) {
+  if (!parser)
+    return;
 
-        memcpy(link_text, text + text_start, link_text_len);
-        link_text[link_text_len] = '\0';
+  reset_reference_links(parser);
+  arena_reset(&parser->scratch);
+  memset(&parser->stream_blocks, 0, sizeof(parser->stream_blocks));
+  parser->stream_output       = NULL;
+  parser->stream_pending_size = 0;
+  parser->nesting_depth       = 0;
+  parser->in_code_block       = false;
+  parser->in_html_block       = false;
+}
 
-        size_t link_pos = 0;
-        result          = parse_inline_content(parser, link_text, &link_pos, output, link_text_len);
-        free(link_text);
-        if (result != MARKER_OK)
-          return result;
+// Find the definition of the label in text[start, end)
+static const marker_ref_link_t* find_reference_link(marker_parser_t* parser, const char* text,
+                                                    size_t start, size_t end) {
+  size_t length = end - start;
+  if (parser->ref_count == 0 || length >= MAX_LINK_LENGTH)
+    return NULL;
 
-        result = buffer_append_str(output, "</a>");
-        if (result != MARKER_OK)
-          return result;
+  // The key is worked out in scratch memory rather than on the stack
+  arena_mark_t mark = arena_mark(&parser->scratch);
+  char*        key  = arena_alloc(&parser->scratch, length + 1);
+  if (!key)
+    return NULL;
 
-        *pos = ref_end + 1;
-        return MARKER_OK;
-      }
-    }
-  }
+  size_t   key_len;
+  uint32_t hash = normalize_label(text + start, length, key, &key_len);
+  size_t   slot = find_ref_slot(parser, key, hash);
+  arena_rewind(&parser->scratch, mark);
+  return parser->ref_slots[slot] ? &parser->ref_slots[slot]->link : NULL;
+}
 
-  // Check for shortcut reference link [link text]
-  char   ref_label[MAX_LINK_LENGTH];
-  size_t link_text_len = text_end - text_start;
-  if (link_text_len < MAX_LINK_LENGTH) {
-    memcpy(ref_label, text + text_start, link_text_len);
-    ref_label[link_text_len] = '\0';
-    trim_whitespace(ref_label);
+// SIMD support, chosen on first use. The first scans may run on several threads
+// at once, so the level is loaded and stored atomically, and threads racing
+// here all store the same one. Scans switch on it rather than call through a
+// function pointer, an indirect call per run costs more than the scan itself
+// on short runs.
+typedef enum {
+  SIMD_UNKNOWN,
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_SSSE3,
+  SIMD_AVX2
+} simd_level_t;
+
+#ifdef MARKER_HAVE_X86_SIMD
+static simd_level_t simd_level = SIMD_UNKNOWN;
+
+static simd_level_t simd_detect(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  if (__builtin_cpu_supports("ssse3"))
+    return SIMD_SSSE3;
+  if (__builtin_cpu_supports("sse2"))
+    return SIMD_SSE2;
+  return SIMD_SCALAR;
+}
 
-    marker_ref_link_t* ref = find_reference_link(parser, ref_label);
-    if (ref) {
-      // Generate HTML for shortcut reference link
-      marker_result_t result = buffer_append_str(output, "<a href=\"");
-      if (result != MARKER_OK)
-        return result;
+static simd_level_t get_simd_level(void) {
+  simd_level_t level = __atomic_load_n(&simd_level, __ATOMIC_RELAXED);
+  if (level == SIMD_UNKNOWN) {
+    level = simd_detect();
+    __atomic_store_n(&simd_level, level, __ATOMIC_RELAXED);
+  }
+  return level;
+}
+#else
+static simd_level_t get_simd_level(void) {
+  return SIMD_SCALAR;
+}
+#endif
 
-      if (parser->config.escape_html) {
-        result = append_escaped_html(output, ref->url, strlen(ref->url));
-      } else {
-        result = buffer_append_str(output, ref->url);
-      }
-      if (result != MARKER_OK)
-        return result;
+// HTML escaping. The scans return the length of the run before the first byte
+// that needs an entity, or len when there is none.
+static size_t escape_scan_scalar(const char* text, size_t len) {
+  size_t i = 0;
+  while (i < len && !html_entity_lengths[(unsigned char) text[i]])
+    i++;
+  return i;
+}
 
-      result = buffer_append_str(output, "\"");
-      if (result != MARKER_OK)
-        return result;
+#ifdef MARKER_HAVE_X86_SIMD
+// '<' and '>' differ in one bit, as do '&' and '\'', so three compares find all
+// five bytes
+__attribute__((target("sse2"))) static size_t escape_scan_sse2(const char* text, size_t len) {
+  const __m128i one   = _mm_set1_epi8(1);
+  const __m128i two   = _mm_set1_epi8(2);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i apos  = _mm_set1_epi8('\'');
+  const __m128i angle = _mm_set1_epi8('>');
 
-      if (ref->title) {
-        result = buffer_append_str(output, " title=\"");
-        if (result != MARKER_OK)
-          return result;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (text + i));
+    __m128i found = _mm_or_si128(
+        _mm_cmpeq_epi8(chunk, quote),
+        _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(chunk, one), apos),
+                     _mm_cmpeq_epi8(_mm_or_si128(chunk, two), angle)));
+    int mask = _mm_movemask_epi8(found);
+    if (mask)
+      return i + (size_t) __builtin_ctz((unsigned) mask);
+  }
+  return i + escape_scan_scalar(text + i, len - i);
+}
 
-        if (parser->config.escape_html) {
-          result = append_escaped_html(output, ref->title, strlen(ref->title));
-        } else {
-          result = buffer_append_str(output, ref->title);
-        }
-        if (result != MARKER_OK)
-          return result;
+__attribute__((target("avx2"))) static size_t escape_scan_avx2(const char* text, size_t len) {
+  const __m256i one   = _mm256_set1_epi8(1);
+  const __m256i two   = _mm256_set1_epi8(2);
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i apos  = _mm256_set1_epi8('\'');
+  const __m256i angle = _mm256_set1_epi8('>');
 
-        result = buffer_append_str(output, "\"");
-        if (result != MARKER_OK)
-          return result;
-      }
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) (text + i));
+    __m256i found = _mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, quote),
+        _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_or_si256(chunk, one), apos),
+                        _mm256_cmpeq_epi8(_mm256_or_si256(chunk, two), angle)));
+    unsigned mask = (unsigned) _mm256_movemask_epi8(found);
+    if (mask)
+      return i + (size_t) __builtin_ctz(mask);
+  }
+  return i + escape_scan_sse2(text + i, len - i);
+}
+#endif
 
-      result = buffer_append_str(output, ">");
-      if (result != MARKER_OK)
-        return result;
+static size_t escape_scan(const char* text, size_t len) {
+  // Dense text has short runs, look at a few bytes before going wide
+  size_t probe = len < 8 ? len : 8;
+  for (size_t i = 0; i < probe; i++) {
+    if (html_entity_lengths[(unsigned char) text[i]])
+      return i;
+  }
+  if (probe == len)
+    return len;
+
+  switch (get_simd_level()) {
+#ifdef MARKER_HAVE_X86_SIMD
+    case SIMD_AVX2:
+      return probe + escape_scan_avx2(text + probe, len - probe);
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+      return probe + escape_scan_sse2(text + probe, len - probe);
+#endif
+    default:
+      return probe + escape_scan_scalar(text + probe, len - probe);
+  }
+}
 
-      // Parse link text
-      char* link_text = malloc(link_text_len + 1);
-      if (!link_text)
-        return MARKER_ERROR_MEMORY_ALLOCATION;
+// Bytes escaped without scanning after an entity. Specials tend to cluster, and
+// the byte loop below beats a scan on short runs.
+#define ESCAPE_DENSE_STRETCH 16
 
-      memcpy(link_text, text + text_start, link_text_len);
-      link_text[link_text_len] = '\0';
+// Escape one byte at a time without branching on the byte. Every byte stores a
+// full padded entity, so output needs eight bytes of room per input byte.
+static size_t escape_dense(const char* text, size_t len, char* output) {
+  char* out = output;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char ch         = (unsigned char) text[i];
+    size_t        entity_len = html_entity_lengths[ch];
+    memcpy(out, html_entities[ch], sizeof(html_entities[ch]));
+    out[0] = entity_len ? out[0] : (char) ch;
+    out += entity_len ? entity_len : 1;
+  }
+  return (size_t) (out - output);
+}
 
-      size_t link_pos = 0;
-      result          = parse_inline_content(parser, link_text, &link_pos, output, link_text_len);
-      free(link_text);
-      if (result != MARKER_OK)
-        return result;
+marker_result_t marker_escape_html(const char* text, char* output, size_t output_size) {
+  if (!text || !output || output_size == 0)
+    return MARKER_ERROR_NULL_POINTER;
 
-      result = buffer_append_str(output, "</a>");
-      if (result != MARKER_OK)
-        return result;
+  size_t len     = strlen(text);
+  size_t in_pos  = 0;
+  size_t out_pos = 0;
 
-      *pos = text_end + 1;
-      return MARKER_OK;
+  while (in_pos < len) {
+    size_t run  = escape_scan(text + in_pos, len - in_pos);
+    size_t room = output_size - 1 - out_pos;
+    if (run > room) {
+      memcpy(output + out_pos, text + in_pos, room);
+      output[out_pos + room] = '\0';
+      return MARKER_ERROR_BUFFER_TOO_SMALL;
+    }
+    memcpy(output + out_pos, text + in_pos, run);
+    out_pos += run;
+    in_pos += run;
+    if (in_pos == len)
+      break;
+
+    size_t stretch = len - in_pos < ESCAPE_DENSE_STRETCH ? len - in_pos : ESCAPE_DENSE_STRETCH;
+    if (output_size - 1 - out_pos >= stretch * sizeof(html_entities[0])) {
+      out_pos += escape_dense(text + in_pos, stretch, output + out_pos);
+      in_pos += stretch;
+      continue;
+    }
+
+    // Close to the end of the output, one entity at a time so it is never cut
+    unsigned char ch         = (unsigned char) text[in_pos];
+    size_t        entity_len = html_entity_lengths[ch];
+    if (entity_len > output_size - 1 - out_pos) {
+      output[out_pos] = '\0';
+      return MARKER_ERROR_BUFFER_TOO_SMALL;
     }
+    memcpy(output + out_pos, html_entities[ch], entity_len);
+    out_pos += entity_len;
+    in_pos++;
   }
 
-  return MARKER_ERROR_INVALID_INPUT;
+  output[out_pos] = '\0';
+  return MARKER_OK;
 }
 
-static marker_result_t parse_image(marker_parser_t* parser, const char* text, size_t* pos,
-                                   marker_buffer_t* output) {
-  size_t start = *pos;
-
-  if (text[start] != '!' || text[start + 1] != '[')
-    return MARKER_ERROR_INVALID_INPUT;
+static marker_result_t append_escaped_html(marker_buffer_t* buffer, const char* text, size_t len) {
+  if (!buffer || !text)
+    return MARKER_ERROR_NULL_POINTER;
 
-  // Find the closing bracket for alt text
-  size_t alt_start = start + 2;
-  size_t alt_end   = alt_start;
+  // Clean runs go in with one copy, the stretch after an entity byte by byte
+  size_t i = 0;
+  while (i < len) {
+    size_t          run    = escape_scan(text + i, len - i);
+    marker_result_t result = buffer_append(buffer, text + i, run);
+    if (result != MARKER_OK)
+      return result;
+    i += run;
+    if (i == len)
+      break;
 
-  while (text[alt_end] && text[alt_end] != ']') {
-    alt_end++;
+    size_t stretch = len - i < ESCAPE_DENSE_STRETCH ? len - i : ESCAPE_DENSE_STRETCH;
+    result = buffer_ensure_capacity(buffer, buffer->size + stretch * sizeof(html_entities[0]) + 1);
+    if (result != MARKER_OK)
+      return result;
+    buffer->size += escape_dense(text + i, stretch, buffer->data + buffer->size);
+    buffer->data[buffer->size] = '\0';
+    i += stretch;
   }
+  return MARKER_OK;
+}
 
-  if (text[alt_end] != ']')
-    return MARKER_ERROR_INVALID_INPUT;
-
-  // Check for immediate URL in parentheses
-  if (text[alt_end + 1] == '(') {
-    size_t url_start = alt_end + 2;
-    size_t url_end   = url_start;
+// Scatter-gather output. Tags, entities and short runs of text are written to
+// output as usual, and each stretch of it becomes a piece once a reference to
+// the input follows. Their bases are filled in when the render is done and the
+// buffer no longer moves.
+struct marker_scatter {
+  marker_buffer_t* output;
+  marker_iovec_t*  pieces;  // Pieces of output have a NULL base until the render ends
+  size_t           piece_count;
+  size_t           piece_capacity;
+  size_t           output_mark;  // Output already covered by a piece
+  size_t           source_size;  // Bytes of pieces that point into the input
+  size_t           size;
+};
 
-    while (text[url_end] && text[url_end] != ')') {
-      url_end++;
-    }
+// marker_iovec_t is documented to be usable as a struct iovec
+typedef char iovec_layout_check[sizeof(marker_iovec_t) == sizeof(struct iovec) &&
+                                        offsetof(marker_iovec_t, length) ==
+                                            offsetof(struct iovec, iov_len)
+                                    ? 1
+                                    : -1];
+
+static marker_result_t scatter_push(marker_scatter_t* scatter, const void* base, size_t length) {
+  if (scatter->piece_count == scatter->piece_capacity) {
+    size_t          capacity = scatter->piece_capacity ? scatter->piece_capacity * 2 : 64;
+    marker_iovec_t* pieces   = realloc(scatter->pieces, capacity * sizeof(marker_iovec_t));
+    if (!pieces)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    scatter->pieces         = pieces;
+    scatter->piece_capacity = capacity;
+  }
 
-    if (text[url_end] != ')')
-      return MARKER_ERROR_INVALID_INPUT;
+  marker_iovec_t* piece = &scatter->pieces[scatter->piece_count++];
+  piece->base           = base;
+  piece->length         = length;
+  return MARKER_OK;
+}
 
-    // Extract URL and optional title
-    char url[MAX_LINK_LENGTH];
-    char title[MAX_LINK_LENGTH] = {0};
-    char alt[MAX_LINK_LENGTH];
+// Output written since the last piece becomes a piece of its own
+static marker_result_t scatter_cut(marker_scatter_t* scatter) {
+  size_t written = scatter->output->size - scatter->output_mark;
+  if (written == 0)
+    return MARKER_OK;
 
-    size_t url_len = url_end - url_start;
-    size_t alt_len = alt_end - alt_start;
+  scatter->output_mark = scatter->output->size;
+  return scatter_push(scatter, NULL, written);
+}
 
-    if (url_len >= MAX_LINK_LENGTH || alt_len >= MAX_LINK_LENGTH) {
-      return MARKER_ERROR_INVALID_INPUT;
-    }
+// Source text that goes out unchanged. Runs that continue the previous piece
+// extend it, short ones are cheaper to copy than to point at.
+static marker_result_t scatter_source(marker_scatter_t* scatter, const char* text, size_t len) {
+  if (len == 0)
+    return MARKER_OK;
 
-    memcpy(url, text + url_start, url_len);
-    url[url_len] = '\0';
-    trim_whitespace(url);
+  marker_iovec_t* last = scatter->piece_count ? &scatter->pieces[scatter->piece_count - 1] : NULL;
+  if (scatter->output->size == scatter->output_mark && last && last->base &&
+      (const char*) last->base + last->length == text) {
+    last->length += len;
+    scatter->source_size += len;
+    return MARKER_OK;
+  }
+  if (len < SCATTER_MIN_RUN)
+    return buffer_append(scatter->output, text, len);
 
-    memcpy(alt, text + alt_start, alt_len);
-    alt[alt_len] = '\0';
+  marker_result_t result = scatter_cut(scatter);
+  if (result == MARKER_OK)
+    result = scatter_push(scatter, text, len);
+  if (result == MARKER_OK)
+    scatter->source_size += len;
+  return result;
+}
 
-    // Check for title in quotes
-    char* title_start = strchr(url, '"');
-    if (title_start) {
-      *title_start = '\0';
-      title_start++;
-      char* title_end = strrchr(title_start, '"');
-      if (title_end) {
-        *title_end = '\0';
-        strcpy(title, title_start);
-      }
-      trim_whitespace(url);
-    }
+// Text from the input, escaped if asked. In a scatter-gather render, clean runs
+// are referenced where they stand instead of being copied.
+static marker_result_t append_text(marker_scatter_t* scatter, marker_buffer_t* output,
+                                   const char* text, size_t len, bool escape) {
+  if (!scatter || scatter->output != output)
+    return escape ? append_escaped_html(output, text, len) : buffer_append(output, text, len);
 
-    // Generate HTML
-    marker_result_t result = buffer_append_str(output, "<img src=\"");
+  while (len > 0) {
+    size_t          run    = escape ? escape_scan(text, len) : len;
+    marker_result_t result = scatter_source(scatter, text, run);
     if (result != MARKER_OK)
       return result;
+    text += run;
+    len -= run;
+    if (len == 0)
+      break;
 
-    if (parser->config.escape_html) {
-      result = append_escaped_html(output, url, strlen(url));
-    } else {
-      result = buffer_append_str(output, url);
-    }
+    size_t stretch = len < ESCAPE_DENSE_STRETCH ? len : ESCAPE_DENSE_STRETCH;
+    result         = append_escaped_html(output, text, stretch);
     if (result != MARKER_OK)
       return result;
+    text += stretch;
+    len -= stretch;
+  }
+  return MARKER_OK;
+}
 
-    result = buffer_append_str(output, "\" alt=\"");
-    if (result != MARKER_OK)
-      return result;
+// Limits of a parse. Scans that can repeat over the same input, such as the
+// search for the end of a code span, charge the bytes they look at, and output
+// is counted a line at a time. Either stops the parse once the config's budget
+// is spent, as does inline content nested too deep.
+static marker_result_t charge_work(marker_parser_t* parser, size_t bytes) {
+  parser->work += bytes;
+  if (parser->config.max_work && parser->work > parser->config.max_work)
+    return MARKER_ERROR_LIMIT_EXCEEDED;
+  return MARKER_OK;
+}
 
-    if (parser->config.escape_html) {
-      result = append_escaped_html(output, alt, strlen(alt));
-    } else {
-      result = buffer_append_str(output, alt);
-    }
-    if (result != MARKER_OK)
-      return result;
+// Output so far, counting pieces of a scatter-gather render that point into the input
+static size_t output_mark(const marker_parser_t* parser, const marker_buffer_t* output) {
+  size_t size = output ? output->size : 0;
+  if (parser->scatter)
+    size += parser->scatter->source_size;
+  return size;
+}
 
-    result = buffer_append_str(output, "\"");
-    if (result != MARKER_OK)
-      return result;
+static marker_result_t charge_output(marker_parser_t* parser, const marker_buffer_t* output,
+                                     size_t mark) {
+  parser->output_size += output_mark(parser, output) - mark;
+  if (parser->config.max_output_size && parser->output_size > parser->config.max_output_size)
+    return MARKER_ERROR_LIMIT_EXCEEDED;
+  return MARKER_OK;
+}
 
-    if (title[0]) {
-      result = buffer_append_str(output, " title=\"");
-      if (result != MARKER_OK)
-        return result;
+// Open emphasis or link text around the content that follows, close it again
+// with leave_inline
+static marker_result_t enter_inline(marker_parser_t* parser) {
+  if (parser->config.max_inline_depth && parser->inline_depth >= parser->config.max_inline_depth)
+    return MARKER_ERROR_LIMIT_EXCEEDED;
+  parser->inline_depth++;
+  return MARKER_OK;
+}
+
+static void leave_inline(marker_parser_t* parser) { parser->inline_depth--; }
+
+// Nodes. The parse functions hand their output to emit_open, emit_close and
+// emit_leaf, which write HTML, or add nodes while a document is built. Either
+// way the HTML of a node comes from html_open and html_close, so rendering a
+// document gives the same HTML as parsing straight to it.
+
+// Destination of a link or image
+typedef struct {
+  const char* url;
+  const char* title;  // NULL when there is none
+  size_t      url_len;
+  size_t      title_len;
+} link_target_t;
+
+struct marker_document {
+  const char*     source;  // Input the spans point into
+  marker_config_t config;  // Of the parser, so rendering matches parsing
+  arena_t         arena;   // Nodes, link targets and strings of reference links
+  marker_node_t*  nodes;
+  size_t          node_count;
+  size_t          node_capacity;
+  link_target_t*  links;
+  size_t          link_count;
+  size_t          link_capacity;
+  uint32_t        open;     // Innermost open node while the document is built
+  uint32_t        sibling;  // Last child of the open node, 0 when it has none
+};
+
+static marker_result_t append_attribute(const marker_config_t* config, marker_buffer_t* output,
+                                        const char* name, const char* value, size_t length) {
+  marker_result_t result = buffer_append_str(output, name);
+  if (result != MARKER_OK)
+    return result;
+
+  if (config->escape_html) {
+    result = append_escaped_html(output, value, length);
+  } else {
+    result = buffer_append(output, value, length);
+  }
+  if (result != MARKER_OK)
+    return result;
+
+  return buffer_append_str(output, "\"");
+}
 
-      if (parser->config.escape_html) {
-        result = append_escaped_html(output, title, strlen(title));
-      } else {
-        result = buffer_append_str(output, title);
+// Write the start of a node, or all of a leaf but its end tag. Text is the span
+// of the node, target the destination of links and images.
+static marker_result_t html_open(const marker_config_t* config, marker_scatter_t* scatter,
+                                 marker_buffer_t* output, const marker_node_t* node,
+                                 const char* text, const link_target_t* target) {
+  marker_result_t result;
+  switch ((marker_node_type_t) node->type) {
+    case MARKER_NODE_DOCUMENT:
+      return MARKER_OK;
+    case MARKER_NODE_PARAGRAPH:
+      return buffer_append_str(output, "<p>");
+    case MARKER_NODE_HEADING: {
+      char tag[] = "<h0>";
+      tag[2]     = (char) ('0' + node->level);
+      return buffer_append(output, tag, 4);
+    }
+    case MARKER_NODE_BLOCKQUOTE:
+      return buffer_append_str(output, "<blockquote>");
+    case MARKER_NODE_LIST:
+      return buffer_append_str(output, node->flags & MARKER_NODE_ORDERED ? "<ol>\n" : "<ul>\n");
+    case MARKER_NODE_ITEM:
+      if (!(node->flags & MARKER_NODE_TASK))
+        return buffer_append_str(output, "<li>");
+      return buffer_append_str(output, node->flags & MARKER_NODE_CHECKED
+                                           ? "<li class=\"task-list-item\"><input type=\"checkbox\""
+                                             " checked disabled> "
+                                           : "<li class=\"task-list-item\"><input type=\"checkbox\""
+                                             " disabled> ");
+    case MARKER_NODE_CODE_BLOCK:
+      return buffer_append_str(output, "<pre><code>");
+    case MARKER_NODE_TABLE:
+      return buffer_append_str(output, "<table>\n");
+    case MARKER_NODE_TABLE_HEAD:
+      return buffer_append_str(output, "<thead>\n");
+    case MARKER_NODE_TABLE_BODY:
+      return buffer_append_str(output, "<tbody>\n");
+    case MARKER_NODE_TABLE_ROW:
+      return buffer_append_str(output, "<tr>");
+    case MARKER_NODE_TABLE_CELL:
+      return buffer_append_str(output, node->flags & MARKER_NODE_HEADER ? "<th>" : "<td>");
+    case MARKER_NODE_THEMATIC_BREAK:
+      return buffer_append_str(output, "<hr>\n");
+    case MARKER_NODE_BLANK_LINE:
+      return buffer_append_char(output, '\n');
+    case MARKER_NODE_TEXT:
+      if (node->flags & MARKER_NODE_LINE) {
+        result = append_text(scatter, output, text, node->length, true);
+        if (result != MARKER_OK)
+          return result;
+        return buffer_append_char(output, '\n');
       }
+      return append_text(scatter, output, text, node->length,
+                         config->escape_html && !(node->flags & MARKER_NODE_VERBATIM));
+    case MARKER_NODE_CODE:
+      result = buffer_append_str(output, "<code>");
       if (result != MARKER_OK)
         return result;
-
-      result = buffer_append_str(output, "\"");
+      return append_text(scatter, output, text, node->length, true);
+    case MARKER_NODE_EMPHASIS:
+      return buffer_append_str(output, "<em>");
+    case MARKER_NODE_STRONG:
+      return buffer_append_str(output, "<strong>");
+    case MARKER_NODE_STRIKETHROUGH:
+      return buffer_append_str(output, "<del>");
+    case MARKER_NODE_LINK:
+      result = append_attribute(config, output, "<a href=\"", target->url, target->url_len);
+      if (result == MARKER_OK && target->title)
+        result = append_attribute(config, output, " title=\"", target->title, target->title_len);
+      if (result != MARKER_OK)
+        return result;
+      return buffer_append_char(output, '>');
+    case MARKER_NODE_IMAGE:
+      result = append_attribute(config, output, "<img src=\"", target->url, target->url_len);
+      if (result == MARKER_OK)
+        result = append_attribute(config, output, " alt=\"", text, node->length);
+      if (result == MARKER_OK && target->title)
+        result = append_attribute(config, output, " title=\"", target->title, target->title_len);
+      if (result != MARKER_OK)
+        return result;
+      return buffer_append_char(output, '>');
+    case MARKER_NODE_AUTOLINK:
+      // The address is written as it is, in the link and as its text
+      result = buffer_append_str(output, node->flags & MARKER_NODE_EMAIL ? "<a href=\"mailto:"
+                                                                        : "<a href=\"");
+      if (result == MARKER_OK)
+        result = buffer_append(output, text, node->length);
+      if (result == MARKER_OK)
+        result = buffer_append_str(output, "\">");
       if (result != MARKER_OK)
         return result;
+      return buffer_append(output, text, node->length);
+    case MARKER_NODE_HTML_INLINE:
+      return buffer_append(output, text, node->length);
+    case MARKER_NODE_LINE_BREAK:
+      return config->hard_line_breaks ? buffer_append_str(output, "<br>")
+                                      : buffer_append_char(output, ' ');
+  }
+  return MARKER_OK;
+}
+
+// Write the end of a node
+static marker_result_t html_close(marker_buffer_t* output, const marker_node_t* node) {
+  switch ((marker_node_type_t) node->type) {
+    case MARKER_NODE_PARAGRAPH:
+      return buffer_append_str(output, "</p>\n");
+    case MARKER_NODE_HEADING: {
+      char tag[] = "</h0>\n";
+      tag[3]     = (char) ('0' + node->level);
+      return buffer_append(output, tag, 6);
     }
+    case MARKER_NODE_BLOCKQUOTE:
+      return buffer_append_str(output, "</blockquote>\n");
+    case MARKER_NODE_LIST:
+      return buffer_append_str(output, node->flags & MARKER_NODE_ORDERED ? "</ol>\n" : "</ul>\n");
+    case MARKER_NODE_ITEM:
+      return buffer_append_str(output, "</li>\n");
+    case MARKER_NODE_CODE_BLOCK:
+      return buffer_append_str(output, "</code></pre>\n");
+    case MARKER_NODE_TABLE:
+      return buffer_append_str(output, "</table>\n");
+    case MARKER_NODE_TABLE_HEAD:
+      return buffer_append_str(output, "</thead>\n");
+    case MARKER_NODE_TABLE_BODY:
+      return buffer_append_str(output, "</tbody>");
+    case MARKER_NODE_TABLE_ROW:
+      return buffer_append_str(output, "</tr>\n");
+    case MARKER_NODE_TABLE_CELL:
+      return buffer_append_str(output, node->flags & MARKER_NODE_HEADER ? "</th>" : "</td>");
+    case MARKER_NODE_CODE:
+      return buffer_append_str(output, "</code>");
+    case MARKER_NODE_EMPHASIS:
+      return buffer_append_str(output, "</em>");
+    case MARKER_NODE_STRONG:
+      return buffer_append_str(output, "</strong>");
+    case MARKER_NODE_STRIKETHROUGH:
+      return buffer_append_str(output, "</del>");
+    case MARKER_NODE_LINK:
+    case MARKER_NODE_AUTOLINK:
+      return buffer_append_str(output, "</a>");
+    default:
+      return MARKER_OK;
+  }
+}
 
-    result = buffer_append_str(output, ">");
-    if (result != MARKER_OK)
-      return result;
+// Add a node as the last child of the open node, and open it unless it is a
+// leaf. Text that continues the text before it extends that node instead.
+static marker_result_t document_add(marker_document_t* document, const marker_node_t* node,
+                                    bool open) {
+  if (!open && node->type == MARKER_NODE_TEXT && document->sibling) {
+    marker_node_t* sibling = &document->nodes[document->sibling];
+    if (sibling->type == MARKER_NODE_TEXT && sibling->flags == node->flags &&
+        !(node->flags & MARKER_NODE_LINE) && sibling->start + sibling->length == node->start) {
+      sibling->length += node->length;
+      return MARKER_OK;
+    }
+  }
+
+  if (document->node_count == document->node_capacity) {
+    if (document->node_count > UINT32_MAX / 2)
+      return MARKER_ERROR_INVALID_SIZE;
+    void* grown = arena_grow(&document->arena, document->nodes, &document->node_capacity,
+                             sizeof(marker_node_t));
+    if (!grown)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    document->nodes = grown;
+  }
+
+  uint32_t       index = (uint32_t) document->node_count++;
+  marker_node_t* added = &document->nodes[index];
+  *added               = *node;
+  added->parent        = document->open;
+  added->first_child   = 0;
+  added->next          = 0;
+  if (document->sibling)
+    document->nodes[document->sibling].next = index;
+  else
+    document->nodes[document->open].first_child = index;
+
+  if (open) {
+    document->open    = index;
+    document->sibling = 0;
+  } else {
+    document->sibling = index;
+  }
+  return MARKER_OK;
+}
+
+static marker_result_t emit_open(marker_parser_t* parser, marker_buffer_t* output,
+                                 marker_node_type_t type, unsigned flags, unsigned level) {
+  marker_node_t node = {0};
+  node.type          = (uint8_t) type;
+  node.flags         = (uint8_t) flags;
+  node.level         = (uint16_t) level;
+  if (parser->document)
+    return document_add(parser->document, &node, true);
+  return html_open(&parser->config, parser->scatter, output, &node, NULL, NULL);
+}
 
-    *pos = url_end + 1;
+static marker_result_t emit_close(marker_parser_t* parser, marker_buffer_t* output,
+                                  marker_node_type_t type, unsigned flags, unsigned level) {
+  marker_document_t* document = parser->document;
+  if (document) {
+    document->sibling = document->open;
+    document->open    = document->nodes[document->open].parent;
     return MARKER_OK;
   }
 
-  return MARKER_ERROR_INVALID_INPUT;
+  marker_node_t node = {0};
+  node.type          = (uint8_t) type;
+  node.flags         = (uint8_t) flags;
+  node.level         = (uint16_t) level;
+  return html_close(output, &node);
 }
 
-static marker_result_t parse_autolink(const char* text, size_t* pos, marker_buffer_t* output) {
-  size_t start = *pos;
+// A node without children, with a span of the input
+static marker_result_t emit_leaf(marker_parser_t* parser, marker_buffer_t* output,
+                                 marker_node_type_t type, unsigned flags, const char* text,
+                                 size_t length) {
+  marker_node_t node = {0};
+  node.type          = (uint8_t) type;
+  node.flags         = (uint8_t) flags;
+  node.length        = (uint32_t) length;
+  if (parser->document) {
+    node.start = (uint32_t) (text - parser->document->source);
+    return document_add(parser->document, &node, false);
+  }
 
-  if (text[start] != '<')
-    return MARKER_ERROR_INVALID_INPUT;
+  marker_result_t result = html_open(&parser->config, parser->scatter, output, &node, text, NULL);
+  if (result != MARKER_OK)
+    return result;
+  return html_close(output, &node);
+}
 
-  size_t end = start + 1;
-  while (text[end] && text[end] != '>' && text[end] != ' ' && text[end] != '\n') {
-    end++;
+// A link, which stays open for its text, or an image with its alt text. A
+// target that does not point into the input is copied into the document.
+static marker_result_t emit_link(marker_parser_t* parser, marker_buffer_t* output,
+                                 marker_node_type_t type, const char* text, size_t length,
+                                 const link_target_t* target, bool copy_target) {
+  marker_node_t node = {0};
+  node.type          = (uint8_t) type;
+  node.length        = (uint32_t) length;
+
+  marker_document_t* document = parser->document;
+  if (!document) {
+    marker_result_t result =
+        html_open(&parser->config, parser->scatter, output, &node, text, target);
+    if (result != MARKER_OK || type == MARKER_NODE_LINK)
+      return result;
+    return html_close(output, &node);
   }
 
-  if (text[end] != '>')
-    return MARKER_ERROR_INVALID_INPUT;
+  if (document->link_count == document->link_capacity) {
+    void* grown = arena_grow(&document->arena, document->links, &document->link_capacity,
+                             sizeof(link_target_t));
+    if (!grown)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    document->links = grown;
+  }
 
-  size_t content_len = end - start - 1;
-  char*  content     = malloc(content_len + 1);
-  if (!content)
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+  link_target_t* copy = &document->links[document->link_count];
+  *copy               = *target;
+  if (copy_target) {
+    copy->url = arena_strndup(&document->arena, target->url, target->url_len);
+    if (!copy->url)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    if (target->title) {
+      copy->title = arena_strndup(&document->arena, target->title, target->title_len);
+      if (!copy->title)
+        return MARKER_ERROR_MEMORY_ALLOCATION;
+    }
+  }
 
-  memcpy(content, text + start + 1, content_len);
-  content[content_len] = '\0';
+  node.link  = (uint32_t) document->link_count++;
+  node.start = (uint32_t) (text - document->source);
+  return document_add(document, &node, type == MARKER_NODE_LINK);
+}
 
-  bool is_email = strchr(content, '@') != NULL;
-  bool is_url   = starts_with(content, "http://") || starts_with(content, "https://") ||
-                starts_with(content, "ftp://");
+// Inline markup triggers. Every other byte is plain text, parse_inline_content
+// copies runs of it in one go and only dispatches on triggers. The table
+// follows the config, so a disabled extension costs nothing on plain text.
+static void build_inline_triggers(marker_parser_t* parser) {
+  unsigned char* triggers = parser->inline_triggers;
+  memset(triggers, 0, sizeof(parser->inline_triggers));
+  memset(parser->inline_nibbles, 0, sizeof(parser->inline_nibbles));
+
+  for (const char* ch = "\\*_`![])\n"; *ch; ch++)
+    triggers[(unsigned char) *ch] = 1;
+  if (parser->config.enable_strikethrough)
+    triggers['~'] = 1;
+  if (parser->config.enable_autolinks || parser->config.enable_inline_html)
+    triggers['<'] = 1;
+
+  // All triggers are ASCII, so eight high nibbles fit a byte
+  for (unsigned ch = 0; ch < 128; ch++) {
+    if (triggers[ch])
+      parser->inline_nibbles[ch & 0x0f] |= (unsigned char) (1u << (ch >> 4));
+  }
+}
 
-  if (is_email || is_url) {
-    marker_result_t result = buffer_append_str(output, "<a href=\"");
-    if (result != MARKER_OK) {
-      free(content);
-      return result;
-    }
+static size_t inline_scan_scalar(const unsigned char* triggers, const char* text, size_t len) {
+  size_t i = 0;
+  while (i < len && !triggers[(unsigned char) text[i]])
+    i++;
+  return i;
+}
 
-    if (is_email) {
-      result = buffer_append_str(output, "mailto:");
-      if (result != MARKER_OK) {
-        free(content);
-        return result;
-      }
-    }
+#ifdef MARKER_HAVE_X86_SIMD
+// A byte is a trigger when the bit of its high nibble is set in the entry of
+// its low nibble, two shuffles classify 16 or 32 bytes at once
+__attribute__((target("ssse3"))) static size_t inline_scan_ssse3(const unsigned char* nibbles,
+                                                                 const char* text, size_t len) {
+  const __m128i low_table  = _mm_loadu_si128((const __m128i*) nibbles);
+  const __m128i high_table = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128, 0, 0, 0, 0, 0, 0,
+                                           0, 0);
+  const __m128i low_mask   = _mm_set1_epi8(0x0f);
+  const __m128i zero       = _mm_setzero_si128();
 
-    result = buffer_append_str(output, content);
-    if (result != MARKER_OK) {
-      free(content);
-      return result;
-    }
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (text + i));
+    __m128i low   = _mm_shuffle_epi8(low_table, _mm_and_si128(chunk, low_mask));
+    __m128i high =
+        _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(chunk, 4), low_mask));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(low, high), zero)) ^ 0xffff;
+    if (mask)
+      return i + (size_t) __builtin_ctz((unsigned) mask);
+  }
+  return i;
+}
 
-    result = buffer_append_str(output, "\">");
-    if (result != MARKER_OK) {
-      free(content);
-      return result;
-    }
+__attribute__((target("avx2"))) static size_t inline_scan_avx2(const unsigned char* nibbles,
+                                                               const char* text, size_t len) {
+  const __m256i low_table =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) nibbles));
+  const __m256i high_table = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, (char) 128, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64,
+      (char) 128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  const __m256i zero     = _mm256_setzero_si256();
 
-    result = buffer_append_str(output, content);
-    if (result != MARKER_OK) {
-      free(content);
-      return result;
-    }
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) (text + i));
+    __m256i low   = _mm256_shuffle_epi8(low_table, _mm256_and_si256(chunk, low_mask));
+    __m256i high =
+        _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), low_mask));
+    unsigned mask =
+        ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(low, high), zero));
+    if (mask)
+      return i + (size_t) __builtin_ctz(mask);
+  }
+  return i;
+}
+#endif
 
-    result = buffer_append_str(output, "</a>");
-    free(content);
-    if (result != MARKER_OK)
-      return result;
+// Length of the plain text at the start of text, up to the first trigger
+static size_t inline_scan(const marker_parser_t* parser, const char* text, size_t len) {
+  // Triggers are often close together, look at a few bytes before going wide
+  size_t i     = 0;
+  size_t probe = len < 8 ? len : 8;
+  for (; i < probe; i++) {
+    if (parser->inline_triggers[(unsigned char) text[i]])
+      return i;
+  }
+  if (probe == len)
+    return len;
+
+#ifdef MARKER_HAVE_X86_SIMD
+  switch (get_simd_level()) {
+    case SIMD_AVX2:
+      i += inline_scan_avx2(parser->inline_nibbles, text + i, len - i);
+      break;
+    case SIMD_SSSE3:
+      i += inline_scan_ssse3(parser->inline_nibbles, text + i, len - i);
+      break;
+    default:
+      break;
+  }
+#endif
 
-    *pos = end + 1;
-    return MARKER_OK;
+  // The tail after the vector loop, or everything without one
+  return i + inline_scan_scalar(parser->inline_triggers, text + i, len - i);
+}
+
+// Utility functions
+static bool is_whitespace(char ch) { return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'; }
+
+static bool is_punctuation(char ch) { return ispunct((unsigned char) ch); }
+
+// Narrow text[0, *length) to its part without surrounding whitespace
+static void trim_whitespace(const char** text, size_t* length) {
+  const char* start = *text;
+  const char* end   = start + *length;
+
+  while (start < end && is_whitespace(*start))
+    start++;
+  while (end > start && is_whitespace(end[-1]))
+    end--;
+
+  *text   = start;
+  *length = (size_t) (end - start);
+}
+
+static bool starts_with(const char* str, size_t length, const char* prefix) {
+  size_t prefix_len = strlen(prefix);
+  return length >= prefix_len && memcmp(str, prefix, prefix_len) == 0;
+}
+
+static marker_result_t parse_autolink(marker_parser_t* parser, const char* text, size_t* pos,
+                                      size_t limit, marker_buffer_t* output) {
+  size_t start = *pos;
+
+  if (text[start] != '<')
+    return MARKER_ERROR_INVALID_INPUT;
+
+  size_t end = start + 1;
+  while (end < limit && text[end] != '>' && text[end] != ' ' && text[end] != '\n') {
+    end++;
   }
+  if (charge_work(parser, end - start) != MARKER_OK)
+    return MARKER_ERROR_LIMIT_EXCEEDED;
 
-  free(content);
-  return MARKER_ERROR_INVALID_INPUT;
+  if (end >= limit || text[end] != '>')
+    return MARKER_ERROR_INVALID_INPUT;
+
+  // The content is written straight from the input
+  const char* content     = text + start + 1;
+  size_t      content_len = end - start - 1;
+
+  bool is_email = memchr(content, '@', content_len) != NULL;
+  bool is_url   = starts_with(content, content_len, "http://") ||
+                starts_with(content, content_len, "https://") ||
+                starts_with(content, content_len, "ftp://");
+
+  if (!is_email && !is_url)
+    return MARKER_ERROR_INVALID_INPUT;
+
+  marker_result_t result = emit_leaf(parser, output, MARKER_NODE_AUTOLINK,
+                                     is_email ? MARKER_NODE_EMAIL : 0, content, content_len);
+  if (result != MARKER_OK)
+    return result;
+
+  *pos = end + 1;
+  return MARKER_OK;
 }
 
-static marker_result_t parse_code_span(const char* text, size_t* pos, marker_buffer_t* output) {
+static marker_result_t parse_code_span(marker_parser_t* parser, const char* text, size_t* pos,
+                                       size_t limit, marker_buffer_t* output) {
   size_t start = *pos;
 
   if (text[start] != '`')
@@ -893,7 +1947,7 @@ static marker_result_t parse_code_span(const char* text, size_t* pos, marker_buf
 
   // Count opening backticks
   size_t tick_count = 0;
-  while (text[start + tick_count] == '`') {
+  while (start + tick_count < limit && text[start + tick_count] == '`') {
     tick_count++;
   }
 
@@ -901,23 +1955,21 @@ static marker_result_t parse_code_span(const char* text, size_t* pos, marker_buf
   size_t content_start = start + tick_count;
   size_t content_end   = content_start;
 
-  while (text[content_end]) {
+  while (content_end < limit) {
     if (text[content_end] == '`') {
       size_t closing_ticks = 0;
       size_t check_pos     = content_end;
 
-      while (text[check_pos] == '`' && closing_ticks < tick_count) {
+      while (check_pos < limit && text[check_pos] == '`' && closing_ticks < tick_count) {
         closing_ticks++;
         check_pos++;
       }
 
       if (closing_ticks == tick_count) {
-        // Found matching closing backticks
-        marker_result_t result = buffer_append_str(output, "<code>");
-        if (result != MARKER_OK)
-          return result;
+        if (charge_work(parser, content_end - start) != MARKER_OK)
+          return MARKER_ERROR_LIMIT_EXCEEDED;
 
-        // Trim one space from each end if present
+        // Found matching closing backticks, trim one space from each end if present
         size_t trim_start = content_start;
         size_t trim_end   = content_end;
 
@@ -928,26 +1980,8 @@ static marker_result_t parse_code_span(const char* text, size_t* pos, marker_buf
           trim_end--;
         }
 
-        // Escape HTML in code content
-        for (size_t i = trim_start; i < trim_end; i++) {
-          bool found = false;
-          for (int j = 0; html_entities[j].ch; j++) {
-            if (text[i] == html_entities[j].ch) {
-              result = buffer_append_str(output, html_entities[j].entity);
-              if (result != MARKER_OK)
-                return result;
-              found = true;
-              break;
-            }
-          }
-          if (!found) {
-            result = buffer_append_char(output, text[i]);
-            if (result != MARKER_OK)
-              return result;
-          }
-        }
-
-        result = buffer_append_str(output, "</code>");
+        marker_result_t result = emit_leaf(parser, output, MARKER_NODE_CODE, 0, text + trim_start,
+                                           trim_end - trim_start);
         if (result != MARKER_OK)
           return result;
 
@@ -958,141 +1992,734 @@ static marker_result_t parse_code_span(const char* text, size_t* pos, marker_buf
     content_end++;
   }
 
+  if (charge_work(parser, limit - start) != MARKER_OK)
+    return MARKER_ERROR_LIMIT_EXCEEDED;
   return MARKER_ERROR_INVALID_INPUT;
 }
 
-static marker_result_t parse_inline_content(marker_parser_t* parser, const char* text, size_t* pos,
-                                            marker_buffer_t* output, size_t end_pos) {
-  if (!parser || !text || !pos || !output)
-    return MARKER_ERROR_NULL_POINTER;
+// Links, emphasis and strikethrough are resolved for a whole span before any of
+// it is written. One pass over the triggers collects delimiter runs, brackets
+// and closing parentheses. Brackets are matched with a stack as they are seen,
+// so finding the `]` of a link is a lookup rather than a scan, and a `[` that
+// cannot start a link is known to fail before it is reached. Links claim their
+// range first, then the delimiter stack of CommonMark (GFM for `~~`) pairs the
+// remaining runs. Every closer looks back for an opener, and failed searches
+// move a floor up per delimiter kind, so no opener is looked at twice for the
+// same kind of closer. The whole span is linear.
+
+// Position of the next byte from `set` at or after from, or end. Callers pass
+// increasing positions, so the cached answer is reused until it is passed.
+static size_t next_of(const char* text, size_t from, size_t end, const char* set, size_t* cache) {
+  if (*cache >= from && *cache != SIZE_MAX)
+    return *cache;
+  size_t i = from;
+  while (i < end && (!text[i] || !strchr(set, text[i])))
+    i++;
+  *cache = i;
+  return i;
+}
 
-  while (*pos < end_pos && text[*pos]) {
-    char ch = text[*pos];
+static int compare_emphasis_matches(const void* a, const void* b) {
+  const emphasis_match_t* x = a;
+  const emphasis_match_t* y = b;
+  return (x->opener > y->opener) - (x->opener < y->opener);
+}
 
-    // Handle escape sequences
-    if (ch == '\\' && text[*pos + 1]) {
-      char next = text[*pos + 1];
-      if (is_punctuation(next)) {
-        marker_result_t result = buffer_append_char(output, next);
-        if (result != MARKER_OK)
-          return result;
-        *pos += 2;
-        continue;
-      }
+static int compare_inline_links(const void* a, const void* b) {
+  const inline_link_t* x = a;
+  const inline_link_t* y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+static void unlink_delim(inline_delim_t* delims, ptrdiff_t index) {
+  if (delims[index].prev >= 0)
+    delims[delims[index].prev].next = delims[index].next;
+  if (delims[index].next >= 0)
+    delims[delims[index].next].prev = delims[index].prev;
+}
+
+// Collect the tokens of text[start, end) in the token arrays of the parser. Code
+// spans, escapes, autolinks and inline HTML bind tighter than links and emphasis
+// and are skipped exactly as render_inline will consume them.
+static MARKER_ALWAYS_INLINE marker_result_t scan_inline_tokens_with(marker_parser_t* parser,
+                                                                    const char* text,
+                                                                    size_t start, size_t end,
+                                                                    inline_tokens_t* tokens,
+                                                                    unsigned         features) {
+  tokens->delim_count   = 0;
+  tokens->bracket_count = 0;
+  tokens->paren_count   = 0;
+
+  // Caches for next_of, and the shortest backtick run known to have no closer
+  size_t next_gt   = SIZE_MAX;
+  size_t next_sp   = SIZE_MAX;
+  size_t next_at   = SIZE_MAX;
+  size_t tick_fail = SIZE_MAX;
+
+  ptrdiff_t open_bracket = -1;  // Innermost unclosed bracket
+  size_t    escaped_end  = SIZE_MAX;
+
+  size_t i = start;
+  while (i < end) {
+    // Everything that matters here is a trigger
+    i += inline_scan(parser, text + i, end - i);
+    if (i >= end)
+      break;
+
+    char ch = text[i];
+
+    if (ch == '\\' && i + 1 < end && is_punctuation(text[i + 1])) {
+      i += 2;
+      escaped_end = i;
+      continue;
     }
 
-    // Handle emphasis and strong
-    if (ch == '*' || ch == '_') {
-      bool is_strong = (text[*pos + 1] == ch);
-      int  count     = is_strong ? 2 : 1;
+    if (ch == '`') {
+      size_t ticks = 0;
+      while (i + ticks < end && text[i + ticks] == '`')
+        ticks++;
+
+      // parse_code_span closes at the first run at least as long
+      size_t close = SIZE_MAX;
+      if (ticks < tick_fail) {
+        size_t j = i + ticks;
+        while (j < end) {
+          if (text[j] != '`') {
+            j++;
+            continue;
+          }
+          size_t run = 0;
+          while (j + run < end && text[j + run] == '`')
+            run++;
+          if (run >= ticks) {
+            close = j;
+            break;
+          }
+          j += run;
+        }
+        if (close == SIZE_MAX)
+          tick_fail = ticks;
+      }
+      i = close == SIZE_MAX ? i + ticks : close + ticks;
+      continue;
+    }
 
-      size_t end = find_emphasis_end(text, *pos, ch, count);
-      if (end != SIZE_MAX) {
-        const char* tag = is_strong ? "strong" : "em";
+    if (ch == '<' && (features & (FEATURE_AUTOLINKS | FEATURE_INLINE_HTML))) {
+      size_t gt = next_of(text, i + 1, end, ">", &next_gt);
+      if (gt < end) {
+        bool skip = features & FEATURE_INLINE_HTML;
+        if (!skip && next_of(text, i + 1, end, " \n>", &next_sp) == gt) {
+          skip = starts_with(text + i + 1, gt - i - 1, "http://") ||
+                 starts_with(text + i + 1, gt - i - 1, "https://") ||
+                 starts_with(text + i + 1, gt - i - 1, "ftp://") ||
+                 next_of(text, i + 1, end, "@>", &next_at) < gt;
+        }
+        if (skip) {
+          i = gt + 1;
+          continue;
+        }
+      }
+      i++;
+      continue;
+    }
 
-        marker_result_t result = buffer_append_str(output, "<");
-        if (result != MARKER_OK)
-          return result;
-        result = buffer_append_str(output, tag);
-        if (result != MARKER_OK)
-          return result;
-        result = buffer_append_str(output, ">");
-        if (result != MARKER_OK)
-          return result;
+    if (ch == '[') {
+      if (tokens->bracket_count == tokens->bracket_capacity) {
+        void* grown = parser_grow(parser, tokens->brackets, &tokens->bracket_capacity,
+                                  sizeof(inline_bracket_t));
+        if (!grown)
+          return MARKER_ERROR_MEMORY_ALLOCATION;
+        tokens->brackets = grown;
+      }
 
-        size_t content_pos = *pos + count;
-        result             = parse_inline_content(parser, text, &content_pos, output, end);
-        if (result != MARKER_OK)
-          return result;
+      inline_bracket_t* bracket = &tokens->brackets[tokens->bracket_count];
+      bracket->open             = i;
+      bracket->close            = SIZE_MAX;
+      bracket->outer            = open_bracket;
+      bracket->label            = -1;
+      bracket->image            = i > start && text[i - 1] == '!' && escaped_end != i;
+      open_bracket              = (ptrdiff_t) tokens->bracket_count++;
+      i++;
+      continue;
+    }
 
-        result = buffer_append_str(output, "</");
-        if (result != MARKER_OK)
-          return result;
-        result = buffer_append_str(output, tag);
-        if (result != MARKER_OK)
-          return result;
-        result = buffer_append_str(output, ">");
-        if (result != MARKER_OK)
-          return result;
+    if (ch == ']') {
+      if (open_bracket >= 0) {
+        // A `[` right after is always the next bracket collected
+        inline_bracket_t* bracket = &tokens->brackets[open_bracket];
+        bracket->close            = i;
+        if (i + 1 < end && text[i + 1] == '[')
+          bracket->label = (ptrdiff_t) tokens->bracket_count;
+        open_bracket = bracket->outer;
+      }
+      i++;
+      continue;
+    }
 
-        *pos = end + count;
-        continue;
+    if (ch == ')') {
+      if (tokens->paren_count == tokens->paren_capacity) {
+        void* grown =
+            parser_grow(parser, tokens->parens, &tokens->paren_capacity, sizeof(size_t));
+        if (!grown)
+          return MARKER_ERROR_MEMORY_ALLOCATION;
+        tokens->parens = grown;
       }
+      tokens->parens[tokens->paren_count++] = i;
+      i++;
+      continue;
+    }
+
+    bool tilde = ch == '~' && (features & FEATURE_STRIKETHROUGH);
+    if (ch != '*' && ch != '_' && !tilde) {
+      i++;
+      continue;
+    }
+
+    size_t run = 1;
+    while (i + run < end && text[i + run] == ch)
+      run++;
+
+    // Strikethrough takes exactly two tildes
+    if (tilde && run != 2) {
+      i += run;
+      continue;
+    }
+
+    // The edges of the span count as whitespace
+    char before = i > start ? text[i - 1] : '\n';
+    char after  = i + run < end ? text[i + run] : '\n';
+
+    bool left_flanking  = !is_whitespace(after) &&
+                         (!is_punctuation(after) || is_whitespace(before) ||
+                          is_punctuation(before));
+    bool right_flanking = !is_whitespace(before) &&
+                          (!is_punctuation(before) || is_whitespace(after) ||
+                           is_punctuation(after));
+
+    if (tokens->delim_count == tokens->delim_capacity) {
+      void* grown = parser_grow(parser, tokens->delims, &tokens->delim_capacity,
+                                sizeof(inline_delim_t));
+      if (!grown)
+        return MARKER_ERROR_MEMORY_ALLOCATION;
+      tokens->delims = grown;
+    }
+
+    inline_delim_t* delim = &tokens->delims[tokens->delim_count++];
+    delim->pos            = i;
+    delim->count          = run;
+    delim->orig_count     = run;
+    delim->ch             = ch;
+    delim->matches        = -1;
+    if (ch == '_') {
+      delim->can_open  = left_flanking && (!right_flanking || is_punctuation(before));
+      delim->can_close = right_flanking && (!left_flanking || is_punctuation(after));
+    } else {
+      delim->can_open  = left_flanking;
+      delim->can_close = right_flanking;
+    }
+
+    i += run;
+  }
+
+  return MARKER_OK;
+}
+
+// First `)` at or after from, or SIZE_MAX
+static size_t find_paren(const inline_tokens_t* tokens, size_t from) {
+  size_t low  = 0;
+  size_t high = tokens->paren_count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (tokens->parens[mid] < from)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low < tokens->paren_count ? tokens->parens[low] : SIZE_MAX;
+}
+
+// Work out whether the bracket starts a link, and where its parts are. An
+// image is `![alt](url)`, a link is `[text](url)`, `[text][label]`, `[text][]`
+// or `[text]` with a known reference.
+static bool resolve_link(marker_parser_t* parser, const char* text, size_t end,
+                         const inline_tokens_t* tokens, const inline_bracket_t* bracket,
+                         bool image, inline_link_t* link) {
+  if (bracket->close == SIZE_MAX)
+    return false;
+
+  memset(link, 0, sizeof(*link));
+  link->start      = image ? bracket->open - 1 : bracket->open;
+  link->text_start = bracket->open + 1;
+  link->text_end   = bracket->close;
+  link->image      = image;
+
+  size_t after = bracket->close + 1;
+  if (after < end && text[after] == '(') {
+    size_t paren = find_paren(tokens, after + 1);
+    if (paren == SIZE_MAX || paren - (after + 1) >= MAX_LINK_LENGTH)
+      return false;
+    if (image && link->text_end - link->text_start >= MAX_LINK_LENGTH)
+      return false;
+
+    link->url_start = after + 1;
+    link->url_end   = paren;
+    link->end       = paren + 1;
+    return true;
+  }
+
+  if (image)
+    return false;
+
+  // Full or collapsed reference, an empty label uses the link text
+  const inline_bracket_t* label = bracket->label >= 0 ? &tokens->brackets[bracket->label] : NULL;
+  if (label && label->close != SIZE_MAX) {
+    size_t label_start = label->close == after + 1 ? link->text_start : after + 1;
+    size_t label_end   = label->close == after + 1 ? link->text_end : label->close;
+    if (label_end - label_start >= MAX_LINK_LENGTH)
+      return false;
+
+    link->ref = find_reference_link(parser, text, label_start, label_end);
+    if (link->ref) {
+      link->end = label->close + 1;
+      return true;
+    }
+  }
+
+  // Shortcut reference
+  link->ref = find_reference_link(parser, text, link->text_start, link->text_end);
+  link->end = after;
+  return link->ref != NULL;
+}
+
+// Links in order of their `[`. Brackets inside a link are left to the parse of
+// its text, an outer link wins over the ones it contains.
+static marker_result_t resolve_links(marker_parser_t* parser, const char* text,
+                                     const inline_tokens_t* tokens, inline_span_t* span) {
+  size_t capacity = 0;
+  size_t covered  = 0;  // End of the last link
+
+  for (size_t b = 0; b < tokens->bracket_count; b++) {
+    const inline_bracket_t* bracket = &tokens->brackets[b];
+    size_t                  start   = bracket->image ? bracket->open - 1 : bracket->open;
+    if (bracket->close == SIZE_MAX || start < covered)
+      continue;
+
+    // `![` that is not an image may still be a link
+    inline_link_t link;
+    if (!(bracket->image && resolve_link(parser, text, span->end, tokens, bracket, true, &link)) &&
+        !resolve_link(parser, text, span->end, tokens, bracket, false, &link))
+      continue;
+
+    if (span->link_count == capacity) {
+      void* grown = arena_grow(&parser->scratch, span->links, &capacity, sizeof(inline_link_t));
+      if (!grown)
+        return MARKER_ERROR_MEMORY_ALLOCATION;
+      span->links = grown;
+    }
+    span->links[span->link_count++] = link;
+    covered                         = link.end;
+  }
+  return MARKER_OK;
+}
+
+static marker_result_t resolve_emphasis(marker_parser_t* parser, inline_tokens_t* tokens,
+                                        inline_span_t* span) {
+  inline_delim_t* delims = tokens->delims;
+
+  // Runs inside links belong to the link text and its own parse
+  size_t count = 0;
+  size_t link  = 0;
+  for (size_t d = 0; d < tokens->delim_count; d++) {
+    while (link < span->link_count && span->links[link].end <= delims[d].pos)
+      link++;
+    if (link < span->link_count && span->links[link].start <= delims[d].pos)
+      continue;
+    delims[count]      = delims[d];
+    delims[count].prev = (ptrdiff_t) count - 1;
+    delims[count].next = (ptrdiff_t) count + 1;
+    count++;
+  }
+  if (count == 0)
+    return MARKER_OK;
+  delims[count - 1].next = -1;
+
+  // Every match uses at least one character of an opener and of a closer
+  size_t delim_chars = 0;
+  for (size_t d = 0; d < count; d++)
+    delim_chars += delims[d].count;
+  emphasis_match_t* matches =
+      arena_alloc(&parser->scratch, (delim_chars / 2 + 1) * sizeof(emphasis_match_t));
+  if (!matches)
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+  size_t match_count = 0;
+
+  // Openers at or below the floor already failed for closers of the same kind,
+  // one floor per character, closer that can also open, and run length mod 3
+  ptrdiff_t floors[3][2][3];
+  for (size_t a = 0; a < 3; a++)
+    for (size_t b = 0; b < 2; b++)
+      for (size_t c = 0; c < 3; c++)
+        floors[a][b][c] = -1;
+
+  ptrdiff_t closer = 0;
+  while (closer >= 0) {
+    inline_delim_t* close = &delims[closer];
+    if (!close->can_close) {
+      closer = close->next;
+      continue;
     }
 
-    // Handle strikethrough
-    if (parser->config.enable_strikethrough && ch == '~' && text[*pos + 1] == '~') {
-      size_t end = *pos + 2;
-      while (text[end] && !(text[end] == '~' && text[end + 1] == '~')) {
-        end++;
+    size_t     kind  = close->ch == '*' ? 0 : close->ch == '_' ? 1 : 2;
+    ptrdiff_t* floor = &floors[kind][close->can_open][close->orig_count % 3];
+
+    ptrdiff_t opener = close->prev;
+    while (opener > *floor) {
+      inline_delim_t* open = &delims[opener];
+      if (open->ch == close->ch && open->can_open) {
+        // A run that can both open and close may not pair with one that makes
+        // the sum a multiple of three, unless both are
+        bool both_ways = open->can_close || close->can_open;
+        bool rule_of_3 = (open->orig_count + close->orig_count) % 3 == 0 &&
+                         !(open->orig_count % 3 == 0 && close->orig_count % 3 == 0);
+        if (close->ch == '~' || !(both_ways && rule_of_3))
+          break;
       }
+      opener = open->prev;
+    }
 
-      if (text[end] == '~' && text[end + 1] == '~') {
-        marker_result_t result = buffer_append_str(output, "<del>");
-        if (result != MARKER_OK)
-          return result;
+    if (opener <= *floor) {
+      *floor         = close->prev;
+      ptrdiff_t next = close->next;
+      if (!close->can_open)
+        unlink_delim(delims, closer);
+      closer = next;
+      continue;
+    }
+
+    inline_delim_t* open = &delims[opener];
+    size_t          used = (open->count >= 2 && close->count >= 2) ? 2 : 1;
+
+    // A run opens from its inside out, each match left of the one before
+    emphasis_match_t* match = &matches[match_count];
+    match->opener           = open->pos + open->count - used;
+    match->closer           = close->pos;
+    match->count            = used;
+    match->next             = open->matches;
+    open->matches           = (ptrdiff_t) match_count++;
+
+    open->count -= used;
+    close->pos += used;
+    close->count -= used;
+
+    // Whatever lies between the pair can no longer match
+    open->next  = closer;
+    close->prev = opener;
+    if (open->count == 0)
+      unlink_delim(delims, opener);
+    if (close->count == 0) {
+      ptrdiff_t next = close->next;
+      unlink_delim(delims, closer);
+      closer = next;
+    }
+  }
+
+  // Runs are in text order, so walking their matches gives them sorted
+  span->matches = arena_alloc(&parser->scratch, (match_count + 1) * sizeof(emphasis_match_t));
+  if (!span->matches)
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+  for (size_t d = 0; d < count; d++) {
+    for (ptrdiff_t m = delims[d].matches; m >= 0; m = matches[m].next)
+      span->matches[span->match_count++] = matches[m];
+  }
+  return MARKER_OK;
+}
+
+// The results live in scratch memory, the caller rewinds it once the span is
+// written
+static marker_result_t resolve_inline(marker_parser_t* parser, const char* text, size_t start,
+                                      size_t end, inline_span_t* span) {
+  memset(span, 0, sizeof(*span));
+  span->end = end;
+
+  // The tokens are done with before any nested span, such as link text, is resolved
+  inline_tokens_t* tokens = &parser->tokens;
+  marker_result_t  result = charge_work(parser, end - start);
+  if (result == MARKER_OK)
+    result = scan_inline_tokens(parser, text, start, end, tokens);
+  if (result != MARKER_OK)
+    return result;
+
+  result = resolve_links(parser, text, tokens, span);
+  if (result != MARKER_OK)
+    return result;
+  return resolve_emphasis(parser, tokens, span);
+}
+
+static const emphasis_match_t* find_emphasis_match(const inline_span_t* span, size_t pos) {
+  if (span->match_count == 0)
+    return NULL;
+
+  emphasis_match_t key = {pos, 0, 0, -1};
+  return bsearch(&key, span->matches, span->match_count, sizeof(emphasis_match_t),
+                 compare_emphasis_matches);
+}
+
+static const inline_link_t* find_inline_link(const inline_span_t* span, size_t start) {
+  if (span->link_count == 0)
+    return NULL;
+
+  inline_link_t key;
+  memset(&key, 0, sizeof(key));
+  key.start = start;
+  return bsearch(&key, span->links, span->link_count, sizeof(inline_link_t),
+                 compare_inline_links);
+}
+
+// Split the destination of an inline link into its URL and optional title in
+// quotes. Both point into text, the title is NULL when there is none or it is
+// empty.
+static void split_destination(const char* text, const inline_link_t* link, const char** url,
+                              size_t* url_len, const char** title, size_t* title_len) {
+  const char* dest     = text + link->url_start;
+  size_t      dest_len = link->url_end - link->url_start;
+  trim_whitespace(&dest, &dest_len);
+
+  *url       = dest;
+  *url_len   = dest_len;
+  *title     = NULL;
+  *title_len = 0;
+
+  const char* quote = memchr(dest, '"', dest_len);
+  if (!quote)
+    return;
+
+  // The title runs to the last quote, the URL is what comes before the first
+  const char* title_start = quote + 1;
+  const char* title_end   = dest + dest_len;
+  while (title_end > title_start && title_end[-1] != '"')
+    title_end--;
+  if (title_end > title_start + 1) {
+    *title     = title_start;
+    *title_len = (size_t) (title_end - 1 - title_start);
+  }
+
+  *url_len = (size_t) (quote - dest);
+  trim_whitespace(url, url_len);
+}
+
+// Write an image found by resolve_links, or open a link. The text of a link is
+// written and the link closed by render_inline.
+static marker_result_t render_link(marker_parser_t* parser, const char* text,
+                                   const inline_link_t* link, marker_buffer_t* output) {
+  link_target_t target;
+  if (link->ref) {
+    target.url       = link->ref->url;
+    target.url_len   = strlen(target.url);
+    target.title     = link->ref->title;
+    target.title_len = target.title ? strlen(target.title) : 0;
+  } else {
+    split_destination(text, link, &target.url, &target.url_len, &target.title,
+                      &target.title_len);
+  }
+
+  marker_node_type_t type = link->image ? MARKER_NODE_IMAGE : MARKER_NODE_LINK;
+  return emit_link(parser, output, type, text + link->text_start,
+                   link->text_end - link->text_start, &target, link->ref != NULL);
+}
+
+// Open a frame for content nested in the current one. The enclosing content is
+// span up to end, and goes on at resume once the frame is closed.
+static marker_result_t push_inline_frame(marker_parser_t* parser, marker_node_type_t type,
+                                         const inline_span_t* span, size_t end, size_t resume) {
+  marker_result_t result = enter_inline(parser);
+  if (result != MARKER_OK)
+    return result;
+
+  if (parser->frame_count == parser->frame_capacity) {
+    void* grown =
+        parser_grow(parser, parser->frames, &parser->frame_capacity, sizeof(inline_frame_t));
+    if (!grown)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    parser->frames = grown;
+  }
+
+  inline_frame_t* frame = &parser->frames[parser->frame_count++];
+  frame->span           = span;
+  frame->end            = end;
+  frame->resume         = resume;
+  frame->mark           = arena_mark(&parser->scratch);
+  frame->type           = type;
+  return MARKER_OK;
+}
+
+// Plain text of a span. Into a buffer it is appended straight away, and the
+// escape check is a constant of the variant.
+static MARKER_ALWAYS_INLINE marker_result_t emit_text(marker_parser_t* parser,
+                                                      marker_buffer_t* output, const char* text,
+                                                      size_t length, unsigned features) {
+  if (parser->document || parser->scatter)
+    return emit_leaf(parser, output, MARKER_NODE_TEXT, 0, text, length);
+  if (features & FEATURE_ESCAPE_HTML)
+    return append_escaped_html(output, text, length);
+  return buffer_append(output, text, length);
+}
+
+static marker_node_type_t emphasis_type(char ch, size_t count) {
+  if (ch == '~')
+    return MARKER_NODE_STRIKETHROUGH;
+  return count == 2 ? MARKER_NODE_STRONG : MARKER_NODE_EMPHASIS;
+}
+
+// Write text[*pos, end_pos), with links and emphasis already resolved for the
+// enclosing span. Nothing recurses: emphasis and link text push a frame on the
+// parser and the loop carries on with their content, and reaching the end of
+// the content pops the frame, closes the node and resumes after it. Deep
+// nesting costs a frame of heap memory per level rather than C stack.
+static MARKER_ALWAYS_INLINE marker_result_t render_inline_with(marker_parser_t* parser,
+                                                               const char* text, size_t* pos,
+                                                               marker_buffer_t*     output,
+                                                               size_t               end_pos,
+                                                               const inline_span_t* span,
+                                                               unsigned             features) {
+  size_t base = parser->frame_count;
+  for (;;) {
+    if (*pos >= end_pos) {
+      if (parser->frame_count == base)
+        return MARKER_OK;
+
+      inline_frame_t frame = parser->frames[--parser->frame_count];
+      leave_inline(parser);
+      arena_rewind(&parser->scratch, frame.mark);
+      marker_result_t result = emit_close(parser, output, frame.type, 0, 0);
+      if (result != MARKER_OK)
+        return result;
+      span    = frame.span;
+      end_pos = frame.end;
+      *pos    = frame.resume;
+      continue;
+    }
+
+    // Plain text up to the next trigger goes out in one piece
+    size_t run = inline_scan(parser, text + *pos, end_pos - *pos);
+    if (run > 0) {
+      marker_result_t result = emit_text(parser, output, text + *pos, run, features);
+      if (result != MARKER_OK)
+        return result;
+      *pos += run;
+      continue;
+    }
+
+    char ch = text[*pos];
 
-        size_t content_pos = *pos + 2;
-        result             = parse_inline_content(parser, text, &content_pos, output, end);
+    // Handle escape sequences
+    if (ch == '\\' && *pos + 1 < span->end) {
+      char next = text[*pos + 1];
+      if (is_punctuation(next)) {
+        marker_result_t result =
+            emit_leaf(parser, output, MARKER_NODE_TEXT, MARKER_NODE_VERBATIM, text + *pos + 1, 1);
         if (result != MARKER_OK)
           return result;
+        *pos += 2;
+        continue;
+      }
+    }
 
-        result = buffer_append_str(output, "</del>");
+    // Handle emphasis, strong and strikethrough
+    if (ch == '*' || ch == '_' || ch == '~') {
+      const emphasis_match_t* match = find_emphasis_match(span, *pos);
+      if (match) {
+        marker_node_type_t type = emphasis_type(ch, match->count);
+        marker_result_t    result =
+            push_inline_frame(parser, type, span, end_pos, match->closer + match->count);
+        if (result == MARKER_OK)
+          result = emit_open(parser, output, type, 0, 0);
         if (result != MARKER_OK)
           return result;
 
-        *pos = end + 2;
+        *pos += match->count;
+        end_pos = match->closer;
         continue;
       }
     }
 
-    // Handle code spans
+    // Handle code spans. A run of backticks without a closer is literal as a
+    // whole, a shorter closer must not match its tail.
     if (ch == '`') {
       size_t          old_pos = *pos;
-      marker_result_t result  = parse_code_span(text, pos, output);
+      marker_result_t result  = parse_code_span(parser, text, pos, span->end, output);
       if (result == MARKER_OK)
         continue;
+      if (result == MARKER_ERROR_LIMIT_EXCEEDED)
+        return result;
       *pos = old_pos;
-    }
 
-    // Handle images
-    if (ch == '!' && text[*pos + 1] == '[') {
-      size_t          old_pos = *pos;
-      marker_result_t result  = parse_image(parser, text, pos, output);
-      if (result == MARKER_OK)
-        continue;
-      *pos = old_pos;
+      size_t ticks = 0;
+      while (*pos + ticks < end_pos && text[*pos + ticks] == '`')
+        ticks++;
+      result =
+          emit_leaf(parser, output, MARKER_NODE_TEXT, MARKER_NODE_VERBATIM, text + *pos, ticks);
+      if (result != MARKER_OK)
+        return result;
+      *pos += ticks;
+      continue;
     }
 
-    // Handle links
-    if (ch == '[') {
-      size_t          old_pos = *pos;
-      marker_result_t result  = parse_link(parser, text, pos, output);
-      if (result == MARKER_OK)
+    // Handle links and images, an image starts at its `!`
+    if ((ch == '!' && *pos + 1 < span->end && text[*pos + 1] == '[') || ch == '[') {
+      const inline_link_t* link = find_inline_link(span, *pos);
+      if (link && link->image == (ch == '!')) {
+        marker_result_t result = render_link(parser, text, link, output);
+        if (result != MARKER_OK)
+          return result;
+        if (link->image) {
+          *pos = link->end;
+          continue;
+        }
+
+        // The link text is a span of its own, parsed where it stands. Its
+        // resolved links and emphasis are scratch memory until the link closes.
+        result = push_inline_frame(parser, MARKER_NODE_LINK, span, end_pos, link->end);
+        if (result != MARKER_OK)
+          return result;
+        inline_span_t* text_span = arena_alloc(&parser->scratch, sizeof(inline_span_t));
+        if (!text_span)
+          return MARKER_ERROR_MEMORY_ALLOCATION;
+        result = resolve_inline(parser, text, link->text_start, link->text_end, text_span);
+        if (result != MARKER_OK)
+          return result;
+
+        span    = text_span;
+        end_pos = link->text_end;
+        *pos    = link->text_start;
         continue;
-      *pos = old_pos;
+      }
     }
 
     // Handle autolinks
-    if (parser->config.enable_autolinks && ch == '<') {
+    if ((features & FEATURE_AUTOLINKS) && ch == '<') {
       size_t          old_pos = *pos;
-      marker_result_t result  = parse_autolink(text, pos, output);
+      marker_result_t result  = parse_autolink(parser, text, pos, span->end, output);
       if (result == MARKER_OK)
         continue;
+      if (result == MARKER_ERROR_LIMIT_EXCEEDED)
+        return result;
       *pos = old_pos;
     }
 
     // Handle inline HTML
-    if (parser->config.enable_inline_html && ch == '<') {
+    if ((features & FEATURE_INLINE_HTML) && ch == '<') {
       // Simple HTML tag detection
       size_t tag_end = *pos + 1;
-      while (text[tag_end] && text[tag_end] != '>') {
+      while (tag_end < span->end && text[tag_end] != '>') {
         tag_end++;
       }
+      if (charge_work(parser, tag_end - *pos) != MARKER_OK)
+        return MARKER_ERROR_LIMIT_EXCEEDED;
 
-      if (text[tag_end] == '>') {
+      if (tag_end < span->end) {
         // Pass through HTML tag
-        marker_result_t result = buffer_append(output, text + *pos, tag_end - *pos + 1);
+        marker_result_t result =
+            emit_leaf(parser, output, MARKER_NODE_HTML_INLINE, 0, text + *pos, tag_end - *pos + 1);
         if (result != MARKER_OK)
           return result;
         *pos = tag_end + 1;
@@ -1102,62 +2729,143 @@ static marker_result_t parse_inline_content(marker_parser_t* parser, const char*
 
     // Handle line breaks
     if (ch == '\n') {
-      if (parser->config.hard_line_breaks) {
-        marker_result_t result = buffer_append_str(output, "<br>");
-        if (result != MARKER_OK)
-          return result;
-      } else {
-        marker_result_t result = buffer_append_char(output, ' ');
-        if (result != MARKER_OK)
-          return result;
-      }
-      (*pos)++;
-      continue;
-    }
-
-    // Regular character
-    if (parser->config.escape_html) {
-      marker_result_t result = append_escaped_html(output, &ch, 1);
-      if (result != MARKER_OK)
-        return result;
-    } else {
-      marker_result_t result = buffer_append_char(output, ch);
+      marker_result_t result = emit_leaf(parser, output, MARKER_NODE_LINE_BREAK, 0, text + *pos, 1);
       if (result != MARKER_OK)
         return result;
+      (*pos)++;
+      continue;
     }
 
-    (*pos)++;
+    // Regular character, together with the plain text after it
+    size_t          length = 1 + inline_scan(parser, text + *pos + 1, end_pos - *pos - 1);
+    marker_result_t result = emit_text(parser, output, text + *pos, length, features);
+    if (result != MARKER_OK)
+      return result;
+    *pos += length;
   }
 
   return MARKER_OK;
 }
 
+// Write the inline content text[*pos, end_pos), a span of its own
+static MARKER_ALWAYS_INLINE marker_result_t parse_inline_with(marker_parser_t* parser,
+                                                              const char* text, size_t* pos,
+                                                              marker_buffer_t* output,
+                                                              size_t end_pos, unsigned features) {
+  arena_mark_t    mark   = arena_mark(&parser->scratch);
+  size_t          frames = parser->frame_count;
+  size_t          depth  = parser->inline_depth;
+  inline_span_t   span;
+  marker_result_t result = resolve_inline(parser, text, *pos, end_pos, &span);
+  if (result == MARKER_OK)
+    result = render_inline_with(parser, text, pos, output, end_pos, &span, features);
+
+  // A render that failed leaves its frames open
+  parser->frame_count  = frames;
+  parser->inline_depth = depth;
+  arena_rewind(&parser->scratch, mark);
+  return result;
+}
+
+// Instantiate the inline engine for a set of features. Within a variant with
+// constant features the checks of the features fold away, along with the code
+// of the ones that are off. The generic variant reads them from the parser.
+#define INLINE_VARIANT(name, features)                                                          \
+  static marker_result_t scan_inline_tokens_##name(marker_parser_t* parser, const char* text,    \
+                                                   size_t start, size_t end,                    \
+                                                   inline_tokens_t* tokens) {                   \
+    return scan_inline_tokens_with(parser, text, start, end, tokens, features);                \
+  }                                                                                             \
+  static marker_result_t parse_inline_##name(marker_parser_t* parser, const char* text,          \
+                                             size_t* pos, marker_buffer_t* output,              \
+                                             size_t end_pos) {                                  \
+    return parse_inline_with(parser, text, pos, output, end_pos, features);                    \
+  }
+
+INLINE_VARIANT(generic, parser->features)
+#ifndef MARKER_NO_VARIANTS
+INLINE_VARIANT(gfm, FEATURES_GFM)
+INLINE_VARIANT(commonmark, FEATURES_COMMONMARK)
+#endif
+
+static void select_inline_variant(marker_parser_t* parser) {
+  const marker_config_t* config = &parser->config;
+  parser->features = (config->enable_strikethrough ? FEATURE_STRIKETHROUGH : 0) |
+                     (config->enable_autolinks ? FEATURE_AUTOLINKS : 0) |
+                     (config->enable_inline_html ? FEATURE_INLINE_HTML : 0) |
+                     (config->escape_html ? FEATURE_ESCAPE_HTML : 0);
+  parser->variant = INLINE_GENERIC;
+#ifndef MARKER_NO_VARIANTS
+  if (parser->features == FEATURES_GFM)
+    parser->variant = INLINE_GFM;
+  else if (parser->features == FEATURES_COMMONMARK)
+    parser->variant = INLINE_COMMONMARK;
+#endif
+}
+
+// Scan and write with the variant of the parser
+static marker_result_t scan_inline_tokens(marker_parser_t* parser, const char* text, size_t start,
+                                          size_t end, inline_tokens_t* tokens) {
+  switch (parser->variant) {
+#ifndef MARKER_NO_VARIANTS
+    case INLINE_GFM:
+      return scan_inline_tokens_gfm(parser, text, start, end, tokens);
+    case INLINE_COMMONMARK:
+      return scan_inline_tokens_commonmark(parser, text, start, end, tokens);
+#endif
+    default:
+      return scan_inline_tokens_generic(parser, text, start, end, tokens);
+  }
+}
+
+// Inlined into its callers, so a span costs one call as it did before the
+// variants
+static MARKER_ALWAYS_INLINE marker_result_t parse_inline_content(marker_parser_t* parser,
+                                                                 const char* text, size_t* pos,
+                                                                 marker_buffer_t* output,
+                                                                 size_t           end_pos) {
+  if (!parser || !text || !pos)
+    return MARKER_ERROR_NULL_POINTER;
+
+  switch (parser->variant) {
+#ifndef MARKER_NO_VARIANTS
+    case INLINE_GFM:
+      return parse_inline_gfm(parser, text, pos, output, end_pos);
+    case INLINE_COMMONMARK:
+      return parse_inline_commonmark(parser, text, pos, output, end_pos);
+#endif
+    default:
+      return parse_inline_generic(parser, text, pos, output, end_pos);
+  }
+}
+
 // Block parsing functions
-static bool is_header_line(const char* line) { return line[0] == '#'; }
+// Lines are spans of the input and are not NUL-terminated
+static bool is_header_line(const char* line, size_t length) { return length > 0 && line[0] == '#'; }
 
-static bool is_code_fence(const char* line) {
-  return starts_with(line, "```") || starts_with(line, "~~~");
+static bool is_code_fence(const char* line, size_t length) {
+  return starts_with(line, length, "```") || starts_with(line, length, "~~~");
 }
 
-static bool is_blockquote(const char* line) { return line[0] == '>'; }
+static bool is_blockquote(const char* line, size_t length) { return length > 0 && line[0] == '>'; }
 
-static bool is_list_item(const char* line) {
-  if ((line[0] == '-' || line[0] == '*' || line[0] == '+') && line[1] == ' ') {
+static bool is_list_item(const char* line, size_t length) {
+  if (length > 1 && (line[0] == '-' || line[0] == '*' || line[0] == '+') && line[1] == ' ') {
     return true;
   }
 
   // Check for ordered list
   size_t i = 0;
-  while (isdigit((unsigned char) line[i]))
+  while (i < length && isdigit((unsigned char) line[i]))
     i++;
-  return i > 0 && line[i] == '.' && line[i + 1] == ' ';
+  return i > 0 && i + 1 < length && line[i] == '.' && line[i + 1] == ' ';
 }
 
-static bool is_horizontal_rule(const char* line) {
+static bool is_horizontal_rule(const char* line, size_t length) {
   size_t count  = 0;
   char   marker = 0;
 
-  for (size_t i = 0; line[i]; i++) {
+  for (size_t i = 0; i < length; i++) {
     if (line[i] == '-' || line[i] == '*' || line[i] == '_') {
       if (marker == 0) {
         marker = line[i];
@@ -1173,11 +2881,11 @@ static bool is_horizontal_rule(const char* line) {
   return count >= 3;
 }
 
-static bool is_table_separator(const char* line) {
+static bool is_table_separator(const char* line, size_t length) {
   bool has_pipe = false;
   bool has_dash = false;
 
-  for (size_t i = 0; line[i]; i++) {
+  for (size_t i = 0; i < length; i++) {
     if (line[i] == '|') {
       has_pipe = true;
     } else if (line[i] == '-') {
@@ -1190,86 +2898,61 @@ static bool is_table_separator(const char* line) {
   return has_pipe && has_dash;
 }
 
-static marker_result_t parse_header(marker_parser_t* parser, const char* line,
+static marker_result_t parse_header(marker_parser_t* parser, const char* line, size_t length,
                                     marker_buffer_t* output) {
-  if (!is_header_line(line))
+  if (!is_header_line(line, length))
     return MARKER_ERROR_INVALID_INPUT;
 
   int level = 0;
-  while (line[level] == '#' && level < 6) {
+  while ((size_t) level < length && line[level] == '#' && level < 6) {
     level++;
   }
 
   // Skip whitespace after # marks
   size_t content_start = level;
-  while (line[content_start] == ' ') {
+  while (content_start < length && line[content_start] == ' ') {
     content_start++;
   }
 
-  char tag[8];
-  snprintf(tag, sizeof(tag), "h%d", level);
-
-  marker_result_t result = buffer_append_str(output, "<");
-  if (result != MARKER_OK)
-    return result;
-  result = buffer_append_str(output, tag);
-  if (result != MARKER_OK)
-    return result;
-  result = buffer_append_str(output, ">");
+  marker_result_t result = emit_open(parser, output, MARKER_NODE_HEADING, 0, (unsigned) level);
   if (result != MARKER_OK)
     return result;
 
   // Parse inline content
-  size_t pos      = content_start;
-  size_t line_len = strlen(line);
-  result          = parse_inline_content(parser, line, &pos, output, line_len);
+  size_t pos = content_start;
+  result     = parse_inline_content(parser, line, &pos, output, length);
   if (result != MARKER_OK)
     return result;
 
-  result = buffer_append_str(output, "</");
-  if (result != MARKER_OK)
-    return result;
-  result = buffer_append_str(output, tag);
-  if (result != MARKER_OK)
-    return result;
-  result = buffer_append_str(output, ">\n");
-  if (result != MARKER_OK)
-    return result;
-
-  return MARKER_OK;
+  return emit_close(parser, output, MARKER_NODE_HEADING, 0, (unsigned) level);
 }
 
 static marker_result_t parse_blockquote(marker_parser_t* parser, const char* line,
-                                        marker_buffer_t* output) {
-  if (!is_blockquote(line))
+                                        size_t length, marker_buffer_t* output) {
+  if (!is_blockquote(line, length))
     return MARKER_ERROR_INVALID_INPUT;
 
   size_t content_start = 1;
-  if (line[content_start] == ' ') {
+  if (content_start < length && line[content_start] == ' ') {
     content_start++;
   }
 
-  marker_result_t result = buffer_append_str(output, "<blockquote>");
+  marker_result_t result = emit_open(parser, output, MARKER_NODE_BLOCKQUOTE, 0, 0);
   if (result != MARKER_OK)
     return result;
 
   // Parse inline content
-  size_t pos      = content_start;
-  size_t line_len = strlen(line);
-  result          = parse_inline_content(parser, line, &pos, output, line_len);
-  if (result != MARKER_OK)
-    return result;
-
-  result = buffer_append_str(output, "</blockquote>\n");
+  size_t pos = content_start;
+  result     = parse_inline_content(parser, line, &pos, output, length);
   if (result != MARKER_OK)
     return result;
 
-  return MARKER_OK;
+  return emit_close(parser, output, MARKER_NODE_BLOCKQUOTE, 0, 0);
 }
 
-static marker_result_t parse_list_item(marker_parser_t* parser, const char* line,
+static marker_result_t parse_list_item(marker_parser_t* parser, const char* line, size_t length,
                                        marker_buffer_t* output, bool* is_ordered) {
-  if (!is_list_item(line))
+  if (!is_list_item(line, length))
     return MARKER_ERROR_INVALID_INPUT;
 
   size_t content_start = 0;
@@ -1289,7 +2972,8 @@ static marker_result_t parse_list_item(marker_parser_t* parser, const char* line
   bool is_task    = false;
   bool is_checked = false;
 
-  if (parser->config.enable_task_lists && line[content_start] == '[' &&
+  if (parser->config.enable_task_lists && content_start + 3 < length &&
+      line[content_start] == '[' &&
       (line[content_start + 1] == ' ' || line[content_start + 1] == 'x' ||
        line[content_start + 1] == 'X') &&
       line[content_start + 2] == ']' && line[content_start + 3] == ' ') {
@@ -1298,58 +2982,32 @@ static marker_result_t parse_list_item(marker_parser_t* parser, const char* line
     content_start += 4;
   }
 
-  marker_result_t result = buffer_append_str(output, "<li");
-  if (result != MARKER_OK)
-    return result;
-
-  if (is_task) {
-    result = buffer_append_str(output, " class=\"task-list-item\"");
-    if (result != MARKER_OK)
-      return result;
-  }
+  unsigned flags = 0;
+  if (is_task)
+    flags = is_checked ? MARKER_NODE_TASK | MARKER_NODE_CHECKED : MARKER_NODE_TASK;
 
-  result = buffer_append_str(output, ">");
+  marker_result_t result = emit_open(parser, output, MARKER_NODE_ITEM, flags, 0);
   if (result != MARKER_OK)
     return result;
 
-  if (is_task) {
-    result = buffer_append_str(output, "<input type=\"checkbox\"");
-    if (result != MARKER_OK)
-      return result;
-    if (is_checked) {
-      result = buffer_append_str(output, " checked");
-      if (result != MARKER_OK)
-        return result;
-    }
-    result = buffer_append_str(output, " disabled> ");
-    if (result != MARKER_OK)
-      return result;
-  }
-
   // Parse inline content
-  size_t pos      = content_start;
-  size_t line_len = strlen(line);
-  result          = parse_inline_content(parser, line, &pos, output, line_len);
-  if (result != MARKER_OK)
-    return result;
-
-  result = buffer_append_str(output, "</li>\n");
+  size_t pos = content_start;
+  result     = parse_inline_content(parser, line, &pos, output, length);
   if (result != MARKER_OK)
     return result;
 
-  return MARKER_OK;
+  return emit_close(parser, output, MARKER_NODE_ITEM, flags, 0);
 }
 
 static marker_result_t parse_table_row(marker_parser_t* parser, const char* line,
-                                       marker_buffer_t* output, bool is_header) {
-  const char* tag = is_header ? "th" : "td";
+                                       size_t line_len, marker_buffer_t* output, bool is_header) {
+  unsigned flags = is_header ? MARKER_NODE_HEADER : 0;
 
-  marker_result_t result = buffer_append_str(output, "<tr>");
+  marker_result_t result = emit_open(parser, output, MARKER_NODE_TABLE_ROW, 0, 0);
   if (result != MARKER_OK)
     return result;
 
-  size_t pos      = 0;
-  size_t line_len = strlen(line);
+  size_t pos = 0;
 
   // Skip leading whitespace and pipe
   while (pos < line_len && (is_whitespace(line[pos]) || line[pos] == '|')) {
@@ -1357,13 +3015,7 @@ static marker_result_t parse_table_row(marker_parser_t* parser, const char* line
   }
 
   while (pos < line_len) {
-    result = buffer_append_str(output, "<");
-    if (result != MARKER_OK)
-      return result;
-    result = buffer_append_str(output, tag);
-    if (result != MARKER_OK)
-      return result;
-    result = buffer_append_str(output, ">");
+    result = emit_open(parser, output, MARKER_NODE_TABLE_CELL, flags, 0);
     if (result != MARKER_OK)
       return result;
 
@@ -1383,29 +3035,14 @@ static marker_result_t parse_table_row(marker_parser_t* parser, const char* line
       cell_start++;
     }
 
-    // Parse cell content
+    // Parse cell content, a span of its own within the line
     if (cell_end > cell_start) {
-      char* cell_content = malloc(cell_end - cell_start + 1);
-      if (!cell_content)
-        return MARKER_ERROR_MEMORY_ALLOCATION;
-
-      memcpy(cell_content, line + cell_start, cell_end - cell_start);
-      cell_content[cell_end - cell_start] = '\0';
-
-      size_t cell_pos = 0;
-      result = parse_inline_content(parser, cell_content, &cell_pos, output, cell_end - cell_start);
-      free(cell_content);
+      result = parse_inline_content(parser, line, &cell_start, output, cell_end);
       if (result != MARKER_OK)
         return result;
     }
 
-    result = buffer_append_str(output, "</");
-    if (result != MARKER_OK)
-      return result;
-    result = buffer_append_str(output, tag);
-    if (result != MARKER_OK)
-      return result;
-    result = buffer_append_str(output, ">");
+    result = emit_close(parser, output, MARKER_NODE_TABLE_CELL, flags, 0);
     if (result != MARKER_OK)
       return result;
 
@@ -1418,501 +3055,1036 @@ static marker_result_t parse_table_row(marker_parser_t* parser, const char* line
     }
   }
 
-  result = buffer_append_str(output, "</tr>\n");
-  if (result != MARKER_OK)
-    return result;
-
-  return MARKER_OK;
+  return emit_close(parser, output, MARKER_NODE_TABLE_ROW, 0, 0);
 }
 
-static marker_result_t parse_paragraph(marker_parser_t* parser, const char* line,
+static marker_result_t parse_paragraph(marker_parser_t* parser, const char* line, size_t length,
                                        marker_buffer_t* output) {
-  marker_result_t result = buffer_append_str(output, "<p>");
-  if (result != MARKER_OK)
-    return result;
-
-  size_t pos      = 0;
-  size_t line_len = strlen(line);
-  result          = parse_inline_content(parser, line, &pos, output, line_len);
+  marker_result_t result = emit_open(parser, output, MARKER_NODE_PARAGRAPH, 0, 0);
   if (result != MARKER_OK)
     return result;
 
-  result = buffer_append_str(output, "</p>\n");
+  size_t pos = 0;
+  result     = parse_inline_content(parser, line, &pos, output, length);
   if (result != MARKER_OK)
     return result;
 
-  return MARKER_OK;
+  return emit_close(parser, output, MARKER_NODE_PARAGRAPH, 0, 0);
 }
 
-// Main parsing function
-marker_result_t marker_parse(marker_parser_t* parser, const char* markdown,
-                             marker_buffer_t* output) {
-  if (!parser || !markdown || !output)
-    return MARKER_ERROR_NULL_POINTER;
+// Whether a trimmed line defines a reference link, `[label]: url "title"`
+static bool is_reference_definition(const char* line, size_t length) {
+  const char* closing = length > 0 && line[0] == '[' ? memchr(line, ']', length) : NULL;
+  return closing && closing + 1 < line + length && closing[1] == ':';
+}
 
-  const char* p               = markdown;
-  bool        in_code_block   = false;
-  bool        in_list         = false;
-  bool        list_is_ordered = false;
-  bool        in_table        = false;
+// Add the definition on a line that is_reference_definition accepted
+static marker_result_t parse_reference_definition(marker_parser_t* parser, const char* line,
+                                                  size_t length) {
+  const char* line_end  = line + length;
+  const char* closing   = memchr(line, ']', length);
+  const char* url_start = closing + 2;
+  while (url_start < line_end && (*url_start == ' ' || *url_start == '\t'))
+    url_start++;
+
+  const char* url_end = url_start;
+  while (url_end < line_end && !is_whitespace(*url_end)) {
+    url_end++;
+  }
 
-  while (*p) {
-    // Extract line
-    size_t line_len = 0;
-    while (p[line_len] && p[line_len] != '\n') {
-      line_len++;
+  const char* title_start = url_end;
+  while (title_start < line_end && (*title_start == ' ' || *title_start == '\t'))
+    title_start++;
+
+  // The title runs to the last quote of the line
+  const char* title     = NULL;
+  size_t      title_len = 0;
+  if (title_start < line_end && *title_start == '"') {
+    title_start++;
+    const char* title_end = line_end;
+    while (title_end > title_start && title_end[-1] != '"')
+      title_end--;
+    if (title_end > title_start) {
+      title     = title_start;
+      title_len = (size_t) (title_end - 1 - title_start);
     }
+  }
 
-    if (line_len >= parser->line_buffer_size) {
-      char* new_buffer = realloc(parser->line_buffer, line_len + 1);
-      if (!new_buffer)
-        return MARKER_ERROR_MEMORY_ALLOCATION;
-      parser->line_buffer      = new_buffer;
-      parser->line_buffer_size = line_len + 1;
+  return add_reference_link(parser, line + 1, (size_t) (closing - line - 1), url_start,
+                            (size_t) (url_end - url_start), title, title_len);
+}
+
+// Length of the line at p, without its newline
+static size_t line_length(const char* p, const char* end) {
+  const char* newline = memchr(p, '\n', (size_t) (end - p));
+  return (size_t) ((newline ? newline : end) - p);
+}
+
+static marker_result_t close_list(marker_parser_t* parser, block_state_t* state,
+                                  marker_buffer_t* output) {
+  if (!state->in_list)
+    return MARKER_OK;
+  state->in_list = false;
+  return emit_close(parser, output, MARKER_NODE_LIST,
+                    state->list_is_ordered ? MARKER_NODE_ORDERED : 0, 0);
+}
+
+static marker_result_t close_table(marker_parser_t* parser, block_state_t* state,
+                                   marker_buffer_t* output) {
+  if (!state->in_table)
+    return MARKER_OK;
+  state->in_table        = false;
+  marker_result_t result = emit_close(parser, output, MARKER_NODE_TABLE_BODY, 0, 0);
+  if (result != MARKER_OK)
+    return result;
+  return emit_close(parser, output, MARKER_NODE_TABLE, 0, 0);
+}
+
+// Render the lines of text[0, text_len). Lines and inline spans are ranges of
+// the input, which is never copied or written to. Unless final is set, parsing
+// stops before a line without its newline, and before a possible table header
+// whose next line is not complete yet. *consumed is how far it got.
+static marker_result_t parse_blocks(marker_parser_t* parser, block_state_t* state,
+                                    const char* text, size_t text_len, bool final,
+                                    marker_buffer_t* output, marker_sink_t* sink,
+                                    size_t* consumed) {
+  const char* p    = text;
+  const char* end  = text + text_len;
+  size_t      mark = output_mark(parser, output);
+
+  while (p < end) {
+    // The output of the line before counts towards the limit
+    marker_result_t result = charge_output(parser, output, mark);
+    if (result != MARKER_OK)
+      return result;
+
+    // Hand the output to the sink once enough of it has built up
+    if (sink && output->size >= SINK_CHUNK_SIZE) {
+      result = sink->write(sink, output->data, output->size);
+      if (result != MARKER_OK)
+        return result;
+      marker_buffer_clear(output);
     }
+    mark = output_mark(parser, output);
 
-    memcpy(parser->line_buffer, p, line_len);
-    parser->line_buffer[line_len] = '\0';
+    // Extract line
+    size_t line_len = line_length(p, end);
+    if (!final && p + line_len == end)
+      break;
+    result = charge_work(parser, line_len + 1);
+    if (result != MARKER_OK)
+      return result;
 
-    char* line = parser->line_buffer;
-    trim_whitespace(line);
+    const char* line   = p;
+    size_t      length = line_len;
+    trim_whitespace(&line, &length);
 
     // Handle code blocks
-    if (is_code_fence(line)) {
-      if (!in_code_block) {
-        marker_result_t result = buffer_append_str(output, "<pre><code>");
-        if (result != MARKER_OK)
-          return result;
-        in_code_block = true;
-      } else {
-        marker_result_t result = buffer_append_str(output, "</code></pre>\n");
-        if (result != MARKER_OK)
-          return result;
-        in_code_block = false;
-      }
-    } else if (in_code_block) {
+    if (is_code_fence(line, length)) {
+      if (!state->in_code_block)
+        result = emit_open(parser, output, MARKER_NODE_CODE_BLOCK, 0, 0);
+      else
+        result = emit_close(parser, output, MARKER_NODE_CODE_BLOCK, 0, 0);
+      state->in_code_block = !state->in_code_block;
+    } else if (state->in_code_block) {
       // Inside code block - output verbatim with HTML escaping
-      marker_result_t result = append_escaped_html(output, line, strlen(line));
-      if (result != MARKER_OK)
-        return result;
-      result = buffer_append_char(output, '\n');
-      if (result != MARKER_OK)
-        return result;
+      result = emit_leaf(parser, output, MARKER_NODE_TEXT, MARKER_NODE_LINE, line, length);
     } else {
       // Check for reference link definitions
-      if (line[0] == '[') {
-        char* closing = strchr(line, ']');
-        if (closing && closing[1] == ':') {
-          // Parse reference link definition
-          size_t label_len = closing - line - 1;
-          char*  label     = malloc(label_len + 1);
-          if (label) {
-            memcpy(label, line + 1, label_len);
-            label[label_len] = '\0';
-
-            char* url_start = closing + 2;
-            while (*url_start == ' ' || *url_start == '\t')
-              url_start++;
-
-            char* url_end = url_start;
-            while (*url_end && !is_whitespace(*url_end)) {
-              url_end++;
-            }
-
-            size_t url_len = url_end - url_start;
-            char*  url     = malloc(url_len + 1);
-            if (url) {
-              memcpy(url, url_start, url_len);
-              url[url_len] = '\0';
-
-              char* title_start = url_end;
-              while (*title_start == ' ' || *title_start == '\t')
-                title_start++;
-
-              char* title = NULL;
-              if (*title_start == '"') {
-                title_start++;
-                char* title_end = strrchr(title_start, '"');
-                if (title_end) {
-                  size_t title_len = title_end - title_start;
-                  title            = malloc(title_len + 1);
-                  if (title) {
-                    memcpy(title, title_start, title_len);
-                    title[title_len] = '\0';
-                  }
-                }
-              }
-
-              marker_add_reference_link(parser, label, url, title);
-              free(url);
-              if (title)
-                free(title);
-            }
-            free(label);
-          }
-
-          // Skip to next line
-          p += line_len;
-          if (*p == '\n')
-            p++;
-          continue;
-        }
+      if (is_reference_definition(line, length)) {
+        parse_reference_definition(parser, line, length);
       }
-
       // Handle empty lines
-      if (strlen(line) == 0) {
-        if (in_list) {
-          marker_result_t result =
-              buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_list = false;
-        }
-        if (in_table) {
-          marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_table = false;
-        }
-        marker_result_t result = buffer_append_char(output, '\n');
-        if (result != MARKER_OK)
-          return result;
+      else if (length == 0) {
+        result = close_list(parser, state, output);
+        if (result == MARKER_OK)
+          result = close_table(parser, state, output);
+        if (result == MARKER_OK)
+          result = emit_leaf(parser, output, MARKER_NODE_BLANK_LINE, 0, line, 0);
       }
       // Handle headers
-      else if (is_header_line(line)) {
-        if (in_list) {
-          marker_result_t result =
-              buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_list = false;
-        }
-        if (in_table) {
-          marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_table = false;
-        }
-        marker_result_t result = parse_header(parser, line, output);
-        if (result != MARKER_OK)
-          return result;
+      else if (is_header_line(line, length)) {
+        result = close_list(parser, state, output);
+        if (result == MARKER_OK)
+          result = close_table(parser, state, output);
+        if (result == MARKER_OK)
+          result = parse_header(parser, line, length, output);
       }
       // Handle horizontal rules
-      else if (is_horizontal_rule(line)) {
-        if (in_list) {
-          marker_result_t result =
-              buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_list = false;
-        }
-        if (in_table) {
-          marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_table = false;
-        }
-        marker_result_t result = buffer_append_str(output, "<hr>\n");
-        if (result != MARKER_OK)
-          return result;
+      else if (is_horizontal_rule(line, length)) {
+        result = close_list(parser, state, output);
+        if (result == MARKER_OK)
+          result = close_table(parser, state, output);
+        if (result == MARKER_OK)
+          result = emit_leaf(parser, output, MARKER_NODE_THEMATIC_BREAK, 0, line, 0);
       }
       // Handle blockquotes
-      else if (is_blockquote(line)) {
-        if (in_list) {
-          marker_result_t result =
-              buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_list = false;
-        }
-        if (in_table) {
-          marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_table = false;
-        }
-        marker_result_t result = parse_blockquote(parser, line, output);
-        if (result != MARKER_OK)
-          return result;
+      else if (is_blockquote(line, length)) {
+        result = close_list(parser, state, output);
+        if (result == MARKER_OK)
+          result = close_table(parser, state, output);
+        if (result == MARKER_OK)
+          result = parse_blockquote(parser, line, length, output);
       }
       // Handle list items
-      else if (is_list_item(line)) {
-        bool item_is_ordered;
-
-        if (in_table) {
-          marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_table = false;
+      else if (is_list_item(line, length)) {
+        result = close_table(parser, state, output);
+
+        // The first item decides the type of the list
+        if (result == MARKER_OK && !state->in_list) {
+          state->list_is_ordered = isdigit((unsigned char) line[0]);
+          state->in_list         = true;
+          result                 = emit_open(parser, output, MARKER_NODE_LIST,
+                                             state->list_is_ordered ? MARKER_NODE_ORDERED : 0, 0);
         }
 
-        // Check if we need to start a new list
-        if (!in_list) {
-          // Determine list type from first item
-          bool dummy;
-          parse_list_item(parser, line, NULL, &dummy);  // Just to get the type
-          list_is_ordered = isdigit((unsigned char) line[0]);
+        bool item_is_ordered;
+        if (result == MARKER_OK)
+          result = parse_list_item(parser, line, length, output, &item_is_ordered);
+      }
+      // Handle tables
+      else if (parser->config.enable_tables && memchr(line, '|', length)) {
+        // Check if next line is table separator
+        const char* next_line_start = p + line_len;
+        if (next_line_start < end)
+          next_line_start++;
+
+        size_t next_line_len = line_length(next_line_start, end);
+        if (!final && next_line_start + next_line_len == end)
+          break;
 
-          marker_result_t result = buffer_append_str(output, list_is_ordered ? "<ol>\n" : "<ul>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_list = true;
-        }
+        const char* next_line   = next_line_start;
+        size_t      next_length = next_line_len;
+        trim_whitespace(&next_line, &next_length);
 
-        marker_result_t result = parse_list_item(parser, line, output, &item_is_ordered);
+        result = close_list(parser, state, output);
         if (result != MARKER_OK)
           return result;
-      }
-      // Handle tables
-      else if (parser->config.enable_tables && strchr(line, '|')) {
-        if (in_list) {
-          marker_result_t result =
-              buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
+
+        if (is_table_separator(next_line, next_length)) {
+          // A header row starts a new table
+          result = close_table(parser, state, output);
+          if (result == MARKER_OK)
+            result = emit_open(parser, output, MARKER_NODE_TABLE, 0, 0);
+          if (result == MARKER_OK)
+            result = emit_open(parser, output, MARKER_NODE_TABLE_HEAD, 0, 0);
+          if (result == MARKER_OK)
+            result = parse_table_row(parser, line, length, output, true);
+          if (result == MARKER_OK)
+            result = emit_close(parser, output, MARKER_NODE_TABLE_HEAD, 0, 0);
+          if (result == MARKER_OK)
+            result = emit_open(parser, output, MARKER_NODE_TABLE_BODY, 0, 0);
           if (result != MARKER_OK)
             return result;
-          in_list = false;
-        }
-
-        // Check if next line is table separator
-        const char* next_line_start = p + line_len;
-        if (*next_line_start == '\n')
-          next_line_start++;
 
-        size_t next_line_len = 0;
-        while (next_line_start[next_line_len] && next_line_start[next_line_len] != '\n') {
-          next_line_len++;
-        }
+          state->in_table = true;
 
-        char* next_line = malloc(next_line_len + 1);
-        if (next_line) {
-          memcpy(next_line, next_line_start, next_line_len);
-          next_line[next_line_len] = '\0';
-          trim_whitespace(next_line);
-
-          if (is_table_separator(next_line)) {
-            // Start table
-            if (!in_table) {
-              marker_result_t result = buffer_append_str(output, "<table>\n<thead>\n");
-              if (result != MARKER_OK) {
-                free(next_line);
-                return result;
-              }
-            }
-
-            // Parse header row
-            marker_result_t result = parse_table_row(parser, line, output, true);
-            if (result != MARKER_OK) {
-              free(next_line);
-              return result;
-            }
-
-            result = buffer_append_str(output, "</thead>\n<tbody>\n");
-            if (result != MARKER_OK) {
-              free(next_line);
-              return result;
-            }
-
-            in_table = true;
-
-            // Skip separator line
-            p = next_line_start + next_line_len;
-            if (*p == '\n')
-              p++;
-
-            free(next_line);
-            continue;
-          }
-          free(next_line);
+          // Skip separator line
+          p = next_line_start + next_line_len;
+          if (p < end)
+            p++;
+          continue;
         }
 
-        if (in_table) {
+        if (state->in_table) {
           // Parse table data row
-          marker_result_t result = parse_table_row(parser, line, output, false);
-          if (result != MARKER_OK)
-            return result;
+          result = parse_table_row(parser, line, length, output, false);
         } else {
           // Regular paragraph
-          marker_result_t result = parse_paragraph(parser, line, output);
-          if (result != MARKER_OK)
-            return result;
+          result = parse_paragraph(parser, line, length, output);
         }
       }
       // Handle regular paragraphs
       else {
-        if (in_list) {
-          marker_result_t result =
-              buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_list = false;
-        }
-        if (in_table) {
-          marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-          if (result != MARKER_OK)
-            return result;
-          in_table = false;
-        }
-        marker_result_t result = parse_paragraph(parser, line, output);
-        if (result != MARKER_OK)
-          return result;
+        result = close_list(parser, state, output);
+        if (result == MARKER_OK)
+          result = close_table(parser, state, output);
+        if (result == MARKER_OK)
+          result = parse_paragraph(parser, line, length, output);
       }
     }
+    if (result != MARKER_OK)
+      return result;
 
     // Move to next line
     p += line_len;
-    if (*p == '\n')
+    if (p < end)
       p++;
   }
 
-  // Close any remaining open elements
-  if (in_code_block) {
-    marker_result_t result = buffer_append_str(output, "</code></pre>\n");
-    if (result != MARKER_OK)
-      return result;
+  *consumed = (size_t) (p - text);
+  return charge_output(parser, output, mark);
+}
+
+// Close the blocks still open at the end of the input
+static marker_result_t close_blocks(marker_parser_t* parser, block_state_t* state,
+                                    marker_buffer_t* output) {
+  marker_result_t result = MARKER_OK;
+  if (state->in_code_block)
+    result = emit_close(parser, output, MARKER_NODE_CODE_BLOCK, 0, 0);
+  if (result == MARKER_OK)
+    result = close_list(parser, state, output);
+  if (result == MARKER_OK)
+    result = close_table(parser, state, output);
+  if (result != MARKER_OK)
+    return result;
+
+  memset(state, 0, sizeof(*state));
+  return MARKER_OK;
+}
+
+marker_result_t marker_parse_n(marker_parser_t* parser, const char* markdown, size_t markdown_len,
+                               marker_buffer_t* output) {
+  if (!parser || !markdown || !output)
+    return MARKER_ERROR_NULL_POINTER;
+
+  begin_parse(parser);
+
+  block_state_t   state = {0};
+  size_t          consumed;
+  marker_result_t result =
+      parse_blocks(parser, &state, markdown, markdown_len, true, output, NULL, &consumed);
+  if (result != MARKER_OK)
+    return result;
+  return close_blocks(parser, &state, output);
+}
+
+marker_result_t marker_parse(marker_parser_t* parser, const char* markdown,
+                             marker_buffer_t* output) {
+  if (!parser || !markdown || !output)
+    return MARKER_ERROR_NULL_POINTER;
+  return marker_parse_n(parser, markdown, strlen(markdown), output);
+}
+
+// One piece of the input of marker_parse_parallel and the worker that renders it
+typedef struct {
+  const marker_parser_t* source;  // Only read while the chunks are parsed
+  marker_parser_t*       parser;
+  marker_buffer_t*       output;
+  const char*            text;
+  size_t                 length;
+  const parallel_ref_t*  refs;  // Definitions in the chunks before this one
+  size_t                 ref_count;
+  marker_result_t        result;
+} parallel_chunk_t;
+
+static marker_result_t parse_chunk(parallel_chunk_t* chunk) {
+  marker_parser_t* parser = chunk->parser;
+  reset_reference_links(parser);
+  begin_parse(parser);
+
+  // Start from the definitions a serial parse would know at this point
+  const marker_parser_t* source = chunk->source;
+  marker_result_t        result = MARKER_OK;
+  for (size_t i = 0; i < source->ref_slot_count && result == MARKER_OK; i++) {
+    const marker_ref_link_t* link = source->ref_slots[i] ? &source->ref_slots[i]->link : NULL;
+    if (link)
+      result = add_reference_link(parser, link->label, strlen(link->label), link->url,
+                                  strlen(link->url), link->title,
+                                  link->title ? strlen(link->title) : 0);
   }
-  if (in_list) {
-    marker_result_t result = buffer_append_str(output, list_is_ordered ? "</ol>\n" : "</ul>\n");
-    if (result != MARKER_OK)
-      return result;
+  for (size_t i = 0; i < chunk->ref_count && result == MARKER_OK; i++)
+    result = parse_reference_definition(parser, chunk->refs[i].line, chunk->refs[i].length);
+
+  block_state_t state = {0};
+  size_t        consumed;
+  if (result == MARKER_OK)
+    result = parse_blocks(parser, &state, chunk->text, chunk->length, true, chunk->output, NULL,
+                          &consumed);
+  if (result == MARKER_OK)
+    result = close_blocks(parser, &state, chunk->output);
+  return result;
+}
+
+static void* parse_chunk_thread(void* arg) {
+  parallel_chunk_t* chunk = arg;
+  chunk->result           = parse_chunk(chunk);
+  return NULL;
+}
+
+// Make sure the parser has count workers
+static marker_result_t ensure_workers(marker_parser_t* parser, size_t count) {
+  if (parser->worker_count >= count)
+    return MARKER_OK;
+
+  size_t             size    = parser->worker_count * sizeof(parallel_worker_t);
+  parallel_worker_t* workers = heap_realloc(&parser->allocator, parser->workers, size,
+                                            count * sizeof(parallel_worker_t));
+  if (!workers)
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+  parser->workers = workers;
+
+  // A worker's buffer comes from the worker, so its stats cover both
+  while (parser->worker_count < count) {
+    parallel_worker_t worker = {marker_parser_new(&parser->config), NULL};
+    if (!worker.parser)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    worker.output = marker_buffer_new_with_allocator(0, &worker.parser->allocator);
+    if (!worker.output) {
+      marker_parser_free(worker.parser);
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    }
+    workers[parser->worker_count++] = worker;
   }
-  if (in_table) {
-    marker_result_t result = buffer_append_str(output, "</tbody></table>\n");
-    if (result != MARKER_OK)
-      return result;
+  return MARKER_OK;
+}
+
+marker_result_t marker_parse_parallel(marker_parser_t* parser, const char* markdown,
+                                      size_t markdown_len, marker_buffer_t* output,
+                                      size_t thread_count) {
+  if (!parser || !markdown || !output)
+    return MARKER_ERROR_NULL_POINTER;
+
+  size_t target = markdown_len / PARALLEL_MIN_CHUNK;
+  if (target > thread_count)
+    target = thread_count;
+  if (target > PARALLEL_MAX_THREADS)
+    target = PARALLEL_MAX_THREADS;
+  if (target <= 1)
+    return marker_parse_n(parser, markdown, markdown_len, output);
+
+  begin_parse(parser);
+
+  // One pass over the lines finds the places to split and the reference
+  // definitions. After a blank line outside a code block no list or table is
+  // open and no lookahead reaches back, so a chunk can start there with empty
+  // state. Only fences, definitions and blank lines matter here.
+  size_t      starts[PARALLEL_MAX_THREADS + 1];
+  size_t      refs_before[PARALLEL_MAX_THREADS];
+  size_t      chunk_count = 1;
+  size_t      ref_count   = 0;
+  bool        in_code     = false;
+  bool        after_blank = false;
+  const char* p           = markdown;
+  const char* end         = markdown + markdown_len;
+  starts[0]               = 0;
+  refs_before[0]          = 0;
+  while (p < end) {
+    size_t offset = (size_t) (p - markdown);
+    if (after_blank && chunk_count < target && offset >= chunk_count * (markdown_len / target)) {
+      starts[chunk_count]        = offset;
+      refs_before[chunk_count++] = ref_count;
+    }
+
+    size_t      line_len = line_length(p, end);
+    const char* line     = p;
+    size_t      length   = line_len;
+    trim_whitespace(&line, &length);
+
+    after_blank = false;
+    if (is_code_fence(line, length)) {
+      in_code = !in_code;
+    } else if (!in_code && is_reference_definition(line, length)) {
+      if (ref_count == parser->parallel_ref_capacity) {
+        parallel_ref_t* refs = parser_grow(parser, parser->parallel_refs,
+                                           &parser->parallel_ref_capacity, sizeof(parallel_ref_t));
+        if (!refs)
+          return MARKER_ERROR_MEMORY_ALLOCATION;
+        parser->parallel_refs = refs;
+      }
+      parallel_ref_t ref                 = {line, length};
+      parser->parallel_refs[ref_count++] = ref;
+    } else if (!in_code && length == 0) {
+      after_blank = true;
+    }
+
+    p += line_len;
+    if (p < end)
+      p++;
   }
+  starts[chunk_count] = markdown_len;
 
-  return MARKER_OK;
+  if (chunk_count == 1)
+    return marker_parse_n(parser, markdown, markdown_len, output);
+
+  marker_result_t result = ensure_workers(parser, chunk_count);
+  if (result != MARKER_OK)
+    return result;
+
+  // The first chunk is rendered straight into the output on this thread
+  parallel_chunk_t chunks[PARALLEL_MAX_THREADS];
+  pthread_t        threads[PARALLEL_MAX_THREADS];
+  bool             started[PARALLEL_MAX_THREADS];
+  for (size_t i = 0; i < chunk_count; i++) {
+    parallel_chunk_t chunk = {parser,
+                              parser->workers[i].parser,
+                              i == 0 ? output : parser->workers[i].output,
+                              markdown + starts[i],
+                              starts[i + 1] - starts[i],
+                              parser->parallel_refs,
+                              refs_before[i],
+                              MARKER_OK};
+    chunks[i]              = chunk;
+    if (i > 0)
+      marker_buffer_clear(chunk.output);
+  }
+  for (size_t i = 1; i < chunk_count; i++)
+    started[i] = pthread_create(&threads[i], NULL, parse_chunk_thread, &chunks[i]) == 0;
+
+  chunks[0].result = parse_chunk(&chunks[0]);
+
+  // A chunk whose thread could not be started is rendered here instead
+  for (size_t i = 1; i < chunk_count; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      chunks[i].result = parse_chunk(&chunks[i]);
+  }
+
+  // Each chunk kept to the limits alone, together they must too
+  parser->work        = 0;
+  parser->output_size = 0;
+  for (size_t i = 0; i < chunk_count; i++) {
+    parser->work += chunks[i].parser->work;
+    parser->output_size += chunks[i].parser->output_size;
+  }
+  const marker_config_t* config = &parser->config;
+  if ((config->max_work && parser->work > config->max_work) ||
+      (config->max_output_size && parser->output_size > config->max_output_size))
+    result = MARKER_ERROR_LIMIT_EXCEEDED;
+
+  // Join the chunks in order, stopping at the first that failed
+  for (size_t i = 0; i < chunk_count && result == MARKER_OK; i++) {
+    result = chunks[i].result;
+    if (i > 0 && result == MARKER_OK)
+      result = buffer_append(output, chunks[i].output->data, chunks[i].output->size);
+  }
+
+  // Leave the parser with the definitions a serial parse would have added
+  for (size_t i = 0; i < ref_count && result == MARKER_OK; i++)
+    result = parse_reference_definition(parser, parser->parallel_refs[i].line,
+                                        parser->parallel_refs[i].length);
+  return result;
 }
 
-// Simplified API functions
-marker_result_t marker_to_html(const char* markdown, char* html, size_t html_size,
-                               const char* css_file) {
-  if (!markdown || !html || html_size == 0)
+marker_result_t marker_parse_to_sink(marker_parser_t* parser, const char* markdown,
+                                     size_t markdown_len, marker_sink_t* sink) {
+  if (!parser || !markdown || !sink)
     return MARKER_ERROR_NULL_POINTER;
 
-  marker_parser_t* parser = marker_parser_new(NULL);
-  if (!parser)
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+  if (!parser->sink_output) {
+    parser->sink_output = marker_buffer_new_with_allocator(SINK_CHUNK_SIZE * 2, &parser->allocator);
+    if (!parser->sink_output)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+  }
 
-  marker_buffer_t* buffer = marker_buffer_new(html_size);
-  if (!buffer) {
-    marker_parser_free(parser);
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+  begin_parse(parser);
+
+  // Blocks are rendered into a small buffer that is drained as it fills
+  marker_buffer_t* output = parser->sink_output;
+  block_state_t    state  = {0};
+  size_t           consumed;
+  marker_buffer_clear(output);
+  marker_result_t result =
+      parse_blocks(parser, &state, markdown, markdown_len, true, output, sink, &consumed);
+  if (result == MARKER_OK)
+    result = close_blocks(parser, &state, output);
+  if (result == MARKER_OK)
+    result = marker_sink_write(sink, output->data, output->size);
+  if (result == MARKER_OK)
+    result = marker_sink_flush(sink);
+
+  marker_buffer_clear(output);
+  return result;
+}
+
+marker_scatter_t* marker_scatter_new(void) {
+  marker_scatter_t* scatter = malloc(sizeof(marker_scatter_t));
+  if (!scatter)
+    return NULL;
+
+  scatter->output = marker_buffer_new(0);
+  if (!scatter->output) {
+    free(scatter);
+    return NULL;
   }
 
-  // Add HTML document structure
-  marker_result_t result = buffer_append_str(buffer, "<!DOCTYPE html><html><head>");
+  scatter->pieces         = NULL;
+  scatter->piece_count    = 0;
+  scatter->piece_capacity = 0;
+  scatter->output_mark    = 0;
+  scatter->source_size    = 0;
+  scatter->size           = 0;
+  return scatter;
+}
+
+void marker_scatter_free(marker_scatter_t* scatter) {
+  if (!scatter)
+    return;
+  marker_buffer_free(scatter->output);
+  free(scatter->pieces);
+  free(scatter);
+}
+
+marker_result_t marker_parse_scatter(marker_parser_t* parser, const char* markdown,
+                                     size_t markdown_len, marker_scatter_t* scatter) {
+  if (!parser || !markdown || !scatter)
+    return MARKER_ERROR_NULL_POINTER;
+
+  marker_buffer_clear(scatter->output);
+  scatter->piece_count = 0;
+  scatter->output_mark = 0;
+  scatter->source_size = 0;
+  scatter->size        = 0;
+
+  parser->scatter        = scatter;
+  marker_result_t result = marker_parse_n(parser, markdown, markdown_len, scatter->output);
+  parser->scatter        = NULL;
+  if (result == MARKER_OK)
+    result = scatter_cut(scatter);
   if (result != MARKER_OK) {
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
+    scatter->piece_count = 0;
     return result;
   }
 
-  if (css_file && strlen(css_file) > 0) {
-    result = buffer_append_str(buffer, "<link rel=\"stylesheet\" href=\"");
-    if (result != MARKER_OK) {
-      marker_buffer_free(buffer);
-      marker_parser_free(parser);
-      return result;
+  // The output is complete, so pieces of it can point into it now
+  const char* data = scatter->output->data;
+  for (size_t i = 0; i < scatter->piece_count; i++) {
+    marker_iovec_t* piece = &scatter->pieces[i];
+    if (!piece->base) {
+      piece->base = data;
+      data += piece->length;
     }
-    result = buffer_append_str(buffer, css_file);
-    if (result != MARKER_OK) {
-      marker_buffer_free(buffer);
-      marker_parser_free(parser);
-      return result;
+    scatter->size += piece->length;
+  }
+  return MARKER_OK;
+}
+
+const marker_iovec_t* marker_scatter_pieces(const marker_scatter_t* scatter, size_t* count) {
+  if (!scatter || !count)
+    return NULL;
+  *count = scatter->piece_count;
+  return scatter->pieces;
+}
+
+size_t marker_scatter_size(const marker_scatter_t* scatter) {
+  return scatter ? scatter->size : 0;
+}
+
+marker_result_t marker_scatter_write(const marker_scatter_t* scatter, int fd) {
+  if (!scatter)
+    return MARKER_ERROR_NULL_POINTER;
+
+  // Pieces go out a batch at a time, a short write resumes inside a piece
+  size_t index  = 0;
+  size_t offset = 0;
+  while (index < scatter->piece_count) {
+    struct iovec batch[SCATTER_WRITE_BATCH];
+    size_t       count = 0;
+    for (size_t i = index; i < scatter->piece_count && count < SCATTER_WRITE_BATCH; i++) {
+      const marker_iovec_t* piece = &scatter->pieces[i];
+      size_t                skip  = i == index ? offset : 0;
+      batch[count].iov_base       = (char*) piece->base + skip;
+      batch[count].iov_len        = piece->length - skip;
+      count++;
     }
-    result = buffer_append_str(buffer, "\">");
-    if (result != MARKER_OK) {
-      marker_buffer_free(buffer);
-      marker_parser_free(parser);
-      return result;
+
+    ssize_t written = writev(fd, batch, (int) count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return MARKER_ERROR_IO_FAILED;
     }
-  }
 
-  result = buffer_append_str(buffer, "</head><body>");
-  if (result != MARKER_OK) {
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
-    return result;
+    size_t left = (size_t) written;
+    while (index < scatter->piece_count && left >= scatter->pieces[index].length - offset) {
+      left -= scatter->pieces[index].length - offset;
+      offset = 0;
+      index++;
+    }
+    offset += left;
   }
+  return MARKER_OK;
+}
 
-  // Parse markdown content
-  result = marker_parse(parser, markdown, buffer);
-  if (result != MARKER_OK) {
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
+marker_document_t* marker_document_new(void) {
+  marker_document_t* document = calloc(1, sizeof(marker_document_t));
+  if (!document)
+    return NULL;
+  marker_config_init(&document->config);
+  return document;
+}
+
+void marker_document_free(marker_document_t* document) {
+  if (!document)
+    return;
+  arena_release(&document->arena);
+  free(document);
+}
+
+marker_result_t marker_parse_document(marker_parser_t* parser, const char* markdown,
+                                      size_t markdown_len, marker_document_t* document) {
+  if (!parser || !markdown || !document)
+    return MARKER_ERROR_NULL_POINTER;
+  if (markdown_len > UINT32_MAX)
+    return MARKER_ERROR_INVALID_SIZE;
+
+  // The arena keeps its memory, so a document of similar size fits again
+  arena_reset(&document->arena);
+  document->source        = markdown;
+  document->config        = parser->config;
+  document->nodes         = NULL;
+  document->node_count    = 0;
+  document->node_capacity = 0;
+  document->links         = NULL;
+  document->link_count    = 0;
+  document->link_capacity = 0;
+  document->open          = 0;
+  document->sibling       = 0;
+
+  marker_node_t   root   = {0};
+  marker_result_t result = document_add(document, &root, true);
+  if (result != MARKER_OK)
     return result;
+  document->nodes[0].first_child = 0;
+
+  begin_parse(parser);
+
+  parser->document = document;
+  block_state_t state = {0};
+  size_t        consumed;
+  result = parse_blocks(parser, &state, markdown, markdown_len, true, NULL, NULL, &consumed);
+  if (result == MARKER_OK)
+    result = close_blocks(parser, &state, NULL);
+  parser->document = NULL;
+
+  if (result != MARKER_OK)
+    document->node_count = 0;
+  return result;
+}
+
+const marker_node_t* marker_document_node(const marker_document_t* document, uint32_t index) {
+  if (!document || index >= document->node_count)
+    return NULL;
+  return &document->nodes[index];
+}
+
+const char* marker_node_text(const marker_document_t* document, const marker_node_t* node,
+                             size_t* length) {
+  if (!document || !node || !length)
+    return NULL;
+  *length = node->length;
+  return document->source + node->start;
+}
+
+static const link_target_t* node_target(const marker_document_t* document,
+                                        const marker_node_t* node) {
+  if (!document || !node)
+    return NULL;
+  if (node->type != MARKER_NODE_LINK && node->type != MARKER_NODE_IMAGE)
+    return NULL;
+  return &document->links[node->link];
+}
+
+const char* marker_node_url(const marker_document_t* document, const marker_node_t* node,
+                            size_t* length) {
+  const link_target_t* target = node_target(document, node);
+  if (!target || !length)
+    return NULL;
+  *length = target->url_len;
+  return target->url;
+}
+
+const char* marker_node_title(const marker_document_t* document, const marker_node_t* node,
+                              size_t* length) {
+  const link_target_t* target = node_target(document, node);
+  if (!target || !target->title || !length)
+    return NULL;
+  *length = target->title_len;
+  return target->title;
+}
+
+marker_result_t marker_document_visit(const marker_document_t* document, marker_visit_fn visit,
+                                      void* user_data) {
+  if (!document || !visit)
+    return MARKER_ERROR_NULL_POINTER;
+  if (document->node_count == 0)
+    return MARKER_OK;
+
+  // Down to the first child, else across to the next sibling, else up to leave
+  // the parent. The root is left last.
+  uint32_t index    = 0;
+  bool     entering = true;
+  for (;;) {
+    const marker_node_t* node   = &document->nodes[index];
+    marker_visit_t       action = visit(document, node, entering, user_data);
+    if (action == MARKER_VISIT_STOP)
+      return MARKER_OK;
+
+    if (entering) {
+      if (node->first_child && action != MARKER_VISIT_SKIP)
+        index = node->first_child;
+      else
+        entering = false;
+    } else if (index == 0) {
+      return MARKER_OK;
+    } else if (node->next) {
+      index    = node->next;
+      entering = true;
+    } else {
+      index = node->parent;
+    }
   }
+}
 
-  result = buffer_append_str(buffer, "</body></html>");
-  if (result != MARKER_OK) {
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
-    return result;
+typedef struct {
+  marker_buffer_t* output;
+  marker_result_t  result;
+} render_state_t;
+
+static marker_visit_t render_node(const marker_document_t* document, const marker_node_t* node,
+                                  bool entering, void* user_data) {
+  render_state_t* state = user_data;
+  if (entering) {
+    state->result = html_open(&document->config, NULL, state->output, node,
+                              document->source + node->start, node_target(document, node));
+  } else {
+    state->result = html_close(state->output, node);
   }
+  return state->result == MARKER_OK ? MARKER_VISIT_CONTINUE : MARKER_VISIT_STOP;
+}
 
-  // Copy to output buffer
-  size_t output_size = marker_buffer_size(buffer);
-  if (output_size >= html_size) {
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
-    return MARKER_ERROR_BUFFER_TOO_SMALL;
+marker_result_t marker_render_html(const marker_document_t* document, marker_buffer_t* output) {
+  if (!document || !output)
+    return MARKER_ERROR_NULL_POINTER;
+
+  render_state_t  state  = {output, MARKER_OK};
+  marker_result_t result = marker_document_visit(document, render_node, &state);
+  return result != MARKER_OK ? result : state.result;
+}
+
+// Streaming. Whole lines of a chunk are parsed where they are, only the
+// unfinished line at its end is kept for the next one, together with a line
+// that may head a table until the line after it is complete.
+static marker_result_t stream_keep(marker_parser_t* parser, const char* data, size_t length) {
+  if (length == 0)
+    return MARKER_OK;
+
+  size_t needed = parser->stream_pending_size + length;
+  if (needed > parser->stream_pending_capacity) {
+    size_t capacity = parser->stream_pending_capacity ? parser->stream_pending_capacity : 256;
+    while (capacity < needed)
+      capacity *= 2;
+
+    char* pending = heap_realloc(&parser->allocator, parser->stream_pending,
+                                 parser->stream_pending_capacity, capacity);
+    if (!pending)
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    parser->stream_pending          = pending;
+    parser->stream_pending_capacity = capacity;
   }
 
-  strcpy(html, marker_buffer_data(buffer));
+  memcpy(parser->stream_pending + parser->stream_pending_size, data, length);
+  parser->stream_pending_size = needed;
+  return MARKER_OK;
+}
+
+marker_result_t marker_stream_begin(marker_parser_t* parser, marker_buffer_t* output) {
+  if (!parser || !output)
+    return MARKER_ERROR_NULL_POINTER;
 
-  marker_buffer_free(buffer);
-  marker_parser_free(parser);
+  begin_parse(parser);
+  memset(&parser->stream_blocks, 0, sizeof(parser->stream_blocks));
+  parser->stream_output       = output;
+  parser->stream_pending_size = 0;
   return MARKER_OK;
 }
 
-marker_result_t marker_parse_inline(marker_parser_t* parser, const char* text,
-                                    marker_buffer_t* output) {
-  if (!parser || !text || !output)
+marker_result_t marker_stream_feed(marker_parser_t* parser, const char* data, size_t length) {
+  if (!parser || !data)
     return MARKER_ERROR_NULL_POINTER;
+  if (!parser->stream_output)
+    return MARKER_ERROR_INVALID_INPUT;
 
-  size_t pos = 0;
-  return parse_inline_content(parser, text, &pos, output, strlen(text));
+  while (length > 0) {
+    marker_result_t result;
+    size_t          consumed;
+    if (parser->stream_pending_size == 0) {
+      result = parse_blocks(parser, &parser->stream_blocks, data, length, false,
+                            parser->stream_output, NULL, &consumed);
+      if (result != MARKER_OK)
+        return result;
+      return stream_keep(parser, data + consumed, length - consumed);
+    }
+
+    // Complete the kept input with the next line of the chunk
+    const char* newline = memchr(data, '\n', length);
+    size_t      take    = newline ? (size_t) (newline - data) + 1 : length;
+    result              = stream_keep(parser, data, take);
+    if (result != MARKER_OK)
+      return result;
+    data += take;
+    length -= take;
+    if (!newline)
+      break;
+
+    result = parse_blocks(parser, &parser->stream_blocks, parser->stream_pending,
+                          parser->stream_pending_size, false, parser->stream_output, NULL,
+                          &consumed);
+    if (result != MARKER_OK)
+      return result;
+    parser->stream_pending_size -= consumed;
+    memmove(parser->stream_pending, parser->stream_pending + consumed,
+            parser->stream_pending_size);
+  }
+
+  return MARKER_OK;
 }
 
-marker_result_t marker_file_to_html_file(const char* input_filename, const char* output_filename,
-                                         const char* css_file) {
-  if (!input_filename || !output_filename)
+marker_result_t marker_stream_finish(marker_parser_t* parser) {
+  if (!parser)
     return MARKER_ERROR_NULL_POINTER;
+  if (!parser->stream_output)
+    return MARKER_ERROR_INVALID_INPUT;
 
-  FILE* fin = fopen(input_filename, "r");
-  if (!fin)
-    return MARKER_ERROR_IO_FAILED;
+  // What is left is the last line, or a line and the one after it
+  marker_result_t result = MARKER_OK;
+  if (parser->stream_pending_size > 0) {
+    size_t consumed;
+    result = parse_blocks(parser, &parser->stream_blocks, parser->stream_pending,
+                          parser->stream_pending_size, true, parser->stream_output, NULL,
+                          &consumed);
+  }
+  if (result == MARKER_OK)
+    result = close_blocks(parser, &parser->stream_blocks, parser->stream_output);
 
-  fseek(fin, 0, SEEK_END);
-  long filesize = ftell(fin);
-  if (filesize < 0) {
-    fclose(fin);
-    return MARKER_ERROR_IO_FAILED;
+  parser->stream_output       = NULL;
+  parser->stream_pending_size = 0;
+  return result;
+}
+
+// A parser and buffer per thread for the simplified API, so a thread that
+// converts many documents sets them up once. They are freed when the thread
+// exits or marker_release_thread_parser is called.
+typedef struct {
+  marker_parser_t* parser;
+  marker_buffer_t* buffer;
+} thread_parser_t;
+
+static pthread_key_t  thread_parser_key;
+static pthread_once_t thread_parser_once = PTHREAD_ONCE_INIT;
+static bool           thread_parser_ready;
+
+static void free_thread_parser(void* data) {
+  thread_parser_t* cached = data;
+  marker_buffer_free(cached->buffer);
+  marker_parser_free(cached->parser);
+  free(cached);
+}
+
+static void create_thread_parser_key(void) {
+  thread_parser_ready = pthread_key_create(&thread_parser_key, free_thread_parser) == 0;
+}
+
+// The calling thread's parser and buffer, reset for a new document. When no
+// thread-local storage can be had, a fresh pair that release_thread_parser frees.
+static thread_parser_t* acquire_thread_parser(void) {
+  pthread_once(&thread_parser_once, create_thread_parser_key);
+  thread_parser_t* cached = thread_parser_ready ? pthread_getspecific(thread_parser_key) : NULL;
+  if (cached) {
+    marker_parser_reset(cached->parser);
+    marker_buffer_clear(cached->buffer);
+    return cached;
   }
 
-  fseek(fin, 0, SEEK_SET);
-  char* markdown = malloc(filesize + 1);
-  if (!markdown) {
-    fclose(fin);
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+  cached = malloc(sizeof(thread_parser_t));
+  if (!cached)
+    return NULL;
+  cached->parser = marker_parser_new(NULL);
+  cached->buffer = marker_buffer_new(0);
+  if (!cached->parser || !cached->buffer) {
+    free_thread_parser(cached);
+    return NULL;
   }
+  if (thread_parser_ready)
+    pthread_setspecific(thread_parser_key, cached);
+  return cached;
+}
 
-  size_t bytes_read    = fread(markdown, 1, filesize, fin);
-  markdown[bytes_read] = '\0';
-  fclose(fin);
+static void release_thread_parser(thread_parser_t* cached) {
+  if (!thread_parser_ready || pthread_getspecific(thread_parser_key) != cached)
+    free_thread_parser(cached);
+}
 
-  marker_parser_t* parser = marker_parser_new(NULL);
-  if (!parser) {
-    free(markdown);
-    return MARKER_ERROR_MEMORY_ALLOCATION;
+void marker_release_thread_parser(void) {
+  pthread_once(&thread_parser_once, create_thread_parser_key);
+  if (!thread_parser_ready)
+    return;
+
+  thread_parser_t* cached = pthread_getspecific(thread_parser_key);
+  if (cached) {
+    pthread_setspecific(thread_parser_key, NULL);
+    free_thread_parser(cached);
+  }
+}
+
+// Write the start of an HTML document, up to and including <body>
+static marker_result_t write_page_head(marker_sink_t* sink, const char* css_file) {
+  const char*     head   = "<!DOCTYPE html><html><head>";
+  marker_result_t result = marker_sink_write(sink, head, strlen(head));
+  if (result == MARKER_OK && css_file && strlen(css_file) > 0) {
+    const char* link = "<link rel=\"stylesheet\" href=\"";
+    result           = marker_sink_write(sink, link, strlen(link));
+    if (result == MARKER_OK)
+      result = marker_sink_write(sink, css_file, strlen(css_file));
+    if (result == MARKER_OK)
+      result = marker_sink_write(sink, "\">", 2);
   }
+  if (result == MARKER_OK)
+    result = marker_sink_write(sink, "</head><body>", 13);
+  return result;
+}
+
+// Simplified API functions
+marker_result_t marker_to_html(const char* markdown, char* html, size_t html_size,
+                               const char* css_file) {
+  if (!markdown || !html || html_size == 0)
+    return MARKER_ERROR_NULL_POINTER;
 
-  marker_buffer_t* buffer = marker_buffer_new(0);
-  if (!buffer) {
-    free(markdown);
-    marker_parser_free(parser);
+  thread_parser_t* cached = acquire_thread_parser();
+  if (!cached)
     return MARKER_ERROR_MEMORY_ALLOCATION;
+
+  // The HTML is written straight into the caller's array
+  fixed_sink_t   fixed = {{fixed_sink_write, NULL}, html, 0, html_size};
+  marker_sink_t* sink  = &fixed.base;
+  html[0]              = '\0';
+
+  // Add HTML document structure
+  marker_result_t result = write_page_head(sink, css_file);
+
+  // Parse markdown content
+  if (result == MARKER_OK)
+    result = marker_parse_to_sink(cached->parser, markdown, strlen(markdown), sink);
+  if (result == MARKER_OK)
+    result = marker_sink_write(sink, "</body></html>", 14);
+
+  if (result != MARKER_OK)
+    html[0] = '\0';
+
+  release_thread_parser(cached);
+  return result;
+}
+
+marker_result_t marker_parse_inline(marker_parser_t* parser, const char* text,
+                                    marker_buffer_t* output) {
+  if (!parser || !text || !output)
+    return MARKER_ERROR_NULL_POINTER;
+
+  begin_parse(parser);
+
+  size_t pos = 0;
+  return parse_inline_content(parser, text, &pos, output, strlen(text));
+}
+
+// Convert input that cannot be mapped, such as a pipe, a chunk at a time, so
+// neither it nor its HTML is ever held in full
+static marker_result_t convert_stream(marker_parser_t* parser, marker_buffer_t* buffer, FILE* fin,
+                                      const char* output_filename, const char* css_file) {
+  FILE* fout = fopen(output_filename, "w");
+  if (!fout) {
+    fclose(fin);
+    return MARKER_ERROR_IO_FAILED;
   }
 
   // Add HTML document structure
@@ -1927,32 +4099,276 @@ marker_result_t marker_file_to_html_file(const char* input_filename, const char*
   if (result == MARKER_OK)
     result = buffer_append_str(buffer, "</head><body>");
   if (result == MARKER_OK)
-    result = marker_parse(parser, markdown, buffer);
-  if (result == MARKER_OK)
-    result = buffer_append_str(buffer, "</body></html>");
+    result = marker_stream_begin(parser, buffer);
+
+  char chunk[FILE_CHUNK_SIZE];
+  bool done = false;
+  while (result == MARKER_OK && !done) {
+    size_t bytes_read = fread(chunk, 1, sizeof(chunk), fin);
+    if (bytes_read < sizeof(chunk)) {
+      if (ferror(fin))
+        result = MARKER_ERROR_IO_FAILED;
+      done = true;
+    }
 
-  if (result != MARKER_OK) {
-    free(markdown);
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
+    if (result == MARKER_OK && bytes_read > 0)
+      result = marker_stream_feed(parser, chunk, bytes_read);
+    if (result == MARKER_OK && done)
+      result = marker_stream_finish(parser);
+    if (result == MARKER_OK && done)
+      result = buffer_append_str(buffer, "</body></html>");
+
+    if (result == MARKER_OK && fwrite(buffer->data, 1, buffer->size, fout) != buffer->size)
+      result = MARKER_ERROR_IO_FAILED;
+    marker_buffer_clear(buffer);
+  }
+
+  fclose(fin);
+  if (fclose(fout) != 0 && result == MARKER_OK)
+    result = MARKER_ERROR_IO_FAILED;
+  return result;
+}
+
+// Convert one file with a parser and a buffer that may have been used before.
+// A regular file is mapped and parsed in place, so it is never copied.
+static marker_result_t convert_file(marker_parser_t* parser, marker_buffer_t* buffer,
+                                    const char* input_filename, const char* output_filename,
+                                    const char* css_file) {
+  if (!input_filename || !output_filename)
+    return MARKER_ERROR_NULL_POINTER;
+
+  int input = open(input_filename, O_RDONLY);
+  if (input < 0)
+    return MARKER_ERROR_IO_FAILED;
+
+  // A file sees none of the definitions of the one before
+  reset_reference_links(parser);
+  marker_buffer_clear(buffer);
+
+  struct stat info;
+  if (fstat(input, &info) != 0) {
+    close(input);
+    return MARKER_ERROR_IO_FAILED;
+  }
+
+  // Pipes and devices are streamed
+  if (!S_ISREG(info.st_mode)) {
+    FILE* fin = fdopen(input, "r");
+    if (!fin) {
+      close(input);
+      return MARKER_ERROR_IO_FAILED;
+    }
+    marker_result_t result = convert_stream(parser, buffer, fin, output_filename, css_file);
+    if (result != MARKER_OK)
+      remove(output_filename);
     return result;
   }
 
-  FILE* fout = fopen(output_filename, "w");
-  if (!fout) {
-    free(markdown);
-    marker_buffer_free(buffer);
-    marker_parser_free(parser);
+  if ((uintmax_t) info.st_size > SIZE_MAX) {
+    close(input);
+    return MARKER_ERROR_INVALID_SIZE;
+  }
+
+  // Truncating the output would truncate the mapped input if they are the same
+  // file, so the HTML then goes to a temporary file that replaces it at the end
+  struct stat target;
+  char*       temp_filename = NULL;
+  if (stat(output_filename, &target) == 0 && target.st_dev == info.st_dev &&
+      target.st_ino == info.st_ino) {
+    size_t length = strlen(output_filename);
+    temp_filename = malloc(length + 5);
+    if (!temp_filename) {
+      close(input);
+      return MARKER_ERROR_MEMORY_ALLOCATION;
+    }
+    memcpy(temp_filename, output_filename, length);
+    memcpy(temp_filename + length, ".tmp", 5);
+  }
+  const char* write_filename = temp_filename ? temp_filename : output_filename;
+
+  size_t size = (size_t) info.st_size;
+  void*  map  = NULL;
+  if (size > 0) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input, 0);
+    if (map == MAP_FAILED) {
+      close(input);
+      free(temp_filename);
+      return MARKER_ERROR_IO_FAILED;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+  }
+  close(input);
+
+  int output = open(write_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (output < 0) {
+    if (map)
+      munmap(map, size);
+    free(temp_filename);
     return MARKER_ERROR_IO_FAILED;
   }
 
-  fputs(marker_buffer_data(buffer), fout);
-  fclose(fout);
+  // The HTML goes out through a staging buffer as it is rendered
+  fd_sink_t fd_sink;
+  fd_sink.base.write  = fd_sink_write;
+  fd_sink.base.flush  = fd_sink_flush;
+  fd_sink.fd          = output;
+  fd_sink.size        = 0;
+  marker_sink_t* sink = &fd_sink.base;
 
-  free(markdown);
-  marker_buffer_free(buffer);
-  marker_parser_free(parser);
-  return MARKER_OK;
+  // Add HTML document structure
+  marker_result_t result = write_page_head(sink, css_file);
+  if (result == MARKER_OK)
+    result = marker_parse_to_sink(parser, map ? map : "", size, sink);
+  if (result == MARKER_OK)
+    result = marker_sink_write(sink, "</body></html>", 14);
+  if (result == MARKER_OK)
+    result = marker_sink_flush(sink);
+  if (map)
+    munmap(map, size);
+
+  if (close(output) != 0 && result == MARKER_OK)
+    result = MARKER_ERROR_IO_FAILED;
+  if (result == MARKER_OK && temp_filename && rename(temp_filename, output_filename) != 0)
+    result = MARKER_ERROR_IO_FAILED;
+  if (result != MARKER_OK)
+    remove(write_filename);
+  free(temp_filename);
+  return result;
+}
+
+marker_result_t marker_file_to_html_file(const char* input_filename, const char* output_filename,
+                                         const char* css_file) {
+  if (!input_filename || !output_filename)
+    return MARKER_ERROR_NULL_POINTER;
+
+  thread_parser_t* cached = acquire_thread_parser();
+  if (!cached)
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+
+  marker_result_t result =
+      convert_file(cached->parser, cached->buffer, input_filename, output_filename, css_file);
+  release_thread_parser(cached);
+  return result;
+}
+
+// A file of a batch and its size, for scheduling
+typedef struct {
+  size_t size;
+  size_t index;
+} batch_file_t;
+
+// Files of a batch conversion, handed out to the threads largest first
+typedef struct {
+  const char**     input_files;
+  const char**     output_files;
+  const char*      css_file;
+  marker_result_t* results;
+  batch_file_t*    files;  // Sorted by size, largest first
+  size_t           count;
+  size_t           next;  // Position in files of the next to convert
+  pthread_mutex_t  lock;
+} file_batch_t;
+
+static int compare_batch_files(const void* a, const void* b) {
+  const batch_file_t* first  = a;
+  const batch_file_t* second = b;
+  if (first->size != second->size)
+    return first->size > second->size ? -1 : 1;
+  return first->index < second->index ? -1 : first->index > second->index;
+}
+
+// Convert files of the batch until none are left, with the thread's parser and
+// buffer for all of them
+static void* convert_files_thread(void* arg) {
+  file_batch_t*    batch  = arg;
+  thread_parser_t* cached = acquire_thread_parser();
+
+  // A thread that cannot get its parser leaves the files to the others
+  while (cached) {
+    pthread_mutex_lock(&batch->lock);
+    size_t position = batch->next < batch->count ? batch->next++ : batch->count;
+    pthread_mutex_unlock(&batch->lock);
+    if (position == batch->count)
+      break;
+
+    size_t index          = batch->files[position].index;
+    batch->results[index] = convert_file(cached->parser, cached->buffer, batch->input_files[index],
+                                         batch->output_files[index], batch->css_file);
+  }
+
+  if (cached)
+    release_thread_parser(cached);
+  return NULL;
+}
+
+marker_result_t marker_batch_to_html_files(const char** input_files, const char** output_files,
+                                           size_t count, const char* css_file,
+                                           size_t thread_count, marker_result_t* results) {
+  if (!input_files || !output_files || count == 0)
+    return MARKER_ERROR_NULL_POINTER;
+
+  if (thread_count == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long online  = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = online > 0 ? (size_t) online : 1;
+#else
+    thread_count = 1;
+#endif
+  }
+  if (thread_count > count)
+    thread_count = count;
+
+  file_batch_t batch;
+  batch.input_files  = input_files;
+  batch.output_files = output_files;
+  batch.css_file     = css_file;
+  batch.results      = results ? results : malloc(count * sizeof(marker_result_t));
+  batch.files        = malloc(count * sizeof(batch_file_t));
+  batch.count        = count;
+  batch.next         = 0;
+  pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+  if (!batch.files || !batch.results || !threads || pthread_mutex_init(&batch.lock, NULL) != 0) {
+    free(threads);
+    if (!results)
+      free(batch.results);
+    free(batch.files);
+    return MARKER_ERROR_MEMORY_ALLOCATION;
+  }
+
+  // Large files go first, so none is left to run alone at the end. A file
+  // that nobody gets to, because no thread could set itself up, is reported
+  // as such.
+  for (size_t i = 0; i < count; i++) {
+    struct stat info;
+    batch_file_t file = {0, i};
+    if (input_files[i] && stat(input_files[i], &info) == 0 && info.st_size > 0)
+      file.size = (size_t) info.st_size;
+    batch.files[i]   = file;
+    batch.results[i] = MARKER_ERROR_MEMORY_ALLOCATION;
+  }
+  qsort(batch.files, count, sizeof(batch_file_t), compare_batch_files);
+
+  // This thread is one of the workers
+  size_t started = 0;
+  for (size_t i = 1; i < thread_count; i++) {
+    if (pthread_create(&threads[started], NULL, convert_files_thread, &batch) == 0)
+      started++;
+  }
+  convert_files_thread(&batch);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  // The first failure in the order of the files
+  marker_result_t result = MARKER_OK;
+  for (size_t i = 0; i < count && result == MARKER_OK; i++)
+    result = batch.results[i];
+
+  pthread_mutex_destroy(&batch.lock);
+  free(threads);
+  if (!results)
+    free(batch.results);
+  free(batch.files);
+  return result;
 }
 
 marker_result_t marker_files_to_html_files(const char** input_files, const char** output_files,
@@ -1960,12 +4376,7 @@ marker_result_t marker_files_to_html_files(const char** input_files, const char*
   if (!input_files || !output_files || count <= 0)
     return MARKER_ERROR_NULL_POINTER;
 
-  for (int i = 0; i < count; i++) {
-    marker_result_t result = marker_file_to_html_file(input_files[i], output_files[i], css_file);
-    if (result != MARKER_OK)
-      return result;
-  }
-  return MARKER_OK;
+  return marker_batch_to_html_files(input_files, output_files, (size_t) count, css_file, 0, NULL);
 }
 
 bool marker_validate(const char* markdown, char* error_msg, size_t error_msg_size) {
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,21 +25,39 @@ typedef enum {
   MARKER_ERROR_IO_FAILED         = -4,
   MARKER_ERROR_MEMORY_ALLOCATION = -5,
   MARKER_ERROR_INVALID_INPUT     = -6,
-  MARKER_ERROR_PARSE_FAILED      = -7
+  MARKER_ERROR_PARSE_FAILED      = -7,
+  MARKER_ERROR_LIMIT_EXCEEDED    = -8  // A limit of marker_config_t stopped the parse
 } marker_result_t;
 
-// Configuration options for modifying parser behaviour
+// Memory functions used in place of malloc, realloc and free. The sizes given
+// to reallocate and deallocate are those the block was allocated with, so a
+// pool allocator need not record them, and neither is ever given NULL. With
+// marker_parse_parallel the functions are called from several threads at once.
 typedef struct {
-  bool   enable_tables;         // Enable GFM tables
-  bool   enable_strikethrough;  // Enable GFM strikethrough (~~text~~)
-  bool   enable_task_lists;     // Enable GFM task lists (- [x] item)
-  bool   enable_autolinks;      // Enable autolink detection
-  bool   enable_inline_html;    // Allow inline HTML passthrough
-  bool   escape_html;           // Escape HTML entities in text
-  bool   smart_quotes;          // Convert quotes to smart quotes
-  bool   hard_line_breaks;      // Treat single line breaks as <br>
-  size_t max_nesting_depth;     // Maximum nesting depth for lists/quotes
-  size_t initial_buffer_size;   // Initial buffer size for dynamic allocation
+  void* (*allocate)(size_t size, void* user_data);
+  void* (*reallocate)(void* memory, size_t old_size, size_t size, void* user_data);
+  void (*deallocate)(void* memory, size_t size, void* user_data);
+  void* user_data;
+} marker_allocator_t;
+
+// Configuration options for modifying parser behaviour. The limits guard a
+// renderer against documents made to be slow or huge. A parse that reaches one
+// stops with MARKER_ERROR_LIMIT_EXCEEDED and leaves incomplete output.
+typedef struct {
+  bool                      enable_tables;         // Enable GFM tables
+  bool                      enable_strikethrough;  // Enable GFM strikethrough (~~text~~)
+  bool                      enable_task_lists;     // Enable GFM task lists (- [x] item)
+  bool                      enable_autolinks;      // Enable autolink detection
+  bool                      enable_inline_html;    // Allow inline HTML passthrough
+  bool                      escape_html;           // Escape HTML entities in text
+  bool                      smart_quotes;          // Convert quotes to smart quotes
+  bool                      hard_line_breaks;      // Treat single line breaks as <br>
+  size_t                    max_nesting_depth;     // Maximum nesting depth for lists/quotes
+  size_t                    initial_buffer_size;   // Initial buffer size for dynamic allocation
+  const marker_allocator_t* allocator;             // Memory of the parser, NULL for the C library
+  size_t                    max_output_size;       // Bytes of HTML a parse may write, 0 for any
+  size_t                    max_inline_depth;      // Nesting of emphasis and links, 0 for any
+  size_t                    max_work;              // Bytes a parse may scan, 0 for any
 } marker_config_t;
 
 // Parser context
@@ -46,11 +65,102 @@ typedef struct marker_parser marker_parser_t;
 
 // HTML output buffer
 typedef struct {
-  char*  data;
-  size_t size;
-  size_t capacity;
+  char*                     data;
+  size_t                    size;
+  size_t                    capacity;
+  const marker_allocator_t* allocator;  // NULL for the C library
 } marker_buffer_t;
 
+// Destination for HTML output, which receives the output in pieces as it is
+// rendered. Any struct that starts with a marker_sink_t can serve as a sink, the
+// stock sinks below cover the common cases.
+typedef struct marker_sink marker_sink_t;
+struct marker_sink {
+  marker_result_t (*write)(marker_sink_t* sink, const char* data, size_t length);
+  marker_result_t (*flush)(marker_sink_t* sink);  // Pass on staged output, may be NULL
+};
+
+// Callback of a callback sink
+typedef marker_result_t (*marker_write_fn)(void* user_data, const char* data, size_t length);
+
+// One piece of scatter-gather output. It is laid out like struct iovec, so an
+// array of pieces can be passed to writev as is.
+typedef struct {
+  const void* base;
+  size_t      length;
+} marker_iovec_t;
+
+// Scatter-gather output of a render
+typedef struct marker_scatter marker_scatter_t;
+
+// Document tree built by marker_parse_document
+typedef struct marker_document marker_document_t;
+
+// Node types of a document
+typedef enum {
+  MARKER_NODE_DOCUMENT,
+  MARKER_NODE_PARAGRAPH,
+  MARKER_NODE_HEADING,
+  MARKER_NODE_BLOCKQUOTE,
+  MARKER_NODE_LIST,
+  MARKER_NODE_ITEM,
+  MARKER_NODE_CODE_BLOCK,
+  MARKER_NODE_TABLE,
+  MARKER_NODE_TABLE_HEAD,
+  MARKER_NODE_TABLE_BODY,
+  MARKER_NODE_TABLE_ROW,
+  MARKER_NODE_TABLE_CELL,
+  MARKER_NODE_THEMATIC_BREAK,
+  MARKER_NODE_BLANK_LINE,
+  MARKER_NODE_TEXT,
+  MARKER_NODE_CODE,
+  MARKER_NODE_EMPHASIS,
+  MARKER_NODE_STRONG,
+  MARKER_NODE_STRIKETHROUGH,
+  MARKER_NODE_LINK,
+  MARKER_NODE_IMAGE,
+  MARKER_NODE_AUTOLINK,
+  MARKER_NODE_HTML_INLINE,
+  MARKER_NODE_LINE_BREAK
+} marker_node_type_t;
+
+// Node flags
+enum {
+  MARKER_NODE_ORDERED  = 1 << 0,  // List with numbers
+  MARKER_NODE_TASK     = 1 << 1,  // Task list item
+  MARKER_NODE_CHECKED  = 1 << 2,  // Checked task list item
+  MARKER_NODE_HEADER   = 1 << 3,  // Header cell of a table
+  MARKER_NODE_EMAIL    = 1 << 4,  // Autolink to an email address
+  MARKER_NODE_VERBATIM = 1 << 5,  // Text that is written as is, never escaped
+  MARKER_NODE_LINE     = 1 << 6   // Text that is a line of a code block
+};
+
+// Node of a document. Nodes refer to each other by index into the document,
+// the root has index 0, so 0 also means none for children and siblings.
+typedef struct {
+  uint8_t  type;         // marker_node_type_t
+  uint8_t  flags;        // MARKER_NODE_* flags
+  uint16_t level;        // Level of headings
+  uint32_t parent;       // The root is its own parent
+  uint32_t first_child;
+  uint32_t next;         // Next sibling
+  uint32_t start;        // Span of the input for text, code, inline HTML, autolinks and image alt
+  uint32_t length;
+  uint32_t link;         // Destination of links and images, see marker_node_url
+} marker_node_t;
+
+// What a visitor asks for next
+typedef enum {
+  MARKER_VISIT_CONTINUE,
+  MARKER_VISIT_SKIP,  // Skip the children of a node that is being entered
+  MARKER_VISIT_STOP
+} marker_visit_t;
+
+// Visitor of a document, called when a node is entered and again when it is left
+typedef marker_visit_t (*marker_visit_fn)(const marker_document_t* document,
+                                          const marker_node_t* node, bool entering,
+                                          void* user_data);
+
 // Reference link
 typedef struct marker_ref_link {
   char*                   label;
@@ -59,6 +169,17 @@ typedef struct marker_ref_link {
   struct marker_ref_link* next;
 } marker_ref_link_t;
 
+// Memory use of a parser
+typedef struct {
+  size_t heap_allocations;   // Heap blocks the parser allocated or grew since it was created
+  size_t scratch_size;       // Bytes kept for temporaries, reused by every parse
+  size_t reference_count;    // Reference definitions known to the parser
+  size_t heap_bytes;         // Bytes the parser holds on the heap
+  size_t parse_allocations;  // Heap blocks allocated or grown by the last parse
+  size_t parse_bytes;        // Bytes those blocks added
+  size_t peak_heap_bytes;    // Most bytes the parser held at once during the last parse
+} marker_stats_t;
+
 /**
  * Get the library version string
  * @return Version string (e.g., "1.0.0")
@@ -78,6 +199,14 @@ const char* marker_error_string(marker_result_t result);
  */
 void marker_config_init(marker_config_t* config);
 
+/**
+ * Initialize a CommonMark configuration, the defaults without tables,
+ * strikethrough and task lists. Parsers with it or with the defaults use an
+ * inline engine built for their configuration.
+ * @param config Configuration structure to initialize
+ */
+void marker_config_init_commonmark(marker_config_t* config);
+
 /**
  * Create a new parser instance with specified configuration
  * @param config Parser configuration (NULL for default)
@@ -91,6 +220,14 @@ marker_parser_t* marker_parser_new(const marker_config_t* config);
  */
 void marker_parser_free(marker_parser_t* parser);
 
+/**
+ * Clear what a parser knows of the documents it has seen, such as reference
+ * definitions and an unfinished stream, so the next document starts afresh.
+ * Buffers and arenas are kept at the size they have grown to.
+ * @param parser Parser instance to reset
+ */
+void marker_parser_reset(marker_parser_t* parser);
+
 /**
  * Create a new output buffer
  * @param initial_capacity Initial buffer capacity
@@ -98,6 +235,16 @@ void marker_parser_free(marker_parser_t* parser);
  */
 marker_buffer_t* marker_buffer_new(size_t initial_capacity);
 
+/**
+ * Create a new output buffer whose memory comes from an allocator
+ * @param initial_capacity Initial buffer capacity
+ * @param allocator Memory functions, NULL for the C library. They must outlive
+ *                  the buffer.
+ * @return Buffer instance or NULL on failure
+ */
+marker_buffer_t* marker_buffer_new_with_allocator(size_t initial_capacity,
+                                                  const marker_allocator_t* allocator);
+
 /**
  * Free output buffer and associated memory
  * @param buffer Buffer to free
@@ -118,6 +265,12 @@ const char* marker_buffer_data(const marker_buffer_t* buffer);
  */
 size_t marker_buffer_size(const marker_buffer_t* buffer);
 
+/**
+ * Empty a buffer, keeping its memory for further output
+ * @param buffer Buffer instance
+ */
+void marker_buffer_clear(marker_buffer_t* buffer);
+
 /**
  * Convert Markdown string to HTML using parser instance
  * @param parser Parser instance
@@ -129,7 +282,265 @@ marker_result_t marker_parse(marker_parser_t* parser, const char* markdown,
                              marker_buffer_t* output);
 
 /**
- * Convert Markdown string to HTML with simple API
+ * Convert Markdown of a given length to HTML using parser instance. The input
+ * is read in place and need not be NUL-terminated, so a mapped file or a
+ * network buffer can be passed as is. NUL bytes in it are treated as text.
+ * @param parser Parser instance
+ * @param markdown Input Markdown
+ * @param markdown_len Length of the input in bytes
+ * @param output Output buffer (will be resized as needed)
+ * @return Result code
+ */
+marker_result_t marker_parse_n(marker_parser_t* parser, const char* markdown, size_t markdown_len,
+                               marker_buffer_t* output);
+
+/**
+ * Convert Markdown of a given length to HTML on several threads. The input is
+ * split after blank lines outside code blocks, where no block is left open, and
+ * the pieces are rendered at the same time and joined in order. The HTML and the
+ * reference definitions the parser ends up with are the same as those of
+ * marker_parse_n. Inputs under 64 KiB per thread are parsed on fewer threads.
+ * @param parser Parser instance, which keeps the worker parsers for the next call
+ * @param markdown Input Markdown
+ * @param markdown_len Length of the input in bytes
+ * @param output Output buffer (will be resized as needed)
+ * @param thread_count Threads to use at most, including the calling one
+ * @return Result code
+ */
+marker_result_t marker_parse_parallel(marker_parser_t* parser, const char* markdown,
+                                      size_t markdown_len, marker_buffer_t* output,
+                                      size_t thread_count);
+
+/**
+ * Convert Markdown of a given length to HTML and write it to a sink. Output is
+ * handed over in pieces while the document is parsed, so memory use does not
+ * depend on the size of the HTML. The sink is flushed at the end.
+ * @param parser Parser instance
+ * @param markdown Input Markdown
+ * @param markdown_len Length of the input in bytes
+ * @param sink Sink to write to
+ * @return Result code, including any error of the sink
+ */
+marker_result_t marker_parse_to_sink(marker_parser_t* parser, const char* markdown,
+                                     size_t markdown_len, marker_sink_t* sink);
+
+/**
+ * Write to a sink
+ * @param sink Sink instance
+ * @param data Data to write
+ * @param length Length of the data in bytes
+ * @return Result code
+ */
+marker_result_t marker_sink_write(marker_sink_t* sink, const char* data, size_t length);
+
+/**
+ * Pass on the output a sink has staged
+ * @param sink Sink instance
+ * @return Result code
+ */
+marker_result_t marker_sink_flush(marker_sink_t* sink);
+
+/**
+ * Create a sink that appends to a buffer
+ * @param buffer Buffer to append to, which must outlive the sink
+ * @return Sink instance or NULL on failure
+ */
+marker_sink_t* marker_sink_buffer_new(marker_buffer_t* buffer);
+
+/**
+ * Create a sink that fills a caller-provided array and keeps it NUL-terminated.
+ * Output that does not fit fails with MARKER_ERROR_BUFFER_TOO_SMALL.
+ * @param data Array to fill
+ * @param size Size of the array, including room for the terminator
+ * @return Sink instance or NULL on failure
+ */
+marker_sink_t* marker_sink_fixed_new(char* data, size_t size);
+
+/**
+ * Create a sink that writes to a file descriptor through a 64 KiB staging
+ * buffer. The descriptor is not closed when the sink is freed.
+ * @param fd File descriptor open for writing
+ * @return Sink instance or NULL on failure
+ */
+marker_sink_t* marker_sink_fd_new(int fd);
+
+/**
+ * Create a sink that passes all output to a callback
+ * @param write Callback, which returns MARKER_OK to continue
+ * @param user_data Pointer passed to the callback
+ * @return Sink instance or NULL on failure
+ */
+marker_sink_t* marker_sink_callback_new(marker_write_fn write, void* user_data);
+
+/**
+ * Free a sink created by one of the functions above. Output that is still
+ * staged is dropped, flush the sink first to keep it.
+ * @param sink Sink to free
+ */
+void marker_sink_free(marker_sink_t* sink);
+
+/**
+ * Create an empty scatter-gather output
+ * @return Scatter-gather output or NULL on failure
+ */
+marker_scatter_t* marker_scatter_new(void);
+
+/**
+ * Free a scatter-gather output
+ * @param scatter Scatter-gather output to free
+ */
+void marker_scatter_free(marker_scatter_t* scatter);
+
+/**
+ * Convert Markdown of a given length to HTML as a list of pieces. Long runs of
+ * text that go out unchanged point into the input, everything else into memory
+ * of the scatter-gather output, which replaces the result of the previous call.
+ * The input must stay unchanged while the pieces are used.
+ * @param parser Parser instance
+ * @param markdown Input Markdown
+ * @param markdown_len Length of the input in bytes
+ * @param scatter Scatter-gather output to fill
+ * @return Result code
+ */
+marker_result_t marker_parse_scatter(marker_parser_t* parser, const char* markdown,
+                                     size_t markdown_len, marker_scatter_t* scatter);
+
+/**
+ * Get the pieces of a scatter-gather output, in order
+ * @param scatter Scatter-gather output
+ * @param count Set to the number of pieces
+ * @return Array of pieces
+ */
+const marker_iovec_t* marker_scatter_pieces(const marker_scatter_t* scatter, size_t* count);
+
+/**
+ * Get the total size of a scatter-gather output
+ * @param scatter Scatter-gather output
+ * @return Size in bytes
+ */
+size_t marker_scatter_size(const marker_scatter_t* scatter);
+
+/**
+ * Write a scatter-gather output to a file descriptor with writev
+ * @param scatter Scatter-gather output
+ * @param fd File descriptor open for writing
+ * @return Result code
+ */
+marker_result_t marker_scatter_write(const marker_scatter_t* scatter, int fd);
+
+/**
+ * Create an empty document
+ * @return Document or NULL on failure
+ */
+marker_document_t* marker_document_new(void);
+
+/**
+ * Free a document with all of its nodes
+ * @param document Document to free
+ */
+void marker_document_free(marker_document_t* document);
+
+/**
+ * Parse Markdown of a given length into a document tree, which replaces the
+ * previous content of the document. Nodes refer to the input by span, so it
+ * must stay unchanged while the document is used.
+ * @param parser Parser instance, whose configuration the document keeps for rendering
+ * @param markdown Input Markdown, at most 4 GiB
+ * @param markdown_len Length of the input in bytes
+ * @param document Document to fill
+ * @return Result code
+ */
+marker_result_t marker_parse_document(marker_parser_t* parser, const char* markdown,
+                                      size_t markdown_len, marker_document_t* document);
+
+/**
+ * Get a node of a document by index
+ * @param document Document instance
+ * @param index Node index, 0 for the root
+ * @return Node or NULL if there is no such node
+ */
+const marker_node_t* marker_document_node(const marker_document_t* document, uint32_t index);
+
+/**
+ * Get the span of the input a node refers to
+ * @param document Document instance
+ * @param node Node of the document
+ * @param length Set to the length of the span
+ * @return Start of the span
+ */
+const char* marker_node_text(const marker_document_t* document, const marker_node_t* node,
+                             size_t* length);
+
+/**
+ * Get the destination of a link or image
+ * @param document Document instance
+ * @param node Link or image node
+ * @param length Set to the length of the destination
+ * @return Destination, or NULL if the node is not a link or image
+ */
+const char* marker_node_url(const marker_document_t* document, const marker_node_t* node,
+                            size_t* length);
+
+/**
+ * Get the title of a link or image
+ * @param document Document instance
+ * @param node Link or image node
+ * @param length Set to the length of the title
+ * @return Title, or NULL if there is none
+ */
+const char* marker_node_title(const marker_document_t* document, const marker_node_t* node,
+                              size_t* length);
+
+/**
+ * Walk a document depth first, without recursion
+ * @param document Document instance
+ * @param visit Called for every node when it is entered and when it is left
+ * @param user_data Pointer passed to the visitor
+ * @return Result code
+ */
+marker_result_t marker_document_visit(const marker_document_t* document, marker_visit_fn visit,
+                                      void* user_data);
+
+/**
+ * Render a document to HTML. The result is the same as parsing its input with
+ * marker_parse_n.
+ * @param document Document instance
+ * @param output Output buffer (will be resized as needed)
+ * @return Result code
+ */
+marker_result_t marker_render_html(const marker_document_t* document, marker_buffer_t* output);
+
+/**
+ * Start parsing a stream of input with parser instance. The HTML of a block is
+ * appended to output as soon as the block is closed, and the caller may take it
+ * out and clear the buffer between chunks. The result is the same as parsing
+ * all chunks at once with marker_parse_n.
+ * @param parser Parser instance, which parses nothing else until the stream is finished
+ * @param output Output buffer (will be resized as needed)
+ * @return Result code
+ */
+marker_result_t marker_stream_begin(marker_parser_t* parser, marker_buffer_t* output);
+
+/**
+ * Feed the next chunk of a stream. Chunks may end anywhere, also in the middle
+ * of a line, and need not outlive the call.
+ * @param parser Parser instance with an open stream
+ * @param data Next chunk of input
+ * @param length Length of the chunk in bytes
+ * @return Result code
+ */
+marker_result_t marker_stream_feed(marker_parser_t* parser, const char* data, size_t length);
+
+/**
+ * End a stream, writing the last line and closing the blocks still open
+ * @param parser Parser instance with an open stream
+ * @return Result code
+ */
+marker_result_t marker_stream_finish(marker_parser_t* parser);
+
+/**
+ * Convert Markdown string to HTML with simple API. Like the file functions, it
+ * uses a parser kept for the calling thread, which is reset for every document.
  * @param markdown Input Markdown string
  * @param html Output buffer for HTML
  * @param html_size Size of output buffer
@@ -150,16 +561,52 @@ marker_result_t marker_file_to_html_file(const char* input_filename, const char*
                                          const char* css_file);
 
 /**
- * Convert multiple Markdown files to HTML files
+ * Convert multiple Markdown files to HTML files, on a thread per core. Every
+ * file is converted even when another one fails.
  * @param input_files Array of input filenames
  * @param output_files Array of output filenames
  * @param count Number of files
  * @param css_file Optional CSS file to include (NULL to omit)
- * @return Result code
+ * @return Result code, the first failure in the order of the files
  */
 marker_result_t marker_files_to_html_files(const char** input_files, const char** output_files,
                                            int count, const char* css_file);
 
+/**
+ * Convert a batch of Markdown files to HTML files on a pool of threads. Each
+ * thread keeps one parser and buffer for all the files it converts, and takes
+ * the largest file left, so a big file is not started last. Files are converted
+ * independently, definitions of one are not seen by another.
+ * @param input_files Array of input filenames
+ * @param output_files Array of output filenames
+ * @param count Number of files
+ * @param css_file Optional CSS file to include (NULL to omit)
+ * @param thread_count Threads to use, including the calling one, or 0 for one per core
+ * @param results Result of every file in the order of input_files, or NULL
+ * @return Result code, the first failure in the order of the files
+ */
+marker_result_t marker_batch_to_html_files(const char** input_files, const char** output_files,
+                                           size_t count, const char* css_file,
+                                           size_t thread_count, marker_result_t* results);
+
+/**
+ * Free the parser that marker_to_html and the file functions keep for the
+ * calling thread. It is freed when the thread exits, so this is only needed to
+ * give the memory back sooner.
+ */
+void marker_release_thread_parser(void);
+
+/**
+ * Get memory statistics of a parser. A parser that has seen a document before
+ * parses it again without new heap allocations, which heap_allocations and
+ * parse_allocations show. The parse counts cover the last parse, stream or
+ * document, and the parser's workers are included. Output buffers belong to the
+ * caller and are not counted.
+ * @param parser Parser instance
+ * @param stats Statistics to fill
+ */
+void marker_parser_stats(const marker_parser_t* parser, marker_stats_t* stats);
+
 /**
  * Add reference link to parser
  * @param parser Parser instance
@@ -1,5 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
 #include "../src/marker.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +25,17 @@
     }                                                                                              \
   } while (0)
 
+// Parse with a config and give the result
+static marker_result_t parse_with(const marker_config_t* config, const char* markdown,
+                                  marker_buffer_t* buffer) {
+  marker_parser_t* parser = marker_parser_new(config);
+  assert(parser != NULL);
+  marker_buffer_clear(buffer);
+  marker_result_t result = marker_parse(parser, markdown, buffer);
+  marker_parser_free(parser);
+  return result;
+}
+
 // Basic test case. Establish a barebones document with common Markdown features
 // and try to parse it. If this fails, then what am I even doing?
 static void test_basic_formatting(void) {
@@ -417,6 +430,34 @@ static void test_configuration(void) {
   ASSERT_HTML_NOT_CONTAINS(html, "task-list-item");
   ASSERT_HTML_NOT_CONTAINS(html, "<table>");
 
+  // The CommonMark preset turns off the same extensions, CommonMark autolinks
+  // and raw HTML stay
+  marker_config_t commonmark;
+  marker_config_init_commonmark(&commonmark);
+  assert(!commonmark.enable_tables && !commonmark.enable_strikethrough &&
+         !commonmark.enable_task_lists);
+  assert(commonmark.enable_autolinks && commonmark.enable_inline_html && commonmark.escape_html);
+  assert(parse_with(&commonmark, "~~a~~ <https://example.com> <b>x</b>", buffer) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(buffer),
+                       "~~a~~ <a href=\"https://example.com\">https://example.com</a> <b>x</b>");
+
+  // Parsers with the defaults use an engine built for them, a configuration
+  // with one feature off the generic one. Where the feature does not matter,
+  // both write the same.
+  const char* inline_markdown = "Some *emphasis*, **strong** and ~~gone~~ text with `code`,\n"
+                                "[a link](/url \"Title\"), ![an image](/i.png) & \"quotes\".\n"
+                                "\\*Escaped\\* [*nested **deeply***](/n) and AT&T.\n";
+  marker_config_t defaults;
+  marker_config_init(&defaults);
+  assert(parse_with(&defaults, inline_markdown, buffer) == MARKER_OK);
+  char* expected = strdup(marker_buffer_data(buffer));
+  assert(expected != NULL);
+  ASSERT_HTML_CONTAINS(expected, "<del>gone</del>");
+  defaults.enable_autolinks = false;
+  assert(parse_with(&defaults, inline_markdown, buffer) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(buffer), expected) == 0);
+  free(expected);
+
   marker_buffer_free(buffer);
   marker_parser_free(parser);
 }
@@ -550,6 +591,1347 @@ static void test_utilities(void) {
   assert(strstr(escaped, "&quot;friends&quot;") != NULL);
 }
 
+// The escaper copies clean runs in blocks of 16 and 32 bytes, so put each
+// special character at every offset of a block and at the ends of the input.
+static void test_escape_runs(void) {
+  printf("Testing HTML escaping across long runs...\n");
+
+  const char* specials[] = {"&", "<", ">", "\"", "'"};
+  const char* entities[] = {"&amp;", "&lt;", "&gt;", "&quot;", "&#39;"};
+
+  for (int s = 0; s < 5; s++) {
+    for (size_t offset = 0; offset < 70; offset++) {
+      char text[80];
+      memset(text, 'a', 70);
+      text[70]     = '\0';
+      text[offset] = specials[s][0];
+
+      char expected[96];
+      snprintf(expected, sizeof(expected), "%.*s%s%s", (int) offset, text, entities[s],
+               text + offset + 1);
+
+      char            escaped[96];
+      marker_result_t result = marker_escape_html(text, escaped, sizeof(escaped));
+      assert(result == MARKER_OK);
+      if (strcmp(escaped, expected) != 0) {
+        fprintf(stderr, "FAIL: Escaping '%s' at offset %zu\n", specials[s], offset);
+        fprintf(stderr, "Got: %s\n", escaped);
+        assert(0);
+      }
+    }
+  }
+
+  // Bytes next to the specials must pass through
+  char escaped[64];
+  assert(marker_escape_html("%=?;:!#$()*+,-./[]^`{|}~\t\xc3\xa9", escaped, sizeof(escaped)) ==
+         MARKER_OK);
+  assert(strcmp(escaped, "%=?;:!#$()*+,-./[]^`{|}~\t\xc3\xa9") == 0);
+
+  // Output that does not fit is cut at a character boundary
+  assert(marker_escape_html("abc&def", escaped, 4) == MARKER_ERROR_BUFFER_TOO_SMALL);
+  assert(strcmp(escaped, "abc") == 0);
+  assert(marker_escape_html("abcdefgh", escaped, 5) == MARKER_ERROR_BUFFER_TOO_SMALL);
+  assert(strcmp(escaped, "abcd") == 0);
+  assert(marker_escape_html("a&", escaped, 7) == MARKER_OK);
+  assert(strcmp(escaped, "a&amp;") == 0);
+}
+
+// Plain text between markup is copied in runs, markup must still be found at
+// any offset into a long run
+static void test_inline_runs(void) {
+  printf("Testing inline markup across long runs...\n");
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  assert(parser != NULL);
+
+  const char* markup[]   = {"*em*", "**strong**", "`code`", "~~del~~", "[a](b)", "\\*"};
+  const char* expected[] = {"<em>em</em>", "<strong>strong</strong>", "<code>code</code>",
+                            "<del>del</del>", "<a href=\"b\">a</a>", "*"};
+
+  for (int m = 0; m < 6; m++) {
+    for (size_t offset = 0; offset < 70; offset++) {
+      char text[96];
+      snprintf(text, sizeof(text), "%.*s%s tail \xc3\xa9", (int) offset,
+               "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+               markup[m]);
+
+      marker_buffer_t* buffer = marker_buffer_new(0);
+      assert(buffer != NULL);
+      assert(marker_parse_inline(parser, text, buffer) == MARKER_OK);
+
+      const char* html = marker_buffer_data(buffer);
+      ASSERT_HTML_CONTAINS(html, expected[m]);
+      ASSERT_HTML_CONTAINS(html, " tail \xc3\xa9");
+      assert(strncmp(html, text, offset) == 0);
+      marker_buffer_free(buffer);
+    }
+  }
+  marker_parser_free(parser);
+
+  // Disabled extensions are plain text, escaped as such
+  marker_config_t config;
+  marker_config_init(&config);
+  config.enable_strikethrough = false;
+  config.enable_autolinks     = false;
+  config.enable_inline_html   = false;
+  parser                      = marker_parser_new(&config);
+  assert(parser != NULL);
+
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse_inline(parser, "a ~~b~~ <https://example.com> <i>c</i>", buffer) ==
+         MARKER_OK);
+  assert(strcmp(marker_buffer_data(buffer),
+                "a ~~b~~ &lt;https://example.com&gt; &lt;i&gt;c&lt;/i&gt;") == 0);
+
+  marker_buffer_free(buffer);
+  marker_parser_free(parser);
+}
+
+// Emphasis follows the CommonMark delimiter run rules, and pathological runs of
+// unmatched delimiters take linear time
+static void test_emphasis_rules(void) {
+  printf("Testing emphasis delimiter rules...\n");
+
+  const char* cases[][2] = {
+      {"*foo bar*", "<em>foo bar</em>"},
+      {"a * foo bar*", "a * foo bar*"},
+      {"foo*bar*", "foo<em>bar</em>"},
+      {"snake_case_word", "snake_case_word"},
+      {"***foo***", "<em><strong>foo</strong></em>"},
+      {"*foo**bar**baz*", "<em>foo<strong>bar</strong>baz</em>"},
+      {"*foo**bar*", "<em>foo**bar</em>"},
+      {"**foo*", "*<em>foo</em>"},
+      {"*foo _bar* baz_", "<em>foo _bar</em> baz_"},
+      {"*a `*`*", "<em>a <code>*</code></em>"},
+      {"~~del~~ and ~~ no ~~", "<del>del</del> and ~~ no ~~"},
+      {"``a`", "``a`"},
+  };
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  assert(parser != NULL);
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    marker_buffer_t* buffer = marker_buffer_new(0);
+    assert(buffer != NULL);
+    assert(marker_parse_inline(parser, cases[i][0], buffer) == MARKER_OK);
+    if (strcmp(marker_buffer_data(buffer), cases[i][1]) != 0) {
+      fprintf(stderr, "FAIL: Emphasis in '%s'\n", cases[i][0]);
+      fprintf(stderr, "Got: %s\n", marker_buffer_data(buffer));
+      assert(0);
+    }
+    marker_buffer_free(buffer);
+  }
+
+  // Quadratic matching would take minutes here
+  const char* units[] = {"_a ", "a_ ", "*a_ ", "c* ", "~~a "};
+  for (size_t u = 0; u < sizeof(units) / sizeof(units[0]); u++) {
+    size_t unit_len = strlen(units[u]);
+    size_t count    = 200000;
+    char*  text     = malloc(unit_len * count + 1);
+    assert(text != NULL);
+    for (size_t i = 0; i < count; i++)
+      memcpy(text + i * unit_len, units[u], unit_len);
+    text[unit_len * count] = '\0';
+
+    marker_buffer_t* buffer = marker_buffer_new(0);
+    assert(buffer != NULL);
+    assert(marker_parse_inline(parser, text, buffer) == MARKER_OK);
+    ASSERT_HTML_NOT_CONTAINS(marker_buffer_data(buffer), "<em>");
+
+    marker_buffer_free(buffer);
+    free(text);
+  }
+
+  marker_parser_free(parser);
+}
+
+static void test_bracket_rules(void) {
+  printf("Testing link bracket matching...\n");
+
+  const char* cases[][2] = {
+      {"[a [b] c](/u)", "<a href=\"/u\">a [b] c</a>"},
+      {"[a](/u) and [b](/v \"t\")", "<a href=\"/u\">a</a> and <a href=\"/v\" title=\"t\">b</a>"},
+      {"![a [b]](/i.png)", "<img src=\"/i.png\" alt=\"a [b]\">"},
+      {"![a](/i.png \"t\")", "<img src=\"/i.png\" alt=\"a\" title=\"t\">"},
+      {"[\\](/u)", "[](/u)"},
+      {"[a `]` b](/u)", "<a href=\"/u\">a <code>]</code> b</a>"},
+      {"*a [b*](/u)", "*a <a href=\"/u\">b*</a>"},
+      {"[*a](/u*)*", "<a href=\"/u*\">*a</a>*"},
+      {"[ref] [other][ref] [ref][] [missing]",
+       "<a href=\"/r\">ref</a> <a href=\"/r\">other</a> <a href=\"/r\">ref</a> [missing]"},
+      {"[[a](/u)", "[<a href=\"/u\">a</a>"},
+  };
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  assert(parser != NULL);
+  assert(marker_add_reference_link(parser, "ref", "/r", NULL) == MARKER_OK);
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    marker_buffer_t* buffer = marker_buffer_new(0);
+    assert(buffer != NULL);
+    assert(marker_parse_inline(parser, cases[i][0], buffer) == MARKER_OK);
+    if (strcmp(marker_buffer_data(buffer), cases[i][1]) != 0) {
+      fprintf(stderr, "FAIL: Links in '%s'\n", cases[i][0]);
+      fprintf(stderr, "Got: %s\n", marker_buffer_data(buffer));
+      assert(0);
+    }
+    marker_buffer_free(buffer);
+  }
+
+  // Rescanning for a closing bracket or parenthesis would take minutes here
+  const char* units[] = {"[a ", "![a ", "[a](", "[a][b] "};
+  for (size_t u = 0; u < sizeof(units) / sizeof(units[0]); u++) {
+    size_t unit_len = strlen(units[u]);
+    size_t count    = 200000;
+    char*  text     = malloc(unit_len * count + 1);
+    assert(text != NULL);
+    for (size_t i = 0; i < count; i++)
+      memcpy(text + i * unit_len, units[u], unit_len);
+    text[unit_len * count] = '\0';
+
+    marker_buffer_t* buffer = marker_buffer_new(0);
+    assert(buffer != NULL);
+    assert(marker_parse_inline(parser, text, buffer) == MARKER_OK);
+    ASSERT_HTML_NOT_CONTAINS(marker_buffer_data(buffer), "<a ");
+    ASSERT_HTML_NOT_CONTAINS(marker_buffer_data(buffer), "<img ");
+
+    marker_buffer_free(buffer);
+    free(text);
+  }
+
+  // Brackets nested as deep as they go
+  size_t depth = 400000;
+  char*  text  = malloc(depth * 2 + 1);
+  assert(text != NULL);
+  memset(text, '[', depth);
+  memset(text + depth, ']', depth);
+  text[depth * 2] = '\0';
+
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse_inline(parser, text, buffer) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(buffer), text) == 0);
+
+  marker_buffer_free(buffer);
+  free(text);
+  marker_parser_free(parser);
+}
+
+static void test_reference_lookup(void) {
+  printf("Testing reference lookup...\n");
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  assert(parser != NULL);
+
+  // Enough labels to grow the table several times
+  char label[32];
+  char url[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(label, sizeof(label), "Ref  %d", i);
+    snprintf(url, sizeof(url), "/r/%d", i);
+    assert(marker_add_reference_link(parser, label, url, i % 2 ? "T" : NULL) == MARKER_OK);
+  }
+  assert(marker_add_reference_link(parser, "ref 7", "/seven", NULL) == MARKER_OK);
+
+  const char* cases[][2] = {
+      {"[ref 0]", "<a href=\"/r/0\">ref 0</a>"},
+      {"[x][REF\t999]", "<a href=\"/r/999\" title=\"T\">x</a>"},
+      {"[ Ref\n 500 ]", "<a href=\"/r/500\"> Ref  500 </a>"},
+      {"[ref 7]", "<a href=\"/seven\">ref 7</a>"},
+      {"[ref 1000]", "[ref 1000]"},
+      {"[ref0]", "[ref0]"},
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    marker_buffer_t* buffer = marker_buffer_new(0);
+    assert(buffer != NULL);
+    assert(marker_parse_inline(parser, cases[i][0], buffer) == MARKER_OK);
+    if (strcmp(marker_buffer_data(buffer), cases[i][1]) != 0) {
+      fprintf(stderr, "FAIL: Reference in '%s'\n", cases[i][0]);
+      fprintf(stderr, "Got: %s\n", marker_buffer_data(buffer));
+      assert(0);
+    }
+    marker_buffer_free(buffer);
+  }
+
+  // Cleared references are gone, and the parser takes new ones
+  marker_clear_reference_links(parser);
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse_inline(parser, "[ref 0]", buffer) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(buffer), "[ref 0]") == 0);
+  assert(marker_add_reference_link(parser, "ref 0", "/again", NULL) == MARKER_OK);
+  marker_buffer_free(buffer);
+
+  buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse_inline(parser, "[ref 0]", buffer) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(buffer), "<a href=\"/again\">ref 0</a>") == 0);
+
+  marker_buffer_free(buffer);
+  marker_parser_free(parser);
+}
+
+// Parse the first length bytes of text from a copy without a terminating NUL, so
+// a read past the end is caught by sanitizers
+static char* parse_length(marker_parser_t* parser, const char* text, size_t length) {
+  char* input = malloc(length ? length : 1);
+  assert(input != NULL);
+  memcpy(input, text, length);
+
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse_n(parser, input, length, buffer) == MARKER_OK);
+
+  size_t size = marker_buffer_size(buffer);
+  char*  html = malloc(size + 1);
+  assert(html != NULL);
+  memcpy(html, marker_buffer_data(buffer), size + 1);
+
+  marker_buffer_free(buffer);
+  free(input);
+  return html;
+}
+
+static void test_parse_length(void) {
+  printf("Testing length-delimited parsing...\n");
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  assert(parser != NULL);
+
+  // The same output as for the terminated string
+  const char* markdown = "# Title\n"
+                         "\n"
+                         "[ref]: /r \"T\"\n"
+                         "Some `code`, [a link](/u \"t\") and [ref].\n"
+                         "| a | *b* |\n"
+                         "|---|-----|\n"
+                         "| [c](/c) | d |";
+  marker_buffer_t* buffer   = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse(parser, markdown, buffer) == MARKER_OK);
+  char* html = parse_length(parser, markdown, strlen(markdown));
+  assert(strcmp(html, marker_buffer_data(buffer)) == 0);
+  ASSERT_HTML_CONTAINS(html, "<a href=\"/u\" title=\"t\">a link</a>");
+  ASSERT_HTML_CONTAINS(html, "<a href=\"/r\" title=\"T\">ref</a>");
+  ASSERT_HTML_CONTAINS(html, "<td><a href=\"/c\">c</a></td>");
+  marker_buffer_free(buffer);
+  free(html);
+
+  // Nothing past the length closes a construct
+  const char* cut[][2] = {
+      {"Some `code`", "Some `code"},
+      {"A [link](/u)", "A [link](/u"},
+      {"A <http://x.y>", "A &lt;http://x.y"},
+      {"**strong**", "*<em>strong</em>"},
+      {"| a |\n-|", "<p>| a |</p>"},
+  };
+  for (size_t i = 0; i < sizeof(cut) / sizeof(cut[0]); i++) {
+    html = parse_length(parser, cut[i][0], strlen(cut[i][0]) - 1);
+    ASSERT_HTML_CONTAINS(html, cut[i][1]);
+    free(html);
+  }
+
+  // NUL bytes are text
+  const char text[] = "a\0b *c*";
+  buffer            = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse_n(parser, text, sizeof(text) - 1, buffer) == MARKER_OK);
+  const char expected[] = "<p>a\0b <em>c</em></p>\n";
+  assert(marker_buffer_size(buffer) == sizeof(expected) - 1);
+  assert(memcmp(marker_buffer_data(buffer), expected, sizeof(expected)) == 0);
+  marker_buffer_free(buffer);
+
+  // An empty input gives empty output
+  html = parse_length(parser, "", 0);
+  assert(html[0] == '\0');
+  free(html);
+
+  marker_parser_free(parser);
+}
+
+// Append the contents of one buffer to another
+static void strcat_buffer(marker_buffer_t* buffer, const marker_buffer_t* more) {
+  size_t size = marker_buffer_size(more);
+  if (buffer->size + size + 1 > buffer->capacity) {
+    buffer->capacity = buffer->size + size + 1;
+    buffer->data     = realloc(buffer->data, buffer->capacity);
+    assert(buffer->data != NULL);
+  }
+  memcpy(buffer->data + buffer->size, marker_buffer_data(more), size + 1);
+  buffer->size += size;
+}
+
+static void test_streaming(void) {
+  printf("Testing streaming input...\n");
+
+  const char* markdown = "# Title\n"
+                         "\n"
+                         "[ref]: /r \"T\"\n"
+                         "Some *emphasis* and [ref].\n"
+                         "- one\n"
+                         "- [x] two\n"
+                         "\n"
+                         "```\n"
+                         "code <here>\n"
+                         "```\n"
+                         "| a | b |\n"
+                         "|---|---|\n"
+                         "| c | d |\n"
+                         "| e | f |\n"
+                         "> quote\n"
+                         "last line";
+  size_t length = strlen(markdown);
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  marker_buffer_t* whole  = marker_buffer_new(0);
+  marker_buffer_t* output = marker_buffer_new(0);
+  marker_buffer_t* html   = marker_buffer_new(0);
+  assert(parser != NULL && whole != NULL && output != NULL && html != NULL);
+  assert(marker_parse(parser, markdown, whole) == MARKER_OK);
+
+  // Any split of the input gives the same HTML
+  size_t chunk_sizes[] = {1, 2, 3, 7, 10, 64, 1024};
+  for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+    marker_buffer_clear(html);
+    assert(marker_stream_begin(parser, output) == MARKER_OK);
+    for (size_t at = 0; at < length; at += chunk_sizes[i]) {
+      size_t size = length - at < chunk_sizes[i] ? length - at : chunk_sizes[i];
+      assert(marker_stream_feed(parser, markdown + at, size) == MARKER_OK);
+
+      // Drain the output as a server would
+      strcat_buffer(html, output);
+      marker_buffer_clear(output);
+    }
+    assert(marker_stream_finish(parser) == MARKER_OK);
+    strcat_buffer(html, output);
+    marker_buffer_clear(output);
+    assert(strcmp(marker_buffer_data(html), marker_buffer_data(whole)) == 0);
+  }
+
+  // A block is written once it is closed, before the stream ends
+  assert(marker_stream_begin(parser, output) == MARKER_OK);
+  assert(marker_stream_feed(parser, "# Title\nSome te", 15) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(output), "<h1>Title</h1>\n") == 0);
+  assert(marker_stream_feed(parser, "xt\n| a |\n", 9) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(output), "<p>Some text</p>");
+  ASSERT_HTML_NOT_CONTAINS(marker_buffer_data(output), "| a |");
+  assert(marker_stream_finish(parser) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(output), "<p>| a |</p>");
+
+  // Feeding without a stream is an error
+  assert(marker_stream_feed(parser, "text", 4) == MARKER_ERROR_INVALID_INPUT);
+  assert(marker_stream_finish(parser) == MARKER_ERROR_INVALID_INPUT);
+
+  marker_buffer_free(html);
+  marker_buffer_free(output);
+  marker_buffer_free(whole);
+  marker_parser_free(parser);
+}
+
+// Callback sink that collects its output and fails once a limit is reached
+typedef struct {
+  marker_buffer_t* buffer;
+  size_t           calls;
+  size_t           limit;
+} collect_t;
+
+static marker_result_t collect_output(void* user_data, const char* data, size_t length) {
+  collect_t* collect = user_data;
+  collect->calls++;
+  if (collect->buffer->size + length > collect->limit)
+    return MARKER_ERROR_IO_FAILED;
+
+  marker_buffer_t piece = {(char*) data, length, length + 1, NULL};
+  strcat_buffer(collect->buffer, &piece);
+  return MARKER_OK;
+}
+
+static void test_sinks(void) {
+  printf("Testing output sinks...\n");
+
+  // Large enough that the output is handed over in several pieces
+  marker_buffer_t* markdown = marker_buffer_new(0);
+  assert(markdown != NULL);
+  for (int i = 0; i < 2000; i++) {
+    char line[128];
+    snprintf(line, sizeof(line), "## Part %d\n- item with **bold** text\n| a | b |\n|---|---|\n\n",
+             i);
+    marker_buffer_t piece = {line, strlen(line), strlen(line) + 1, NULL};
+    strcat_buffer(markdown, &piece);
+  }
+
+  marker_parser_t* parser   = marker_parser_new(NULL);
+  marker_buffer_t* expected = marker_buffer_new(0);
+  marker_buffer_t* output   = marker_buffer_new(0);
+  assert(parser != NULL && expected != NULL && output != NULL);
+  assert(marker_parse_n(parser, markdown->data, markdown->size, expected) == MARKER_OK);
+  assert(expected->size > 100000);
+
+  // Buffer sink
+  marker_sink_t* sink = marker_sink_buffer_new(output);
+  assert(sink != NULL);
+  assert(marker_parse_to_sink(parser, markdown->data, markdown->size, sink) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(output), marker_buffer_data(expected)) == 0);
+  marker_sink_free(sink);
+
+  // Callback sink gets the output in pieces
+  collect_t collect = {output, 0, (size_t) -1};
+  marker_buffer_clear(output);
+  sink = marker_sink_callback_new(collect_output, &collect);
+  assert(sink != NULL);
+  assert(marker_parse_to_sink(parser, markdown->data, markdown->size, sink) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(output), marker_buffer_data(expected)) == 0);
+  assert(collect.calls > 2);
+
+  // An error of the sink stops the parse
+  collect.limit = 50000;
+  marker_buffer_clear(output);
+  assert(marker_parse_to_sink(parser, markdown->data, markdown->size, sink) ==
+         MARKER_ERROR_IO_FAILED);
+  marker_sink_free(sink);
+
+  // File descriptor sink
+  FILE* file = tmpfile();
+  assert(file != NULL);
+  sink = marker_sink_fd_new(fileno(file));
+  assert(sink != NULL);
+  assert(marker_parse_to_sink(parser, markdown->data, markdown->size, sink) == MARKER_OK);
+  marker_sink_free(sink);
+
+  char* written = malloc(expected->size + 1);
+  assert(written != NULL);
+  rewind(file);
+  assert(fread(written, 1, expected->size + 1, file) == expected->size);
+  assert(memcmp(written, expected->data, expected->size) == 0);
+  free(written);
+  fclose(file);
+
+  // Fixed sink
+  char html[256];
+  sink = marker_sink_fixed_new(html, sizeof(html));
+  assert(sink != NULL);
+  const char* small = "# Title\n\nSome *text*";
+  assert(marker_parse_to_sink(parser, small, strlen(small), sink) == MARKER_OK);
+  assert(strcmp(html, "<h1>Title</h1>\n\n<p>Some <em>text</em></p>\n") == 0);
+  assert(marker_parse_to_sink(parser, markdown->data, markdown->size, sink) ==
+         MARKER_ERROR_BUFFER_TOO_SMALL);
+  marker_sink_free(sink);
+
+  assert(marker_sink_buffer_new(NULL) == NULL);
+  assert(marker_sink_fixed_new(html, 0) == NULL);
+  assert(marker_sink_fd_new(-1) == NULL);
+  assert(marker_sink_callback_new(NULL, NULL) == NULL);
+  assert(marker_parse_to_sink(parser, small, strlen(small), NULL) == MARKER_ERROR_NULL_POINTER);
+
+  marker_buffer_free(output);
+  marker_buffer_free(expected);
+  marker_buffer_free(markdown);
+  marker_parser_free(parser);
+}
+
+static void test_scatter(void) {
+  printf("Testing scatter-gather output...\n");
+
+  const char* markdown = "# Title\n"
+                         "A paragraph long enough that its text is not copied but referenced "
+                         "where it stands, *with emphasis* & an entity.\n"
+                         "```\n"
+                         "code line that is also long enough to stay where it is in the input <b>\n"
+                         "```\n";
+  size_t length = strlen(markdown);
+
+  marker_parser_t*  parser   = marker_parser_new(NULL);
+  marker_buffer_t*  expected = marker_buffer_new(0);
+  marker_buffer_t*  joined   = marker_buffer_new(0);
+  marker_scatter_t* scatter  = marker_scatter_new();
+  assert(parser != NULL && expected != NULL && joined != NULL && scatter != NULL);
+  assert(marker_parse_n(parser, markdown, length, expected) == MARKER_OK);
+
+  // The pieces add up to the HTML, and some of them are the input itself
+  assert(marker_parse_scatter(parser, markdown, length, scatter) == MARKER_OK);
+  size_t                count;
+  const marker_iovec_t* pieces     = marker_scatter_pieces(scatter, &count);
+  bool                  referenced = false;
+  for (size_t i = 0; i < count; i++) {
+    marker_buffer_t piece = {(char*) pieces[i].base, pieces[i].length, pieces[i].length + 1, NULL};
+    strcat_buffer(joined, &piece);
+    const char* base = pieces[i].base;
+    if (base >= markdown && base < markdown + length)
+      referenced = true;
+  }
+  assert(referenced);
+  assert(marker_scatter_size(scatter) == expected->size);
+  assert(strcmp(marker_buffer_data(joined), marker_buffer_data(expected)) == 0);
+
+  // Written with writev
+  FILE* file = tmpfile();
+  assert(file != NULL);
+  assert(marker_scatter_write(scatter, fileno(file)) == MARKER_OK);
+  char* written = malloc(expected->size + 1);
+  assert(written != NULL);
+  rewind(file);
+  assert(fread(written, 1, expected->size + 1, file) == expected->size);
+  assert(memcmp(written, expected->data, expected->size) == 0);
+  free(written);
+  fclose(file);
+
+  // A second render replaces the first
+  assert(marker_parse_scatter(parser, "*hi*", 4, scatter) == MARKER_OK);
+  pieces = marker_scatter_pieces(scatter, &count);
+  assert(count == 1 && pieces[0].length == marker_scatter_size(scatter));
+  assert(memcmp(pieces[0].base, "<p><em>hi</em></p>\n", pieces[0].length) == 0);
+
+  assert(marker_parse_scatter(parser, markdown, length, NULL) == MARKER_ERROR_NULL_POINTER);
+
+  marker_scatter_free(scatter);
+  marker_buffer_free(joined);
+  marker_buffer_free(expected);
+  marker_parser_free(parser);
+}
+
+// Visitor that collects the text of headings and counts the nodes it enters
+typedef struct {
+  char   headings[256];
+  size_t entered;
+  size_t left;
+  size_t stop_after;
+} outline_t;
+
+static marker_visit_t outline_node(const marker_document_t* document, const marker_node_t* node,
+                                   bool entering, void* user_data) {
+  outline_t* outline = user_data;
+  if (!entering) {
+    outline->left++;
+    return MARKER_VISIT_CONTINUE;
+  }
+
+  outline->entered++;
+  if (outline->entered == outline->stop_after)
+    return MARKER_VISIT_STOP;
+  if (node->type == MARKER_NODE_CODE_BLOCK)
+    return MARKER_VISIT_SKIP;
+
+  const marker_node_t* parent = marker_document_node(document, node->parent);
+  if (node->type == MARKER_NODE_TEXT && parent->type == MARKER_NODE_HEADING) {
+    size_t      length;
+    const char* text = marker_node_text(document, node, &length);
+    strncat(outline->headings, text, length);
+    strcat(outline->headings, "|");
+  }
+  return MARKER_VISIT_CONTINUE;
+}
+
+static void test_document(void) {
+  printf("Testing document tree...\n");
+
+  const char* markdown = "# First *part*\n"
+                         "[ref]: /target \"Title\"\n"
+                         "Text with [a link][ref], ![an image](/i.png) and <http://x.org>.\n"
+                         "- [x] done with `code`\n"
+                         "1. numbered\n"
+                         "\n"
+                         "| a | b |\n"
+                         "|---|---|\n"
+                         "| **c** | d |\n"
+                         "```\n"
+                         "code <here>\n"
+                         "```\n"
+                         "## Second\n"
+                         "> quote\n"
+                         "---\n";
+  size_t length = strlen(markdown);
+
+  marker_parser_t*   parser   = marker_parser_new(NULL);
+  marker_document_t* document = marker_document_new();
+  marker_buffer_t*   expected = marker_buffer_new(0);
+  marker_buffer_t*   output   = marker_buffer_new(0);
+  assert(parser != NULL && document != NULL && expected != NULL && output != NULL);
+  assert(marker_parse_n(parser, markdown, length, expected) == MARKER_OK);
+
+  // Rendering the tree gives what parsing straight to HTML does
+  assert(marker_parse_document(parser, markdown, length, document) == MARKER_OK);
+  assert(marker_render_html(document, output) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(output), marker_buffer_data(expected)) == 0);
+
+  // Reference destinations are kept by the document
+  marker_clear_reference_links(parser);
+  const marker_node_t* root = marker_document_node(document, 0);
+  assert(root != NULL && root->type == MARKER_NODE_DOCUMENT);
+  const marker_node_t* heading = marker_document_node(document, root->first_child);
+  assert(heading->type == MARKER_NODE_HEADING && heading->level == 1);
+
+  const marker_node_t* link = NULL;
+  for (uint32_t i = 0; marker_document_node(document, i); i++) {
+    const marker_node_t* node = marker_document_node(document, i);
+    if (node->type == MARKER_NODE_LINK)
+      link = node;
+  }
+  assert(link != NULL);
+  size_t      url_len, title_len;
+  const char* url   = marker_node_url(document, link, &url_len);
+  const char* title = marker_node_title(document, link, &title_len);
+  assert(url_len == 7 && memcmp(url, "/target", 7) == 0);
+  assert(title_len == 5 && memcmp(title, "Title", 5) == 0);
+  assert(marker_node_url(document, heading, &url_len) == NULL);
+
+  // One tree feeds another consumer, here an outline of the headings
+  outline_t outline = {{0}, 0, 0, 0};
+  assert(marker_document_visit(document, outline_node, &outline) == MARKER_OK);
+  assert(strcmp(outline.headings, "First |Second|") == 0);
+  assert(outline.entered == outline.left);
+
+  outline_t stopped = {{0}, 0, 0, 3};
+  assert(marker_document_visit(document, outline_node, &stopped) == MARKER_OK);
+  assert(stopped.entered == 3);
+
+  // A document is reused for the next parse
+  assert(marker_parse_document(parser, "*hi*", 4, document) == MARKER_OK);
+  marker_buffer_clear(output);
+  assert(marker_render_html(document, output) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(output), "<p><em>hi</em></p>\n") == 0);
+
+  assert(marker_parse_document(parser, markdown, length, NULL) == MARKER_ERROR_NULL_POINTER);
+  assert(marker_document_visit(document, NULL, NULL) == MARKER_ERROR_NULL_POINTER);
+  assert(marker_document_node(document, 100) == NULL);
+
+  marker_buffer_free(output);
+  marker_buffer_free(expected);
+  marker_document_free(document);
+  marker_parser_free(parser);
+}
+
+static void test_parallel(void) {
+  printf("Testing parallel parsing...\n");
+
+  // Sections link to definitions of earlier ones, redefine a shared label and
+  // hold fenced code with blank lines and a definition inside, none of which
+  // may change when the input is split
+  size_t count    = 4000;
+  size_t capacity = count * 320;
+  char*  markdown = malloc(capacity);
+  assert(markdown != NULL);
+  size_t length = 0;
+  for (size_t i = 0; i < count; i++) {
+    length += (size_t) snprintf(markdown + length, capacity - length,
+                                "## Section %zu\n\n"
+                                "[r%zu]: /u%zu \"T%zu\"\n"
+                                "[shared]: /s%zu\n"
+                                "\n"
+                                "See [r%zu], [shared], [fake] and [r%zu].\n"
+                                "- item\n"
+                                "- [x] task\n"
+                                "\n"
+                                "| a | b |\n"
+                                "|---|---|\n"
+                                "| %zu | c |\n"
+                                "```\n"
+                                "code\n"
+                                "\n"
+                                "[fake]: /no\n"
+                                "\n"
+                                "```\n"
+                                "\n",
+                                i, i, i, i, i, i > 0 ? i - 1 : 0, i + 1, i);
+  }
+  assert(length > 512 * 1024 && length < capacity);
+
+  // The second parse of a document already knows all of its definitions
+  marker_parser_t* serial = marker_parser_new(NULL);
+  marker_buffer_t* expected[2];
+  assert(serial != NULL);
+  assert(marker_add_reference_link(serial, "fake", "/given", NULL) == MARKER_OK);
+  for (int run = 0; run < 2; run++) {
+    expected[run] = marker_buffer_new(0);
+    assert(expected[run] != NULL);
+    assert(marker_parse_n(serial, markdown, length, expected[run]) == MARKER_OK);
+  }
+  assert(expected[1]->size > expected[0]->size);
+  marker_stats_t serial_stats;
+  marker_parser_stats(serial, &serial_stats);
+
+  size_t thread_counts[] = {1, 2, 3, 8};
+  for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+    marker_parser_t* parser = marker_parser_new(NULL);
+    assert(parser != NULL);
+    assert(marker_add_reference_link(parser, "fake", "/given", NULL) == MARKER_OK);
+
+    // The same HTML and definitions as the serial parser, including on reuse
+    for (int run = 0; run < 2; run++) {
+      marker_buffer_t* output = marker_buffer_new(0);
+      assert(output != NULL);
+      assert(marker_parse_parallel(parser, markdown, length, output, thread_counts[i]) ==
+             MARKER_OK);
+      assert(output->size == expected[run]->size);
+      assert(memcmp(output->data, expected[run]->data, output->size) == 0);
+      marker_buffer_free(output);
+    }
+    marker_stats_t stats;
+    marker_parser_stats(parser, &stats);
+    assert(stats.reference_count == serial_stats.reference_count);
+    marker_parser_free(parser);
+  }
+
+  // Small inputs take the serial path
+  marker_buffer_t* small = marker_buffer_new(0);
+  assert(small != NULL);
+  assert(marker_parse_parallel(serial, "*hi*", 4, small, 8) == MARKER_OK);
+  assert(strcmp(marker_buffer_data(small), "<p><em>hi</em></p>\n") == 0);
+  assert(marker_parse_parallel(serial, NULL, 0, small, 8) == MARKER_ERROR_NULL_POINTER);
+
+  marker_buffer_free(small);
+  marker_buffer_free(expected[0]);
+  marker_buffer_free(expected[1]);
+  marker_parser_free(serial);
+  free(markdown);
+}
+
+// Contents of a file, NUL-terminated, or NULL when it cannot be read
+static char* read_file(const char* name) {
+  FILE* file = fopen(name, "rb");
+  if (!file)
+    return NULL;
+
+  char*  data   = NULL;
+  size_t length = 0;
+  char   chunk[4096];
+  size_t bytes_read;
+  while ((bytes_read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data = realloc(data, length + bytes_read + 1);
+    assert(data != NULL);
+    memcpy(data + length, chunk, bytes_read);
+    length += bytes_read;
+  }
+  fclose(file);
+  if (!data)
+    data = calloc(1, 1);
+  else
+    data[length] = '\0';
+  return data;
+}
+
+static void test_batch_files(void) {
+  printf("Testing batch file conversion...\n");
+
+  // Files of different sizes, one defining a label that the next one uses and
+  // one that does not exist
+  enum { FILE_COUNT = 12 };
+  char        inputs[FILE_COUNT][64];
+  char        outputs[FILE_COUNT][64];
+  char        singles[FILE_COUNT][64];
+  const char* input_names[FILE_COUNT];
+  const char* output_names[FILE_COUNT];
+  for (size_t i = 0; i < FILE_COUNT; i++) {
+    strcpy(inputs[i], "/tmp/marker_batchXXXXXX");
+    int fd = mkstemp(inputs[i]);
+    assert(fd >= 0);
+    FILE* file = fdopen(fd, "w");
+    assert(file != NULL);
+    if (i == 3)
+      fprintf(file, "[r]: /defined\n");
+    for (size_t line = 0; line < (i * 37) % 200; line++)
+      fprintf(file, "Line %zu of *file* %zu with [r] and `code`.\n\n", line, i);
+    fclose(file);
+
+    snprintf(outputs[i], sizeof(outputs[i]), "%s.html", inputs[i]);
+    snprintf(singles[i], sizeof(singles[i]), "%s.single", inputs[i]);
+    input_names[i]  = inputs[i];
+    output_names[i] = outputs[i];
+  }
+  remove(inputs[7]);
+
+  marker_result_t results[FILE_COUNT];
+  assert(marker_batch_to_html_files(input_names, output_names, FILE_COUNT, "style.css", 4,
+                                    results) == MARKER_ERROR_IO_FAILED);
+
+  // Every file is converted as on its own, the missing one fails alone
+  for (size_t i = 0; i < FILE_COUNT; i++) {
+    if (i == 7) {
+      assert(results[i] == MARKER_ERROR_IO_FAILED);
+      assert(read_file(outputs[i]) == NULL);
+      continue;
+    }
+    assert(results[i] == MARKER_OK);
+    assert(marker_file_to_html_file(inputs[i], singles[i], "style.css") == MARKER_OK);
+    char* batch  = read_file(outputs[i]);
+    char* single = read_file(singles[i]);
+    assert(batch != NULL && single != NULL);
+    assert(strcmp(batch, single) == 0);
+    if (i == 4)
+      ASSERT_HTML_NOT_CONTAINS(batch, "/defined");
+    free(batch);
+    free(single);
+  }
+
+  // Devices and pipes are streamed rather than mapped, to the same HTML
+  assert(marker_file_to_html_file("/dev/null", outputs[0], "style.css") == MARKER_OK);
+  char* streamed = read_file(outputs[0]);
+  char* mapped   = read_file(singles[0]);
+  assert(streamed != NULL && mapped != NULL);
+  assert(strcmp(streamed, mapped) == 0);
+  free(streamed);
+  free(mapped);
+
+  // A file converted onto itself is replaced by its HTML, not truncated first
+  assert(marker_file_to_html_file(inputs[5], inputs[5], "style.css") == MARKER_OK);
+  char* in_place = read_file(inputs[5]);
+  char* single   = read_file(singles[5]);
+  assert(in_place != NULL && single != NULL);
+  assert(strcmp(in_place, single) == 0);
+  free(in_place);
+  free(single);
+
+  // The older call goes through the same pool
+  assert(marker_files_to_html_files(input_names, output_names, FILE_COUNT, NULL) ==
+         MARKER_ERROR_IO_FAILED);
+  input_names[7] = inputs[6];
+  assert(marker_files_to_html_files(input_names, output_names, FILE_COUNT, NULL) == MARKER_OK);
+  assert(marker_batch_to_html_files(input_names, output_names, 0, NULL, 1, NULL) ==
+         MARKER_ERROR_NULL_POINTER);
+
+  for (size_t i = 0; i < FILE_COUNT; i++) {
+    remove(inputs[i]);
+    remove(outputs[i]);
+    remove(singles[i]);
+  }
+}
+
+// Convert a page many times on one thread, each result must be the same
+static void* convert_pages(void* arg) {
+  const char* expected = arg;
+  char        html[1024];
+  for (int i = 0; i < 200; i++) {
+    if (marker_to_html("# Page\n[r]: /u\nSee [r].\n", html, sizeof(html), NULL) != MARKER_OK ||
+        strcmp(html, expected) != 0)
+      return (void*) 1;
+  }
+  marker_release_thread_parser();
+  return NULL;
+}
+
+static void test_parser_reset(void) {
+  printf("Testing parser reset...\n");
+
+  const char* defining = "[ref]: /target\nSee [ref].\n";
+  const char* using    = "See [ref].\n";
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(parser != NULL && buffer != NULL);
+
+  // Definitions stay with the parser until it is reset
+  assert(marker_parse(parser, defining, buffer) == MARKER_OK);
+  marker_buffer_clear(buffer);
+  assert(marker_parse(parser, using, buffer) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "href=\"/target\"");
+
+  marker_stats_t before;
+  marker_stats_t after;
+  marker_parser_stats(parser, &before);
+  marker_parser_reset(parser);
+  marker_parser_stats(parser, &after);
+  assert(after.reference_count == 0);
+
+  marker_buffer_clear(buffer);
+  assert(marker_parse(parser, using, buffer) == MARKER_OK);
+  ASSERT_HTML_NOT_CONTAINS(marker_buffer_data(buffer), "href");
+
+  // The memory is kept, so the same document needs nothing new
+  marker_parser_reset(parser);
+  marker_buffer_clear(buffer);
+  assert(marker_parse(parser, defining, buffer) == MARKER_OK);
+  marker_parser_stats(parser, &after);
+  assert(after.heap_allocations == before.heap_allocations);
+
+  // An unfinished stream is dropped
+  assert(marker_stream_begin(parser, buffer) == MARKER_OK);
+  assert(marker_stream_feed(parser, "# Title", 7) == MARKER_OK);
+  marker_parser_reset(parser);
+  assert(marker_stream_feed(parser, "x", 1) == MARKER_ERROR_INVALID_INPUT);
+
+  // The simple API reuses a parser per thread but no definitions
+  char html[1024];
+  assert(marker_to_html(defining, html, sizeof(html), NULL) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(html, "href=\"/target\"");
+  assert(marker_to_html(using, html, sizeof(html), NULL) == MARKER_OK);
+  ASSERT_HTML_NOT_CONTAINS(html, "href");
+  marker_release_thread_parser();
+  marker_release_thread_parser();
+
+  char expected[1024];
+  assert(marker_to_html("# Page\n[r]: /u\nSee [r].\n", expected, sizeof(expected), NULL) ==
+         MARKER_OK);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    assert(pthread_create(&threads[i], NULL, convert_pages, expected) == 0);
+  for (int i = 0; i < 4; i++) {
+    void* failed;
+    assert(pthread_join(threads[i], &failed) == 0);
+    assert(failed == NULL);
+  }
+
+  marker_buffer_free(buffer);
+  marker_parser_free(parser);
+}
+
+static void test_parser_stats(void) {
+  printf("Testing parser statistics...\n");
+
+  const char* markdown = "# Title\n"
+                         "\n"
+                         "[ref]: https://example.com \"Title\"\n"
+                         "\n"
+                         "Some *emphasis*, a [link](/u \"t\"), [ref] and <https://example.com>.\n"
+                         "\n"
+                         "| a | *b* |\n"
+                         "|---|-----|\n"
+                         "| [c][ref] | `d` |\n";
+
+  marker_parser_t* parser = marker_parser_new(NULL);
+  assert(parser != NULL);
+
+  marker_stats_t first;
+  marker_stats_t second;
+  for (int run = 0; run < 2; run++) {
+    marker_buffer_t* buffer = marker_buffer_new(4096);
+    assert(buffer != NULL);
+    assert(marker_parse(parser, markdown, buffer) == MARKER_OK);
+    ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "<a href=\"/u\" title=\"t\">link</a>");
+    ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "<td><a href=\"https://example.com\"");
+    marker_buffer_free(buffer);
+    marker_parser_stats(parser, run == 0 ? &first : &second);
+  }
+
+  // A warm parser takes nothing from the heap for the same document
+  assert(first.heap_allocations > 0);
+  assert(second.heap_allocations == first.heap_allocations);
+  assert(second.reference_count == 1);
+  assert(second.scratch_size > 0);
+
+  // A document that outgrows the scratch memory grows it once
+  size_t count = 20000;
+  char*  large = malloc(count * 8 + 1);
+  assert(large != NULL);
+  for (size_t i = 0; i < count; i++)
+    memcpy(large + i * 8, "[*a_ b](", 8);
+  large[count * 8] = '\0';
+
+  size_t allocations[3];
+  for (int run = 0; run < 3; run++) {
+    marker_buffer_t* buffer = marker_buffer_new(0);
+    assert(buffer != NULL);
+    assert(marker_parse(parser, large, buffer) == MARKER_OK);
+    marker_buffer_free(buffer);
+    marker_parser_stats(parser, &first);
+    allocations[run] = first.heap_allocations;
+  }
+  assert(allocations[2] == allocations[1]);
+
+  free(large);
+  marker_parser_free(parser);
+}
+
+// An allocator that keeps the size of each block in front of it, to check the
+// sizes marker gives back, and counts what is held
+typedef struct {
+  pthread_mutex_t lock;
+  size_t          allocations;
+  size_t          bytes;
+} counting_heap_t;
+
+#define COUNTING_HEADER 16
+
+static void* counting_allocate(size_t size, void* user_data) {
+  counting_heap_t* heap  = user_data;
+  char*            block = malloc(COUNTING_HEADER + size);
+  if (!block)
+    return NULL;
+  memcpy(block, &size, sizeof(size));
+  pthread_mutex_lock(&heap->lock);
+  heap->allocations++;
+  heap->bytes += size;
+  pthread_mutex_unlock(&heap->lock);
+  return block + COUNTING_HEADER;
+}
+
+static void* counting_reallocate(void* memory, size_t old_size, size_t size, void* user_data) {
+  counting_heap_t* heap  = user_data;
+  char*            block = (char*) memory - COUNTING_HEADER;
+  size_t           recorded;
+  memcpy(&recorded, block, sizeof(recorded));
+  assert(recorded == old_size);
+
+  block = realloc(block, COUNTING_HEADER + size);
+  if (!block)
+    return NULL;
+  memcpy(block, &size, sizeof(size));
+  pthread_mutex_lock(&heap->lock);
+  heap->allocations++;
+  heap->bytes += size - old_size;
+  pthread_mutex_unlock(&heap->lock);
+  return block + COUNTING_HEADER;
+}
+
+static void counting_deallocate(void* memory, size_t size, void* user_data) {
+  counting_heap_t* heap  = user_data;
+  char*            block = (char*) memory - COUNTING_HEADER;
+  size_t           recorded;
+  memcpy(&recorded, block, sizeof(recorded));
+  assert(recorded == size);
+
+  free(block);
+  pthread_mutex_lock(&heap->lock);
+  heap->bytes -= size;
+  pthread_mutex_unlock(&heap->lock);
+}
+
+static void test_allocator(void) {
+  printf("Testing custom allocator...\n");
+
+  counting_heap_t heap;
+  pthread_mutex_init(&heap.lock, NULL);
+  heap.allocations = 0;
+  heap.bytes       = 0;
+  marker_allocator_t allocator = {counting_allocate, counting_reallocate, counting_deallocate,
+                                  &heap};
+
+  marker_config_t config;
+  marker_config_init(&config);
+  assert(config.allocator == NULL);
+  config.allocator = &allocator;
+
+  // Every function is needed
+  marker_allocator_t partial = allocator;
+  partial.reallocate         = NULL;
+  config.allocator           = &partial;
+  assert(marker_parser_new(&config) == NULL);
+  config.allocator = &allocator;
+
+  marker_parser_t* parser = marker_parser_new(&config);
+  assert(parser != NULL);
+
+  // The stats count exactly what the parser took from the allocator
+  const char* markdown = "# Title\n"
+                         "\n"
+                         "[ref]: /target\n"
+                         "\n"
+                         "Some *emphasis* and [ref], ~~gone~~.\n";
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+  assert(marker_parse(parser, markdown, buffer) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "<a href=\"/target\">ref</a>");
+
+  marker_stats_t stats;
+  marker_parser_stats(parser, &stats);
+  assert(stats.heap_allocations == heap.allocations);
+  assert(stats.heap_bytes == heap.bytes);
+  assert(stats.parse_allocations > 0 && stats.parse_allocations < stats.heap_allocations);
+  assert(stats.parse_bytes > 0);
+  assert(stats.peak_heap_bytes >= stats.heap_bytes);
+
+  // A warm parse of the same document allocates nothing
+  marker_buffer_clear(buffer);
+  assert(marker_parse(parser, markdown, buffer) == MARKER_OK);
+  marker_parser_stats(parser, &stats);
+  assert(stats.parse_allocations == 0);
+  assert(stats.parse_bytes == 0);
+  assert(stats.peak_heap_bytes == stats.heap_bytes);
+
+  // Streams, sinks and parallel workers take their memory from it too
+  assert(marker_stream_begin(parser, buffer) == MARKER_OK);
+  assert(marker_stream_feed(parser, "Some *text", 10) == MARKER_OK);
+  assert(marker_stream_finish(parser) == MARKER_OK);
+  marker_sink_t* sink = marker_sink_buffer_new(buffer);
+  assert(sink != NULL);
+  assert(marker_parse_to_sink(parser, markdown, strlen(markdown), sink) == MARKER_OK);
+  marker_sink_free(sink);
+
+  size_t paragraphs = 12000;
+  char*  large      = malloc(paragraphs * 24 + 1);
+  assert(large != NULL);
+  for (size_t i = 0; i < paragraphs; i++)
+    memcpy(large + i * 24, "Words with *emphasis*.\n\n", 24);
+  large[paragraphs * 24] = '\0';
+  marker_buffer_clear(buffer);
+  assert(marker_parse_parallel(parser, large, paragraphs * 24, buffer, 4) == MARKER_OK);
+  marker_parser_stats(parser, &stats);
+  assert(stats.heap_allocations == heap.allocations);
+  assert(stats.heap_bytes == heap.bytes);
+  assert(stats.parse_allocations > 0);
+  free(large);
+
+  // Buffers can use it as well
+  marker_buffer_t* owned = marker_buffer_new_with_allocator(16, &allocator);
+  assert(owned != NULL);
+  assert(marker_parse(parser, markdown, owned) == MARKER_OK);
+  assert(heap.bytes > stats.heap_bytes);
+  marker_buffer_free(owned);
+
+  marker_buffer_free(buffer);
+  marker_parser_free(parser);
+  assert(heap.bytes == 0);
+  pthread_mutex_destroy(&heap.lock);
+}
+
+static void test_limits(void) {
+  printf("Testing parse limits...\n");
+
+  marker_config_t config;
+  marker_config_init(&config);
+  assert(config.max_output_size == 0 && config.max_work == 0 && config.max_inline_depth > 0);
+  assert(strcmp(marker_error_string(MARKER_ERROR_LIMIT_EXCEEDED), "Parse limit exceeded") == 0);
+
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+
+  // Emphasis and link text count towards the inline depth
+  config.max_inline_depth = 2;
+  assert(parse_with(&config, "*a **b** c* and [*d*](/u)", buffer) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "<em>a <strong>b</strong> c</em>");
+  assert(parse_with(&config, "*a **b ~~c~~** d*", buffer) == MARKER_ERROR_LIMIT_EXCEEDED);
+  assert(parse_with(&config, "**[*d*](/u)**", buffer) == MARKER_ERROR_LIMIT_EXCEEDED);
+
+  // Nesting deep enough to exhaust the stack stops at the default depth
+  size_t depth  = 100000;
+  char*  nested = malloc(depth * 2 + 2);
+  assert(nested != NULL);
+  memset(nested, '*', depth);
+  nested[depth] = 'a';
+  memset(nested + depth + 1, '*', depth);
+  nested[depth * 2 + 1] = '\0';
+  marker_config_init(&config);
+  assert(parse_with(&config, nested, buffer) == MARKER_ERROR_LIMIT_EXCEEDED);
+  depth = 600;
+  memset(nested, '*', depth);
+  nested[depth] = 'a';
+  memset(nested + depth + 1, '*', depth);
+  nested[depth * 2 + 1] = '\0';
+  assert(parse_with(&config, nested, buffer) == MARKER_ERROR_LIMIT_EXCEEDED);
+  config.max_inline_depth = 0;
+  assert(parse_with(&config, nested, buffer) == MARKER_OK);
+  free(nested);
+
+  // Output is counted a line at a time, in every kind of render
+  const char* markdown = "# Title\n\nA paragraph long enough that a scatter-gather render "
+                         "refers to it in the input rather than copying it.\n";
+  marker_config_init(&config);
+  assert(parse_with(&config, markdown, buffer) == MARKER_OK);
+  size_t size            = marker_buffer_size(buffer);
+  config.max_output_size = size;
+  assert(parse_with(&config, markdown, buffer) == MARKER_OK);
+  config.max_output_size = size - 1;
+  assert(parse_with(&config, markdown, buffer) == MARKER_ERROR_LIMIT_EXCEEDED);
+
+  marker_parser_t*  parser  = marker_parser_new(&config);
+  marker_scatter_t* scatter = marker_scatter_new();
+  marker_sink_t*    sink    = marker_sink_buffer_new(buffer);
+  assert(parser != NULL && scatter != NULL && sink != NULL);
+  assert(marker_parse_scatter(parser, markdown, strlen(markdown), scatter) ==
+         MARKER_ERROR_LIMIT_EXCEEDED);
+  assert(marker_parse_to_sink(parser, markdown, strlen(markdown), sink) ==
+         MARKER_ERROR_LIMIT_EXCEEDED);
+  marker_sink_free(sink);
+  marker_scatter_free(scatter);
+  marker_parser_free(parser);
+
+  // Scans that repeat over the input use up the work budget
+  size_t length = 20000;
+  char*  tags   = malloc(length + 1);
+  assert(tags != NULL);
+  memset(tags, '<', length);
+  tags[length] = '\0';
+  marker_config_init(&config);
+  assert(parse_with(&config, tags, buffer) == MARKER_OK);
+  config.max_work = length * 100;
+  assert(parse_with(&config, tags, buffer) == MARKER_ERROR_LIMIT_EXCEEDED);
+  assert(parse_with(&config, markdown, buffer) == MARKER_OK);
+  free(tags);
+
+  // A stream has one budget, a parallel parse one for all of its chunks
+  config.max_work = strlen(markdown) * 3;
+  parser          = marker_parser_new(&config);
+  assert(parser != NULL);
+  assert(marker_stream_begin(parser, buffer) == MARKER_OK);
+  assert(marker_stream_feed(parser, markdown, strlen(markdown)) == MARKER_OK);
+  assert(marker_stream_feed(parser, markdown, strlen(markdown)) == MARKER_ERROR_LIMIT_EXCEEDED);
+  marker_parser_free(parser);
+
+  size_t paragraphs = 20000;
+  char*  large      = malloc(paragraphs * 24 + 1);
+  assert(large != NULL);
+  for (size_t i = 0; i < paragraphs; i++)
+    memcpy(large + i * 24, "Words with *emphasis*.\n\n", 24);
+  large[paragraphs * 24] = '\0';
+  config.max_work        = paragraphs * 24;
+  parser                 = marker_parser_new(&config);
+  assert(parser != NULL);
+  assert(marker_parse_parallel(parser, large, paragraphs * 24, buffer, 4) ==
+         MARKER_ERROR_LIMIT_EXCEEDED);
+  marker_parser_free(parser);
+  free(large);
+
+  marker_buffer_free(buffer);
+}
+
+// Nest the opening and closing text of a construct depth times around `x`
+static char* nest(const char* open, const char* close, size_t depth) {
+  size_t open_len  = strlen(open);
+  size_t close_len = strlen(close);
+  char*  text      = malloc(depth * (open_len + close_len) + 2);
+  assert(text != NULL);
+  char* at = text;
+  for (size_t i = 0; i < depth; i++, at += open_len)
+    memcpy(at, open, open_len);
+  *at++ = 'x';
+  for (size_t i = 0; i < depth; i++, at += close_len)
+    memcpy(at, close, close_len);
+  *at = '\0';
+  return text;
+}
+
+// Render nesting without a depth limit, the stack of the thread is 64 KiB
+static void* render_nested(void* arg) {
+  (void) arg;
+  marker_config_t config;
+  marker_config_init(&config);
+  config.max_inline_depth = 0;
+  marker_buffer_t* buffer = marker_buffer_new(0);
+  assert(buffer != NULL);
+
+  char* emphasis = nest("*", "*", 100000);
+  assert(parse_with(&config, emphasis, buffer) == MARKER_OK);
+  const char* html = marker_buffer_data(buffer);
+  assert(strncmp(html, "<p><strong><strong>", 19) == 0);
+  ASSERT_HTML_CONTAINS(html, "<strong>x</strong>");
+  free(emphasis);
+
+  char* mixed = nest("*a _~~", "~~_ a*", 20000);
+  assert(parse_with(&config, mixed, buffer) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "<em>a <em><del>x</del></em> a</em>");
+  free(mixed);
+
+  char* links = nest("[*", "*](/u)", 1000);
+  assert(parse_with(&config, links, buffer) == MARKER_OK);
+  ASSERT_HTML_CONTAINS(marker_buffer_data(buffer), "<a href=\"/u\"><em>x</em></a>");
+  free(links);
+
+  marker_buffer_free(buffer);
+  return NULL;
+}
+
+static void test_deep_nesting(void) {
+  printf("Testing deep inline nesting...\n");
+
+  pthread_attr_t attributes;
+  pthread_t      thread;
+  assert(pthread_attr_init(&attributes) == 0);
+  assert(pthread_attr_setstacksize(&attributes, 64 * 1024) == 0);
+  assert(pthread_create(&thread, &attributes, render_nested, NULL) == 0);
+  assert(pthread_join(thread, NULL) == 0);
+  pthread_attr_destroy(&attributes);
+}
+
 int main(void) {
   printf("===Running Marker test suite===\n\n");
 
@@ -560,6 +1942,23 @@ int main(void) {
   test_gfm_features();
   test_autolinks();
   test_html_escaping();
+  test_escape_runs();
+  test_inline_runs();
+  test_emphasis_rules();
+  test_bracket_rules();
+  test_reference_lookup();
+  test_parser_stats();
+  test_allocator();
+  test_limits();
+  test_deep_nesting();
+  test_parser_reset();
+  test_parse_length();
+  test_streaming();
+  test_sinks();
+  test_scatter();
+  test_document();
+  test_parallel();
+  test_batch_files();
   test_inline_html();
   test_edge_cases();
   test_error_handling();
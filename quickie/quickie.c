@@ -107,6 +107,7 @@ typedef struct {
   char                md_base_dir[QUICKIE_MAX_PATH];
   char                html_base_dir[QUICKIE_MAX_PATH];
   char                css_file[QUICKIE_MAX_PATH];
+  char                bundle_file[QUICKIE_MAX_PATH];
   pthread_t           watch_thread;
   volatile int        running;
 } quickie_watch_state;
@@ -301,6 +302,12 @@ static int quickie_add_watch(quickie_watch_state* state, const char* dir_path) {
   if (!state || !dir_path || state->watch_count >= QUICKIE_MAX_WATCHES)
     return -1;
 
+  size_t dir_path_len = strlen(dir_path);
+  if (dir_path_len >= QUICKIE_MAX_PATH) {
+    log_error("Watch path too long: %s", dir_path);
+    return -1;
+  }
+
   int wd = inotify_add_watch(state->inotify_fd, dir_path,
                              IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO);
   if (wd < 0) {
@@ -309,8 +316,7 @@ static int quickie_add_watch(quickie_watch_state* state, const char* dir_path) {
   }
 
   state->watches[state->watch_count].wd = wd;
-  strncpy(state->watches[state->watch_count].path, dir_path, QUICKIE_MAX_PATH - 1);
-  state->watches[state->watch_count].path[QUICKIE_MAX_PATH - 1] = '\0';
+  memcpy(state->watches[state->watch_count].path, dir_path, dir_path_len + 1);
   state->watch_count++;
 
   return wd;
@@ -362,7 +368,11 @@ static void quickie_add_watches_recursive(quickie_watch_state* state, const char
     }
 
     char full_path[QUICKIE_MAX_PATH];
-    snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, rel_path);
+    int  full_path_len = snprintf(full_path, sizeof(full_path), "%s/%s", base_dir, rel_path);
+    if (full_path_len < 0 || full_path_len >= (int) sizeof(full_path)) {
+      log_error("Full path too long");
+      continue;
+    }
 
     struct stat st;
     if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
@@ -411,7 +421,11 @@ static void quickie_convert_single(const char* md_base_dir, const char* html_bas
   }
 
   char html_tmp[QUICKIE_MAX_PATH];
-  snprintf(html_tmp, sizeof(html_tmp), "%s.tmp", html_full);
+  int  html_tmp_len = snprintf(html_tmp, sizeof(html_tmp), "%s.tmp", html_full);
+  if (html_tmp_len < 0 || html_tmp_len >= (int) sizeof(html_tmp)) {
+    log_error("Temp HTML file path too long: %s.tmp", html_full);
+    return;
+  }
 
   int res = md_file_to_html_file(md_full, html_tmp, css_file);
   if (res == 0) {
@@ -441,13 +455,26 @@ static void quickie_delete_html(const char* html_base_dir, const char* rel_md_pa
   }
 
   // Build full HTML path
-  snprintf(html_full, sizeof(html_full), "%s/%s", html_base_dir, html_rel);
+  int html_full_len = snprintf(html_full, sizeof(html_full), "%s/%s", html_base_dir, html_rel);
+  if (html_full_len < 0 || html_full_len >= (int) sizeof(html_full)) {
+    log_error("HTML file path too long: %s/%s", html_base_dir, html_rel);
+    return;
+  }
 
   if (unlink(html_full) == 0) {
     printf("Deleted HTML file: %s\n", html_full);
   }
 }
 
+// Rebuild the site bundle after the HTML changed. Iris notices the new bundle
+// on its own, requests keep being served from the old one until then.
+static void quickie_rebuild_bundle(const char* html_base_dir, const char* bundle_file) {
+  if (strlen(bundle_file) == 0)
+    return;
+  if (iris_bundle_build(html_base_dir, bundle_file) != 0)
+    log_error("Failed to rebuild bundle %s", bundle_file);
+}
+
 // Thread watcher
 static void* quickie_threadwatcher(void* arg) {
   quickie_watch_state* state = (quickie_watch_state*) arg;
@@ -464,7 +491,9 @@ static void* quickie_threadwatcher(void* arg) {
       break;
     }
 
-    int i = 0;
+    // Events come in batches, the bundle is rebuilt once per batch
+    int changed = 0;
+    int i       = 0;
     while (i < length) {
       struct inotify_event* event = (struct inotify_event*) &buffer[i];
 
@@ -506,15 +535,20 @@ static void* quickie_threadwatcher(void* arg) {
             printf("Detected change: %s\n", rel_path);
             quickie_convert_single(state->md_base_dir, state->html_base_dir, rel_path,
                                    strlen(state->css_file) > 0 ? state->css_file : NULL);
+            changed = 1;
           } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
             printf("Detected deletion: %s\n", rel_path);
             quickie_delete_html(state->html_base_dir, rel_path);
+            changed = 1;
           }
         }
       }
 
       i += QUICKIE_INOTIFY_EVENT_SIZE + event->len;
     }
+
+    if (changed)
+      quickie_rebuild_bundle(state->html_base_dir, state->bundle_file);
   }
 
   printf("File watcher stopped\n");
@@ -523,7 +557,7 @@ static void* quickie_threadwatcher(void* arg) {
 
 // Initialize watch state
 static quickie_watch_state* quickie_watcher_init(const char* md_base_dir, const char* html_base_dir,
-                                                 const char* css_file) {
+                                                 const char* css_file, const char* bundle_file) {
   quickie_watch_state* state = malloc(sizeof(quickie_watch_state));
   if (!state) {
     log_error("Failed to allocate watch state");
@@ -544,6 +578,9 @@ static quickie_watch_state* quickie_watcher_init(const char* md_base_dir, const
   if (css_file) {
     strncpy(state->css_file, css_file, QUICKIE_MAX_PATH - 1);
   }
+  if (bundle_file) {
+    strncpy(state->bundle_file, bundle_file, QUICKIE_MAX_PATH - 1);
+  }
   state->running = 1;
 
   // Add watches recursively
@@ -577,9 +614,10 @@ static void quickie_cleanup_watch(quickie_watch_state* state) {
 }
 
 // Serve HTML files using iris, but intercept requests for .md and serve the
-// HTML
+// HTML. With a bundle file, the HTML directory is packed into it and Iris
+// serves the bundle instead.
 int quickie_serve(const char* address, const char* md_base_dir, const char* html_base_dir,
-                  const char* css_file, int port) {
+                  const char* css_file, const char* bundle_file, int port) {
   if (!address || !md_base_dir || !html_base_dir) {
     log_error("Invalid null parameters");
     return 1;
@@ -608,8 +646,19 @@ int quickie_serve(const char* address, const char* md_base_dir, const char* html
   quickie_scan_markdown(md_base_dir, NULL);
   quickie_convert_all(md_base_dir, html_base_dir, css_file);
 
+  if (bundle_file) {
+    if (iris_bundle_build(html_base_dir, bundle_file) != 0) {
+      log_error("Failed to build bundle %s from %s", bundle_file, html_base_dir);
+      return 1;
+    }
+    if (iris_set_bundle(bundle_file) != 0) {
+      log_error("Failed to open bundle %s", bundle_file);
+      return 1;
+    }
+  }
+
   // Initialize file watcher for dynamic updates
-  g_watch_state = quickie_watcher_init(md_base_dir, html_base_dir, css_file);
+  g_watch_state = quickie_watcher_init(md_base_dir, html_base_dir, css_file, bundle_file);
   if (!g_watch_state) {
     log_error("Failed to initialize file watcher - continuing without live reload");
   }
@@ -627,21 +676,25 @@ int quickie_serve(const char* address, const char* md_base_dir, const char* html
 
 // Clap solves this
 void quickie_usage(const char* prog) {
-  fprintf(stderr, "Usage: %s [-b ADDRESS] [-m MD_DIR] [-o HTML_DIR] [-c CSS_FILE] [-p PORT]\n",
+  fprintf(stderr,
+          "Usage: %s [-b ADDRESS] [-m MD_DIR] [-o HTML_DIR] [-c CSS_FILE] [-p PORT] "
+          "[--bundle FILE]\n",
           prog);
   fprintf(stderr, "  -b ADDRESS   Bind address (default: 0.0.0.0)\n");
   fprintf(stderr, "  -m MD_DIR    Directory to scan for markdown files (default: .)\n");
   fprintf(stderr, "  -o HTML_DIR  Directory to output and serve HTML files (default: .)\n");
   fprintf(stderr, "  -c CSS_FILE  CSS file to include in HTML output (optional)\n");
   fprintf(stderr, "  -p PORT      Port to listen on (default: %d)\n", QUICKIE_DEFAULT_PORT);
+  fprintf(stderr, "  --bundle FILE  Pack the HTML into FILE and serve from it (optional)\n");
 }
 
 int main(int argc, char* argv[]) {
-  char address[64]                = "0.0.0.0";
-  char md_dir[QUICKIE_MAX_PATH]   = QUICKIE_DEFAULT_MD_DIR;
-  char html_dir[QUICKIE_MAX_PATH] = QUICKIE_DEFAULT_HTML_DIR;
-  char css_file[QUICKIE_MAX_PATH] = "";
-  int  port                       = QUICKIE_DEFAULT_PORT;
+  char address[64]                   = "0.0.0.0";
+  char md_dir[QUICKIE_MAX_PATH]      = QUICKIE_DEFAULT_MD_DIR;
+  char html_dir[QUICKIE_MAX_PATH]    = QUICKIE_DEFAULT_HTML_DIR;
+  char css_file[QUICKIE_MAX_PATH]    = "";
+  char bundle_file[QUICKIE_MAX_PATH] = "";
+  int  port                          = QUICKIE_DEFAULT_PORT;
 
   for (int i = 1; i < argc; ++i) {
     if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
@@ -707,6 +760,18 @@ int main(int argc, char* argv[]) {
       }
       strncpy(css_file, argv[++i], sizeof(css_file) - 1);
       css_file[sizeof(css_file) - 1] = '\0';
+    } else if (strcmp(argv[i], "--bundle") == 0 && i + 1 < argc) {
+      const char* bundle_arg = argv[i + 1];
+      if (!bundle_arg || strlen(bundle_arg) == 0) {
+        log_error("Empty bundle file argument");
+        return 1;
+      }
+      if (strlen(bundle_arg) >= sizeof(bundle_file)) {
+        log_error("Bundle file argument too long");
+        return 1;
+      }
+      strncpy(bundle_file, argv[++i], sizeof(bundle_file) - 1);
+      bundle_file[sizeof(bundle_file) - 1] = '\0';
     } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
       const char* port_arg = argv[i + 1];
       if (!port_arg || strlen(port_arg) == 0) {
@@ -730,8 +795,8 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  int result =
-      quickie_serve(address, md_dir, html_dir, strlen(css_file) > 0 ? css_file : NULL, port);
+  int result = quickie_serve(address, md_dir, html_dir, strlen(css_file) > 0 ? css_file : NULL,
+                             strlen(bundle_file) > 0 ? bundle_file : NULL, port);
 
   free(quickie_entries);
 